@@ -10,9 +10,13 @@
 #include <iostream>
 #include <fstream>
 #include <inttypes.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "DiskBuffer.h"
+#include "Probes.h"
 
 /*!
 	\param fileName The filename that will be used to store the information.
@@ -20,7 +24,10 @@
 	\param nextSeq The starting sequence number.
 */
 DiskBuffer::DiskBuffer(string &fileName, uint64_t fileSize, uint64_t nextSeq) 
-	: mFileName(fileName), mFileSize(fileSize), mNextSeq(nextSeq)
+	: mFileName(fileName), mFileSize(fileSize), mNextSeq(nextSeq), mRing(NULL), mFd(-1),
+	  mAlignment(0), mChunkData(NULL), mChunkCount(0), mChunkSize(0), mCurrentChunk(0), mWriteOffset(0),
+	  mWriterThread(_StartWriter, this), mWriterRunning(false), mWriterStop(false),
+	  mFullChunks(NULL), mFreeChunks(NULL), mChunkHeld(false), mTrace(NULL), mStages(NULL), mStream(NULL)
 {
 	// Open the file for writing
 	try {
@@ -31,16 +38,161 @@ DiskBuffer::DiskBuffer(string &fileName, uint64_t fileSize, uint64_t nextSeq)
 	}
 }
 
+/*!
+	\brief Creates a DiskBuffer that hands the data, in order, to a stream
+	buffer instead of writing a file. Data that does not fit in the stream
+	buffer is turned away, and the window shrinks as it fills up, so its reader
+	sets the pace. The write modes, io_uring and the writer thread do not apply.
+	\param stream Takes the data. Must outlive the DiskBuffer.
+	\param fileSize The total size of the data.
+	\param nextSeq The starting sequence number.
+*/
+DiskBuffer::DiskBuffer(StreamBuffer *stream, uint64_t fileSize, uint64_t nextSeq)
+	: mFileSize(fileSize), mNextSeq(nextSeq), mRing(NULL), mFd(-1),
+	  mAlignment(0), mChunkData(NULL), mChunkCount(0), mChunkSize(0), mCurrentChunk(0), mWriteOffset(0),
+	  mWriterThread(_StartWriter, this), mWriterRunning(false), mWriterStop(false),
+	  mFullChunks(NULL), mFreeChunks(NULL), mChunkHeld(false), mTrace(NULL), mStages(NULL), mStream(stream)
+{
+}
+
 DiskBuffer::~DiskBuffer()
 {
+	if (mChunkCount > 0) {
+		Flush();
+	}
+
+	if (mWriterRunning) {
+		mWriterLock.Lock();
+		mWriterStop = true;
+		mWriterLock.Signal();
+		mWriterLock.Unlock();
+		mWriterThread.Join();
+	}
+
+	delete mFullChunks;
+	delete mFreeChunks;
+
+	if (mFd >= 0) {
+		close(mFd);
+	}
+
+	delete mRing;
+	free(mChunkData);
 	mFile.close();
 }
 
+/*!
+	\brief Chooses how data reaches the disk. With DISK_WRITE_COALESCE in order data
+	is gathered into a kDiskBufferCoalesceSize buffer and written with one pwrite
+	when it fills, and the file is preallocated to the size given in the SYN.
+	DISK_WRITE_DIRECT does the same with the file opened O_DIRECT, so the writes
+	skip the page cache. If the file system refuses O_DIRECT, buffered writes are
+	used instead. Call before EnableIoUring or EnableWriterThread, which keep the
+	mode but write smaller chunks asynchronously.
+	\param mode The write mode to use.
+	\return true if the mode is in use, false if writes stay on the fstream.
+*/
+bool DiskBuffer::SetWriteMode(DiskWriteMode mode)
+{
+	if (mode == DISK_WRITE_STREAM || mChunkCount > 0) {
+		return mode == DISK_WRITE_STREAM;
+	}
+
+	if (!_OpenFile(mode == DISK_WRITE_DIRECT)) {
+		return false;
+	}
+
+	_AllocateChunks(1, kDiskBufferCoalesceSize);
+
+	return true;
+}
+
+/*!
+	\brief Switches writes to an io_uring backend. In order data is copied into
+	one of kDiskBufferRingChunks chunks, and each full chunk is written
+	asynchronously at its file offset while the next one fills up, so the
+	receive loop does not wait for the disk. The chunks and the file are
+	registered with the ring when the kernel allows it.
+	\param sqPoll Whether the ring should use a kernel submission polling thread.
+	\return true if the backend is in use, false if writes stay as they were.
+*/
+bool DiskBuffer::EnableIoUring(bool sqPoll)
+{
+	if (mRing != NULL || mWriterRunning) {
+		return mRing != NULL;
+	}
+
+	if (mFd < 0 && !_OpenFile(false)) {
+		return false;
+	}
+
+	mRing = new IoUring(kDiskBufferRingChunks, sqPoll);
+
+	if (!mRing->IsValid()) {
+		delete mRing;
+		mRing = NULL;
+		return false;
+	}
+
+	_AllocateChunks(kDiskBufferRingChunks, kDiskBufferRingChunkSize);
+
+	// One registered buffer covers every chunk.
+	struct iovec fBuffer;
+	fBuffer.iov_base = mChunkData;
+	fBuffer.iov_len = mChunkCount * mChunkSize;
+	mRing->RegisterBuffers(&fBuffer, 1);
+	mRing->RegisterFiles(&mFd, 1);
+
+	return true;
+}
+
+/*!
+	\brief Moves file writes to a writer thread. In order data is copied into one
+	of kDiskBufferWriterChunks chunks, and each full chunk is passed to the writer
+	thread through a lock free queue and comes back through a second one once it
+	is on disk. The receive loop never waits for the disk: when every chunk is
+	queued, Add turns away in order data, and GetWindowSize reports the room left
+	so the sender slows down before that happens.
+	\return true if the writer thread is running, false if writes stay as they were.
+*/
+bool DiskBuffer::EnableWriterThread()
+{
+	if (mWriterRunning || mRing != NULL) {
+		return mWriterRunning;
+	}
+
+	if (mFd < 0 && !_OpenFile(false)) {
+		return false;
+	}
+
+	_AllocateChunks(kDiskBufferWriterChunks, kDiskBufferRingChunkSize);
+
+	mFullChunks = new SpscQueue(mChunkCount);
+	mFreeChunks = new SpscQueue(mChunkCount);
+
+	for (unsigned i = 0; i < mChunkCount; i++) {
+		mFreeChunks->Push(i);
+	}
+
+	mWriterStop = false;
+	mWriterRunning = (mWriterThread.Start() == 0);
+
+	if (!mWriterRunning) {
+		delete mFullChunks;
+		delete mFreeChunks;
+		mFullChunks = NULL;
+		mFreeChunks = NULL;
+	}
+
+	return mWriterRunning;
+}
+
 /*!
 	\brief Adds data to the DiskBuffer. If the data is in order, the 
 	data will be added and the out of order cache will be iterated over
 	to find any data that may come next. If the data is out of order it will be
-	put in the OutOfSeqCache
+	put in the OutOfSeqCache. With a writer thread, in order data that does
+	not fit in the free chunks is dropped and the sender has to send it again.
 	\sa Data
 	\param &packet The packet that you wish to add to the buffer.
     \return The amount of data saved to disk.
@@ -52,26 +204,37 @@ uint64_t DiskBuffer::Add(Data &packet)
 
 	// If the sequence number is the number that we 
 	// are expecting to receive then process the data.
-	if (mNextSeq == fSeqNum) {
+	if (mNextSeq == fSeqNum && fSize > _GetFreeSpace()) {
+		fSize = 0;
+	}
+	else if (mNextSeq == fSeqNum) {
 		// TODO: This can probably be finner grain.
 		//mWriteLock.Lock();
 	
-		try {
-			mFile.write(packet.mData, (streamsize)fSize);
-		}
-		catch (ios_base::failure &e) {
-			cerr<<"DiskBuffer [Add]: "<<e.what()<<endl;
-		}
+		_Write(packet.mData, fSize);
 	
 		// Increment the current sequence number by the size of the packet. 
 		// This should be the next sequence number. Then loop over the out 
 		// of order cache and add as much data as we have.
 		mNextSeq += fSize;
 		Data *fNext = mOutOfSeqCache.GetData(mNextSeq);
+		ScopedStageTimer fReorder((fNext != NULL) ? mStages : NULL, STAGE_REORDER);
+
 		while (fNext != NULL) {
+			// Leave the rest in the cache until the writer thread catches up.
+			if (fNext->mPacketSize > _GetFreeSpace()) {
+				mOutOfSeqCache.Add(*fNext);
+				delete [] fNext->mData;
+				delete fNext;
+				break;
+			}
+
 			// Write the data.
-			mFile.flush();
-			mFile.write(fNext->mData, (streamsize)fNext->mPacketSize);
+			if (mChunkCount == 0) {
+				mFile.flush();
+			}
+
+			_Write(fNext->mData, fNext->mPacketSize);
 			fSize += fNext->mPacketSize;
 			
 			// Increment the pointer
@@ -92,11 +255,14 @@ uint64_t DiskBuffer::Add(Data &packet)
 	else if (mNextSeq < fSeqNum) {
 		// Lock so we are not adding data while trying to remove above.
 		//mWriteLock.Lock();
+		ScopedStageTimer fReorder(mStages, STAGE_REORDER);
 		mOutOfSeqCache.Add(packet);
 		//mWriteLock.Unlock();
 		//fSize = 0;
 	}
 
+	PROBE4(disk_add, fSeqNum, packet.mPacketSize, mNextSeq, fSize);
+
 	// return how many bytes we saved to disk.
 	return fSize;
 }
@@ -111,13 +277,32 @@ uint64_t DiskBuffer::GetNextSeq()
 }
 
 /*!
-	\brief Returns the window size to throttle back the sender.
+	\brief Returns the number of packets held in the out of order cache.
+*/
+size_t DiskBuffer::GetOutOfSeqCount()
+{
+	return mOutOfSeqCache.GetCount();
+}
+
+/*!
+	\brief Returns the window size to throttle back the sender. With a writer
+	thread this is the room left in the chunks that are not queued for the disk,
+	so the window closes as the disk falls behind, and with a stream buffer it
+	is the room left there. A sender reads 0 as no limit,
+	so a full queue reports 1 byte, which holds it to one packet at a time.
+	Room for that packet is kept out of the window.
     \return the window size
 */
 uint32_t DiskBuffer::GetWindowSize()
 {
-	//TODO: Make this do something useful
-	return 0xFFFFFFFF;
+	if (!mWriterRunning && mStream == NULL) {
+		return 0xFFFFFFFF;
+	}
+
+	// Hold back a datagram's worth, so the one packet still fits.
+	uint64_t fFree = _GetFreeSpace();
+
+	return (fFree > kMaxDatagramSize) ? (uint32_t)MIN(fFree - kMaxDatagramSize, (uint64_t)0xFFFFFFFF) : 1;
 }
 
 /*!
@@ -126,10 +311,430 @@ uint32_t DiskBuffer::GetWindowSize()
 */
 void DiskBuffer::Flush()
 {
-	try {
-		mFile.flush();
+	if (mChunkCount == 0) {
+		try {
+			mFile.flush();
+		}
+		catch (ios_base::failure &e) {
+			cerr<<"DiskBuffer [Flush]: "<<e.what()<<endl;
+		}
+
+		return;
+	}
+
+	// Write out the partly filled chunk and wait for every write to land.
+	DiskChunk *fChunk = &mChunks[mCurrentChunk];
+	bool fHeld = !mWriterRunning || mChunkHeld;
+	uint32_t fTail = (mAlignment > 0 && fHeld && !fChunk->mBusy) ? fChunk->mLength % mAlignment : 0;
+	char *fTailData = fChunk->mData + fChunk->mLength - fTail;
+
+	if (fHeld) {
+		_SubmitChunk();
+	}
+
+	while (mRing != NULL && mRing->GetInFlight() > 0) {
+		_ReapWrites(1);
+	}
+
+	if (mWriterRunning) {
+		_WaitForWriter();
+	}
+
+	// O_DIRECT writes whole blocks, so the last block went out padded. Start the
+	// next chunk with it so any later data rewrites it in place.
+	if (fTail > 0) {
+		DiskChunk *fNext = _GetChunk();
+		memmove(fNext->mData, fTailData, fTail);
+		fNext->mOffset = mWriteOffset - fTail;
+		fNext->mLength = fTail;
+	}
+
+	// Drop the padding and whatever the preallocation reserved past the data.
+	if (ftruncate(mFd, mWriteOffset) != 0) {
+		cerr<<"DiskBuffer [Flush]: Unable to set the file size to "<<dec<<mWriteOffset<<" bytes."<<endl;
+	}
+}
+
+/*!
+	\brief Opens the file for chunked writes and preallocates it to the size given in
+	the SYN so the file system can lay it out in one piece.
+	\param direct Whether to open the file with O_DIRECT. Falls back to buffered
+	writes if the file system does not support it.
+	\return true if the file is open.
+*/
+bool DiskBuffer::_OpenFile(bool direct)
+{
+	if (mStream != NULL) {
+		return false;
+	}
+
+	if (direct) {
+		mFd = open(mFileName.c_str(), O_WRONLY | O_DIRECT);
+
+		if (mFd >= 0) {
+			mAlignment = kDiskBufferAlignment;
+		}
+		else {
+			cout<<"O_DIRECT is not supported for '"<<mFileName<<"', using buffered writes."<<endl;
+		}
+	}
+
+	if (mFd < 0) {
+		mFd = open(mFileName.c_str(), O_WRONLY);
+	}
+
+	if (mFd < 0) {
+		return false;
+	}
+
+	// A stream of unknown length has nothing to reserve.
+	if (mFileSize > 0 && mFileSize != kStreamUnknownSize) {
+		posix_fallocate(mFd, 0, (off_t)mFileSize);
+	}
+
+	return true;
+}
+
+/*!
+	\brief Replaces the chunks with count page aligned chunks of size bytes each.
+	Must only be called while no chunk holds data.
+*/
+void DiskBuffer::_AllocateChunks(unsigned count, uint32_t size)
+{
+	void *fData = NULL;
+
+	if (posix_memalign(&fData, kDiskBufferAlignment, (size_t)count * size) != 0) {
+		return;
+	}
+
+	free(mChunkData);
+	mChunkData = (char*)fData;
+	mChunkCount = count;
+	mChunkSize = size;
+	mCurrentChunk = 0;
+
+	for (unsigned i = 0; i < mChunkCount; i++) {
+		mChunks[i].mData = mChunkData + (i * mChunkSize);
+		mChunks[i].mLength = 0;
+		mChunks[i].mOffset = 0;
+		mChunks[i].mBusy = false;
+	}
+}
+
+/*!
+	\brief Returns how many more bytes of in order data can be taken without
+	waiting for the disk. Only limited when there is a writer thread or a
+	stream buffer.
+*/
+uint64_t DiskBuffer::_GetFreeSpace()
+{
+	if (mStream != NULL) {
+		return mStream->GetFree();
+	}
+
+	if (!mWriterRunning) {
+		return (uint64_t)-1;
+	}
+
+	uint64_t fFree = (uint64_t)mFreeChunks->GetSize() * mChunkSize;
+
+	if (mChunkHeld) {
+		fFree += mChunkSize - mChunks[mCurrentChunk].mLength;
+	}
+
+	return fFree;
+}
+
+/*!
+	\brief Returns the chunk new data should go into. With io_uring this waits for
+	the chunk's last write to finish. With a writer thread a free chunk is taken
+	if the receive loop does not hold one, so callers must check _GetFreeSpace first.
+*/
+DiskChunk *DiskBuffer::_GetChunk()
+{
+	DiskChunk *fChunk = &mChunks[mCurrentChunk];
+
+	if (mWriterRunning && !mChunkHeld) {
+		uint32_t fIndex = 0;
+
+		if (mFreeChunks->Pop(&fIndex)) {
+			mCurrentChunk = fIndex;
+			mChunkHeld = true;
+			fChunk = &mChunks[mCurrentChunk];
+			fChunk->mLength = 0;
+		}
+	}
+
+	// Wait for the disk to catch up if every chunk is being written.
+	while (fChunk->mBusy) {
+		_ReapWrites(1);
+	}
+
+	return fChunk;
+}
+
+/*!
+	\brief Records the file writes in trace, if it is not NULL. Writes on the
+	writer thread are recorded from there. The trace must outlive the DiskBuffer.
+*/
+void DiskBuffer::SetTrace(Trace *trace)
+{
+	mTrace = trace;
+}
+
+/*!
+	\brief Times the out of order cache and the file writes as stages, on
+	whichever thread does them, if stages is not NULL. The timers must outlive
+	the DiskBuffer.
+*/
+void DiskBuffer::SetStageTimers(StageTimers *stages)
+{
+	mStages = stages;
+}
+
+/*!
+	\brief Records a write that took duration nanoseconds, at TRACE_CONTROL if it
+	was slow enough to hold up the receiver.
+*/
+static void traceWrite(Trace *trace, uint32_t length, uint64_t offset, uint64_t duration)
+{
+	traceEvent(trace, (duration > kTraceSlowWriteNs) ? TRACE_CONTROL : TRACE_PACKET, TRACE_DISK_WRITE, length, offset, duration);
+}
+
+/*!
+	\brief Returns the CLOCK_MONOTONIC time in nanoseconds, or 0 when not tracing.
+*/
+static uint64_t getTraceTime(Trace *trace)
+{
+	return (trace != NULL) ? getMonotonicMicroSeconds() * 1000 : 0;
+}
+
+/*!
+	\brief Appends data to the file, through the current chunk if chunked writes
+	are in use.
+*/
+void DiskBuffer::_Write(char *data, uint32_t size)
+{
+	if (mChunkCount == 0) {
+		uint64_t fStart = getTraceTime(mTrace);
+
+		PROBE2(disk_write_start, mWriteOffset, size);
+
+		try {
+			ScopedStageTimer fWrite(mStages, STAGE_DISK_WRITE);
+
+			if (mStream != NULL) {
+				mStream->Write(data, size);
+			}
+			else {
+				mFile.write(data, (streamsize)size);
+			}
+		}
+		catch (ios_base::failure &e) {
+			cerr<<"DiskBuffer [Add]: "<<e.what()<<endl;
+		}
+
+		PROBE2(disk_write_done, mWriteOffset, size);
+
+		if (mTrace != NULL) {
+			traceWrite(mTrace, size, mWriteOffset, getTraceTime(mTrace) - fStart);
+		}
+
+		mWriteOffset += size;
+		return;
+	}
+
+	while (size > 0) {
+		DiskChunk *fChunk = _GetChunk();
+
+		if (fChunk->mLength == 0) {
+			fChunk->mOffset = mWriteOffset;
+		}
+
+		uint32_t fCopy = MIN(size, mChunkSize - fChunk->mLength);
+		memcpy(fChunk->mData + fChunk->mLength, data, fCopy);
+		fChunk->mLength += fCopy;
+		mWriteOffset += fCopy;
+		data += fCopy;
+		size -= fCopy;
+
+		if (fChunk->mLength == mChunkSize) {
+			_SubmitChunk();
+		}
+	}
+}
+
+/*!
+	\brief Writes the current chunk and moves on to the next one. With io_uring the
+	write is only started and with a writer thread the chunk is queued for it,
+	otherwise it is done before returning.
+*/
+void DiskBuffer::_SubmitChunk()
+{
+	DiskChunk *fChunk = &mChunks[mCurrentChunk];
+
+	if (fChunk->mLength == 0 || fChunk->mBusy) {
+		return;
+	}
+
+	if (mWriterRunning) {
+		// The queue holds every chunk, so this cannot fail.
+		mFullChunks->Push(mCurrentChunk);
+		mChunkHeld = false;
+
+		mWriterLock.Lock();
+		mWriterLock.Signal();
+		mWriterLock.Unlock();
+		return;
 	}
-	catch (ios_base::failure &e) {
-		cerr<<"DiskBuffer [Flush]: "<<e.what()<<endl;
+
+	uint32_t fLength = _PadChunk(fChunk);
+
+	if (mRing != NULL) {
+		fChunk->mBusy = true;
+		fChunk->mLength = fLength;
+		PROBE2(disk_write_start, fChunk->mOffset, fLength);
+		mRing->PrepareWrite(mFd, fChunk->mData, fLength, fChunk->mOffset, mCurrentChunk);
+		mRing->Submit(0);
+		mCurrentChunk = (mCurrentChunk + 1) % mChunkCount;
+
+		// Pick up finished writes while we are here, it costs nothing.
+		_ReapWrites(0);
+		return;
 	}
+
+	_WriteChunk(fChunk, fLength);
+
+	fChunk->mLength = 0;
+	mCurrentChunk = (mCurrentChunk + 1) % mChunkCount;
+}
+
+/*!
+	\brief Pads the chunk to a whole block when the file is open with O_DIRECT.
+	\return The number of bytes to write.
+*/
+uint32_t DiskBuffer::_PadChunk(DiskChunk *chunk)
+{
+	uint32_t fLength = chunk->mLength;
+
+	if (mAlignment > 0 && (fLength % mAlignment) != 0) {
+		uint32_t fPadded = fLength + mAlignment - (fLength % mAlignment);
+		memset(chunk->mData + fLength, 0, fPadded - fLength);
+		fLength = fPadded;
+	}
+
+	return fLength;
+}
+
+/*!
+	\brief Writes length bytes of the chunk at its file offset, blocking until done.
+*/
+void DiskBuffer::_WriteChunk(DiskChunk *chunk, uint32_t length)
+{
+	uint64_t fStart = getTraceTime(mTrace);
+	uint32_t fDone = 0;
+
+	PROBE2(disk_write_start, chunk->mOffset, length);
+	ScopedStageTimer fWrite(mStages, STAGE_DISK_WRITE);
+
+	while (fDone < length) {
+		ssize_t fWritten = pwrite(mFd, chunk->mData + fDone, length - fDone, chunk->mOffset + fDone);
+
+		if (fWritten <= 0 && errno != EINTR) {
+			cerr<<"DiskBuffer [Write]: Unable to write "<<dec<<length<<" bytes at offset "<<chunk->mOffset<<endl;
+			break;
+		}
+
+		fDone += (fWritten > 0) ? (uint32_t)fWritten : 0;
+	}
+
+	PROBE2(disk_write_done, chunk->mOffset, length);
+
+	if (mTrace != NULL) {
+		traceWrite(mTrace, length, chunk->mOffset, getTraceTime(mTrace) - fStart);
+	}
+}
+
+/*!
+	\brief Frees the chunks whose writes have completed, waiting for at least
+	waitCount of them. A write the disk cut short is finished synchronously.
+*/
+void DiskBuffer::_ReapWrites(unsigned waitCount)
+{
+	uint64_t fIndex = 0;
+	int fResult = 0;
+
+	if (waitCount > 0) {
+		mRing->Submit(waitCount);
+	}
+
+	while (mRing->GetCompletion(&fIndex, &fResult)) {
+		DiskChunk *fChunk = &mChunks[fIndex % mChunkCount];
+
+		if (fResult < 0 || (uint32_t)fResult < fChunk->mLength) {
+			uint32_t fDone = (fResult > 0) ? (uint32_t)fResult : 0;
+			ssize_t fWritten = pwrite(mFd, fChunk->mData + fDone, fChunk->mLength - fDone, fChunk->mOffset + fDone);
+
+			if (fWritten != (ssize_t)(fChunk->mLength - fDone)) {
+				cerr<<"DiskBuffer [Write]: Unable to write "<<dec<<fChunk->mLength<<" bytes at offset "<<fChunk->mOffset<<endl;
+			}
+		}
+
+		PROBE2(disk_write_done, fChunk->mOffset, fChunk->mLength);
+		traceEvent(mTrace, TRACE_PACKET, TRACE_DISK_WRITE, fChunk->mLength, fChunk->mOffset, 0);
+		fChunk->mLength = 0;
+		fChunk->mBusy = false;
+	}
+}
+
+/*!
+	\brief Waits until the writer thread has written every queued chunk.
+*/
+void DiskBuffer::_WaitForWriter()
+{
+	mIdleLock.Lock();
+
+	while (mFreeChunks->GetSize() + (mChunkHeld ? 1 : 0) < mChunkCount) {
+		mIdleLock.Wait();
+	}
+
+	mIdleLock.Unlock();
+}
+
+/*!
+	\brief Entry point of the writer thread. Writes queued chunks in order and
+	hands them back, sleeping while the queue is empty.
+	\param args The DiskBuffer that started the thread.
+*/
+void *DiskBuffer::_StartWriter(void *args)
+{
+	DiskBuffer *fBuffer = (DiskBuffer*)args;
+	uint32_t fIndex = 0;
+
+	while (true) {
+		fBuffer->mWriterLock.Lock();
+
+		while (fBuffer->mFullChunks->GetSize() == 0 && !fBuffer->mWriterStop) {
+			fBuffer->mWriterLock.Wait();
+		}
+
+		fBuffer->mWriterLock.Unlock();
+
+		if (!fBuffer->mFullChunks->Pop(&fIndex)) {
+			break;
+		}
+
+		// Drain everything that is queued before looking at the lock again.
+		do {
+			DiskChunk *fChunk = &fBuffer->mChunks[fIndex];
+			fBuffer->_WriteChunk(fChunk, fBuffer->_PadChunk(fChunk));
+			fBuffer->mFreeChunks->Push(fIndex);
+
+			fBuffer->mIdleLock.Lock();
+			fBuffer->mIdleLock.Signal();
+			fBuffer->mIdleLock.Unlock();
+		} while (fBuffer->mFullChunks->Pop(&fIndex));
+	}
+
+	return NULL;
 }
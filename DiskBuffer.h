@@ -16,9 +16,39 @@
 #include "Transmission.h"
 #include "OutOfSeqCache.h"
 #include "Mutex.h"
+#include "IoUring.h"
+#include "Thread.h"
+#include "SpscQueue.h"
+#include "StageTimer.h"
+#include "StreamBuffer.h"
+#include "Trace.h"
+
+#define kDiskBufferRingChunks 8
+#define kDiskBufferWriterChunks 16
+#define kDiskBufferMaxChunks 16
+#define kDiskBufferRingChunkSize 262144
+#define kDiskBufferCoalesceSize 4194304
+#define kDiskBufferAlignment 4096 // O_DIRECT buffer, offset and length alignment.
 
 using namespace std;
 
+enum DiskWriteMode
+{
+	DISK_WRITE_STREAM, // Every payload goes through the fstream as it arrives.
+	DISK_WRITE_COALESCE, // In order data is gathered into large buffers first.
+	DISK_WRITE_DIRECT // Like DISK_WRITE_COALESCE, bypassing the page cache with O_DIRECT.
+};
+
+/*! \struct DiskChunk
+    \brief In order data waiting to be written in one piece.
+*/
+struct DiskChunk {
+	char		*mData;
+	uint32_t	mLength;
+	uint64_t	mOffset;
+	bool		mBusy; // A write of this chunk has not completed yet.
+};
+
 /*! \class DiskBuffer
     \brief Represents a place to store large amounts of information.
 
@@ -29,14 +59,33 @@ using namespace std;
 class DiskBuffer {
 	public:
 		DiskBuffer(string &fileName, uint64_t fileSize, uint64_t nextSeq);
+		DiskBuffer(StreamBuffer *stream, uint64_t fileSize, uint64_t nextSeq);
 		virtual ~DiskBuffer();
 		
 		uint64_t		Add(Data &);
 		uint64_t		GetNextSeq();
+		size_t			GetOutOfSeqCount();
 		uint32_t		GetWindowSize();
 		void	 		Flush();
+		bool			SetWriteMode(DiskWriteMode mode);
+		bool			EnableIoUring(bool sqPoll);
+		bool			EnableWriterThread();
+		void			SetTrace(Trace *trace);
+		void			SetStageTimers(StageTimers *stages);
 		
 	private:
+		static void*	_StartWriter(void *);
+		bool			_OpenFile(bool direct);
+		void			_AllocateChunks(unsigned count, uint32_t size);
+		uint64_t		_GetFreeSpace();
+		DiskChunk		*_GetChunk();
+		void			_Write(char *data, uint32_t size);
+		void			_SubmitChunk();
+		uint32_t		_PadChunk(DiskChunk *chunk);
+		void			_WriteChunk(DiskChunk *chunk, uint32_t length);
+		void			_ReapWrites(unsigned waitCount);
+		void			_WaitForWriter();
+
 		//Mutex			mWriteLock;
 		OutOfSeqCache	mOutOfSeqCache;
 		
@@ -45,5 +94,27 @@ class DiskBuffer {
 		uint64_t		mFileSize;
 		uint64_t		mNextSeq;
 		uint32_t		mWindowSize;
+
+		IoUring			*mRing;
+		int				mFd;
+		uint32_t		mAlignment; // Write alignment when the file is open with O_DIRECT, otherwise 0.
+		char			*mChunkData;
+		DiskChunk		mChunks[kDiskBufferMaxChunks];
+		unsigned		mChunkCount; // 0 while writes go through the fstream.
+		uint32_t		mChunkSize;
+		unsigned		mCurrentChunk;
+		uint64_t		mWriteOffset; // File offset following the last byte handed to a chunk.
+
+		Thread			mWriterThread;
+		bool			mWriterRunning;
+		bool			mWriterStop; // Tells the writer thread to exit once the queue is empty.
+		SpscQueue		*mFullChunks; // Chunks waiting for the writer thread, in file order.
+		SpscQueue		*mFreeChunks; // Chunks the writer thread has finished with.
+		bool			mChunkHeld; // Whether mCurrentChunk belongs to the receive loop.
+		Mutex			mWriterLock; // Wakes the writer thread when a chunk is queued.
+		Mutex			mIdleLock; // Wakes Flush when the writer thread frees a chunk.
+		Trace			*mTrace; // Not owned. NULL when not tracing.
+		StageTimers		*mStages; // Not owned. NULL when not timing.
+		StreamBuffer	*mStream; // Not owned. Takes the in order data in place of the file, or NULL.
 };
 #endif
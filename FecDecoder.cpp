@@ -0,0 +1,229 @@
+/*
+ * File: FecDecoder.cpp
+ * Desc: Rebuilds lost DATA packets from the XOR parity packets produced
+ * by FecEncoder.
+ */
+#include <string.h>
+
+#include "FecDecoder.h"
+
+/*!
+	\param payloadSize The DATA payload size used by the sender. Parity
+	packets with any other stride are ignored.
+*/
+FecDecoder::FecDecoder(unsigned short payloadSize)
+	: mPayloadSize(payloadSize), mRecoveredCount(0)
+{
+	mSlots = new FecSlot[kFecHistorySlots];
+	mSlotData = new char[kFecHistorySlots * mPayloadSize];
+	mRecovered = new char[mPayloadSize];
+
+	for (int i = 0; i < kFecHistorySlots; i++)
+	{
+		mSlots[i].mSeqNum = 0;
+		mSlots[i].mSize = 0;
+		mSlots[i].mUsed = false;
+		mSlots[i].mData = mSlotData + (i * mPayloadSize);
+	}
+}
+
+FecDecoder::~FecDecoder()
+{
+	for (vector<FecParity>::iterator fIter = mPending.begin(); fIter != mPending.end(); fIter++)
+	{
+		delete [] fIter->mData;
+	}
+
+	delete [] mSlots;
+	delete [] mSlotData;
+	delete [] mRecovered;
+}
+
+/*!
+	\brief Remembers a received DATA payload so it can take part in recovery.
+	\param &packet The packet that was received.
+*/
+void FecDecoder::AddData(Data &packet)
+{
+	if (packet.mPacketSize == 0 || packet.mPacketSize > mPayloadSize)
+	{
+		return;
+	}
+
+	FecSlot *fSlot = _GetSlot(packet.mSeqNum);
+	fSlot->mSeqNum = packet.mSeqNum;
+	fSlot->mSize = packet.mPacketSize;
+	fSlot->mUsed = true;
+	memcpy(fSlot->mData, packet.mData, packet.mPacketSize);
+}
+
+/*!
+	\brief Stores a parity packet until its block can be checked by Recover.
+	\param seqNum The sequence number of the first packet in the block.
+	\param count The number of DATA packets in the block.
+	\param stride The payload size of every packet in the block but the last.
+	\param lengthXor The XOR of the payload sizes of every packet in the block.
+	\param data The parity payload, stride bytes long.
+*/
+void FecDecoder::AddParity(uint64_t seqNum, unsigned short count, unsigned short stride,
+	unsigned short lengthXor, char *data)
+{
+	if (data == NULL || stride != mPayloadSize || count == 0 || count > (kFecHistorySlots / 2))
+	{
+		return;
+	}
+
+	for (vector<FecParity>::iterator fIter = mPending.begin(); fIter != mPending.end(); fIter++)
+	{
+		if (fIter->mSeqNum == seqNum && fIter->mCount == count)
+		{
+			return;
+		}
+	}
+
+	// Drop the oldest parity if the sender is far ahead of us.
+	if (mPending.size() >= kFecMaxPendingParity)
+	{
+		delete [] mPending.front().mData;
+		mPending.erase(mPending.begin());
+	}
+
+	FecParity fParity;
+	fParity.mSeqNum = seqNum;
+	fParity.mCount = count;
+	fParity.mLengthXor = lengthXor;
+	fParity.mData = new char[mPayloadSize];
+	memcpy(fParity.mData, data, mPayloadSize);
+
+	mPending.push_back(fParity);
+}
+
+/*!
+	\brief Looks for a block with exactly one packet missing and rebuilds it.
+	The returned packet is only valid until the next call to Recover, so it
+	should be handed to DiskBuffer::Add straight away. Call repeatedly until
+	NULL is returned, since one recovered packet may complete another block.
+	\param nextSeq The next sequence number the receiver is expecting. Blocks
+	that end before it are already on disk and are discarded.
+	\return The rebuilt packet or NULL if nothing can be recovered.
+*/
+Data *FecDecoder::Recover(uint64_t nextSeq)
+{
+	_Prune(nextSeq);
+
+	vector<FecParity>::iterator fIter = mPending.begin();
+	while (fIter != mPending.end())
+	{
+		int fMissing = 0;
+		uint64_t fMissingSeq = 0;
+
+		for (unsigned short i = 0; i < fIter->mCount && fMissing < 2; i++)
+		{
+			uint64_t fSeqNum = fIter->mSeqNum + (uint64_t)i * mPayloadSize;
+			FecSlot *fSlot = _GetSlot(fSeqNum);
+
+			if (!fSlot->mUsed || fSlot->mSeqNum != fSeqNum)
+			{
+				fMissing++;
+				fMissingSeq = fSeqNum;
+			}
+		}
+
+		if (fMissing == 1)
+		{
+			unsigned short fSize = fIter->mLengthXor;
+			memcpy(mRecovered, fIter->mData, mPayloadSize);
+
+			for (unsigned short i = 0; i < fIter->mCount; i++)
+			{
+				uint64_t fSeqNum = fIter->mSeqNum + (uint64_t)i * mPayloadSize;
+
+				if (fSeqNum != fMissingSeq)
+				{
+					FecSlot *fSlot = _GetSlot(fSeqNum);
+					fSize ^= fSlot->mSize;
+
+					for (unsigned short j = 0; j < fSlot->mSize; j++)
+					{
+						mRecovered[j] ^= fSlot->mData[j];
+					}
+				}
+			}
+
+			delete [] fIter->mData;
+			mPending.erase(fIter);
+
+			// A size outside the stride means the block did not line up with
+			// what we have, so drop it rather than write garbage.
+			if (fSize > 0 && fSize <= mPayloadSize)
+			{
+				mRecoveredData.mSeqNum = fMissingSeq;
+				mRecoveredData.mPacketSize = fSize;
+				mRecoveredData.mData = mRecovered;
+
+				AddData(mRecoveredData);
+				mRecoveredCount++;
+
+				return &mRecoveredData;
+			}
+
+			fIter = mPending.begin();
+		}
+		else if (fMissing == 0)
+		{
+			delete [] fIter->mData;
+			fIter = mPending.erase(fIter);
+		}
+		else
+		{
+			fIter++;
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+	\brief Returns the DATA payload size this decoder was created for.
+*/
+unsigned short FecDecoder::GetPayloadSize()
+{
+	return mPayloadSize;
+}
+
+/*!
+	\brief Returns the number of packets rebuilt from parity so far.
+*/
+uint64_t FecDecoder::GetRecoveredCount()
+{
+	return mRecoveredCount;
+}
+
+/*!
+	\brief Maps a sequence number to its history slot. Packets in a transfer
+	are spaced one payload apart, so consecutive packets land in consecutive slots.
+*/
+FecSlot *FecDecoder::_GetSlot(uint64_t seqNum)
+{
+	return &mSlots[(seqNum / mPayloadSize) % kFecHistorySlots];
+}
+
+/*!
+	\brief Discards parity packets whose whole block has already been written.
+*/
+void FecDecoder::_Prune(uint64_t nextSeq)
+{
+	vector<FecParity>::iterator fIter = mPending.begin();
+	while (fIter != mPending.end())
+	{
+		if (fIter->mSeqNum + (uint64_t)fIter->mCount * mPayloadSize <= nextSeq)
+		{
+			delete [] fIter->mData;
+			fIter = mPending.erase(fIter);
+		}
+		else
+		{
+			fIter++;
+		}
+	}
+}
@@ -0,0 +1,74 @@
+/*
+ * File: FecDecoder.h
+ * Desc: Rebuilds lost DATA packets from the XOR parity packets produced
+ * by FecEncoder.
+ */
+#ifndef _FECDECODER_H_
+#define _FECDECODER_H_
+
+#include <inttypes.h>
+#include <vector>
+
+#include "Transmission.h"
+
+#define kFecHistorySlots 256
+#define kFecMaxPendingParity 32
+
+using namespace std;
+
+/*! \struct FecSlot
+    \brief A recently received DATA payload kept around for parity recovery.
+*/
+struct FecSlot {
+	uint64_t		mSeqNum;
+	unsigned short	mSize;
+	bool			mUsed;
+	char			*mData;
+};
+
+/*! \struct FecParity
+    \brief A parity packet whose block still has more than one packet missing.
+*/
+struct FecParity {
+	uint64_t		mSeqNum;
+	unsigned short	mCount;
+	unsigned short	mLengthXor;
+	char			*mData;
+};
+
+/*! \class FecDecoder
+    \brief Keeps a short history of received DATA payloads and the parity
+    packets that cover them.
+
+   DATA packets are written to disk as soon as they are in order, so the decoder
+   keeps its own copy of the most recent payloads in a ring indexed by sequence
+   number. When a parity packet's block is missing exactly one packet, that packet
+   is rebuilt by XORing the parity with the rest of the block. Parity packets
+   with more than one packet missing are held until a retransmission fills
+   one of the holes.
+*/
+class FecDecoder {
+	public:
+		FecDecoder(unsigned short payloadSize);
+		virtual ~FecDecoder();
+
+		void			AddData(Data &);
+		void			AddParity(uint64_t seqNum, unsigned short count, unsigned short stride,
+							unsigned short lengthXor, char *data);
+		Data			*Recover(uint64_t nextSeq);
+		unsigned short	GetPayloadSize();
+		uint64_t		GetRecoveredCount();
+
+	private:
+		FecSlot			*_GetSlot(uint64_t seqNum);
+		void			_Prune(uint64_t nextSeq);
+
+		FecSlot			*mSlots;
+		char			*mSlotData;
+		vector<FecParity>	mPending;
+		unsigned short	mPayloadSize;
+		char			*mRecovered;
+		Data			mRecoveredData;
+		uint64_t		mRecoveredCount;
+};
+#endif
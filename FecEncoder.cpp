@@ -0,0 +1,187 @@
+/*
+ * File: FecEncoder.cpp
+ * Desc: Builds XOR parity packets over blocks of consecutive DATA packets
+ * so the receiver can rebuild a single lost packet per block without
+ * waiting for a retransmission.
+ */
+#include <string.h>
+
+#include "FecEncoder.h"
+
+/*!
+	\param maxBlockSize The largest number of DATA packets a parity packet may cover.
+	\param maxPayloadSize The largest DATA payload that will be added to a block.
+*/
+FecEncoder::FecEncoder(unsigned short maxBlockSize, unsigned short maxPayloadSize)
+	: mBlockSeq(0), mCount(0), mStride(0), mLengthXor(0), mMaxPayloadSize(maxPayloadSize),
+	  mSentCount(0), mLossCount(0), mLossRate(0.0)
+{
+	if (maxBlockSize < kFecMinBlockSize)
+	{
+		maxBlockSize = kFecMinBlockSize;
+	}
+	else if (maxBlockSize > kFecMaxBlockSize)
+	{
+		maxBlockSize = kFecMaxBlockSize;
+	}
+
+	mMaxBlockSize = maxBlockSize;
+	mBlockSize = maxBlockSize;
+	mParity = new char[mMaxPayloadSize];
+}
+
+FecEncoder::~FecEncoder()
+{
+	delete [] mParity;
+}
+
+/*!
+	\brief Folds a DATA payload into the current block. A payload that does not
+	directly follow the previous one in sequence space starts a new block, since
+	the receiver rebuilds packet positions from the block start and stride.
+	\param seqNum The sequence number of the DATA packet.
+	\param data The payload of the DATA packet.
+	\param size The number of payload bytes.
+*/
+void FecEncoder::Add(uint64_t seqNum, char *data, unsigned short size)
+{
+	if (data == NULL || size == 0 || size > mMaxPayloadSize)
+	{
+		return;
+	}
+
+	mSentCount++;
+
+	if (mCount > 0 && (seqNum != mBlockSeq + (uint64_t)mCount * mStride || size > mStride))
+	{
+		Reset();
+	}
+
+	if (mCount == 0)
+	{
+		mBlockSeq = seqNum;
+		mStride = size;
+		mLengthXor = size;
+		memcpy(mParity, data, size);
+	}
+	else
+	{
+		mLengthXor ^= size;
+
+		for (unsigned short i = 0; i < size; i++)
+		{
+			mParity[i] ^= data[i];
+		}
+	}
+
+	mCount++;
+}
+
+/*!
+	\brief Writes a PARITY packet covering the current block into buff and
+	starts a new block.
+	\return The number of bytes written, or 0 if there is no block to send.
+*/
+uint32_t FecEncoder::BuildParityPacket(char *buff, uint32_t buffSize)
+{
+	uint32_t fLength = 0;
+
+	if (mCount > 0 && buff != NULL && buffSize >= (uint32_t)(kParityPacketSize + mStride))
+	{
+		ParityPacket::Code::Set(buff, PARITY);
+		ParityPacket::Seq::Set(buff, mBlockSeq);
+		ParityPacket::Count::Set(buff, mCount);
+		ParityPacket::Stride::Set(buff, mStride);
+		ParityPacket::LengthXor::Set(buff, mLengthXor);
+
+		memcpy(buff + ParityPacket::kSize, mParity, mStride);
+		fLength = ParityPacket::kSize + mStride;
+
+		Reset();
+	}
+
+	return fLength;
+}
+
+/*!
+	\brief Returns true once the block holds as many packets as the current block
+	size. A block never grows past the send window, since a loss inside a larger
+	block would stall the sender before the parity could go out.
+	\param windowPackets The number of packets the sender may have in flight.
+*/
+bool FecEncoder::IsBlockFull(uint32_t windowPackets)
+{
+	return mCount >= mBlockSize || mCount >= windowPackets;
+}
+
+/*!
+	\brief Returns true if at least one packet is waiting for a parity packet.
+*/
+bool FecEncoder::HasBlock()
+{
+	return mCount > 0;
+}
+
+/*!
+	\brief Discards the current block. Used when the sender goes back to
+	retransmit, since the block would no longer be contiguous.
+*/
+void FecEncoder::Reset()
+{
+	mCount = 0;
+	mStride = 0;
+	mLengthXor = 0;
+}
+
+/*!
+	\brief Records packets the sender found lost.
+	\param count The packets the loss detector found lost, or 1 for a
+	retransmission timeout, which says nothing about how many were.
+*/
+void FecEncoder::ReportLoss(uint32_t count)
+{
+	mLossCount += count;
+	_UpdateBlockSize();
+}
+
+/*!
+	\brief Returns the number of DATA packets currently covered by each parity packet.
+*/
+unsigned short FecEncoder::GetBlockSize()
+{
+	_UpdateBlockSize();
+
+	return mBlockSize;
+}
+
+/*!
+	\brief Recomputes the block size from a moving average of the loss rate.
+	A block of K packets plus its parity survives a single loss, so K is chosen
+	to keep the expected number of losses per block around one half.
+*/
+void FecEncoder::_UpdateBlockSize()
+{
+	if (mSentCount < kFecLossSamplePackets)
+	{
+		return;
+	}
+
+	double fSample = (double)mLossCount / mSentCount;
+	mLossRate = (mLossRate * 0.75) + (fSample * 0.25);
+	mSentCount = 0;
+	mLossCount = 0;
+
+	if (mLossRate <= 0.0 || (1.0 / (2.0 * mLossRate)) >= mMaxBlockSize)
+	{
+		mBlockSize = mMaxBlockSize;
+	}
+	else
+	{
+		mBlockSize = (unsigned short)(1.0 / (2.0 * mLossRate));
+
+		if (mBlockSize < kFecMinBlockSize)
+		{
+			mBlockSize = kFecMinBlockSize;
+		}
+	}
+}
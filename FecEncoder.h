@@ -0,0 +1,55 @@
+/*
+ * File: FecEncoder.h
+ * Desc: Builds XOR parity packets over blocks of consecutive DATA packets
+ * so the receiver can rebuild a single lost packet per block without
+ * waiting for a retransmission.
+ */
+#ifndef _FECENCODER_H_
+#define _FECENCODER_H_
+
+#include <inttypes.h>
+
+#include "Transmission.h"
+
+#define kFecMinBlockSize 2
+#define kFecMaxBlockSize 64
+#define kFecLossSamplePackets 64
+
+/*! \class FecEncoder
+    \brief Accumulates the XOR parity of a block of DATA packets.
+
+   Every DATA payload sent is folded into the current block. Once the block
+   holds GetBlockSize() packets, or the sender runs out of data, a PARITY
+   packet is built that covers the whole block. The block size adapts to
+   the loss rate reported by the sender so that lossy links get more
+   redundancy and clean links pay almost nothing.
+*/
+class FecEncoder {
+	public:
+		FecEncoder(unsigned short maxBlockSize, unsigned short maxPayloadSize);
+		virtual ~FecEncoder();
+
+		void			Add(uint64_t seqNum, char *data, unsigned short size);
+		uint32_t		BuildParityPacket(char *buff, uint32_t buffSize);
+		bool			IsBlockFull(uint32_t windowPackets);
+		bool			HasBlock();
+		void			Reset();
+		void			ReportLoss(uint32_t count);
+		unsigned short	GetBlockSize();
+
+	private:
+		void			_UpdateBlockSize();
+
+		char			*mParity;
+		uint64_t		mBlockSeq;
+		unsigned short	mCount;
+		unsigned short	mStride;
+		unsigned short	mLengthXor;
+		unsigned short	mMaxPayloadSize;
+		unsigned short	mBlockSize;
+		unsigned short	mMaxBlockSize;
+		uint32_t		mSentCount;
+		uint32_t		mLossCount;
+		double			mLossRate;
+};
+#endif
@@ -0,0 +1,334 @@
+/*
+ * File: Impairment.cpp
+ * Desc: Emulates a bad network path under the datagram sends: loss, burst
+ * loss, delay, jitter, reordering, duplication and a rate limited bottleneck.
+ */
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "Impairment.h"
+#include "Transmission.h"
+
+/*!
+	\param config What to do to each datagram, see ParseConfig.
+*/
+Impairment::Impairment(const ImpairConfig &config)
+	: mConfig(config), mRandomState(config.mSeed), mBurstState(false), mLastDeparture(0),
+	  mScheduler(_StartScheduler, this), mRunning(false)
+{
+}
+
+/*!
+	\brief Datagrams still waiting are dropped; the scheduler thread is left to
+	exit with the process, like the other worker threads.
+*/
+Impairment::~Impairment()
+{
+}
+
+/*!
+	\brief Reads a comma separated list of impairments, such as
+	"loss=0.01,delay=20,jitter=5,rate=50,queue=64,seed=3". Keys:
+	loss=<p>, burst=<enter>:<leave>:<loss> (Gilbert-Elliott), delay=<ms>,
+	jitter=<ms>, reorder=<p>, dup=<p>, rate=<Mbit/s>, queue=<datagrams> and
+	seed=<n>.
+	\param spec The list.
+	\param config Set to the defaults, then to the values in spec.
+	\return false if a key is unknown or a value is out of range.
+*/
+bool Impairment::ParseConfig(const char *spec, ImpairConfig *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->mQueue = kImpairDefaultQueue;
+	config->mSeed = 1;
+
+	stringstream fList(spec);
+	string fItem;
+
+	while (getline(fList, fItem, ','))
+	{
+		size_t fEquals = fItem.find('=');
+
+		if (fEquals == string::npos)
+		{
+			return false;
+		}
+
+		string fKey = fItem.substr(0, fEquals);
+		const char *fValue = fItem.c_str() + fEquals + 1;
+		char *fEnd = NULL;
+		double fNumber = strtod(fValue, &fEnd);
+
+		if (fKey == "burst")
+		{
+			// Three numbers separated by colons.
+			config->mBurstEnter = fNumber;
+			config->mBurstLeave = (*fEnd == ':') ? strtod(fEnd + 1, &fEnd) : -1;
+			config->mBurstLoss = (*fEnd == ':') ? strtod(fEnd + 1, &fEnd) : -1;
+
+			if (config->mBurstEnter < 0 || config->mBurstEnter > 1 || config->mBurstLeave <= 0 || config->mBurstLeave > 1
+				|| config->mBurstLoss < 0 || config->mBurstLoss > 1)
+			{
+				return false;
+			}
+		}
+		else if (fKey == "loss" || fKey == "reorder" || fKey == "dup")
+		{
+			if (fNumber < 0 || fNumber > 1)
+			{
+				return false;
+			}
+
+			*((fKey == "loss") ? &config->mLoss : ((fKey == "reorder") ? &config->mReorder : &config->mDuplicate)) = fNumber;
+		}
+		else if ((fKey == "delay" || fKey == "jitter" || fKey == "rate") && fNumber >= 0)
+		{
+			*((fKey == "delay") ? &config->mDelay : ((fKey == "jitter") ? &config->mJitter : &config->mRate)) = fNumber;
+		}
+		else if (fKey == "queue" && fNumber >= 1)
+		{
+			config->mQueue = (uint32_t)fNumber;
+		}
+		else if (fKey == "seed")
+		{
+			config->mSeed = strtoull(fValue, &fEnd, 10);
+		}
+		else
+		{
+			return false;
+		}
+
+		if (fEnd == fValue || *fEnd != '\0')
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*!
+	\brief Starts the scheduler thread that sends delayed datagrams.
+	\return false if the thread could not be started.
+*/
+bool Impairment::Start()
+{
+	if (!mRunning)
+	{
+		mRunning = (mScheduler.Start() == 0);
+	}
+
+	return mRunning;
+}
+
+/*!
+	\brief Returns the impairments in effect, for the startup log.
+*/
+string Impairment::Describe()
+{
+	stringstream fText;
+
+	fText<<"loss "<<mConfig.mLoss;
+
+	if (mConfig.mBurstEnter > 0)
+	{
+		fText<<", burst "<<mConfig.mBurstEnter<<":"<<mConfig.mBurstLeave<<":"<<mConfig.mBurstLoss;
+	}
+
+	fText<<", delay "<<mConfig.mDelay<<" ms, jitter "<<mConfig.mJitter<<" ms, reorder "<<mConfig.mReorder
+		<<", dup "<<mConfig.mDuplicate;
+
+	if (mConfig.mRate > 0)
+	{
+		fText<<", rate "<<mConfig.mRate<<" Mbit/s, queue "<<mConfig.mQueue;
+	}
+
+	fText<<", seed "<<mConfig.mSeed;
+	return fText.str();
+}
+
+/*!
+	\brief Sends a datagram through the impairments. It may be dropped, sent
+	now, sent later or sent twice.
+*/
+void Impairment::Send(int sock, struct sockaddr_in *to, const char *data, size_t size)
+{
+	mLock.Lock();
+
+	uint64_t fNow = getMonotonicMicroSeconds() * 1000;
+	uint64_t fRelease = fNow;
+
+	if (_IsLost())
+	{
+		mLock.Unlock();
+		return;
+	}
+
+	if (mConfig.mRate > 0)
+	{
+		// Forget the datagrams that have left the bottleneck.
+		while (!mBottleneck.empty() && mBottleneck.front() <= fNow)
+		{
+			mBottleneck.pop_front();
+		}
+
+		if (mBottleneck.size() >= mConfig.mQueue)
+		{
+			mLock.Unlock();
+			return;
+		}
+
+		// Wait for the datagrams ahead, then for this one to be serialized.
+		fRelease = ((mLastDeparture > fNow) ? mLastDeparture : fNow) + (uint64_t)((size * 8 * 1000.0) / mConfig.mRate);
+		mLastDeparture = fRelease;
+		mBottleneck.push_back(fRelease);
+	}
+
+	double fDelay = mConfig.mDelay;
+
+	if (mConfig.mJitter > 0)
+	{
+		fDelay += ((_Random() * 2) - 1) * mConfig.mJitter;
+	}
+
+	if (mConfig.mReorder > 0 && _Random() < mConfig.mReorder)
+	{
+		fDelay += kImpairReorderHold;
+	}
+
+	fRelease += (fDelay > 0) ? (uint64_t)(fDelay * 1000000) : 0;
+	bool fDuplicate = (mConfig.mDuplicate > 0 && _Random() < mConfig.mDuplicate);
+
+	if (fRelease <= fNow || !mRunning)
+	{
+		mLock.Unlock();
+		sendto(sock, data, size, 0, (struct sockaddr*)to, sizeof(*to));
+
+		if (fDuplicate)
+		{
+			sendto(sock, data, size, 0, (struct sockaddr*)to, sizeof(*to));
+		}
+
+		return;
+	}
+
+	_Schedule(fRelease, sock, to, data, size);
+
+	if (fDuplicate)
+	{
+		_Schedule(fRelease, sock, to, data, size);
+	}
+
+	mLock.Unlock();
+}
+
+/*!
+	\brief Returns a uniform random number from 0 up to 1 (splitmix64). Call
+	with mLock held.
+*/
+double Impairment::_Random()
+{
+	uint64_t fValue = (mRandomState += 0x9E3779B97F4A7C15ULL);
+
+	fValue = (fValue ^ (fValue >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	fValue = (fValue ^ (fValue >> 27)) * 0x94D049BB133111EBULL;
+	fValue ^= fValue >> 31;
+
+	return (fValue >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*!
+	\brief Decides whether the next datagram is lost, moving the burst loss
+	model between its states first. Call with mLock held.
+*/
+bool Impairment::_IsLost()
+{
+	if (mConfig.mBurstEnter > 0)
+	{
+		mBurstState = mBurstState ? (_Random() >= mConfig.mBurstLeave) : (_Random() < mConfig.mBurstEnter);
+
+		if (mBurstState && _Random() < mConfig.mBurstLoss)
+		{
+			return true;
+		}
+	}
+
+	return (mConfig.mLoss > 0 && _Random() < mConfig.mLoss);
+}
+
+/*!
+	\brief Copies a datagram for the scheduler thread to send at release, and
+	wakes it in case it is due before the ones already waiting. Call with
+	mLock held.
+*/
+void Impairment::_Schedule(uint64_t release, int sock, struct sockaddr_in *to, const char *data, size_t size)
+{
+	multimap<uint64_t, ImpairedDatagram>::iterator fEntry = mPending.insert(make_pair(release, ImpairedDatagram()));
+
+	fEntry->second.mSocket = sock;
+	fEntry->second.mTo = *to;
+	fEntry->second.mData.assign(data, size);
+
+	if (fEntry == mPending.begin())
+	{
+		mLock.Signal();
+	}
+}
+
+/*!
+	\brief Entry point of the scheduler thread. Sends each waiting datagram
+	when its release time comes, in release order; datagrams released at the
+	same time keep the order they were sent in.
+	\param args The Impairment that started the thread.
+*/
+void *Impairment::_StartScheduler(void *args)
+{
+	Impairment *fImpairment = (Impairment*)args;
+
+	fImpairment->mLock.Lock();
+
+	while (true)
+	{
+		if (fImpairment->mPending.empty())
+		{
+			fImpairment->mLock.Wait();
+			continue;
+		}
+
+		uint64_t fNow = getMonotonicMicroSeconds() * 1000;
+		multimap<uint64_t, ImpairedDatagram>::iterator fFirst = fImpairment->mPending.begin();
+
+		if (fFirst->first > fNow)
+		{
+			// The condition variable waits on CLOCK_REALTIME.
+			struct timespec fWake;
+			uint64_t fWait = fFirst->first - fNow;
+
+			clock_gettime(CLOCK_REALTIME, &fWake);
+			fWake.tv_sec += fWait / 1000000000;
+			fWake.tv_nsec += fWait % 1000000000;
+
+			if (fWake.tv_nsec >= 1000000000)
+			{
+				fWake.tv_sec++;
+				fWake.tv_nsec -= 1000000000;
+			}
+
+			fImpairment->mLock.TimedWait(fWake);
+			continue;
+		}
+
+		ImpairedDatagram fDatagram = fFirst->second;
+		fImpairment->mPending.erase(fFirst);
+
+		fImpairment->mLock.Unlock();
+		sendto(fDatagram.mSocket, fDatagram.mData.data(), fDatagram.mData.size(), 0, (struct sockaddr*)&fDatagram.mTo, sizeof(fDatagram.mTo));
+		fImpairment->mLock.Lock();
+	}
+
+	return NULL;
+}
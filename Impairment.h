@@ -0,0 +1,89 @@
+/*
+ * File: Impairment.h
+ * Desc: Emulates a bad network path under the datagram sends: loss, burst
+ * loss, delay, jitter, reordering, duplication and a rate limited bottleneck.
+ */
+#ifndef _IMPAIRMENT_H_
+#define _IMPAIRMENT_H_
+
+#include <deque>
+#include <inttypes.h>
+#include <map>
+#include <string>
+#include <netinet/in.h>
+
+#include "Mutex.h"
+#include "Thread.h"
+
+#define kImpairReorderHold 2 // Milliseconds a reordered datagram is held back, so the next ones overtake it.
+#define kImpairDefaultQueue 100 // Datagrams the bottleneck holds before it drops, when rate is set.
+
+using namespace std;
+
+/*! \struct ImpairConfig
+    \brief What an Impairment does to each datagram. Probabilities are from 0
+    to 1; the defaults leave datagrams untouched.
+*/
+struct ImpairConfig {
+	double		mLoss; // Independent loss.
+	double		mBurstEnter; // Gilbert-Elliott: chance of moving from the good to the bad state.
+	double		mBurstLeave; // Gilbert-Elliott: chance of moving from the bad to the good state.
+	double		mBurstLoss; // Gilbert-Elliott: loss in the bad state.
+	double		mDelay; // Milliseconds added to every datagram.
+	double		mJitter; // Up to this many milliseconds more or less, uniformly.
+	double		mReorder; // Held back by kImpairReorderHold.
+	double		mDuplicate; // Sent twice.
+	double		mRate; // Bottleneck in Mbit/s, or 0 for none.
+	uint32_t	mQueue; // Datagrams waiting at the bottleneck before tail drop.
+	uint64_t	mSeed;
+};
+
+/*! \struct ImpairedDatagram
+    \brief A datagram waiting for its release time.
+*/
+struct ImpairedDatagram {
+	int					mSocket;
+	struct sockaddr_in	mTo;
+	string				mData;
+};
+
+/*! \class Impairment
+    \brief Sends datagrams as if they crossed a lossy, slow or jittery path.
+
+   Each datagram goes through the same stages as with tc netem: the loss models,
+   then the bottleneck, which serializes datagrams at mRate and drops them when
+   mQueue are already waiting, then the delay, jitter and reordering, then
+   duplication. Datagrams due now are sent by the caller; the rest are copied
+   and sent by a scheduler thread at their release time.
+
+   Every random choice comes from one generator seeded with mSeed, so the same
+   sequence of sends is impaired the same way on every run. Send may be called
+   from any thread.
+*/
+class Impairment {
+	public:
+		Impairment(const ImpairConfig &config);
+		virtual ~Impairment();
+
+		static bool		ParseConfig(const char *spec, ImpairConfig *config);
+		bool			Start();
+		void			Send(int sock, struct sockaddr_in *to, const char *data, size_t size);
+		string			Describe();
+
+	private:
+		static void*	_StartScheduler(void *);
+		double			_Random();
+		bool			_IsLost();
+		void			_Schedule(uint64_t release, int sock, struct sockaddr_in *to, const char *data, size_t size);
+
+		ImpairConfig					mConfig;
+		uint64_t						mRandomState;
+		bool							mBurstState; // In the Gilbert-Elliott bad state.
+		deque<uint64_t>					mBottleneck; // Times the datagrams waiting at the bottleneck leave it.
+		uint64_t						mLastDeparture;
+		multimap<uint64_t, ImpairedDatagram>	mPending; // By CLOCK_MONOTONIC release time in nanoseconds.
+		Mutex							mLock; // Guards everything above and wakes the scheduler.
+		Thread							mScheduler;
+		bool							mRunning;
+};
+#endif
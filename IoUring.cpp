@@ -0,0 +1,463 @@
+/*
+ * File: IoUring.cpp
+ * Desc: A small wrapper around a Linux io_uring submission and completion
+ * queue pair, used as an asynchronous alternative to the blocking socket and
+ * file calls.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "IoUring.h"
+
+/*!
+	\param entries The number of submission queue entries. The completion queue
+	is twice as large, so up to 2 * entries operations may be in flight.
+	\param sqPoll Whether a kernel thread should poll the submission queue. Falls
+	back to a plain ring if that is not permitted.
+*/
+IoUring::IoUring(unsigned entries, bool sqPoll)
+	: mRingFd(-1), mSqPoll(false), mSqRing(MAP_FAILED), mCqRing(MAP_FAILED), mSqRingSize(0), mCqRingSize(0),
+	  mSqes((io_uring_sqe*)MAP_FAILED), mSqLocalTail(0), mSqSubmitted(0), mInFlight(0),
+	  mFileCount(0), mBufferCount(0), mEnterCount(0)
+{
+	memset(&mParams, 0, sizeof(mParams));
+
+	if (sqPoll)
+	{
+		mParams.flags = IORING_SETUP_SQPOLL;
+		mParams.sq_thread_idle = kIoUringSqPollIdle;
+		mRingFd = (int)syscall(__NR_io_uring_setup, entries, &mParams);
+		mSqPoll = (mRingFd >= 0);
+	}
+
+	if (mRingFd < 0)
+	{
+		memset(&mParams, 0, sizeof(mParams));
+		mRingFd = (int)syscall(__NR_io_uring_setup, entries, &mParams);
+	}
+
+	if (mRingFd < 0)
+	{
+		return;
+	}
+
+	mSqRingSize = mParams.sq_off.array + mParams.sq_entries * sizeof(unsigned);
+	mCqRingSize = mParams.cq_off.cqes + mParams.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels map both rings with a single mmap.
+	if (mParams.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (mCqRingSize > mSqRingSize)
+		{
+			mSqRingSize = mCqRingSize;
+		}
+
+		mCqRingSize = mSqRingSize;
+	}
+
+	mSqRing = mmap(NULL, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+
+	if (mParams.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		mCqRing = mSqRing;
+	}
+	else
+	{
+		mCqRing = mmap(NULL, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+	}
+
+	mSqes = (io_uring_sqe*)mmap(NULL, mParams.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+
+	if (mSqRing == MAP_FAILED || mCqRing == MAP_FAILED || mSqes == MAP_FAILED)
+	{
+		close(mRingFd);
+		mRingFd = -1;
+		return;
+	}
+
+	char *fSq = (char*)mSqRing;
+	mSqHead = (unsigned*)(fSq + mParams.sq_off.head);
+	mSqTail = (unsigned*)(fSq + mParams.sq_off.tail);
+	mSqMask = (unsigned*)(fSq + mParams.sq_off.ring_mask);
+	mSqFlags = (unsigned*)(fSq + mParams.sq_off.flags);
+	mSqArray = (unsigned*)(fSq + mParams.sq_off.array);
+
+	char *fCq = (char*)mCqRing;
+	mCqHead = (unsigned*)(fCq + mParams.cq_off.head);
+	mCqTail = (unsigned*)(fCq + mParams.cq_off.tail);
+	mCqMask = (unsigned*)(fCq + mParams.cq_off.ring_mask);
+	mCqes = (io_uring_cqe*)(fCq + mParams.cq_off.cqes);
+
+	mSqLocalTail = *mSqTail;
+	mSqSubmitted = mSqLocalTail;
+}
+
+IoUring::~IoUring()
+{
+	if (mSqes != MAP_FAILED)
+	{
+		munmap(mSqes, mParams.sq_entries * sizeof(struct io_uring_sqe));
+	}
+
+	if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+	{
+		munmap(mCqRing, mCqRingSize);
+	}
+
+	if (mSqRing != MAP_FAILED)
+	{
+		munmap(mSqRing, mSqRingSize);
+	}
+
+	if (mRingFd >= 0)
+	{
+		close(mRingFd);
+	}
+}
+
+/*!
+	\brief Returns true if the kernel set up the ring. If it did not, the caller
+	should use the blocking calls instead.
+*/
+bool IoUring::IsValid()
+{
+	return mRingFd >= 0;
+}
+
+/*!
+	\brief Registers file descriptors with the ring so operations on them skip the
+	per operation file lookup. Operations on these descriptors use them as fixed
+	files from then on.
+	\return true if the files were registered.
+*/
+bool IoUring::RegisterFiles(int *fds, unsigned count)
+{
+	if (!IsValid() || fds == NULL || count == 0 || count > kIoUringMaxFiles || mFileCount > 0)
+	{
+		return false;
+	}
+
+	if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_FILES, fds, count) != 0)
+	{
+		return false;
+	}
+
+	memcpy(mFiles, fds, count * sizeof(int));
+	mFileCount = count;
+
+	return true;
+}
+
+/*!
+	\brief Registers buffers with the ring so the kernel maps them once instead of on
+	every operation. Reads and writes that fall inside one of them use it as a fixed
+	buffer from then on.
+	\return true if the buffers were registered.
+*/
+bool IoUring::RegisterBuffers(struct iovec *buffs, unsigned count)
+{
+	if (!IsValid() || buffs == NULL || count == 0 || count > kIoUringMaxBuffers || mBufferCount > 0)
+	{
+		return false;
+	}
+
+	if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_BUFFERS, buffs, count) != 0)
+	{
+		return false;
+	}
+
+	memcpy(mBuffers, buffs, count * sizeof(struct iovec));
+	mBufferCount = count;
+
+	return true;
+}
+
+/*!
+	\brief Queues a read of size bytes from offset in fd into buff.
+	\param link If true, the next operation prepared only runs if this read
+	returns all size bytes, and is cancelled otherwise.
+	\return false if the operation could not be queued.
+*/
+bool IoUring::PrepareRead(int fd, char *buff, uint32_t size, uint64_t offset, uint64_t userData, bool link)
+{
+	int fBufferIndex = _GetBufferIndex(buff, size);
+	struct io_uring_sqe *fSqe = _GetSqe(fd, (fBufferIndex >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ, userData);
+
+	if (fSqe == NULL)
+	{
+		return false;
+	}
+
+	fSqe->addr = (uint64_t)(uintptr_t)buff;
+	fSqe->len = size;
+	fSqe->off = offset;
+	fSqe->buf_index = (fBufferIndex >= 0) ? (uint16_t)fBufferIndex : 0;
+
+	if (link)
+	{
+		fSqe->flags |= IOSQE_IO_LINK;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Queues a write of size bytes from buff to offset in fd. buff must not be
+	changed until the completion has been taken.
+	\return false if the operation could not be queued.
+*/
+bool IoUring::PrepareWrite(int fd, char *buff, uint32_t size, uint64_t offset, uint64_t userData)
+{
+	int fBufferIndex = _GetBufferIndex(buff, size);
+	struct io_uring_sqe *fSqe = _GetSqe(fd, (fBufferIndex >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, userData);
+
+	if (fSqe == NULL)
+	{
+		return false;
+	}
+
+	fSqe->addr = (uint64_t)(uintptr_t)buff;
+	fSqe->len = size;
+	fSqe->off = offset;
+	fSqe->buf_index = (fBufferIndex >= 0) ? (uint16_t)fBufferIndex : 0;
+
+	return true;
+}
+
+/*!
+	\brief Queues a sendmsg on fd. msg and everything it points to must not be
+	changed until the completion has been taken.
+	\return false if the operation could not be queued.
+*/
+bool IoUring::PrepareSendMsg(int fd, struct msghdr *msg, uint64_t userData)
+{
+	struct io_uring_sqe *fSqe = _GetSqe(fd, IORING_OP_SENDMSG, userData);
+
+	if (fSqe == NULL)
+	{
+		return false;
+	}
+
+	fSqe->addr = (uint64_t)(uintptr_t)msg;
+	fSqe->len = 1;
+
+	return true;
+}
+
+/*!
+	\brief Queues a recvmsg on fd. The result is the number of bytes received, and
+	msg is filled in as by recvmsg once the completion has been taken.
+	\return false if the operation could not be queued.
+*/
+bool IoUring::PrepareRecvMsg(int fd, struct msghdr *msg, uint64_t userData)
+{
+	struct io_uring_sqe *fSqe = _GetSqe(fd, IORING_OP_RECVMSG, userData);
+
+	if (fSqe == NULL)
+	{
+		return false;
+	}
+
+	fSqe->addr = (uint64_t)(uintptr_t)msg;
+	fSqe->len = 1;
+
+	return true;
+}
+
+/*!
+	\brief Hands every prepared operation to the kernel, and waits until at least
+	waitCount completions are ready to be taken.
+	\return The number of operations submitted, or a negative errno.
+*/
+int IoUring::Submit(unsigned waitCount)
+{
+	unsigned fToSubmit = mSqLocalTail - mSqSubmitted;
+	int fResult = 0;
+
+	if (!IsValid())
+	{
+		return -EBADF;
+	}
+
+	// Publish the new entries. The release store makes sure the kernel sees the
+	// filled in entries before the tail that covers them.
+	__atomic_store_n(mSqTail, mSqLocalTail, __ATOMIC_RELEASE);
+	mSqSubmitted = mSqLocalTail;
+
+	if (mSqPoll)
+	{
+		mInFlight += fToSubmit;
+
+		unsigned fFlags = 0;
+
+		// The polling thread picks the entries up by itself unless it went to sleep.
+		if (fToSubmit > 0 && (__atomic_load_n(mSqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP))
+		{
+			fFlags |= IORING_ENTER_SQ_WAKEUP;
+		}
+
+		if (waitCount > 0 && (__atomic_load_n(mCqTail, __ATOMIC_ACQUIRE) - *mCqHead) < waitCount)
+		{
+			fFlags |= IORING_ENTER_GETEVENTS;
+		}
+
+		if (fFlags != 0)
+		{
+			fResult = _Enter(fToSubmit, waitCount, fFlags);
+		}
+
+		return (fResult < 0) ? fResult : (int)fToSubmit;
+	}
+
+	// Entries the kernel turned down last time (e.g. while the completion queue
+	// was full) are still in the queue, so count from its head.
+	fToSubmit = mSqLocalTail - *mSqHead;
+
+	if (fToSubmit > 0 || (waitCount > 0 && (__atomic_load_n(mCqTail, __ATOMIC_ACQUIRE) - *mCqHead) < waitCount))
+	{
+		fResult = _Enter(fToSubmit, waitCount, (waitCount > 0) ? IORING_ENTER_GETEVENTS : 0);
+
+		if (fResult > 0)
+		{
+			mInFlight += fResult;
+		}
+	}
+
+	return fResult;
+}
+
+/*!
+	\brief Takes the next completion if there is one, without waiting.
+	\param userData Set to the user value the operation was prepared with.
+	\param result Set to the result of the operation, a negative errno on failure.
+	\return true if a completion was taken.
+*/
+bool IoUring::GetCompletion(uint64_t *userData, int *result)
+{
+	if (!IsValid())
+	{
+		return false;
+	}
+
+	unsigned fHead = *mCqHead;
+
+	if (fHead == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	struct io_uring_cqe *fCqe = &mCqes[fHead & *mCqMask];
+	*userData = fCqe->user_data;
+	*result = fCqe->res;
+
+	__atomic_store_n(mCqHead, fHead + 1, __ATOMIC_RELEASE);
+
+	if (mInFlight > 0)
+	{
+		mInFlight--;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Returns the number of operations submitted whose completion has not been taken.
+*/
+unsigned IoUring::GetInFlight()
+{
+	return mInFlight;
+}
+
+/*!
+	\brief Returns the number of times the ring entered the kernel.
+*/
+uint64_t IoUring::GetEnterCount()
+{
+	return mEnterCount;
+}
+
+/*!
+	\brief Returns the next free submission queue entry, set up for the specified
+	operation. If the queue is full, what is in it is submitted first.
+*/
+struct io_uring_sqe *IoUring::_GetSqe(int fd, uint8_t opCode, uint64_t userData)
+{
+	if (!IsValid())
+	{
+		return NULL;
+	}
+
+	if (mSqLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mParams.sq_entries)
+	{
+		Submit(0);
+
+		// A polling thread may not have caught up yet, so wait for room.
+		while (mSqPoll && mSqLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mParams.sq_entries)
+		{
+			_Enter(0, 0, IORING_ENTER_SQ_WAIT);
+		}
+	}
+
+	unsigned fIndex = mSqLocalTail & *mSqMask;
+	struct io_uring_sqe *fSqe = &mSqes[fIndex];
+	memset(fSqe, 0, sizeof(*fSqe));
+
+	fSqe->opcode = opCode;
+	fSqe->fd = fd;
+	fSqe->user_data = userData;
+
+	for (unsigned i = 0; i < mFileCount; i++)
+	{
+		if (mFiles[i] == fd)
+		{
+			fSqe->fd = (int)i;
+			fSqe->flags |= IOSQE_FIXED_FILE;
+			break;
+		}
+	}
+
+	mSqArray[fIndex] = fIndex;
+	mSqLocalTail++;
+
+	return fSqe;
+}
+
+/*!
+	\brief Returns the index of the registered buffer that holds the specified
+	range, or -1 if it is not in one.
+*/
+int IoUring::_GetBufferIndex(char *buff, uint32_t size)
+{
+	for (unsigned i = 0; i < mBufferCount; i++)
+	{
+		char *fStart = (char*)mBuffers[i].iov_base;
+
+		if (buff >= fStart && buff + size <= fStart + mBuffers[i].iov_len)
+		{
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+/*!
+	\brief Calls io_uring_enter, retrying if it is interrupted.
+*/
+int IoUring::_Enter(unsigned submit, unsigned waitCount, unsigned flags)
+{
+	int fResult = 0;
+
+	do
+	{
+		mEnterCount++;
+		fResult = (int)syscall(__NR_io_uring_enter, mRingFd, submit, waitCount, flags, NULL, 0);
+	}
+	while (fResult < 0 && errno == EINTR);
+
+	return (fResult < 0) ? -errno : fResult;
+}
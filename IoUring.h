@@ -0,0 +1,78 @@
+/*
+ * File: IoUring.h
+ * Desc: A small wrapper around a Linux io_uring submission and completion
+ * queue pair, used as an asynchronous alternative to the blocking socket and
+ * file calls.
+ */
+#ifndef _IOURING_H_
+#define _IOURING_H_
+
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define kIoUringMaxFiles 4
+#define kIoUringMaxBuffers 64
+#define kIoUringSqPollIdle 100 // Milliseconds the SQPOLL thread spins before sleeping.
+
+/*! \class IoUring
+    \brief Queues socket and file operations and submits them to the kernel in batches.
+
+   Operations are prepared with the Prepare functions, which only fill in a
+   submission queue entry, and handed to the kernel together by Submit. Each
+   operation carries a user value that is returned with its result by
+   GetCompletion. Files and buffers passed to RegisterFiles and RegisterBuffers
+   are used as fixed files and buffers automatically. With SQPOLL a kernel thread
+   picks up submissions, so Submit only enters the kernel to wait or to wake
+   that thread. The ring is not thread safe.
+*/
+class IoUring {
+	public:
+		IoUring(unsigned entries, bool sqPoll);
+		virtual ~IoUring();
+
+		bool			IsValid();
+		bool			RegisterFiles(int *fds, unsigned count);
+		bool			RegisterBuffers(struct iovec *buffs, unsigned count);
+		bool			PrepareRead(int fd, char *buff, uint32_t size, uint64_t offset, uint64_t userData, bool link);
+		bool			PrepareWrite(int fd, char *buff, uint32_t size, uint64_t offset, uint64_t userData);
+		bool			PrepareSendMsg(int fd, struct msghdr *msg, uint64_t userData);
+		bool			PrepareRecvMsg(int fd, struct msghdr *msg, uint64_t userData);
+		int				Submit(unsigned waitCount);
+		bool			GetCompletion(uint64_t *userData, int *result);
+		unsigned		GetInFlight();
+		uint64_t		GetEnterCount();
+
+	private:
+		struct io_uring_sqe	*_GetSqe(int fd, uint8_t opCode, uint64_t userData);
+		int				_GetBufferIndex(char *buff, uint32_t size);
+		int				_Enter(unsigned submit, unsigned waitCount, unsigned flags);
+
+		int				mRingFd;
+		bool			mSqPoll;
+		struct io_uring_params mParams;
+		void			*mSqRing;
+		void			*mCqRing;
+		size_t			mSqRingSize;
+		size_t			mCqRingSize;
+		struct io_uring_sqe	*mSqes;
+		unsigned		*mSqHead;
+		unsigned		*mSqTail;
+		unsigned		*mSqMask;
+		unsigned		*mSqFlags;
+		unsigned		*mSqArray;
+		unsigned		*mCqHead;
+		unsigned		*mCqTail;
+		unsigned		*mCqMask;
+		struct io_uring_cqe	*mCqes;
+		unsigned		mSqLocalTail; // Entries prepared, some possibly not yet visible to the kernel.
+		unsigned		mSqSubmitted; // Entries made visible to the kernel.
+		unsigned		mInFlight; // Operations submitted whose completion has not been taken.
+		int				mFiles[kIoUringMaxFiles];
+		unsigned		mFileCount;
+		struct iovec	mBuffers[kIoUringMaxBuffers];
+		unsigned		mBufferCount;
+		uint64_t		mEnterCount;
+};
+#endif
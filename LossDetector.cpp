@@ -0,0 +1,427 @@
+/*
+ * File: LossDetector.cpp
+ * Desc: Remembers when each DATA packet was sent, so the sender can tell a
+ * lost packet from a late one by time instead of waiting for a timeout.
+ */
+#include <string.h>
+#include <time.h>
+
+#include "LossDetector.h"
+#include "Transmission.h"
+
+LossDetector::LossDetector()
+	: mRackPath(0), mMinRtt(0), mLastSentTime(0), mProbeSent(false)
+{
+	memset(mRack, 0, sizeof(mRack));
+	memset(mPaths, 0, sizeof(mPaths));
+}
+
+LossDetector::~LossDetector()
+{
+}
+
+/*!
+	\brief Records a packet as sent now. Whatever it covers that was sent
+	before is replaced, so a packet sent again counts as retransmitted.
+	\param seqNum The first sequence number of the packet.
+	\param size The sequence numbers it covers, 1 for the SYN or the FIN.
+	\param path The path it went on, below kLossMaxPaths.
+*/
+void LossDetector::OnSent(uint64_t seqNum, uint32_t size, uint8_t path)
+{
+	uint64_t fNow = getMonotonicMicroSeconds();
+	uint64_t fEndSeqNum = seqNum + size;
+	bool fRetransmitted = false;
+
+	if (path >= kLossMaxPaths)
+	{
+		path = 0;
+	}
+
+	// Find the first packet that ends after seqNum.
+	SentPacketMap::iterator fIter = mPackets.upper_bound(seqNum);
+
+	if (fIter != mPackets.begin())
+	{
+		--fIter;
+
+		if (fIter->first + fIter->second.mSize <= seqNum)
+		{
+			++fIter;
+		}
+	}
+
+	// Packets sent at another datagram size may only partly overlap, and keep
+	// the parts outside the new packet.
+	while (fIter != mPackets.end() && fIter->first < fEndSeqNum)
+	{
+		SentPacket fOld = fIter->second;
+		uint64_t fOldEndSeqNum = fIter->first + fOld.mSize;
+
+		fRetransmitted = true;
+
+		// The part sent again is no longer in flight where it went before.
+		_Uncount(&fIter->second, (uint32_t)(MIN(fOldEndSeqNum, fEndSeqNum) - MAX(fIter->first, seqNum)));
+
+		if (fIter->first < seqNum)
+		{
+			fIter->second.mSize = (uint32_t)(seqNum - fIter->first);
+			++fIter;
+		}
+		else
+		{
+			fIter = mPackets.erase(fIter);
+		}
+
+		if (fOldEndSeqNum > fEndSeqNum)
+		{
+			fOld.mSize = (uint32_t)(fOldEndSeqNum - fEndSeqNum);
+			mPackets[fEndSeqNum] = fOld;
+			break;
+		}
+	}
+
+	SentPacket fPacket = { size, fNow, fRetransmitted, false, false, true, path };
+	mPackets[seqNum] = fPacket;
+	mPaths[path].mInFlight += size;
+	mPaths[path].mSent += size;
+	mLastSentTime = fNow;
+}
+
+/*!
+	\brief Forgets every packet before a cumulative ACK, taking each one that
+	had not been SACKed as arrived now.
+	\param ackSeqNum The sequence number the receiver expects next.
+	\param retransmitted Set to true if the packet the sample is from was
+	sent more than once.
+	\return The round trip time in microseconds of the most recently sent
+	packet the ACK covered, or 0 if it covered none.
+*/
+uint64_t LossDetector::OnAck(uint64_t ackSeqNum, bool *retransmitted)
+{
+	uint64_t fNow = getMonotonicMicroSeconds();
+	uint64_t fRtt = 0;
+	uint64_t fSentTime = 0;
+	SentPacketMap::iterator fIter = mPackets.begin();
+
+	*retransmitted = false;
+
+	while (fIter != mPackets.end() && fIter->first < ackSeqNum)
+	{
+		uint64_t fEndSeqNum = fIter->first + fIter->second.mSize;
+
+		// Only the start of it arrived, from a smaller packet sent in its place.
+		if (fEndSeqNum > ackSeqNum)
+		{
+			SentPacket fRest = fIter->second;
+			uint32_t fArrived = (uint32_t)(ackSeqNum - fIter->first);
+
+			if (!fRest.mDelivered)
+			{
+				_Uncount(&fRest, fArrived);
+				mPaths[fRest.mPath].mDelivered += fArrived;
+			}
+
+			fRest.mSize = (uint32_t)(fEndSeqNum - ackSeqNum);
+			mPackets.erase(fIter);
+			mPackets[ackSeqNum] = fRest;
+			break;
+		}
+
+		if (!fIter->second.mDelivered)
+		{
+			uint64_t fPacketRtt = _OnDelivered(&fIter->second, fEndSeqNum, fNow);
+
+			if (fRtt == 0 || fIter->second.mSentTime >= fSentTime)
+			{
+				fRtt = fPacketRtt;
+				fSentTime = fIter->second.mSentTime;
+				*retransmitted = fIter->second.mRetransmitted;
+			}
+		}
+
+		fIter = mPackets.erase(fIter);
+	}
+
+	return fRtt;
+}
+
+/*!
+	\brief Takes the packet holding seqNum as arrived now, ahead of a hole.
+	Sequence numbers that are not outstanding are ignored.
+	\param retransmitted Set to true if the packet was sent more than once.
+	\return The round trip time of the packet in microseconds, or 0 if it was
+	not outstanding.
+*/
+uint64_t LossDetector::OnSack(uint64_t seqNum, bool *retransmitted)
+{
+	SentPacketMap::iterator fIter = mPackets.upper_bound(seqNum);
+
+	*retransmitted = false;
+
+	if (fIter == mPackets.begin())
+	{
+		return 0;
+	}
+
+	--fIter;
+
+	if (seqNum >= fIter->first + fIter->second.mSize || fIter->second.mDelivered)
+	{
+		return 0;
+	}
+
+	fIter->second.mDelivered = true;
+	fIter->second.mLost = false;
+	*retransmitted = fIter->second.mRetransmitted;
+
+	return _OnDelivered(&fIter->second, fIter->first + fIter->second.mSize, getMonotonicMicroSeconds());
+}
+
+/*!
+	\brief Records that a tail loss probe went out. No other is due until
+	something more arrives.
+*/
+void LossDetector::OnProbeSent()
+{
+	mProbeSent = true;
+}
+
+/*!
+	\brief Forgets the packets found lost and the probe, and takes every
+	packet out of flight, since a retransmission timeout sends everything
+	outstanding again.
+*/
+void LossDetector::OnTimeOut()
+{
+	for (SentPacketMap::iterator fIter = mPackets.begin(); fIter != mPackets.end(); ++fIter)
+	{
+		fIter->second.mLost = false;
+		_Uncount(&fIter->second, fIter->second.mSize);
+		fIter->second.mInFlight = false;
+	}
+
+	mProbeSent = false;
+}
+
+/*!
+	\brief Marks as lost every outstanding packet that was sent before the
+	most recently sent packet known to have arrived on its path, and is still
+	missing a reordering window after it should have arrived too.
+	\return The number of packets newly found lost.
+*/
+uint32_t LossDetector::DetectLosses()
+{
+	// Nothing has arrived on any path yet.
+	if (mRack[mRackPath].mSentTime == 0)
+	{
+		return 0;
+	}
+
+	uint64_t fNow = getMonotonicMicroSeconds();
+	uint64_t fWindow = _GetReorderWindow();
+	uint32_t fCount = 0;
+
+	for (SentPacketMap::iterator fIter = mPackets.begin(); fIter != mPackets.end(); ++fIter)
+	{
+		SentPacket *fPacket = &fIter->second;
+
+		if (!fPacket->mDelivered && !fPacket->mLost && _IsSentBeforeRack(fIter->first, fPacket)
+			&& fNow >= fPacket->mSentTime + mRack[fPacket->mPath].mRtt + fWindow)
+		{
+			fPacket->mLost = true;
+			_Uncount(fPacket, fPacket->mSize);
+			fPacket->mInFlight = false;
+			mPaths[fPacket->mPath].mLost++;
+			fCount++;
+		}
+	}
+
+	return fCount;
+}
+
+/*!
+	\brief Hands out the lowest packet found lost, clearing its mark. The
+	caller sends it again and reports that with OnSent.
+	\return false if no packet is waiting to be sent again.
+*/
+bool LossDetector::TakeLost(uint64_t *seqNum, uint32_t *size)
+{
+	for (SentPacketMap::iterator fIter = mPackets.begin(); fIter != mPackets.end(); ++fIter)
+	{
+		if (fIter->second.mLost)
+		{
+			fIter->second.mLost = false;
+			*seqNum = fIter->first;
+			*size = fIter->second.mSize;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*!
+	\brief Returns the highest packet not known to have arrived, which a tail
+	loss probe sends again.
+	\return false if nothing is outstanding.
+*/
+bool LossDetector::GetTail(uint64_t *seqNum, uint32_t *size)
+{
+	for (SentPacketMap::reverse_iterator fIter = mPackets.rbegin(); fIter != mPackets.rend(); ++fIter)
+	{
+		if (!fIter->second.mDelivered)
+		{
+			*seqNum = fIter->first;
+			*size = fIter->second.mSize;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*!
+	\brief Returns how long the caller's timer should wait before calling
+	DetectLosses again, or before a tail loss probe if nothing is waiting on
+	the reordering window.
+	\param smoothedRtt The smoothed round trip time in microseconds, or 0
+	before the first sample.
+	\param reorder Set to true if the wait is for the reordering window.
+	\return Milliseconds, at least 1, or 0 if no timer is needed.
+*/
+uint32_t LossDetector::GetTimeOut(uint64_t smoothedRtt, bool *reorder)
+{
+	uint64_t fNow = getMonotonicMicroSeconds();
+	uint64_t fDeadline = 0;
+	bool fOutstanding = false;
+
+	*reorder = false;
+
+	for (SentPacketMap::iterator fIter = mPackets.begin(); fIter != mPackets.end(); ++fIter)
+	{
+		SentPacket *fPacket = &fIter->second;
+
+		if (fPacket->mDelivered)
+		{
+			continue;
+		}
+
+		fOutstanding = true;
+
+		if (!fPacket->mLost && _IsSentBeforeRack(fIter->first, fPacket))
+		{
+			uint64_t fLostTime = fPacket->mSentTime + mRack[fPacket->mPath].mRtt + _GetReorderWindow();
+			fDeadline = (fDeadline == 0) ? fLostTime : MIN(fDeadline, fLostTime);
+			*reorder = true;
+		}
+	}
+
+	// Without an RTT sample there is no telling how long the ACK should take,
+	// so only the retransmission timeout applies.
+	if (fDeadline == 0 && fOutstanding && !mProbeSent && smoothedRtt > 0)
+	{
+		fDeadline = mLastSentTime + MAX(2 * smoothedRtt, (uint64_t)kLossMinProbeTimeOut);
+	}
+
+	if (fDeadline == 0)
+	{
+		return 0;
+	}
+
+	return (fDeadline > fNow) ? (uint32_t)((fDeadline - fNow + 999) / 1000) : 1;
+}
+
+/*!
+	\brief Returns the round trip time of the most recently sent packet known
+	to have arrived on the path something last arrived on, in microseconds.
+*/
+uint64_t LossDetector::GetRackRtt()
+{
+	return mRack[mRackPath].mRtt;
+}
+
+/*!
+	\brief Returns what was sent, delivered and lost on a path so far.
+*/
+const PathCounters &LossDetector::GetPathCounters(uint8_t path)
+{
+	return mPaths[(path < kLossMaxPaths) ? path : 0];
+}
+
+/*!
+	\brief Takes an RTT sample from a packet that arrived and moves the RACK
+	state of its path to it if it was sent later than the one before.
+	\return The time since the packet was last sent, in microseconds.
+*/
+uint64_t LossDetector::_OnDelivered(SentPacket *packet, uint64_t endSeqNum, uint64_t now)
+{
+	uint64_t fRtt = (now > packet->mSentTime) ? now - packet->mSentTime : 1;
+	PathCounters *fPath = &mPaths[packet->mPath];
+	RackState *fRack = &mRack[packet->mPath];
+
+	_Uncount(packet, packet->mSize);
+	packet->mInFlight = false;
+	fPath->mDelivered += packet->mSize;
+
+	// An ACK sooner than any round trip so far is for an earlier copy of a
+	// packet sent more than once, so it says nothing about this copy.
+	if (packet->mRetransmitted && fRtt < mMinRtt)
+	{
+		return fRtt;
+	}
+
+	mProbeSent = false;
+
+	if (!packet->mRetransmitted)
+	{
+		mMinRtt = (mMinRtt == 0) ? fRtt : MIN(mMinRtt, fRtt);
+		fPath->mRtt = fRtt;
+		fPath->mRttSamples++;
+	}
+
+	if (packet->mSentTime > fRack->mSentTime || (packet->mSentTime == fRack->mSentTime && endSeqNum > fRack->mEndSeqNum))
+	{
+		fRack->mSentTime = packet->mSentTime;
+		fRack->mEndSeqNum = endSeqNum;
+		fRack->mRtt = fRtt;
+		mRackPath = packet->mPath;
+	}
+
+	return fRtt;
+}
+
+/*!
+	\brief Returns true if the packet went out before the most recently sent
+	packet known to have arrived on its path.
+*/
+bool LossDetector::_IsSentBeforeRack(uint64_t seqNum, SentPacket *packet)
+{
+	RackState *fRack = &mRack[packet->mPath];
+
+	return packet->mSentTime < fRack->mSentTime
+		|| (packet->mSentTime == fRack->mSentTime && seqNum + packet->mSize < fRack->mEndSeqNum);
+}
+
+/*!
+	\brief Returns how long, in microseconds, a packet may arrive behind one
+	sent after it before it is taken as lost.
+*/
+uint64_t LossDetector::_GetReorderWindow()
+{
+	return MAX(mMinRtt / 4, (uint64_t)kLossMinReorderWindow);
+}
+
+/*!
+	\brief Takes size sequence numbers of a packet out of the in flight count
+	of its path, if the packet is counted there. The caller clears mInFlight
+	once none of the packet is left in flight.
+*/
+void LossDetector::_Uncount(SentPacket *packet, uint32_t size)
+{
+	if (packet->mInFlight)
+	{
+		PathCounters *fPath = &mPaths[packet->mPath];
+		fPath->mInFlight -= MIN((uint64_t)size, fPath->mInFlight);
+	}
+}
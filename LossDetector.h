@@ -0,0 +1,110 @@
+/*
+ * File: LossDetector.h
+ * Desc: Remembers when each DATA packet was sent, so the sender can tell a
+ * lost packet from a late one by time instead of waiting for a timeout.
+ */
+#ifndef _LOSSDETECTOR_H_
+#define _LOSSDETECTOR_H_
+
+#include <inttypes.h>
+#include <map>
+
+using namespace std;
+
+#define kLossMinReorderWindow 1000 // Microseconds a packet may arrive behind a later one, at least, before it is lost.
+#define kLossMinProbeTimeOut 2000 // Microseconds to wait for an ACK, at least, before a tail loss probe.
+#define kLossMaxPaths 8 // Paths a packet may be sent on, numbered from 0.
+
+/*! \struct SentPacket
+    \brief A DATA packet, the SYN or the FIN, that has been sent and not yet acknowledged.
+*/
+struct SentPacket {
+	uint32_t		mSize; // Sequence numbers covered, 1 for the SYN or the FIN.
+	uint64_t		mSentTime; // CLOCK_MONOTONIC microseconds of the latest send.
+	bool			mRetransmitted; // Sent more than once, so an ACK may be for an earlier copy.
+	bool			mDelivered; // A SACK said it arrived ahead of a hole.
+	bool			mLost; // Found lost and not sent again yet.
+	bool			mInFlight; // Counted in the in flight bytes of its path.
+	uint8_t			mPath; // Path it was last sent on.
+};
+
+/*! \struct PathCounters
+    \brief What the detector has seen of the packets sent on one path. All
+    but mInFlight only ever grow, so a caller can tell what changed since it
+    last looked.
+*/
+struct PathCounters {
+	uint64_t		mInFlight; // Sequence numbers sent and not yet arrived, lost or timed out.
+	uint64_t		mSent; // Sequence numbers sent, including retransmissions.
+	uint64_t		mDelivered; // Sequence numbers that arrived.
+	uint64_t		mLost; // Packets found lost.
+	uint64_t		mRtt; // Latest round trip sample from a packet sent once, in microseconds.
+	uint64_t		mRttSamples; // Samples taken so far.
+};
+
+/*! \struct RackState
+    \brief The most recently sent packet known to have arrived on one path.
+*/
+struct RackState {
+	uint64_t		mSentTime; // 0 until a packet on the path has arrived.
+	uint64_t		mEndSeqNum; // Sequence number following the packet.
+	uint64_t		mRtt; // Round trip time of the packet, in microseconds.
+};
+
+typedef map<uint64_t, SentPacket> SentPacketMap;
+
+/*! \class LossDetector
+    \brief Time based loss detection in the style of RACK, with tail loss
+    probes.
+
+   The sender reports every packet it sends and every packet the receiver
+   says has arrived, either by the cumulative ACK or by a SACK. A packet is
+   lost once a packet sent after it has arrived and it is still missing a
+   reordering window later, where the window is a quarter of the smallest
+   round trip time seen. Packets sent after the last one known to have
+   arrived cannot be judged that way, so once no ACK has come for twice the
+   smoothed round trip time the sender probes with the last packet, which
+   gets it SACKed or fills the hole at the tail.
+
+   Packets may be sent on several paths, whose round trip times differ, so
+   a packet arriving after a later one from a faster path says nothing about
+   it. Each path keeps its own most recently arrived packet and packets are
+   only judged against the one of their path, and each path counts what was
+   sent, delivered and lost on it for the caller's congestion control.
+
+   The detector only decides; the caller sends, keeps its timer and keeps
+   the smoothed round trip time from the samples OnAck and OnSack hand back.
+   It is not thread safe.
+*/
+class LossDetector {
+	public:
+		LossDetector();
+		virtual ~LossDetector();
+
+		void		OnSent(uint64_t seqNum, uint32_t size, uint8_t path = 0);
+		uint64_t	OnAck(uint64_t ackSeqNum, bool *retransmitted);
+		uint64_t	OnSack(uint64_t seqNum, bool *retransmitted);
+		void		OnProbeSent();
+		void		OnTimeOut();
+		uint32_t	DetectLosses();
+		bool		TakeLost(uint64_t *seqNum, uint32_t *size);
+		bool		GetTail(uint64_t *seqNum, uint32_t *size);
+		uint32_t	GetTimeOut(uint64_t smoothedRtt, bool *reorder);
+		uint64_t	GetRackRtt();
+		const PathCounters	&GetPathCounters(uint8_t path);
+
+	private:
+		uint64_t	_OnDelivered(SentPacket *packet, uint64_t endSeqNum, uint64_t now);
+		bool		_IsSentBeforeRack(uint64_t seqNum, SentPacket *packet);
+		uint64_t	_GetReorderWindow();
+		void		_Uncount(SentPacket *packet, uint32_t size);
+
+		SentPacketMap	mPackets; // By first sequence number.
+		RackState		mRack[kLossMaxPaths]; // By path.
+		uint8_t			mRackPath; // Path of the packet that arrived last.
+		PathCounters	mPaths[kLossMaxPaths];
+		uint64_t		mMinRtt; // Microseconds, 0 until the first sample.
+		uint64_t		mLastSentTime;
+		bool			mProbeSent; // A tail loss probe went out and nothing has arrived since.
+};
+#endif
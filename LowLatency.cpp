@@ -0,0 +1,372 @@
+/*
+ * File: LowLatency.cpp
+ * Desc: Keeps the threads of a transfer on chosen cores, has the kernel busy
+ * poll their sockets and lets them spin instead of sleeping, for paths where
+ * waking a thread up costs more than the CPU time it saves.
+ */
+#include <ctype.h>
+#include <ifaddrs.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LowLatency.h"
+#include "Transmission.h"
+
+/*!
+	\brief Tells the core that the caller is spinning, so a sibling
+	hyperthread gets the execution units meanwhile.
+*/
+static inline void relaxCpu()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*!
+	\brief Parses a list of cores in the kernel's format, such as "0-3,8,10-11".
+	\param cpus Set to the cores, in the order given, without duplicates.
+	\return false if the list is empty or malformed.
+*/
+bool parseCpuList(const char *list, vector<int> *cpus)
+{
+	const char *fNext = list;
+
+	cpus->clear();
+
+	while (*fNext != '\0' && *fNext != '\n')
+	{
+		char *fEnd;
+		long fFirst = strtol(fNext, &fEnd, 10);
+		long fLast = fFirst;
+
+		if (fEnd == fNext || fFirst < 0 || fFirst >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		if (*fEnd == '-')
+		{
+			fNext = fEnd + 1;
+			fLast = strtol(fNext, &fEnd, 10);
+
+			if (fEnd == fNext || fLast < fFirst || fLast >= CPU_SETSIZE)
+			{
+				return false;
+			}
+		}
+
+		for (long i = fFirst; i <= fLast; i++)
+		{
+			bool fListed = false;
+
+			for (size_t j = 0; j < cpus->size() && !fListed; j++)
+			{
+				fListed = ((*cpus)[j] == i);
+			}
+
+			if (!fListed)
+			{
+				cpus->push_back((int)i);
+			}
+		}
+
+		fNext = fEnd;
+
+		if (*fNext == ',')
+		{
+			fNext++;
+		}
+		else if (*fNext != '\0' && *fNext != '\n')
+		{
+			return false;
+		}
+	}
+
+	return !cpus->empty();
+}
+
+/*!
+	\brief Returns the cores the process may run on.
+	\return false if the kernel would not say.
+*/
+bool getAllowedCpus(vector<int> *cpus)
+{
+	cpu_set_t fSet;
+
+	cpus->clear();
+
+	if (sched_getaffinity(0, sizeof(fSet), &fSet) != 0)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < CPU_SETSIZE; i++)
+	{
+		if (CPU_ISSET(i, &fSet))
+		{
+			cpus->push_back(i);
+		}
+	}
+
+	return !cpus->empty();
+}
+
+/*!
+	\brief Returns the cores on the NUMA node of a network interface, which
+	are the ones its interrupts and the memory of its queues are closest to.
+	\return false if the interface is not backed by a device, like loopback
+	and most virtual interfaces, or the name is not an interface.
+*/
+bool getDeviceCpus(const char *device, vector<int> *cpus)
+{
+	char fPath[256];
+	char fList[1024];
+
+	// Interface names never hold a slash, and the name goes into a path.
+	if (strchr(device, '/') != NULL)
+	{
+		return false;
+	}
+
+	snprintf(fPath, sizeof(fPath), "/sys/class/net/%s/device/local_cpulist", device);
+
+	FILE *fFile = fopen(fPath, "r");
+
+	if (fFile == NULL)
+	{
+		return false;
+	}
+
+	bool fRead = (fgets(fList, sizeof(fList), fFile) != NULL);
+	fclose(fFile);
+
+	return fRead && parseCpuList(fList, cpus);
+}
+
+/*!
+	\brief Finds the interface the kernel routes datagrams to peer through.
+	\param device Set to the name of the interface.
+	\return false if there is no route to peer.
+*/
+bool getRouteDevice(struct sockaddr_in *peer, string *device)
+{
+	struct sockaddr_in fLocal;
+	socklen_t fLocalSize = sizeof(fLocal);
+	struct ifaddrs *fAddrs = NULL;
+	bool fFound = false;
+
+	// Connecting a datagram socket sends nothing, it only picks the route and
+	// with it the local address.
+	int fSock = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fSock < 0)
+	{
+		return false;
+	}
+
+	if (connect(fSock, (struct sockaddr*)peer, sizeof(*peer)) != 0
+		|| getsockname(fSock, (struct sockaddr*)&fLocal, &fLocalSize) != 0)
+	{
+		close(fSock);
+		return false;
+	}
+
+	close(fSock);
+
+	if (getifaddrs(&fAddrs) != 0)
+	{
+		return false;
+	}
+
+	for (struct ifaddrs *fAddr = fAddrs; fAddr != NULL && !fFound; fAddr = fAddr->ifa_next)
+	{
+		if (fAddr->ifa_addr != NULL && fAddr->ifa_addr->sa_family == AF_INET
+			&& ((struct sockaddr_in*)fAddr->ifa_addr)->sin_addr.s_addr == fLocal.sin_addr.s_addr)
+		{
+			*device = fAddr->ifa_name;
+			fFound = true;
+		}
+	}
+
+	freeifaddrs(fAddrs);
+
+	return fFound;
+}
+
+/*!
+	\brief Works out which cores to run a transfer's threads on.
+	\param spec A list of cores such as "2-3", the name of the interface to
+	use the cores local to, or "auto" for the interface that routes to peer.
+	An interface with no device behind it, like loopback, gives every core.
+	\param peer The other end, used by "auto". May be NULL, and then "auto"
+	gives every core.
+	\param cpus Set to the cores, limited to the ones the process may run on.
+	\return false if spec is malformed or leaves no core to run on.
+*/
+bool getLowLatencyCpus(const char *spec, struct sockaddr_in *peer, vector<int> *cpus)
+{
+	vector<int> fAllowed;
+	vector<int> fWanted;
+	string fDevice;
+
+	if (!getAllowedCpus(&fAllowed))
+	{
+		return false;
+	}
+
+	if (isdigit((unsigned char)spec[0]))
+	{
+		if (!parseCpuList(spec, &fWanted))
+		{
+			return false;
+		}
+	}
+	else if (strcmp(spec, "auto") == 0)
+	{
+		if (peer == NULL || !getRouteDevice(peer, &fDevice) || !getDeviceCpus(fDevice.c_str(), &fWanted))
+		{
+			fWanted = fAllowed;
+		}
+	}
+	else if (!getDeviceCpus(spec, &fWanted))
+	{
+		// Only an interface that exists may fall back to every core.
+		char fPath[256];
+		snprintf(fPath, sizeof(fPath), "/sys/class/net/%s", spec);
+
+		if (strchr(spec, '/') != NULL || access(fPath, F_OK) != 0)
+		{
+			return false;
+		}
+
+		fWanted = fAllowed;
+	}
+
+	cpus->clear();
+
+	for (size_t i = 0; i < fWanted.size(); i++)
+	{
+		for (size_t j = 0; j < fAllowed.size(); j++)
+		{
+			if (fWanted[i] == fAllowed[j])
+			{
+				cpus->push_back(fWanted[i]);
+				break;
+			}
+		}
+	}
+
+	return !cpus->empty();
+}
+
+/*!
+	\brief Keeps a thread on one core.
+	\return false if the core does not exist or the thread may not use it.
+*/
+bool pinThread(pthread_t thread, int cpu)
+{
+	cpu_set_t fSet;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+	{
+		return false;
+	}
+
+	CPU_ZERO(&fSet);
+	CPU_SET(cpu, &fSet);
+
+	return pthread_setaffinity_np(thread, sizeof(fSet), &fSet) == 0;
+}
+
+/*!
+	\brief Has a blocking receive on sock poll the device queue for up to
+	microSeconds before it sleeps, and asks the kernel to leave the queue's
+	interrupts off while it is being polled. Raising the time needs
+	CAP_NET_ADMIN. Only devices driven by NAPI are polled, so loopback gains
+	nothing from it.
+	\return false if the kernel refused either option.
+*/
+bool setBusyPoll(int sock, uint32_t microSeconds)
+{
+	int fMicroSeconds = (int)microSeconds;
+	int fPrefer = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &fMicroSeconds, sizeof(fMicroSeconds)) != 0)
+	{
+		return false;
+	}
+
+	return setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &fPrefer, sizeof(fPrefer)) == 0;
+}
+
+/*!
+	\brief Returns true if a datagram is waiting on a socket, without
+	taking it. For AdaptiveSpin::Spin.
+	\param sock Points to the socket descriptor.
+*/
+bool isSocketReadable(void *sock)
+{
+	char fByte;
+
+	return recv(*(int*)sock, &fByte, sizeof(fByte), MSG_PEEK | MSG_DONTWAIT) >= 0;
+}
+
+AdaptiveSpin::AdaptiveSpin(uint32_t maxMicroSeconds)
+	: mMaxBudget(MAX(maxMicroSeconds, (uint32_t)kLowLatencyMinSpin)), mBudget(mMaxBudget), mSkipped(0)
+{
+}
+
+AdaptiveSpin::~AdaptiveSpin()
+{
+}
+
+/*!
+	\brief Calls isReady until it returns true or the budget runs out.
+	\param arg Passed to isReady.
+	\return true if isReady did, so the caller need not block.
+*/
+bool AdaptiveSpin::Spin(bool (*isReady)(void*), void *arg)
+{
+	if (mBudget == 0)
+	{
+		if (++mSkipped < kLowLatencySpinRetry)
+		{
+			return false;
+		}
+
+		mSkipped = 0;
+		mBudget = kLowLatencyMinSpin;
+	}
+
+	uint64_t fStart = getMonotonicMicroSeconds();
+
+	do
+	{
+		if (isReady(arg))
+		{
+			mBudget = MIN(mBudget * 2, mMaxBudget);
+			return true;
+		}
+
+		relaxCpu();
+	}
+	while (getMonotonicMicroSeconds() - fStart < mBudget);
+
+	mBudget /= 2;
+
+	if (mBudget < kLowLatencyMinSpin)
+	{
+		mBudget = 0;
+		mSkipped = 0;
+	}
+
+	return false;
+}
@@ -0,0 +1,59 @@
+/*
+ * File: LowLatency.h
+ * Desc: Keeps the threads of a transfer on chosen cores, has the kernel busy
+ * poll their sockets and lets them spin instead of sleeping, for paths where
+ * waking a thread up costs more than the CPU time it saves.
+ */
+#ifndef _LOWLATENCY_H_
+#define _LOWLATENCY_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define kLowLatencyBusyPoll 50 // Microseconds the kernel busy polls a socket for, by default.
+#define kLowLatencyMaxSpin 100 // Microseconds a wait spins for at most before it blocks.
+#define kLowLatencyMinSpin 4 // Microseconds below which spinning is given up on.
+#define kLowLatencySpinRetry 64 // Blocking waits before spinning is tried again after it was given up on.
+
+// SO_PREFER_BUSY_POLL came with Linux 5.11, after most libc headers were written.
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+bool parseCpuList(const char *list, vector<int> *cpus);
+bool getAllowedCpus(vector<int> *cpus);
+bool getDeviceCpus(const char *device, vector<int> *cpus);
+bool getRouteDevice(struct sockaddr_in *peer, string *device);
+bool getLowLatencyCpus(const char *spec, struct sockaddr_in *peer, vector<int> *cpus);
+bool pinThread(pthread_t thread, int cpu);
+bool setBusyPoll(int sock, uint32_t microSeconds);
+bool isSocketReadable(void *sock);
+
+/*! \class AdaptiveSpin
+    \brief Spins on a condition for a while before the caller blocks on it.
+
+   Each wait spins for at most the current budget. A condition that came true
+   while spinning doubles the budget, up to the maximum, and one that did not
+   halves it, so waits that keep ending in a block soon stop spinning. Once the
+   budget falls under kLowLatencyMinSpin the waits block straight away, and
+   every kLowLatencySpinRetry of them one spins for kLowLatencyMinSpin again
+   in case the traffic has picked up. It is for one thread.
+*/
+class AdaptiveSpin {
+	public:
+		AdaptiveSpin(uint32_t maxMicroSeconds = kLowLatencyMaxSpin);
+		virtual ~AdaptiveSpin();
+
+		bool		Spin(bool (*isReady)(void*), void *arg);
+
+	private:
+		uint32_t	mMaxBudget; // Microseconds.
+		uint32_t	mBudget; // Microseconds the next wait spins for, 0 while spinning is given up on.
+		uint32_t	mSkipped; // Waits that did not spin since the budget fell to 0.
+};
+#endif
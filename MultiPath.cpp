@@ -0,0 +1,423 @@
+/*
+ * File: MultiPath.cpp
+ * Desc: Spreads the DATA packets of one transfer over several local and
+ * remote addresses, each with its own congestion window, round trip time
+ * and delivery rate, into the one sequence space the receiver ACKs.
+ */
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MultiPath.h"
+#include "Transmission.h"
+
+/*!
+	\brief Returns an address as a.b.c.d:port.
+*/
+static string describeAddress(const sockaddr_in *address)
+{
+	char fText[INET_ADDRSTRLEN];
+
+	if (inet_ntop(AF_INET, &address->sin_addr, fText, sizeof(fText)) == NULL)
+	{
+		return "?";
+	}
+
+	return string(fText) + ":" + to_string(ntohs(address->sin_port));
+}
+
+/*!
+	\brief Parses a path as relsend takes it: <local>[/<remote>][@<impairments>],
+	such as "127.0.0.2", "10.0.1.5/192.168.7.1" or "127.0.0.3@delay=20,rate=10".
+	\param local Set to the local address to send from, with port 0.
+	\param remote Set to the address to send to, or to INADDR_ANY for the
+	receiver's. The port is always the receiver's and is left 0.
+	\param impairments Set to what follows the @, or emptied.
+	\return false if either address is not a dotted quad.
+*/
+bool parsePathSpec(const char *spec, sockaddr_in *local, sockaddr_in *remote, string *impairments)
+{
+	string fSpec = spec;
+	size_t fAt = fSpec.find('@');
+
+	*impairments = (fAt != string::npos) ? fSpec.substr(fAt + 1) : "";
+	fSpec = fSpec.substr(0, fAt);
+
+	size_t fSlash = fSpec.find('/');
+	string fLocal = fSpec.substr(0, fSlash);
+	string fRemote = (fSlash != string::npos) ? fSpec.substr(fSlash + 1) : "";
+
+	memset(local, 0, sizeof(*local));
+	memset(remote, 0, sizeof(*remote));
+	local->sin_family = AF_INET;
+	remote->sin_family = AF_INET;
+	remote->sin_addr.s_addr = INADDR_ANY;
+
+	if (inet_pton(AF_INET, fLocal.c_str(), &local->sin_addr) != 1)
+	{
+		return false;
+	}
+
+	return fRemote.empty() || inet_pton(AF_INET, fRemote.c_str(), &remote->sin_addr) == 1;
+}
+
+/*!
+	\brief Starts with path 0, sock sending to recv.
+	\param sock The sender's socket. Not owned.
+	\param initialTimeOut Microseconds to wait for the ACK of a packet on a
+	path without a round trip sample yet.
+*/
+PathScheduler::PathScheduler(int sock, sockaddr_in *recv, uint64_t initialTimeOut)
+	: mInitialTimeOut(initialTimeOut)
+{
+	SendPath fPath = SendPath();
+
+	fPath.mSock = sock;
+	fPath.mRemote = *recv;
+	fPath.mCongWin = kPathInitialWindowPackets * kPacketSize;
+	fPath.mRto = RtoEstimator(mInitialTimeOut);
+	mPaths.push_back(fPath);
+}
+
+PathScheduler::~PathScheduler()
+{
+	for (size_t i = 1; i < mPaths.size(); i++)
+	{
+		close(mPaths[i].mSock);
+	}
+}
+
+/*!
+	\brief Adds a path with a socket of its own.
+	\param local The address to send from, or NULL for the one the route to
+	remote gives.
+	\param remote The address to send to, or NULL, or INADDR_ANY, for the
+	receiver's. The receiver's port is used either way.
+	\param impairment Emulates the path, or NULL. Not owned.
+	\return false if the socket could not be bound or connected, or there
+	are kPathMaxPaths paths already.
+*/
+bool PathScheduler::Open(const sockaddr_in *local, const sockaddr_in *remote, Impairment *impairment)
+{
+	SendPath fPath = SendPath();
+	socklen_t fLocalSize = sizeof(fPath.mLocal);
+
+	if (mPaths.size() >= kPathMaxPaths)
+	{
+		return false;
+	}
+
+	fPath.mRemote = mPaths[0].mRemote;
+	fPath.mImpairment = impairment;
+	fPath.mCongWin = kPathInitialWindowPackets * kPacketSize;
+	fPath.mRto = RtoEstimator(mInitialTimeOut);
+
+	if (remote != NULL && remote->sin_addr.s_addr != INADDR_ANY)
+	{
+		fPath.mRemote.sin_addr = remote->sin_addr;
+	}
+
+	fPath.mSock = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fPath.mSock < 0)
+	{
+		return false;
+	}
+
+	// Connecting fixes the local address and port, which the receiver is told
+	// in the SYN, without sending anything.
+	if ((local != NULL && bind(fPath.mSock, (const sockaddr*)local, sizeof(*local)) != 0)
+		|| connect(fPath.mSock, (sockaddr*)&fPath.mRemote, sizeof(fPath.mRemote)) != 0
+		|| getsockname(fPath.mSock, (sockaddr*)&fPath.mLocal, &fLocalSize) != 0)
+	{
+		close(fPath.mSock);
+		return false;
+	}
+
+	mPaths.push_back(fPath);
+
+	return true;
+}
+
+/*!
+	\brief Returns the number of paths, path 0 included.
+*/
+uint32_t PathScheduler::GetCount()
+{
+	return (uint32_t)mPaths.size();
+}
+
+/*!
+	\brief Returns a path, which stays valid until the next Open.
+*/
+SendPath *PathScheduler::GetPath(uint32_t path)
+{
+	return &mPaths[path];
+}
+
+/*!
+	\brief Starts every path over at kPathInitialWindowPackets, for data
+	sent with packetSize byte datagrams.
+	\return The sender's window, as _GetCongWin gives it.
+*/
+uint32_t PathScheduler::Reset(uint32_t packetSize)
+{
+	socklen_t fLocalSize = sizeof(mPaths[0].mLocal);
+
+	// The sender's socket was bound by sending the SYN.
+	getsockname(mPaths[0].mSock, (sockaddr*)&mPaths[0].mLocal, &fLocalSize);
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		mPaths[i].mCongWin = kPathInitialWindowPackets * packetSize;
+		mPaths[i].mRecoveryTime = 0;
+	}
+
+	return _GetCongWin();
+}
+
+/*!
+	\brief Picks the path for a packet.
+	\param loss Holds what is in flight on each path.
+	\param size The sequence numbers the packet covers.
+	\param remaining The sequence numbers left to send, the packet included.
+	\param force true for a packet that must go now, such as one found
+	lost. It then takes a full path if no path has room.
+	\return The path, or -1 if the packet should wait for an ACK.
+*/
+int PathScheduler::Pick(LossDetector *loss, uint32_t size, uint64_t remaining, bool force)
+{
+	int fPick = -1;
+	int fSoonest = -1;
+	uint64_t fPickTime = 0;
+	uint64_t fSoonestTime = 0;
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		SendPath *fPath = &mPaths[i];
+		const PathCounters &fCounters = loss->GetPathCounters((uint8_t)i);
+		uint64_t fTime = _GetArrivalTime(fPath, fCounters, size);
+		bool fRoom = (fCounters.mInFlight + size <= fPath->mCongWin);
+
+		// A full path without a sample cannot say when it would deliver.
+		if ((fRoom || fPath->mRto.GetSmoothedRtt() > 0) && (fSoonest < 0 || fTime < fSoonestTime))
+		{
+			fSoonest = (int)i;
+			fSoonestTime = fTime;
+		}
+
+		if (fRoom && (fPick < 0 || fTime < fPickTime))
+		{
+			fPick = (int)i;
+			fPickTime = fTime;
+		}
+	}
+
+	if (force)
+	{
+		return (fPick >= 0) ? fPick : MAX(fSoonest, 0);
+	}
+
+	// Waiting for room on a faster path gets everything there sooner.
+	if (fPick >= 0 && fSoonest != fPick
+		&& _GetArrivalTime(&mPaths[fSoonest], loss->GetPathCounters((uint8_t)fSoonest), remaining) < fPickTime)
+	{
+		return -1;
+	}
+
+	return fPick;
+}
+
+/*!
+	\brief Sends a datagram on a path other than path 0, which the sender
+	sends on itself.
+*/
+void PathScheduler::Send(uint32_t path, char *data, size_t size)
+{
+	SendPath *fPath = &mPaths[path];
+
+	if (fPath->mImpairment != NULL)
+	{
+		fPath->mImpairment->Send(fPath->mSock, &fPath->mRemote, data, size);
+	}
+	else
+	{
+		sendPacket(fPath->mSock, &fPath->mRemote, data, size, false);
+	}
+}
+
+/*!
+	\brief Takes what the loss detector saw on each path since the last call:
+	round trip samples move the smoothed RTT and timeout, delivered data grows
+	the window and losses cut it. Only the latest sample is taken, which is
+	plenty for a timeout.
+	\return The sender's window, as _GetCongWin gives it.
+*/
+uint32_t PathScheduler::Update(LossDetector *loss, uint32_t packetSize)
+{
+	uint64_t fNow = getMonotonicMicroSeconds();
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		SendPath *fPath = &mPaths[i];
+		const PathCounters &fCounters = loss->GetPathCounters((uint8_t)i);
+		uint64_t fDelivered = fCounters.mDelivered - fPath->mCounted.mDelivered;
+		uint64_t fLost = fCounters.mLost - fPath->mCounted.mLost;
+
+		if (fCounters.mRttSamples != fPath->mCounted.mRttSamples)
+		{
+			fPath->mRto.AddSample(fCounters.mRtt, false);
+		}
+
+		uint64_t fSmoothedRtt = fPath->mRto.GetSmoothedRtt();
+
+		// All the losses of a flight are answered by one cut.
+		if (fLost > 0 && fNow >= fPath->mRecoveryTime)
+		{
+			fPath->mCongWin = MAX(fPath->mCongWin / 2, packetSize);
+			fPath->mRecoveryTime = fNow + MAX(fSmoothedRtt, (uint64_t)kPathMinRateInterval);
+		}
+		else if (fLost == 0 && fDelivered > 0)
+		{
+			fPath->mCongWin = (uint32_t)MIN(fPath->mCongWin + fDelivered, (uint64_t)kPathMaxWindowPackets * packetSize);
+		}
+
+		// The rate is sampled about once a round trip, and an interval in
+		// which nothing arrived is only skipped.
+		if (fPath->mRateStartTime == 0)
+		{
+			fPath->mRateStartTime = fNow;
+			fPath->mRateStartDelivered = fCounters.mDelivered;
+		}
+		else if (fNow - fPath->mRateStartTime >= MAX(fSmoothedRtt, (uint64_t)kPathMinRateInterval))
+		{
+			uint64_t fBytes = fCounters.mDelivered - fPath->mRateStartDelivered;
+
+			if (fBytes > 0)
+			{
+				uint64_t fRate = fBytes * kMicroSecond / (fNow - fPath->mRateStartTime);
+				fPath->mDeliveryRate = (fPath->mDeliveryRate == 0) ? fRate : (3 * fPath->mDeliveryRate + fRate) / 4;
+			}
+
+			fPath->mRateStartTime = fNow;
+			fPath->mRateStartDelivered = fCounters.mDelivered;
+		}
+
+		fPath->mCounted = fCounters;
+	}
+
+	return _GetCongWin();
+}
+
+/*!
+	\brief Halves every window and doubles every timeout after a
+	retransmission timeout, which sends everything outstanding again.
+	\return The sender's window, as _GetCongWin gives it.
+*/
+uint32_t PathScheduler::OnTimeOut(uint32_t packetSize)
+{
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		mPaths[i].mCongWin = MAX(mPaths[i].mCongWin / 2, packetSize);
+		mPaths[i].mRto.BackOff();
+	}
+
+	return _GetCongWin();
+}
+
+/*!
+	\brief Returns the longest retransmission timeout of the paths with data
+	in flight, in milliseconds, or 0 if nothing is in flight.
+*/
+uint32_t PathScheduler::GetTimeOutMilliSeconds(LossDetector *loss)
+{
+	uint32_t fTimeOut = 0;
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		if (loss->GetPathCounters((uint8_t)i).mInFlight > 0)
+		{
+			fTimeOut = MAX(fTimeOut, mPaths[i].mRto.GetTimeOutMilliSeconds());
+		}
+	}
+
+	return fTimeOut;
+}
+
+/*!
+	\brief Returns the longest smoothed round trip time of the paths, in
+	microseconds, or 0 before the first sample.
+*/
+uint64_t PathScheduler::GetSmoothedRtt()
+{
+	uint64_t fSmoothedRtt = 0;
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		fSmoothedRtt = MAX(fSmoothedRtt, mPaths[i].mRto.GetSmoothedRtt());
+	}
+
+	return fSmoothedRtt;
+}
+
+/*!
+	\brief Prints a line for each path with what was sent and lost on it and
+	what was learned about it.
+*/
+void PathScheduler::PrintSummary(ostream &out, LossDetector *loss)
+{
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		SendPath *fPath = &mPaths[i];
+		const PathCounters &fCounters = loss->GetPathCounters((uint8_t)i);
+
+		out<<"Path "<<dec<<i<<" "<<describeAddress(&fPath->mLocal)<<" to "<<describeAddress(&fPath->mRemote)<<": "
+			<<fCounters.mSent<<" bytes sent, "<<fCounters.mLost<<" packets lost, RTT "<<(fPath->mRto.GetSmoothedRtt() / 1000.0)
+			<<" ms, "<<(fPath->mDeliveryRate * 8 / 1000000.0)<<" Mbit/s delivered."<<endl;
+	}
+}
+
+/*!
+	\brief Returns when, in microseconds from now, a packet of size sent on
+	a path now would arrive, or 0 if the path has no round trip sample yet.
+*/
+uint64_t PathScheduler::_GetArrivalTime(SendPath *path, const PathCounters &counters, uint32_t size)
+{
+	uint64_t fSmoothedRtt = path->mRto.GetSmoothedRtt();
+
+	if (fSmoothedRtt == 0)
+	{
+		return 0;
+	}
+
+	// A window limited path delivers a window a round trip, whatever the
+	// last rate sample, which may be from when it had less to send.
+	uint64_t fRate = MAX(path->mDeliveryRate, (uint64_t)path->mCongWin * kMicroSecond / fSmoothedRtt);
+
+	return fSmoothedRtt / 2 + (counters.mInFlight + size) * kMicroSecond / MAX(fRate, (uint64_t)1);
+}
+
+/*!
+	\brief Returns the sequence numbers the sender may have outstanding past
+	its cumulative ACK. While a packet of the slowest path is out, each other
+	path gets through its window as many times as its round trip fits into the
+	slowest one, so its window counts that many times, up to kPathMaxRttRatio.
+	Only the sum of the windows would have the fast paths wait on the slow one.
+*/
+uint32_t PathScheduler::_GetCongWin()
+{
+	uint64_t fSlowestRtt = GetSmoothedRtt();
+	uint64_t fCongWin = 0;
+
+	for (size_t i = 0; i < mPaths.size(); i++)
+	{
+		uint64_t fSmoothedRtt = mPaths[i].mRto.GetSmoothedRtt();
+		uint64_t fRatio = (fSmoothedRtt > 0) ? MIN(fSlowestRtt / fSmoothedRtt, (uint64_t)kPathMaxRttRatio) : 1;
+
+		fCongWin += (uint64_t)mPaths[i].mCongWin * MAX(fRatio, (uint64_t)1);
+	}
+
+	return (uint32_t)MIN(fCongWin, (uint64_t)0xFFFFFFFF);
+}
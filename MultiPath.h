@@ -0,0 +1,106 @@
+/*
+ * File: MultiPath.h
+ * Desc: Spreads the DATA packets of one transfer over several local and
+ * remote addresses, each with its own congestion window, round trip time
+ * and delivery rate, into the one sequence space the receiver ACKs.
+ */
+#ifndef _MULTIPATH_H_
+#define _MULTIPATH_H_
+
+#include <inttypes.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+#include "Impairment.h"
+#include "LossDetector.h"
+#include "RtoEstimator.h"
+
+using namespace std;
+
+#define kPathMaxPaths kLossMaxPaths // Paths of a transfer, the sender's own socket included.
+#define kPathInitialWindowPackets 4 // Congestion window of each path as data starts.
+#define kPathMaxWindowPackets 14 // Largest congestion window of a path.
+#define kPathMinRateInterval 1000 // Microseconds, at least, over which a delivery rate is sampled.
+#define kPathMaxRttRatio 16 // Most times a path's window counts toward the sender's for a slower path.
+
+/*! \struct SendPath
+    \brief One local and remote address pair packets can take, and what
+    has been learned about it.
+*/
+struct SendPath {
+	int				mSock; // Connected to mRemote. Path 0 uses the sender's own socket.
+	sockaddr_in		mLocal; // Address the receiver sees the path's packets come from.
+	sockaddr_in		mRemote;
+	Impairment		*mImpairment; // Not owned. Emulates the path, or NULL for the one setImpairment set.
+	uint32_t		mCongWin; // Bytes.
+	RtoEstimator	mRto; // Round trip time and retransmission timeout of the path alone.
+	uint64_t		mDeliveryRate; // Bytes per second, 0 until the first sample.
+	uint64_t		mRecoveryTime; // Losses found before this time were already answered by a cut.
+	uint64_t		mRateStartTime; // Start of the delivery rate sample being taken.
+	uint64_t		mRateStartDelivered; // Delivered count at mRateStartTime.
+	PathCounters	mCounted; // Detector counters as of the last Update.
+};
+
+/*! \struct PathConfig
+    \brief A path as Sender::AddPath takes it, kept until the sender opens it.
+*/
+struct PathConfig {
+	sockaddr_in		mLocal;
+	sockaddr_in		mRemote; // INADDR_ANY for the receiver's address.
+	Impairment		*mImpairment; // Not owned, or NULL.
+};
+
+bool parsePathSpec(const char *spec, sockaddr_in *local, sockaddr_in *remote, string *impairments);
+
+/*! \class PathScheduler
+    \brief Picks the path each DATA packet goes on, and keeps the congestion
+    window of each path from what the loss detector saw on it.
+
+   A packet goes on the path it is expected to arrive soonest by, which is
+   half the smoothed round trip time of the path plus the time its delivery
+   rate takes to get through what is in flight there. Only paths with room
+   in their window are used, and a packet waits rather than take one when a
+   full path would deliver all that is left to send before the packet
+   arrived, so a slow path does not hold up the last ACK (the ECF scheduler).
+   Paths that have no round trip sample yet are used first, to get one.
+
+   Each path grows its window by what was delivered on it, up to
+   kPathMaxWindowPackets, halves it on losses found on it, at most once a
+   round trip, and halves it again on a retransmission timeout. The sender's
+   window is the sum, with the window of each path counted once for every
+   time its round trip fits into that of the slowest path, since the ACK
+   cannot pass a packet of the slowest path before it arrives. Each path
+   also keeps its own retransmission timeout, and the sender waits for the
+   longest one of the paths with data in flight, so the packets of a slow
+   path are not given up on at the pace of a fast one, which would leave the
+   slow path without a round trip sample for good. Path 0 is the sender's
+   own socket and the receiver's address, which the handshake, ACKs and FIN
+   use. It is not thread safe.
+*/
+class PathScheduler {
+	public:
+		PathScheduler(int sock, sockaddr_in *recv, uint64_t initialTimeOut);
+		virtual ~PathScheduler();
+
+		bool		Open(const sockaddr_in *local, const sockaddr_in *remote, Impairment *impairment);
+		uint32_t	GetCount();
+		SendPath	*GetPath(uint32_t path);
+		uint32_t	Reset(uint32_t packetSize);
+		int			Pick(LossDetector *loss, uint32_t size, uint64_t remaining, bool force);
+		void		Send(uint32_t path, char *data, size_t size);
+		uint32_t	Update(LossDetector *loss, uint32_t packetSize);
+		uint32_t	OnTimeOut(uint32_t packetSize);
+		uint32_t	GetTimeOutMilliSeconds(LossDetector *loss);
+		uint64_t	GetSmoothedRtt();
+		void		PrintSummary(ostream &out, LossDetector *loss);
+
+	private:
+		uint64_t	_GetArrivalTime(SendPath *path, const PathCounters &counters, uint32_t size);
+		uint32_t	_GetCongWin();
+
+		vector<SendPath>	mPaths;
+		uint64_t			mInitialTimeOut; // Microseconds, for a path without a sample.
+};
+#endif
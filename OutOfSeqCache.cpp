@@ -75,3 +75,11 @@ Data *OutOfSeqCache::GetData(uint64_t seqNum)
 	// If we fall through return NULL.
 	return fVal;
 }
+
+/*!
+	\brief Returns the number of packets waiting in the cache.
+*/
+size_t OutOfSeqCache::GetCount()
+{
+	return mMap.size();
+}
@@ -31,6 +31,7 @@ typedef map<uint64_t, Data*> DataMap;
 		
 		void		Add(Data);
 		Data		*GetData(uint64_t);
+		size_t		GetCount();
 	
 	private:
 		DataMap		mMap;
@@ -0,0 +1,53 @@
+/*
+ * File: Probes.h
+ * Desc: Static probe points (USDT) on the send, ACK, timer and disk paths, for
+ * perf, bpftrace and SystemTap. See tools/bpftrace for example scripts.
+ */
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Each probe compiles to a single nop plus a note describing where its
+ * arguments live, so an unattached probe costs nothing beyond keeping the
+ * arguments in registers. Tracers find the probes by provider "tcplight" and
+ * the names below. Building with -DkUseProbes=0, or without sys/sdt.h
+ * (systemtap-sdt-dev or systemtap-sdt-devel), leaves them out entirely.
+ *
+ * relsend:
+ *   send_data(seq, size, cwnd, window) - A DATA packet with size bytes from seq.
+ *   ack(ack, receiver window, cwnd, estimated RTT ms) - An ACK was parsed.
+ *   retransmit(seq, bytes, timeout ms, timeouts in a row) - A timeout resends from seq.
+ *   rtt(sample us, estimated RTT ms, timeout ms) - An RTT sample was taken.
+ *   rack_loss(seq, bytes, RACK RTT us) - A later packet arrived first, so the one at seq is resent.
+ *   tail_probe(seq, bytes) - The ACK for the last packets is overdue, so the one at seq is resent.
+ * relrecv:
+ *   recv_data(seq, size, next seq expected) - A DATA packet arrived.
+ *   disk_add(seq, size, next seq expected, bytes taken in order) - DiskBuffer::Add returned.
+ *   disk_write_start(file offset, size), disk_write_done(file offset, size) - Around each file write.
+ * Both:
+ *   timer_fire(delay ms, intervals left) - A TransmissionTimer timed out.
+ */
+#ifndef kUseProbes
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define kUseProbes 1
+#endif
+#endif
+#endif
+
+#ifndef kUseProbes
+#define kUseProbes 0
+#endif
+
+#if kUseProbes
+#include <sys/sdt.h>
+
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(tcplight, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(tcplight, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(tcplight, name, a1, a2, a3, a4)
+#else
+#define PROBE2(name, a1, a2) do {} while (0)
+#define PROBE3(name, a1, a2, a3) do {} while (0)
+#define PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif
+#endif
@@ -0,0 +1,254 @@
+/*
+ * File: ReadAhead.cpp
+ * Desc: Reads the file being sent into memory on its own thread, ahead of
+ * the send window.
+ */
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ReadAhead.h"
+#include "Transmission.h"
+
+/*!
+	\param fileName The file to read.
+	\param fileSize The size of the file.
+*/
+ReadAhead::ReadAhead(string &fileName, uint64_t fileSize)
+	: mFileName(fileName), mFileSize(fileSize), mFd(-1), mChunkData(NULL),
+	  mChunkCount((fileSize + kReadAheadChunkSize - 1) / kReadAheadChunkSize), mFilled(0), mReleased(0),
+	  mFailed(false), mStop(false), mRunning(false), mReaderThread(_StartReader, this),
+	  mStallCount(0), mStallTime(0)
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+	if (mRunning)
+	{
+		mFreeLock.Lock();
+		mStop = true;
+		mFreeLock.Signal();
+		mFreeLock.Unlock();
+		mReaderThread.Join();
+	}
+
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+
+	free(mChunkData);
+}
+
+/*!
+	\brief Opens the file, tells the kernel it will be read sequentially and
+	starts the reader thread.
+	\return true if the reader thread is running.
+*/
+bool ReadAhead::Start()
+{
+	if (mRunning)
+	{
+		return true;
+	}
+
+	mFd = open(mFileName.c_str(), O_RDONLY);
+
+	if (mFd < 0)
+	{
+		return false;
+	}
+
+	posix_fadvise(mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	void *fData = NULL;
+
+	if (posix_memalign(&fData, 4096, (size_t)kReadAheadChunks * kReadAheadChunkSize) != 0)
+	{
+		return false;
+	}
+
+	mChunkData = (char*)fData;
+	mRunning = (mReaderThread.Start() == 0);
+
+	return mRunning;
+}
+
+/*!
+	\brief Copies file data into buff, waiting for the reader thread if it has
+	not got that far yet. The offset must not be below the last Release.
+	\param offset The file offset to read from.
+	\param buff Where to copy the data.
+	\param size The number of bytes wanted.
+	\return The number of bytes copied. Less than size at the end of the file or
+	if the file could not be read.
+*/
+uint32_t ReadAhead::Read(uint64_t offset, char *buff, uint32_t size)
+{
+	uint32_t fDone = 0;
+
+	while (fDone < size && offset + fDone < mFileSize)
+	{
+		uint64_t fChunk = (offset + fDone) / kReadAheadChunkSize;
+		uint32_t fStart = (uint32_t)((offset + fDone) % kReadAheadChunkSize);
+
+		if (fChunk < mReleased || !_WaitForChunk(fChunk))
+		{
+			break;
+		}
+
+		uint32_t fCopy = MIN(size - fDone, _GetChunkLength(fChunk) - fStart);
+		memcpy(buff + fDone, mChunkData + ((fChunk % kReadAheadChunks) * kReadAheadChunkSize) + fStart, fCopy);
+		fDone += fCopy;
+	}
+
+	return fDone;
+}
+
+/*!
+	\brief Hands the slots holding data before offset back to the reader thread.
+	\param offset The lowest file offset that may still be read.
+*/
+void ReadAhead::Release(uint64_t offset)
+{
+	uint64_t fChunk = MIN(offset / kReadAheadChunkSize, __atomic_load_n(&mFilled, __ATOMIC_ACQUIRE));
+
+	if (fChunk > mReleased)
+	{
+		__atomic_store_n(&mReleased, fChunk, __ATOMIC_RELEASE);
+
+		mFreeLock.Lock();
+		mFreeLock.Signal();
+		mFreeLock.Unlock();
+	}
+}
+
+/*!
+	\brief Returns the number of times Read had to wait for the reader thread.
+*/
+uint64_t ReadAhead::GetStallCount()
+{
+	return mStallCount;
+}
+
+/*!
+	\brief Returns the total time Read spent waiting for the reader thread, in microseconds.
+*/
+uint64_t ReadAhead::GetStallTime()
+{
+	return mStallTime;
+}
+
+/*!
+	\brief Waits until the reader thread has read the chunk, timing the wait.
+	\return false if the chunk could not be read.
+*/
+bool ReadAhead::_WaitForChunk(uint64_t chunk)
+{
+	if (chunk < __atomic_load_n(&mFilled, __ATOMIC_ACQUIRE))
+	{
+		return true;
+	}
+
+	uint64_t fStart = getMonotonicMicroSeconds();
+
+	mFillLock.Lock();
+
+	while (chunk >= __atomic_load_n(&mFilled, __ATOMIC_ACQUIRE) && !mFailed)
+	{
+		mFillLock.Wait();
+	}
+
+	mFillLock.Unlock();
+
+	mStallCount++;
+	mStallTime += getMonotonicMicroSeconds() - fStart;
+
+	return chunk < __atomic_load_n(&mFilled, __ATOMIC_ACQUIRE);
+}
+
+/*!
+	\brief Returns the number of bytes of the file in the chunk. Only the last
+	chunk is short.
+*/
+uint32_t ReadAhead::_GetChunkLength(uint64_t chunk)
+{
+	return (uint32_t)MIN((uint64_t)kReadAheadChunkSize, mFileSize - (chunk * kReadAheadChunkSize));
+}
+
+/*!
+	\brief Entry point of the reader thread. Reads the chunks in file order into
+	free slots, sleeping while the ring is full.
+	\param args The ReadAhead that started the thread.
+*/
+void *ReadAhead::_StartReader(void *args)
+{
+	ReadAhead *fReader = (ReadAhead*)args;
+
+	for (uint64_t fChunk = 0; fChunk < fReader->mChunkCount; fChunk++)
+	{
+		fReader->mFreeLock.Lock();
+
+		while (fChunk >= __atomic_load_n(&fReader->mReleased, __ATOMIC_ACQUIRE) + kReadAheadChunks && !fReader->mStop)
+		{
+			fReader->mFreeLock.Wait();
+		}
+
+		fReader->mFreeLock.Unlock();
+
+		if (fReader->mStop)
+		{
+			break;
+		}
+
+		// Get the kernel started on the next chunk while we copy this one.
+		if (fChunk + 1 < fReader->mChunkCount)
+		{
+			posix_fadvise(fReader->mFd, (off_t)((fChunk + 1) * kReadAheadChunkSize), kReadAheadChunkSize, POSIX_FADV_WILLNEED);
+		}
+
+		char *fData = fReader->mChunkData + ((fChunk % kReadAheadChunks) * kReadAheadChunkSize);
+		uint64_t fOffset = fChunk * kReadAheadChunkSize;
+		uint32_t fLength = fReader->_GetChunkLength(fChunk);
+		uint32_t fDone = 0;
+
+		while (fDone < fLength)
+		{
+			ssize_t fRead = pread(fReader->mFd, fData + fDone, fLength - fDone, (off_t)(fOffset + fDone));
+
+			if (fRead <= 0 && !(fRead < 0 && errno == EINTR))
+			{
+				break;
+			}
+
+			fDone += (fRead > 0) ? (uint32_t)fRead : 0;
+		}
+
+		fReader->mFillLock.Lock();
+
+		if (fDone < fLength)
+		{
+			cerr<<"ReadAhead [Read]: Unable to read "<<dec<<fLength<<" bytes at offset "<<fOffset<<endl;
+			fReader->mFailed = true;
+		}
+		else
+		{
+			__atomic_store_n(&fReader->mFilled, fChunk + 1, __ATOMIC_RELEASE);
+		}
+
+		fReader->mFillLock.Signal();
+		fReader->mFillLock.Unlock();
+
+		if (fReader->mFailed)
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * File: ReadAhead.h
+ * Desc: Reads the file being sent into memory on its own thread, ahead of
+ * the send window.
+ */
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <inttypes.h>
+#include <string>
+
+#include "Mutex.h"
+#include "Thread.h"
+
+#define kReadAheadChunks 8
+#define kReadAheadChunkSize 1048576
+
+using namespace std;
+
+/*! \class ReadAhead
+    \brief Keeps the next few megabytes of a file in memory for the send loop.
+
+   The file is split into chunks of kReadAheadChunkSize bytes, and chunk n is
+   read into ring slot n % kReadAheadChunks. A reader thread fills the slots in
+   file order as far ahead as the ring allows, while the send loop copies packets
+   out of the filled ones. The reader only moves the count of filled chunks and
+   the send loop only moves the count of released ones, so the ring needs no
+   lock; the mutexes are only used to sleep when one side has to wait for the
+   other. Read and Release must only be called from one thread.
+*/
+class ReadAhead {
+	public:
+		ReadAhead(string &fileName, uint64_t fileSize);
+		virtual ~ReadAhead();
+
+		bool			Start();
+		uint32_t		Read(uint64_t offset, char *buff, uint32_t size);
+		void			Release(uint64_t offset);
+		uint64_t		GetStallCount();
+		uint64_t		GetStallTime();
+
+	private:
+		static void*	_StartReader(void *);
+		bool			_WaitForChunk(uint64_t chunk);
+		uint32_t		_GetChunkLength(uint64_t chunk);
+
+		string			mFileName;
+		uint64_t		mFileSize;
+		int				mFd;
+		char			*mChunkData;
+		uint64_t		mChunkCount; // Chunks in the whole file.
+		uint64_t		mFilled; // Chunks read so far. Written by the reader thread.
+		uint64_t		mReleased; // Chunks the send loop is done with. Written by the send loop.
+		bool			mFailed; // The reader thread could not read the next chunk.
+		bool			mStop;
+		bool			mRunning;
+		Thread			mReaderThread;
+		Mutex			mFillLock; // Wakes the send loop when a chunk has been read.
+		Mutex			mFreeLock; // Wakes the reader thread when a slot has been released.
+		uint64_t		mStallCount; // Times the send loop had to wait for the reader.
+		uint64_t		mStallTime; // Microseconds the send loop spent waiting.
+};
+#endif
@@ -5,62 +5,21 @@
  * Team Members: Bryce Groff, Brandon Grant, Emiliano Miranda
  * Author: Emiliano Miranda
  * Created Date: 04-20-09
- * Desc: This file contains the definition and entry point for the Receiver class
- * and relrecv program.
+ * Desc: This file contains the definition of the Receiver class.
  */
 
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "Receiver.h"
+#include "Probes.h"
 
 #define kRecvDebug 0
 #define kSynTimeOut 1 // Timeout SYN after 1 second.
-#define kRecvMinPacketSize 9
-#define kSeqNumSize 8
 #define kRecvDefaultTimeOut 100
 #define kRecvFinTimeOut 1000
-#define error(s) { perror(s); exit(1); }
-
-void printUsage();
-
-/* Function: main
- * Desc: This function is the main entry point for the relrecv program.
- */
-int main (int argc, char *argv[])
-{
-	// Check to see if we have correct # of arguments.
-	if (argc == 2)
-	{
-		int port = atoi(argv[1]);
-
-		if (port >= kPortNumMin && port <= kPortNumMax)
-		{
-			Receiver receiver((unsigned short)port);
-			receiver.Start();
-		}
-		else
-		{
-			printUsage();
-		}
-	}
-	else
-	{
-		printUsage();
-	}
-
-	exit(EXIT_SUCCESS);
-}
-
-/* Function: printUsage
- * Desc: This function displays the usage information on how this program should work.
- */
-void printUsage()
-{
-	cout<<"Invalid command line arguments specified.\n\n";
-	cout<<"You must supply one numeric argument, which denotes the port number.\n";
-	cout<<"Usage: relrecv <port>\n";
-	cout<<"\t<port> - A number between "<<kPortNumMin<<" and "<<kPortNumMax<<"."<<endl;
-}
+#define kRecvFeatures FEATURE_ALL // ProtocolFeature bits this receiver supports.
+#define error(s) { perror(s); return -1; }
 
 /* Function (ctor): Receiver 
  * Desc: This constructor initializes a new instance of the Receiver class. The port
@@ -70,26 +29,311 @@ Receiver::Receiver(unsigned short port)
 	: mPort(port), mCurrentState(RECV_NO_CONN), mSocket(-1), mFileSize(1), mTotalReceived(0),
 	  mLastAck(0), mIsStarted(false), mSenderAddr(NULL), mDiskBuffer(NULL), 
 	  mTimeOutInterval(kRecvDefaultTimeOut), mLastAckRetransmit(false),
-	  mEstRtt(0), mDevRtt(0)
+	  mRto(kRecvDefaultTimeOut * 1000), mFecDecoder(NULL), mMaxPacketSize(kMaxDatagramSize), mPacketSize(0),
+	  mPeerVersion(0), mFeatures(kRecvFeatures), mSupportedFeatures(kRecvFeatures), mSynAck(false),
+	  mReceiveOffload(false), mDeferAck(false), mAckPending(false), mSackPending(0),
+	  mUseIoUring(false), mSqPoll(false), mRing(NULL), mQueueAcks(false), mWriteMode(DISK_WRITE_STREAM),
+	  mWriterThread(false), mBusyPoll(0), mSpin(false), mStats("relrecv"), mStatsExporter(NULL), mTrace(NULL), mStages(NULL),
+	  mSink(NULL), mOwnsSocket(true), mAdvertisedWindow(0), mLog(&cout), mNotifyCaller(NULL), mNotify(NULL)
 {
 	// Temporarily use hard coded timeout of 100ms.
 	mTransTimer = new TransmissionTimer(mTimeOutInterval, kTransmissionTimerInfiniteInterval, (void*)this, Receiver::_TimeOutCallBack);
 }
 
+/* Function (ctor): Receiver
+ * Desc: This constructor initializes a receiver that shares sock, which is already
+ * bound, with the receivers of other senders, and hands the data to sink in place
+ * of a file. The owner of the socket passes it each datagram from its sender with
+ * Receive; Start is not called.
+ */
+Receiver::Receiver(int sock, StreamBuffer *sink)
+	: Receiver((unsigned short)0)
+{
+	mSocket = sock;
+	mSink = sink;
+	mOwnsSocket = false;
+	mIsStarted = true;
+
+	// The owner of the socket tells senders apart by address.
+	mSupportedFeatures &= ~FEATURE_MULTIPATH;
+	_RegisterStats();
+}
+
 /* Function (dtor): Receiver 
  * Desc: This destructor frees memory allocated by the Receiver class.
  */
 Receiver::~Receiver()
 {
-	delete mSenderAddr;
+	// The timer thread calls back into this object until it is gone.
 	delete mTransTimer;
+	delete mSenderAddr;
 	delete mDiskBuffer;
+	delete mFecDecoder;
+	delete mRing;
+	delete mStatsExporter;
+	delete mTrace;
+	delete mStages;
+}
+
+/* Function: SetMaxPacketSize
+ * Desc: This function sets the largest datagram the receiver will accept. A sender
+ * that offers a datagram size in its SYN is told the smaller of the two sizes. It
+ * must be called before Start.
+ */
+void Receiver::SetMaxPacketSize(uint32_t maxPacketSize)
+{
+	mMaxPacketSize = MIN(MAX(maxPacketSize, (uint32_t)kPacketSize), (uint32_t)kMaxDatagramSize);
+}
+
+/* Function: EnableIoUring
+ * Desc: This function switches the receiver from blocking socket and file calls to
+ * io_uring. Several receives are kept posted on the socket, and ACKs and file writes
+ * are queued and submitted in batches. If sqPoll is true, kernel threads pick up the
+ * submissions. It must be called before Start, and the receiver falls back to the
+ * blocking calls if the kernel does not support io_uring.
+ */
+void Receiver::EnableIoUring(bool sqPoll)
+{
+	mUseIoUring = true;
+	mSqPoll = sqPoll;
+}
+
+/* Function: SetWriteMode
+ * Desc: This function sets how the received file is written to disk. See
+ * DiskBuffer::SetWriteMode. It must be called before Start.
+ */
+void Receiver::SetWriteMode(DiskWriteMode mode)
+{
+	mWriteMode = mode;
+}
+
+/* Function: SetSink
+ * Desc: This function delivers the received data in order to sink, for an
+ * application to read, instead of writing it to a file. The write mode, writer
+ * thread and io_uring file writes then do not apply. It must be called before Start.
+ */
+void Receiver::SetSink(StreamBuffer *sink)
+{
+	mSink = sink;
+}
+
+/* Function: RefuseEarlyData
+ * Desc: This function turns down data that a sender puts in its SYN, so it is only
+ * taken after the handshake. It must be called before Start.
+ */
+void Receiver::RefuseEarlyData()
+{
+	mSupportedFeatures &= ~FEATURE_EARLY_DATA;
+}
+
+/* Function: EnableWriterThread
+ * Desc: This function moves file writes off the receive loop onto a writer thread.
+ * See DiskBuffer::EnableWriterThread. It must be called before Start.
+ */
+void Receiver::EnableWriterThread()
+{
+	mWriterThread = true;
+}
+
+/* Function: EnableStats
+ * Desc: This function publishes the transfer statistics while the receiver runs:
+ * rewritten as JSON to jsonFile, if not NULL, and served in the Prometheus text
+ * format on 127.0.0.1:port, if port is not 0. The end of transfer summary is
+ * printed either way. It must be called before Start.
+ */
+void Receiver::EnableStats(const char *jsonFile, unsigned short port)
+{
+	delete mStatsExporter;
+	mStatsExporter = new StatsExporter(&mStats, jsonFile, port);
+}
+
+/* Function: EnableTrace
+ * Desc: This function records protocol events to fileName as a binary trace, at
+ * the detail given by level. It must be called before Start.
+ */
+void Receiver::EnableTrace(const char *fileName, TraceLevel level)
+{
+	delete mTrace;
+	mTrace = new Trace(fileName, level, TRACE_RECEIVER);
+}
+
+/* Function: EnableStageTimers
+ * Desc: This function times each stage a packet goes through, on the receive
+ * loop and the disk writer thread, and prints the percentiles of each when the
+ * file is complete. It must be called before Start.
+ */
+void Receiver::EnableStageTimers()
+{
+	delete mStages;
+	mStages = new StageTimers();
+}
+
+/* Function: EnableLowLatency
+ * Desc: This function trades CPU time for a shorter wait between a packet arriving
+ * and its ACK going out. cpus, if not NULL, pins the receive loop to the first core
+ * of a list such as "2-3", of the cores on the NUMA node of the named interface, or
+ * of every core for "auto", since the sender is not known yet; the ACK timer goes on
+ * the last core. busyPoll, if not 0, has the kernel poll the device for that many
+ * microseconds before the receive loop sleeps. spin has the receive loop spin on the
+ * socket before each blocking receive, backing off to blocking while the waits keep
+ * outlasting the spin; it needs two cores or more and does not apply to io_uring.
+ * It must be called before Start.
+ */
+void Receiver::EnableLowLatency(const char *cpus, uint32_t busyPoll, bool spin)
+{
+	mCpuSpec = (cpus != NULL) ? cpus : "";
+	mBusyPoll = busyPoll;
+	mSpin = spin;
+}
+
+/* Function: SetLog
+ * Desc: This function sends the progress messages and the end of transfer summary
+ * to log instead of cout. An ostream without a buffer discards them. It must be
+ * called before Start or Receive.
+ */
+void Receiver::SetLog(ostream *log)
+{
+	mLog = log;
+}
+
+/* Function: SetNotify
+ * Desc: This function has notify called with caller whenever data arrives in order,
+ * which puts more in the stream buffer, or the state changes. It is called on the
+ * thread that receives or on the timer thread, and must not call back into the
+ * Receiver. It must be called before Start or Receive.
+ */
+void Receiver::SetNotify(void *caller, void (*notify)(void*))
+{
+	mNotifyCaller = caller;
+	mNotify = notify;
+}
+
+/* Function: _Notify
+ * Desc: This function calls the function given to SetNotify, if any.
+ */
+void Receiver::_Notify()
+{
+	if (mNotify != NULL)
+	{
+		mNotify(mNotifyCaller);
+	}
+}
+
+/* Function: GetState
+ * Desc: This function returns how far the transfer has got.
+ */
+ReceiverState Receiver::GetState()
+{
+	mPacketLock.Lock();
+	ReceiverState state = mCurrentState;
+	mPacketLock.Unlock();
+
+	return state;
+}
+
+/* Function: IsActive
+ * Desc: This function returns false once the receiver is done with its sender:
+ * it lingered after the FIN to answer retransmitted ones, or turned the file away.
+ */
+bool Receiver::IsActive()
+{
+	mPacketLock.Lock();
+	bool isStarted = mIsStarted;
+	mPacketLock.Unlock();
+
+	return isStarted;
+}
+
+/* Function: GetFileName
+ * Desc: This function returns the name the sender gave in its SYN, with the 'r'
+ * prepended when writing a file, or an empty string before the SYN.
+ */
+string Receiver::GetFileName()
+{
+	mPacketLock.Lock();
+	string fileName = mFileName;
+	mPacketLock.Unlock();
+
+	return fileName;
+}
+
+/* Function: GetFileSize
+ * Desc: This function returns the size the sender gave in its SYN. For a stream
+ * of unknown length that is kStreamUnknownSize until the FIN arrives, and the
+ * number of bytes received after.
+ */
+uint64_t Receiver::GetFileSize()
+{
+	mPacketLock.Lock();
+	uint64_t fileSize = mFileSize;
+	mPacketLock.Unlock();
+
+	return fileSize;
+}
+
+/* Function: _StartLowLatency
+ * Desc: This function pins the receive loop, which runs on the thread that calls
+ * Start, and the ACK timer, and turns on busy polling, as EnableLowLatency asked.
+ */
+void Receiver::_StartLowLatency()
+{
+	vector<int> cpus;
+
+	if (mBusyPoll > 0 && !setBusyPoll(mSocket, mBusyPoll))
+	{
+		*mLog<<"Unable to busy poll the socket."<<endl;
+	}
+
+	if (!mCpuSpec.empty() && !getLowLatencyCpus(mCpuSpec.c_str(), NULL, &cpus))
+	{
+		*mLog<<"Unable to pin the threads to '"<<mCpuSpec<<"'."<<endl;
+	}
+
+	// Unpinned threads run on any core the process may use.
+	vector<int> spinCpus = cpus;
+
+	if (spinCpus.empty())
+	{
+		getAllowedCpus(&spinCpus);
+	}
+
+	if (mSpin && spinCpus.size() < 2)
+	{
+		*mLog<<"Spinning needs two cores or more, blocking instead."<<endl;
+		mSpin = false;
+	}
+
+	if (!cpus.empty())
+	{
+		pinThread(pthread_self(), cpus[0]);
+		mTransTimer->SetAffinity(cpus.back());
+	}
+}
+
+/* Function: _RegisterStats
+ * Desc: This function names the statistics the receive path keeps.
+ */
+void Receiver::_RegisterStats()
+{
+	mStats.Add("data_packets_received", "DATA packets received from the sender.", &mStatDataReceived);
+	mStats.Add("data_bytes_received", "File bytes received in DATA packets, including duplicates.", &mStatBytesReceived);
+	mStats.Add("duplicate_packets", "DATA packets for data already received.", &mStatDuplicates);
+	mStats.Add("out_of_order_packets", "DATA packets that arrived ahead of a hole.", &mStatOutOfOrder);
+	mStats.Add("parity_packets_received", "PARITY packets received.", &mStatParityReceived);
+	mStats.Add("recovered_packets", "DATA packets rebuilt from parity.", &mStatRecovered);
+	mStats.Add("acks_sent", "ACKs sent, including retransmissions.", &mStatAcksSent);
+	mStats.Add("sacks_sent", "SACKs sent for DATA that did not move the ACK forward.", &mStatSacksSent);
+	mStats.Add("window_bytes", "Window last advertised to the sender.", &mStatWindow);
+	mStats.Add("out_of_order_depth", "Packets waiting in the out of order cache.", &mStatOutOfOrderDepth);
+	mStats.Add("out_of_order_depths", "Packets in the out of order cache after each out of order arrival.", &mStatOutOfOrderDepths);
 }
 
 /* Function: Start
- * Desc: This function starts the receiver to begin listening for a file transfer.
+ * Desc: This function starts the receiver to begin listening for a file transfer, and
+ * returns once the transfer is over. It returns false if the socket could not be set
+ * up.
  */
-void Receiver::Start()
+bool Receiver::Start()
 {
 	if (!mIsStarted)
 	{
@@ -99,11 +343,54 @@ void Receiver::Start()
 		{
 			mIsStarted = true;
 			mSocket = sock;
-			_StartRecvCheck();
+			_RegisterStats();
+			_StartLowLatency();
+
+			if (mStatsExporter != NULL && !mStatsExporter->Start())
+			{
+				*mLog<<"Unable to publish statistics."<<endl;
+				delete mStatsExporter;
+				mStatsExporter = NULL;
+			}
+
+			if (mTrace != NULL && !mTrace->Start())
+			{
+				*mLog<<"Unable to start the trace."<<endl;
+				delete mTrace;
+				mTrace = NULL;
+			}
+
+			if (mUseIoUring)
+			{
+				// Room for every posted receive and queued ACK to complete at once.
+				mRing = new IoUring(kRecvRingSlots + kRecvRingAcks, mSqPoll);
+
+				if (!mRing->IsValid())
+				{
+					*mLog<<"io_uring is not available, using blocking calls."<<endl;
+					delete mRing;
+					mRing = NULL;
+					mUseIoUring = false;
+				}
+				else
+				{
+					mRing->RegisterFiles(&mSocket, 1);
+				}
+			}
+
+			if (mRing != NULL)
+			{
+				_StartRingRecvCheck();
+			}
+			else
+			{
+				_StartRecvCheck();
+			}
 		}
 		else
 		{
 			cerr<<"Could not bind the socket"<<endl;
+			return false;
 		}
 
 		if (mDiskBuffer != NULL)
@@ -112,6 +399,8 @@ void Receiver::Start()
 			mDiskBuffer->Flush();
 		}
 	}
+
+	return true;
 }
 
 /* Function: _ConfigureSocket
@@ -145,6 +434,16 @@ int Receiver::_ConfigureSocket(unsigned short port)
 		error("Error binding listen socket");
 	}
 
+	// Make room for a full window of large datagrams.
+	if (mMaxPacketSize > kPacketSize)
+	{
+		setSocketBufferSize(sock, kSocketBufferSize);
+	}
+
+	// Take runs of DATA packets from a sender using segmentation offload in
+	// one receive. Older kernels just keep delivering them one at a time.
+	mReceiveOffload = enableReceiveOffload(sock);
+
 	return sock;
 }
 
@@ -155,12 +454,13 @@ int Receiver::_ConfigureSocket(unsigned short port)
 void Receiver::_StartRecvCheck()
 {
 	int bytesRead = 0;
-	char buff[kPacketSize];
+	uint32_t segmentSize = 0;
+	// Coalesced datagrams can be as large as a single maximum size datagram.
+	uint32_t buffSize = mReceiveOffload ? kMaxDatagramSize : mMaxPacketSize;
+	char* buff = new char[buffSize];
 	struct sockaddr_in* senderAddrIn = new struct sockaddr_in;
-	struct sockaddr* senderAddr = (struct sockaddr*)senderAddrIn;
-	socklen_t sockAddrInSize = sizeof(*senderAddrIn);
 
-	cout<<"Waiting to receive file..."<<endl;
+	*mLog<<"Waiting to receive file..."<<endl;
 
 	while (this->mIsStarted)
 	//while (this->mIsStarted && this->mLastAck < this->mFileSize) // This is not entirely correct.
@@ -169,82 +469,280 @@ void Receiver::_StartRecvCheck()
 
 		if (kRecvDebug)
 		{
-			cout<<"Starting to listen on port "<<dec<<mPort<<" with socket descriptor "<<mSocket<<endl;
-			cout<<mTotalReceived<<" bytes out of "<<mFileSize<<" bytes received. Sequence # = "<<mLastAck<<endl;
+			*mLog<<"Starting to listen on port "<<dec<<mPort<<" with socket descriptor "<<mSocket<<endl;
+			*mLog<<mTotalReceived<<" bytes out of "<<mFileSize<<" bytes received. Sequence # = "<<mLastAck<<endl;
 		}
 
 		mPacketLock.Unlock();
 
-		bytesRead = recvfrom(mSocket, buff, kPacketSize, 0, senderAddr, &sockAddrInSize);
+		if (mSpin)
+		{
+			mRecvSpin.Spin(isSocketReadable, &mSocket);
+		}
 
-		mPacketLock.Lock();
+		bytesRead = receiveSegments(mSocket, senderAddrIn, buff, buffSize, &segmentSize);
 
 		if (bytesRead > 0)
 		{
 			// Check if we are in debug mode to print the packet.
 			if (kRecvDebug)
 			{
-				cout<<"Received data from "<<inet_ntoa(senderAddrIn->sin_addr)
+				*mLog<<"Received data from "<<inet_ntoa(senderAddrIn->sin_addr)
 					<<" on port "<<dec<<ntohs(senderAddrIn->sin_port)<<".\n"
 					<<"Packet: ";
 
 				for (int i = 0; i < bytesRead; i++)
 				{
 					// Print individual byte (i.e. ff or 5a).
-					cout<<hex<<int((unsigned char)buff[i])<<" ";
+					*mLog<<hex<<int((unsigned char)buff[i])<<" ";
 				}
 
-				cout<<endl<<endl;
+				*mLog<<endl<<endl;
 			}
 
 			// Everything looks okay initially, so let's parse this packet.
-			_ParseMessage(senderAddrIn, buff, bytesRead);	
+			Receive(senderAddrIn, buff, bytesRead, segmentSize);
 		}
 		else if (bytesRead == -1)
 		{
 			cerr<<"Error receiving data on listen socket: "<<mSocket<<endl;
 		}
-
-		mPacketLock.Unlock();
 	}
 
 	if (senderAddrIn != NULL)
 	{
 		delete senderAddrIn;
 	}
+
+	delete [] buff;
 }
 
-/* Function: _ParseMessage
- * Desc: This function parses a UDP packet received and takes an appropriate action
- * based on its validity.
+/* Function: Receive
+ * Desc: This function parses a received buffer that holds one or more datagrams of
+ * segmentSize bytes each, as the listen loop does. Several coalesced datagrams are
+ * parsed one after another and ACKed once. The owner of a shared socket calls it
+ * with each buffer from this receiver's sender.
  */
-void Receiver::_ParseMessage(struct sockaddr_in* senderAddr, char* buff, uint32_t size)
+void Receiver::Receive(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint32_t segmentSize)
 {
-	// All packets must have at least 9-bytes to be valid.
-	// 1 byte for message type.
-	// 8 bytes for sequence number.
-	if (size >= kRecvMinPacketSize)
+	mPacketLock.Lock();
+
+	uint64_t lastAck = mLastAck;
+	ReceiverState state = mCurrentState;
+
+	mDeferAck = (segmentSize < size);
+	_ParseDatagrams(senderAddr, buff, size, segmentSize);
+	mDeferAck = false;
+
+	if (mAckPending)
 	{
-		char msg = buff[0];
-		uint64_t seqNum = 0;
-		int offset = 1;
+		mAckPending = false;
+		_SendAck(false);
+	}
 
-		if (tryGetULongFromMessage(buff + offset, size - offset, &seqNum))
+	if (mSackPending > 0)
+	{
+		if (mSackPending >= mLastAck)
 		{
-			offset += kSeqNumSize; // Init offset with num of bytes seq # is.
+			_SendSack(mSackPending);
+		}
+
+		mSackPending = 0;
+	}
+
+	bool changed = (mLastAck != lastAck || mCurrentState != state);
+	mPacketLock.Unlock();
+
+	if (changed)
+	{
+		_Notify();
+	}
+}
+
+/* Function: UpdateWindow
+ * Desc: This function tells the sender that room was made in the stream buffer, if
+ * the last ACK closed its window. The application calls it after reading, since the
+ * sender has nothing in flight to be ACKed and would otherwise wait for a timeout.
+ */
+void Receiver::UpdateWindow()
+{
+	mPacketLock.Lock();
+
+	uint32_t packetSize = (mPacketSize > 0) ? mPacketSize : kPacketSize;
+
+	if (mCurrentState == RECV_DATA && mDiskBuffer != NULL && mAdvertisedWindow < packetSize
+		&& mDiskBuffer->GetWindowSize() >= packetSize)
+	{
+		_SendAck(false);
+	}
+
+	mPacketLock.Unlock();
+}
+
+/* Function: _StartRingRecvCheck
+ * Desc: This function is the receiver listen loop for the io_uring backend. A
+ * receive is kept posted for each of kRecvRingSlots buffers. Each pass submits the
+ * reposted receives and queued ACKs and waits for completions with a single system
+ * call, then parses every datagram that arrived and answers with one ACK.
+ */
+void Receiver::_StartRingRecvCheck()
+{
+	// Coalesced datagrams can be as large as a single maximum size datagram.
+	uint32_t buffSize = mReceiveOffload ? kMaxDatagramSize : mMaxPacketSize;
+	RecvSlot* slots = new RecvSlot[kRecvRingSlots];
+	uint64_t userData = 0;
+	int result = 0;
+
+	for (int i = 0; i < kRecvRingAcks; i++)
+	{
+		mAckSlots[i].mBusy = false;
+	}
+
+	for (int i = 0; i < kRecvRingSlots; i++)
+	{
+		slots[i].mBuffer = new char[buffSize];
+		slots[i].mIov.iov_base = slots[i].mBuffer;
+		slots[i].mIov.iov_len = buffSize;
+		_PostRecv(&slots[i]);
+		mRing->PrepareRecvMsg(mSocket, &slots[i].mMsg, i);
+	}
 
-			if (msg == (char)SYN)
+	*mLog<<"Waiting to receive file..."<<endl;
+
+	while (this->mIsStarted)
+	{
+		mRing->Submit(1);
+
+		mPacketLock.Lock();
+		mQueueAcks = true;
+		mDeferAck = true;
+
+		uint64_t lastAck = mLastAck;
+		ReceiverState state = mCurrentState;
+
+		while (mRing->GetCompletion(&userData, &result))
+		{
+			// Completed ACK sends just give their slot back.
+			if (userData >= kRecvRingSlots)
 			{
-				_ParseSyn(senderAddr, buff + offset, size - offset, seqNum);
+				mAckSlots[(userData - kRecvRingSlots) % kRecvRingAcks].mBusy = false;
+				continue;
 			}
-			else if (msg == (char)DATA)
+
+			RecvSlot* slot = &slots[userData];
+
+			if (result > 0)
 			{
-				_ParseData(senderAddr, buff + offset, size - offset, seqNum);
+				_ParseDatagrams(&slot->mAddr, slot->mBuffer, result, getReceivedSegmentSize(&slot->mMsg, result));
 			}
-			else if (msg == (char)FIN)
+			else if (result < 0 && result != -EINTR && result != -EAGAIN)
 			{
-				_ParseFin(senderAddr, buff + offset, size - offset, seqNum);
+				cerr<<"Error receiving data on listen socket: "<<mSocket<<endl;
 			}
+
+			_PostRecv(slot);
+			mRing->PrepareRecvMsg(mSocket, &slot->mMsg, userData);
+		}
+
+		mDeferAck = false;
+
+		if (mAckPending)
+		{
+			mAckPending = false;
+			_SendAck(false);
+		}
+
+		if (mSackPending > 0)
+		{
+			if (mSackPending >= mLastAck)
+			{
+				_SendSack(mSackPending);
+			}
+
+			mSackPending = 0;
+		}
+
+		mQueueAcks = false;
+
+		bool changed = (mLastAck != lastAck || mCurrentState != state);
+		mPacketLock.Unlock();
+
+		if (changed)
+		{
+			_Notify();
+		}
+	}
+
+	for (int i = 0; i < kRecvRingSlots; i++)
+	{
+		delete [] slots[i].mBuffer;
+	}
+
+	delete [] slots;
+}
+
+/* Function: _PostRecv
+ * Desc: This function resets the message header of a receive slot before its receive
+ * is submitted, since the kernel overwrites the address and control lengths.
+ */
+void Receiver::_PostRecv(RecvSlot *slot)
+{
+	memset(&slot->mMsg, 0, sizeof(slot->mMsg));
+	slot->mMsg.msg_name = &slot->mAddr;
+	slot->mMsg.msg_namelen = sizeof(slot->mAddr);
+	slot->mMsg.msg_iov = &slot->mIov;
+	slot->mMsg.msg_iovlen = 1;
+	slot->mMsg.msg_control = slot->mControl;
+	slot->mMsg.msg_controllen = sizeof(slot->mControl);
+}
+
+/* Function: _ParseDatagrams
+ * Desc: This function parses a received buffer that holds one or more datagrams
+ * of segmentSize bytes each, of which only the last may be shorter.
+ */
+void Receiver::_ParseDatagrams(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint32_t segmentSize)
+{
+	for (uint32_t offset = 0; segmentSize > 0 && offset < size; offset += segmentSize)
+	{
+		_ParseMessage(senderAddr, buff + offset, MIN(segmentSize, size - offset));
+	}
+}
+
+/* Function: _ParseMessage
+ * Desc: This function parses a UDP packet received and takes an appropriate action
+ * based on its validity.
+ */
+void Receiver::_ParseMessage(struct sockaddr_in* senderAddr, char* buff, uint32_t size)
+{
+	// All packets must have at least 9-bytes to be valid.
+	// 1 byte for message type.
+	// 8 bytes for sequence number.
+	// Each parse function checks the rest of its layout once before reading it.
+	if (isWireSizeValid<PacketHeader>(size))
+	{
+		ScopedStageTimer parseTimer(mStages, STAGE_RECV_PARSE);
+		uint8_t msg = PacketHeader::Code::Get(buff);
+		uint64_t seqNum = PacketHeader::Seq::Get(buff);
+
+		if (msg == SYN)
+		{
+			_ParseSyn(senderAddr, buff, size, seqNum);
+		}
+		else if (msg == DATA)
+		{
+			_ParseData(senderAddr, buff, size, seqNum);
+		}
+		else if (msg == FIN)
+		{
+			_ParseFin(senderAddr, buff, size, seqNum);
+		}
+		else if (msg == PARITY && (mFeatures & FEATURE_FEC))
+		{
+			_ParseParity(senderAddr, buff, size, seqNum);
+		}
+		else if (msg == PROBE && (mFeatures & FEATURE_PROBE))
+		{
+			_ParseProbe(senderAddr, size);
 		}
 	}
 }
@@ -261,12 +759,11 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 	if (mCurrentState == RECV_NO_CONN)
 	{
 		// Verify rest of packet is correct format.
-		uint64_t fileSize = 0;
-
-		// Get total size of file.
-		if (tryGetULongFromMessage(buff, size, &fileSize))
+		if (isWireSizeValid<SynPacket>(size))
 		{
-			int offset = sizeof(uint64_t); // Init offset with num of bytes file size is.
+			// Get total size of file.
+			uint64_t fileSize = SynPacket::FileSize::Get(buff);
+			int offset = SynPacket::kSize; // The file name follows the fixed fields.
 
 			// Allocate 2 extra bytes. One for \0 (since I'm assuming max chars is just the name alone) and one for appending 'r' to front of file name.
 			char fileName[kFileNameMaxChars + 2];
@@ -279,22 +776,57 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 				&& isRegExMatch(fileName + 1, kFileNameRegEx, kFileNameMaxChars)) 
 			{
 				fileName[0] = 'r';
+				offset += strlen(fileName + 1) + 1;
+
+				// Newer senders follow the name with the largest datagram they
+				// want to use. Older ones don't, and must get plain ACKs back.
+				unsigned short packetSize = 0;
+				mPacketSize = 0;
+
+				if ((int)size - offset >= kSegmentSizeByteSize)
+				{
+					packetSize = wireLoad<uint16_t>(buff + offset);
+					mPacketSize = MIN(MAX((uint32_t)packetSize, (uint32_t)kPacketSize), mMaxPacketSize);
+					offset += kSegmentSizeByteSize;
+				}
+
+				// Versioned senders then list the features they support, and we
+				// use the ones we both have. Older senders get everything, as before.
+				uint32_t peerFeatures = mSupportedFeatures;
+				mPeerVersion = 0;
+
+				if (mPacketSize > 0)
+				{
+					getHandshakeOptions(buff + offset, size - offset, &mPeerVersion, &peerFeatures);
+				}
+
+				mFeatures = mSupportedFeatures & peerFeatures;
 
 				/*if (kRecvDebug)
 				{
-					cout<<"Received SYN for file '"<<fileName<<"'."<<endl;
+					*mLog<<"Received SYN for file '"<<fileName<<"'."<<endl;
 				}*/
 
-				cout<<"Receiving file '"<<fileName<<"' from "<<inet_ntoa(senderAddr->sin_addr)
+				*mLog<<"Receiving file '"<<fileName<<"' from "<<inet_ntoa(senderAddr->sin_addr)
 					<<" on port "<<dec<<ntohs(senderAddr->sin_port)<<"."<<endl;
 
-				if (!doesFileExist(fileName))
+				if (mPeerVersion > 0)
+				{
+					*mLog<<"Negotiated "<<describeFeatures(MIN(mPeerVersion, (uint8_t)kProtocolVersion), mFeatures)<<"."<<endl;
+				}
+				else
+				{
+					*mLog<<"Sender predates protocol versions, allowing "<<describeFeatures(0, mFeatures)<<"."<<endl;
+				}
+
+				// A stream buffer takes any name, since nothing is written to disk.
+				if (mSink != NULL || !doesFileExist(fileName))
 				{
 					// We have everything we need from the SYN.
 
 					if (kRecvDebug)
 					{
-						cout<<"Sending ACK..."<<endl;
+						*mLog<<"Sending ACK..."<<endl;
 					}
 
 					// Get the connection start time.
@@ -303,11 +835,21 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 					// Get the initial RTT start time.
 					gettimeofday(&mRttStartTime, NULL);
 
-					// Save sender data.
+					// Save sender data, and the other addresses its data may come from.
 					_SetSenderAddr(senderAddr, true);
+					mSenderPaths.clear();
+
+					if (mFeatures & FEATURE_MULTIPATH)
+					{
+						struct sockaddr_in paths[kRecvMaxPaths];
+						uint32_t pathCount = getPaths(buff + offset, size - offset, paths, kRecvMaxPaths);
+
+						mSenderPaths.assign(paths, paths + pathCount);
+						*mLog<<"Taking data from "<<dec<<pathCount<<" more sender addresses."<<endl;
+					}
 
 					// Save file name.
-					mFileName.assign(fileName);
+					mFileName.assign((mSink != NULL) ? fileName + 1 : fileName);
 
 					// Save total file size.
 					mFileSize = fileSize;
@@ -320,7 +862,48 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 					mCurrentState = RECV_DATA;
 
 					// Setup the DiskBuffer
-					mDiskBuffer = new DiskBuffer(mFileName, mFileSize, mLastAck);
+					if (mSink != NULL)
+					{
+						mDiskBuffer = new DiskBuffer(mSink, mFileSize, mLastAck);
+					}
+					else
+					{
+						mDiskBuffer = new DiskBuffer(mFileName, mFileSize, mLastAck);
+						mDiskBuffer->SetWriteMode(mWriteMode);
+
+						if (mWriterThread)
+						{
+							mDiskBuffer->EnableWriterThread();
+						}
+						else if (mUseIoUring)
+						{
+							mDiskBuffer->EnableIoUring(mSqPoll);
+						}
+					}
+
+					mDiskBuffer->SetTrace(mTrace);
+					mDiskBuffer->SetStageTimers(mStages);
+
+					// Take the data the SYN carries as the start of the file. It is
+					// only taken here, as the connection is set up, so a SYN sent
+					// again is answered without taking it twice. The SYN-ACK
+					// acknowledges it, so it must not be ACKed on its own.
+					if (mFeatures & FEATURE_EARLY_DATA)
+					{
+						char early[kMaxDatagramSize];
+						uint32_t earlyLength = getEarlyData(buff + offset, size - offset, early, sizeof(early));
+
+						if (earlyLength > 0 && earlyLength <= mFileSize)
+						{
+							Data data(mLastAck, (unsigned short)earlyLength, early);
+							bool deferAck = mDeferAck;
+
+							mDeferAck = true;
+							_AddData(data);
+							mDeferAck = deferAck;
+							mAckPending = false;
+						}
+					}
 
 					// Start SYN timeout thread.
 					mTransTimer->Start(true);
@@ -329,7 +912,7 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 				{
 					if (kRecvDebug)
 					{
-						cout<<"File already exists. Sending NACK..."<<endl;
+						*mLog<<"File already exists. Sending NACK..."<<endl;
 					}
 
 					// Get the connection start time.
@@ -338,23 +921,40 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 					// Get the initial RTT start time.
 					gettimeofday(&mRttStartTime, NULL);
 
+					// The NACK goes back to the sender like any ACK.
+					_SetSenderAddr(senderAddr, true);
+
 					mLastAck = seqNum;
-					this->mIsStarted = false;
 				}
 
 				// Send ACK.
+				mSynAck = true;
 				_SendAck(false);
+				mSynAck = false;
+
+				// Stop once a sender that was turned away has its NACK.
+				if (mCurrentState == RECV_NO_CONN)
+				{
+					this->mIsStarted = false;
+				}
 			}
 		}
 	}
-	// Check if we received a SYN previously (indicated by being in RECV_DATA state and 0 bytes received).
-	else if (mCurrentState == RECV_DATA && mTotalReceived == 0 && isEqualHost(mSenderAddr, senderAddr))
+	// Check if we received a SYN previously. Its SYN-ACK was lost, or it came
+	// again on its own, so answer it with the ACK we are at. Any data it carries
+	// was taken the first time.
+	else if ((mCurrentState == RECV_DATA || mCurrentState == RECV_FIN) && isEqualHost(mSenderAddr, senderAddr))
 	{
 		// Reset SYN timeout thread.
-		this->mTransTimer->Start(true);
+		if (mCurrentState == RECV_DATA && mTotalReceived == 0)
+		{
+			this->mTransTimer->Start(true);
+		}
 
 		// Resend ACK.
+		mSynAck = true;
 		_SendAck(true);
+		mSynAck = false;
 	}
 }
 
@@ -365,58 +965,171 @@ void Receiver::_ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 void Receiver::_ParseData(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum)
 {
 	// Check if we are talking to the right host.
-	if (isEqualHost(mSenderAddr, senderAddr))
+	if (_IsSender(senderAddr))
 	{
 		// Check if we are in the right state and if the ack # matches up
 		// with what we expect.
 		//if (mCurrentState == RECV_DATA && mLastAck == seqNum)
 		if (mCurrentState == RECV_DATA)
 		{
-			unsigned short fLength = 0;
+			unsigned short fLength = isWireSizeValid<DataPacket>(size) ? DataPacket::Length::Get(buff) : 0;
 
-			// Get length of data.
-			if (tryGetUShortFromMessage(buff, size, &fLength))
+			// Make sure the packet really holds as much data as it says.
+			if (isWireSizeValid<DataPacket>(size) && fLength <= size - DataPacket::kSize)
 			{
-				int offset = 2;
-
 				// Create object to hold data we received.
-				Data data(seqNum, fLength, buff + offset);
+				Data data(seqNum, fLength, buff + DataPacket::kSize);
+				uint64_t nextSeq = mDiskBuffer->GetNextSeq();
+
+				mStatDataReceived.Add();
+				mStatBytesReceived.Add(fLength);
+				traceEvent(mTrace, TRACE_PACKET, TRACE_PACKET_RECEIVED, fLength, seqNum, nextSeq);
+				PROBE3(recv_data, seqNum, fLength, nextSeq);
 
-				// Add the data.
-				if (mDiskBuffer->Add(data) > 0)
+				if (seqNum < nextSeq)
 				{
-					//mTotalReceived += fLength;
-					uint64_t buffAck = mDiskBuffer->GetNextSeq();
+					mStatDuplicates.Add();
+				}
 
-					// Check if the data was added in order. If it wasn't
-					// then the ack number in the disk buffer will be the
-					// same ack we have in this receiver object.
-					if (mLastAck < buffAck)
-					{
-						mTotalReceived += (buffAck - mLastAck);
+				// Let the FEC decoder keep a copy in case a later packet of the
+				// same block is lost.
+				if (mFecDecoder != NULL)
+				{
+					mFecDecoder->AddData(data);
+				}
 
-						// Update our ack number since we received data in order.
-						mLastAck = buffAck;
+				_AddData(data);
+				_RecoverData();
 
-						// Update RTT.
-						// Only update RTT for packets that have been transmitted once.
-						_UpdateRtt();
+				// Tell the sender which packet arrived when the ACK did not move,
+				// so it can tell a lost packet from a late one.
+				if ((mFeatures & FEATURE_SACK) && mDiskBuffer->GetNextSeq() == nextSeq)
+				{
+					if (mDeferAck)
+					{
+						mSackPending = seqNum;
+					}
+					else
+					{
+						_SendSack(seqNum);
+					}
+				}
 
-						// Start timer.
-						mTransTimer->Start(true, mTimeOutInterval);
+				if (seqNum > nextSeq)
+				{
+					mStatOutOfOrder.Add();
+					size_t depth = mDiskBuffer->GetOutOfSeqCount();
+					mStatOutOfOrderDepths.Record(depth);
 
-						_SendAck(false);
-					}
+					// Only the packet that opens a hole is worth recording at the lower level.
+					traceEvent(mTrace, (depth <= 1) ? TRACE_CONTROL : TRACE_PACKET, TRACE_OUT_OF_ORDER, (uint32_t)depth, seqNum, nextSeq);
 				}
+
+				mStatOutOfOrderDepth.Set((int64_t)mDiskBuffer->GetOutOfSeqCount());
 			}
 		}
 		/*else
 		{
-			cout << "Data was received out of order." << endl;
+			*mLog << "Data was received out of order." << endl;
 		}*/
 	}
 }
 
+/* Function: _ParseParity
+ * Desc: This function parses a PARITY packet from the sender. The parity is handed
+ * to the FEC decoder, which is created on the first parity packet, and any packet
+ * it can rebuild is added as if it had been received.
+ */
+void Receiver::_ParseParity(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum)
+{
+	if (_IsSender(senderAddr) && mCurrentState == RECV_DATA)
+	{
+		// Get the block length, stride and length parity.
+		if (isWireSizeValid<ParityPacket>(size))
+		{
+			unsigned short fCount = ParityPacket::Count::Get(buff);
+			unsigned short fStride = ParityPacket::Stride::Get(buff);
+			unsigned short fLengthXor = ParityPacket::LengthXor::Get(buff);
+			int offset = ParityPacket::kSize;
+
+			if (fStride > 0 && fStride <= size - offset)
+			{
+				if (mFecDecoder == NULL)
+				{
+					mFecDecoder = new FecDecoder(fStride);
+				}
+
+				mFecDecoder->AddParity(seqNum, fCount, fStride, fLengthXor, buff + offset);
+				mStatParityReceived.Add();
+				_RecoverData();
+			}
+		}
+	}
+}
+
+/* Function: _AddData
+ * Desc: This function adds received (or recovered) data to the disk buffer and
+ * acknowledges it if it moved the next expected sequence number forward.
+ */
+void Receiver::_AddData(Data &data)
+{
+	// Add the data.
+	if (mDiskBuffer->Add(data) > 0)
+	{
+		//mTotalReceived += fLength;
+		uint64_t buffAck = mDiskBuffer->GetNextSeq();
+
+		// Check if the data was added in order. If it wasn't
+		// then the ack number in the disk buffer will be the
+		// same ack we have in this receiver object.
+		if (mLastAck < buffAck)
+		{
+			mTotalReceived += (buffAck - mLastAck);
+
+			// Update our ack number since we received data in order.
+			mLastAck = buffAck;
+
+			// Update RTT.
+			// Only update RTT for packets that have been transmitted once.
+			_UpdateRtt();
+
+			// Start timer.
+			mTransTimer->Start(true, mTimeOutInterval);
+
+			if (mDeferAck)
+			{
+				mAckPending = true;
+			}
+			else
+			{
+				_SendAck(false);
+			}
+		}
+	}
+}
+
+/* Function: _RecoverData
+ * Desc: This function adds every packet the FEC decoder is able to rebuild.
+ */
+void Receiver::_RecoverData()
+{
+	if (mFecDecoder != NULL)
+	{
+		Data* data = NULL;
+
+		while ((data = mFecDecoder->Recover(mDiskBuffer->GetNextSeq())) != NULL)
+		{
+			if (kRecvDebug)
+			{
+				*mLog << "Recovered " << dec << data->mPacketSize << " bytes at sequence # " << data->mSeqNum << " from parity." << endl;
+			}
+
+			_AddData(*data);
+			mStatRecovered.Add();
+		}
+	}
+}
+
 /* Function: _ParseFin
  * Desc: This function parses a FIN packet from the sender and takes an appropriate action
  * based on its validity.
@@ -424,15 +1137,18 @@ void Receiver::_ParseData(struct sockaddr_in* senderAddr, char* buff, uint32_t s
 void Receiver::_ParseFin(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum)
 {
 	// Check if we are talking to the right host.
-	if (isEqualHost(mSenderAddr, senderAddr))
+	if (_IsSender(senderAddr))
 	{
 		// Check if we are in the right state and if the ack # matches up
 		// with what we expect.
 		if (mCurrentState == RECV_DATA && mLastAck == seqNum)
 		{
-			// Validate file.
-			if (mTotalReceived == mFileSize)
+			// Validate file. A stream of unknown length ends wherever the FIN
+			// is, and every byte before it has arrived.
+			if (mTotalReceived == mFileSize || mFileSize == kStreamUnknownSize)
 			{
+				mFileSize = mTotalReceived;
+
 				// Save sequence # + 1.
 				mLastAck = seqNum + 1;
 
@@ -455,17 +1171,30 @@ void Receiver::_ParseFin(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 				gettimeofday(&mConnEndTime, NULL);
 				double transTime = (((mConnEndTime.tv_sec * 1000000.0) + mConnEndTime.tv_usec) - ((mConnStartTime.tv_sec * 1000000.0) + mConnStartTime.tv_usec)) / 1000000.0;
 
-				cout.precision(4);
-				cout << "File received successfully!" << endl;
-				cout << "Time to receive was " << dec << transTime << " seconds at a rate of " << (transTime / mTotalReceived) << " seconds per byte." << endl;
-				cout << "Terminating in " << dec << (kRecvFinTimeOut / 1000) << " second..." << endl;
+				mLog->precision(4);
+				*mLog << "File received successfully!" << endl;
+				*mLog << "Time to receive was " << dec << transTime << " seconds at a rate of " << (transTime / mTotalReceived) << " seconds per byte." << endl;
+
+				if (mFecDecoder != NULL)
+				{
+					*mLog << "Packets recovered from parity: " << dec << mFecDecoder->GetRecoveredCount() << endl;
+				}
+
+				mStats.PrintSummary(*mLog);
+
+				if (mStages != NULL)
+				{
+					mStages->PrintSummary(*mLog);
+				}
+
+				*mLog << "Terminating in " << dec << (kRecvFinTimeOut / 1000) << " second..." << endl;
 			}
 			else
 			{
-				cout << "An error occurred while validiating the received file. The expected number of bytes received does not "
+				*mLog << "An error occurred while validiating the received file. The expected number of bytes received does not "
 					<< "match the actual number of bytes received." << endl;
-				cout << "Expected: " << dec << mFileSize << " bytes." << endl;
-				cout << "Received: " << dec << mTotalReceived << " bytes." << endl;
+				*mLog << "Expected: " << dec << mFileSize << " bytes." << endl;
+				*mLog << "Received: " << dec << mTotalReceived << " bytes." << endl;
 			}
 		}
 		else if (mCurrentState == RECV_FIN)
@@ -477,7 +1206,7 @@ void Receiver::_ParseFin(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 		}
 		else if (kRecvDebug)
 		{
-			cout << "Received FIN packet before all data was received." << endl;
+			*mLog << "Received FIN packet before all data was received." << endl;
 
 			// Reset timeout thread.
 			this->mTransTimer->Start(true);
@@ -488,6 +1217,21 @@ void Receiver::_ParseFin(struct sockaddr_in* senderAddr, char* buff, uint32_t si
 	}
 }
 
+/* Function: _ParseProbe
+ * Desc: This function answers a PROBE packet from the sender with the size of the
+ * datagram that arrived, telling the sender that size fits through the path.
+ */
+void Receiver::_ParseProbe(struct sockaddr_in* senderAddr, uint32_t size)
+{
+	if (isEqualHost(mSenderAddr, senderAddr) && mCurrentState == RECV_DATA)
+	{
+		char packet[PacketHeader::kSize];
+		ProbePacket::Code::Set(packet, PROBE);
+		ProbePacket::Size::Set(packet, size);
+		sendPacket(mSocket, mSenderAddr, packet, sizeof(packet), kRecvDebug);
+	}
+}
+
 /* Function: _SetSenderAddr
  * Desc: This function will set the sender variable for this instance to
  * the specified sender parameter. If the copy parameter is true, then
@@ -511,20 +1255,43 @@ void Receiver::_SetSenderAddr(struct sockaddr_in* senderAddr, bool copy)
 	}
 }
 
+/* Function: _IsSender
+ * Desc: This function returns true if the specified address is the sender's, the
+ * one its SYN came from or one of the others the SYN listed. ACKs only go to the
+ * first.
+ */
+bool Receiver::_IsSender(struct sockaddr_in* senderAddr)
+{
+	if (isEqualHost(mSenderAddr, senderAddr))
+	{
+		return true;
+	}
+
+	for (size_t i = 0; i < mSenderPaths.size(); i++)
+	{
+		if (isEqualHost(&mSenderPaths[i], senderAddr))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /* Function: _BuildAckPacket
- * Desc: This function builds an ACK packet in the specified packet parameter.
+ * Desc: This function builds an ACK packet in the specified packet parameter and
+ * returns its length. Until data starts flowing, ACKs to a sender that offered a
+ * datagram size also carry the size we agreed to, followed by our protocol
+ * version and features if the sender sent its own.
  */
-void Receiver::_BuildAckPacket(char packet[kAckPacketSize])
+uint32_t Receiver::_BuildAckPacket(char packet[kAckPacketMaxSize])
 {
 	//char* packet = new char[kAckPacketSize];
-	int offset = 1;
-	packet[0] = (char)ACK;
+	int offset = AckPacket::kSize;
+	AckPacket::Code::Set(packet, ACK);
 	
 	// Copy the ack # to packet.
-	setULongToMessage(packet + offset, kAckPacketSize - offset, mLastAck);
-
-	// Increase offset by 8-bytes for ack #.
-	offset += kSeqNumSize;
+	AckPacket::Ack::Set(packet, mLastAck);
 
 	uint32_t windowSize = 0;
 
@@ -537,7 +1304,21 @@ void Receiver::_BuildAckPacket(char packet[kAckPacketSize])
 	}
 
 	// Copy the window size to packet.
-	setUIntToMessage(packet + offset, kAckPacketSize - offset, windowSize);
+	AckPacket::Window::Set(packet, windowSize);
+
+	if (mPacketSize > 0 && (mSynAck || (mCurrentState == RECV_DATA && mTotalReceived == 0)))
+	{
+		AckPacket::SegmentSize::Set(packet, (uint16_t)mPacketSize);
+		offset = AckPacket::SegmentSize::kEnd;
+
+		// Answer a versioned SYN with our own version and features.
+		if (mPeerVersion > 0)
+		{
+			offset += setHandshakeOptions(packet + offset, kAckPacketMaxSize - offset, mSupportedFeatures);
+		}
+	}
+
+	return offset;
 }
 
 /* Function: _SendAck
@@ -548,9 +1329,19 @@ void Receiver::_SendAck(bool isRetransmit)
 	//if (mIsStarted && (mCurrentState == RECV_DATA || mCurrentState == RECV_FIN))
 	if (this->mIsStarted)
 	{
-		char packet[kAckPacketSize];
-		_BuildAckPacket(packet);
-		sendPacket(mSocket, mSenderAddr, packet, kAckPacketSize, kRecvDebug);
+		char packet[kAckPacketMaxSize];
+		uint32_t size = _BuildAckPacket(packet);
+
+		mAdvertisedWindow = AckPacket::Window::Get(packet);
+		mStatAcksSent.Add();
+		mStatWindow.Set(mAdvertisedWindow);
+		traceEvent(mTrace, TRACE_PACKET, TRACE_ACK_SENT, AckPacket::Window::Get(packet), mLastAck, isRetransmit ? 1 : 0);
+
+		// The receive loop submits queued ACKs along with its next wait.
+		if (!_QueueAck(packet, size))
+		{
+			sendPacket(mSocket, mSenderAddr, packet, size, kRecvDebug);
+		}
 	}
 
 	if (isRetransmit && !mLastAckRetransmit)
@@ -560,34 +1351,91 @@ void Receiver::_SendAck(bool isRetransmit)
 	}
 }
 
-/* Function: _UpdateRtt
- * Desc: This function updates the running estimated round trip time and deviation.
- * These values are used to calculate a new time out interval, which is also
- * updated. An update will only occur if there was no previous retransmission.
+/* Function: _SendSack
+ * Desc: This function sends the sender a SACK for the DATA packet at seqNum, which
+ * arrived without moving the ACK forward. It carries the current ACK and window too.
  */
-void Receiver::_UpdateRtt()
+void Receiver::_SendSack(uint64_t seqNum)
 {
-	// Check if we didn't retransmit.
-	if (!mLastAckRetransmit)
+	if (this->mIsStarted)
 	{
-		// Get the RTT end time.
-		gettimeofday(&mRttEndTime, NULL);
-		mTimeOutInterval = calculateTimeOutInterval(&mEstRtt, &mDevRtt, &mRttStartTime, &mRttEndTime);
+		char packet[kAckPacketMaxSize];
+		_BuildAckPacket(packet);
+		SackPacket::Code::Set(packet, SACK);
+		SackPacket::Received::Set(packet, seqNum);
+
+		mAdvertisedWindow = SackPacket::Window::Get(packet);
+		mStatSacksSent.Add();
+		mStatWindow.Set(mAdvertisedWindow);
 
-		// Check if we had a error condition for some reason.
-		if (mTimeOutInterval == 0)
+		if (!_QueueAck(packet, SackPacket::kSize))
 		{
-			mTimeOutInterval = kRecvDefaultTimeOut;
+			sendPacket(mSocket, mSenderAddr, packet, SackPacket::kSize, kRecvDebug);
 		}
 	}
-	// We retransmitted, so don't calculate RTT this time.
-	else
+}
+
+/* Function: _QueueAck
+ * Desc: This function queues an ACK on the io_uring backend if it is in use and the
+ * receive loop is the caller. If false is returned, the ACK was not queued and
+ * should be sent directly.
+ */
+bool Receiver::_QueueAck(char* packet, uint32_t size)
+{
+	// Impaired datagrams, including emulated drops, must all go through sendPacket.
+	if (mRing == NULL || !mQueueAcks || isImpaired())
 	{
-		mLastAckRetransmit = false;
+		return false;
 	}
 
+	for (int i = 0; i < kRecvRingAcks; i++)
+	{
+		AckSlot* slot = &mAckSlots[i];
+
+		if (!slot->mBusy)
+		{
+			memcpy(slot->mPacket, packet, size);
+			slot->mIov.iov_base = slot->mPacket;
+			slot->mIov.iov_len = size;
+
+			memset(&slot->mMsg, 0, sizeof(slot->mMsg));
+			slot->mMsg.msg_name = mSenderAddr;
+			slot->mMsg.msg_namelen = sizeof(*mSenderAddr);
+			slot->mMsg.msg_iov = &slot->mIov;
+			slot->mMsg.msg_iovlen = 1;
+
+			if (mRing->PrepareSendMsg(mSocket, &slot->mMsg, kRecvRingSlots + i))
+			{
+				slot->mBusy = true;
+				return true;
+			}
+
+			return false;
+		}
+	}
+
+	return false;
+}
+
+/* Function: _UpdateRtt
+ * Desc: This function feeds the time since the last ACK that moved forward to
+ * the estimator, which works out a new time out interval from it. The sample is
+ * skipped if an ACK was retransmitted in between, since there is no telling
+ * which one the data answered.
+ */
+void Receiver::_UpdateRtt()
+{
+	struct timeval fNow;
+	gettimeofday(&fNow, NULL);
+
+	int64_t fSample = (int64_t)(fNow.tv_sec - mRttStartTime.tv_sec) * kMicroSecond + (fNow.tv_usec - mRttStartTime.tv_usec);
+
+	mRto.AddSample((uint64_t)MAX(fSample, (int64_t)0), mLastAckRetransmit);
+	mTimeOutInterval = mRto.GetTimeOutMilliSeconds();
+	mLastAckRetransmit = false;
+
 	// Restart the RTT time.
-	gettimeofday(&mRttStartTime, NULL);
+	mRttStartTime = fNow;
 }
 
 /* Function: _AckTimeOut
@@ -602,26 +1450,52 @@ void Receiver::_AckTimeOut()
 	{
 		if (kRecvDebug)
 		{
-			cout << "ACK timeout!" << endl;
+			*mLog << "ACK timeout!" << endl;
 		}
 
 		// Make sure we are in right state and we haven't changed out ACK number.
 		if (mCurrentState == RECV_DATA && mLastAck == mDiskBuffer->GetNextSeq())
 		{
 			_SendAck(true);
+
+			// Back off, so a sender that has gone quiet is not flooded.
+			mRto.BackOff();
+			mTimeOutInterval = mRto.GetTimeOutMilliSeconds();
+			mTransTimer->SetTimerDelay(mTimeOutInterval);
 		}
-		else if (mCurrentState == RECV_FIN)
+		else if (mCurrentState == RECV_FIN && this->mIsStarted)
 		{
-			//cout << "Terminating after FIN timeout." << endl;
+			//*mLog << "Terminating after FIN timeout." << endl;
 			this->mIsStarted = false;
-			exit(EXIT_SUCCESS);
+			mTransTimer->Stop();
+
+			// Leave the final numbers in the JSON file and the trace before exiting.
+			if (mStatsExporter != NULL)
+			{
+				mStatsExporter->Stop();
+			}
+
+			if (mTrace != NULL)
+			{
+				mTrace->Stop();
+			}
+
+			// Wake the listen loop from its receive, so Start returns.
+			if (mOwnsSocket)
+			{
+				shutdown(mSocket, SHUT_RD);
+			}
+
+			mPacketLock.Unlock();
+			_Notify();
+			return;
 		}
 
 		mPacketLock.Unlock();
 	}
 	else if (kRecvDebug)
 	{
-		cout << "An ACK timeout occurred, but the packet lock could not be obtained." << endl;
+		*mLog << "An ACK timeout occurred, but the packet lock could not be obtained." << endl;
 	}
 }
 
@@ -11,7 +11,19 @@
 #include "Transmission.h"
 #include "TransmissionTimer.h"
 #include "DiskBuffer.h"
+#include "FecDecoder.h"
+#include "IoUring.h"
+#include "LowLatency.h"
+#include "RtoEstimator.h"
 #include "Mutex.h"
+#include "StageTimer.h"
+#include "Stats.h"
+#include "StreamBuffer.h"
+#include "Trace.h"
+
+#define kRecvRingSlots 8
+#define kRecvRingAcks 16
+#define kRecvMaxPaths 7 // Sender addresses taken from a SYN besides its own.
 
 using namespace std;
 
@@ -22,30 +34,95 @@ enum ReceiverState
 	RECV_FIN
 };
 
+/*! \struct RecvSlot
+    \brief A receive buffer posted to the io_uring backend.
+*/
+struct RecvSlot {
+	char				*mBuffer;
+	struct iovec		mIov;
+	struct msghdr		mMsg;
+	struct sockaddr_in	mAddr;
+	char				mControl[CMSG_SPACE(sizeof(int))];
+};
+
+/*! \struct AckSlot
+    \brief An ACK queued on the io_uring backend, kept until its send completes.
+*/
+struct AckSlot {
+	char				mPacket[kAckPacketMaxSize];
+	struct iovec		mIov;
+	struct msghdr		mMsg;
+	bool				mBusy;
+};
+
+/*! \class Receiver
+    \brief The main class of the receiving application.
+
+   Accepts one file from a sender and writes it to disk. Constructed with a
+   port, it binds its own socket and receives on the thread that calls Start.
+   Constructed with a socket and a StreamBuffer, it shares the socket with
+   other receivers: its owner hands it the datagrams from its sender through
+   Receive, and the data goes to the stream buffer for an application to read.
+   SetSink sends the data of a receiver with its own socket to a stream buffer
+   as well.
+*/
 class Receiver {
 	public:
 		Receiver(unsigned short port);
+		Receiver(int sock, StreamBuffer *sink);
 		virtual ~Receiver();
 		
-		void Start();
+		bool Start();
+		void Receive(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint32_t segmentSize);
+		void UpdateWindow();
+		ReceiverState GetState();
+		bool IsActive();
+		string GetFileName();
+		uint64_t GetFileSize();
+		void SetLog(ostream *log);
+		void SetNotify(void *caller, void (*notify)(void*));
+		void SetMaxPacketSize(uint32_t maxPacketSize);
+		void EnableIoUring(bool sqPoll);
+		void SetWriteMode(DiskWriteMode mode);
+		void SetSink(StreamBuffer *sink);
+		void RefuseEarlyData();
+		void EnableWriterThread();
+		void EnableStats(const char *jsonFile, unsigned short port);
+		void EnableTrace(const char *fileName, TraceLevel level);
+		void EnableStageTimers();
+		void EnableLowLatency(const char *cpus, uint32_t busyPoll, bool spin);
 	
 	private:
 		int _ConfigureSocket(unsigned short port);
 		void _StartRecvCheck();
+		void _StartRingRecvCheck();
+		void _PostRecv(RecvSlot *slot);
+		bool _QueueAck(char* packet, uint32_t size);
+		void _ParseDatagrams(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint32_t segmentSize);
 		void _ParseMessage(struct sockaddr_in* senderAddr, char* buff, uint32_t size);
 		void _ParseSyn(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum);
 		void _ParseData(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum);
 		void _ParseFin(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum);
-		void _BuildAckPacket(char packet[kAckPacketSize]);
+		void _ParseParity(struct sockaddr_in* senderAddr, char* buff, uint32_t size, uint64_t seqNum);
+		void _ParseProbe(struct sockaddr_in* senderAddr, uint32_t size);
+		void _AddData(Data &data);
+		void _RecoverData();
+		uint32_t _BuildAckPacket(char packet[kAckPacketMaxSize]);
 		void _SendAck(bool isRetransmit);
+		void _SendSack(uint64_t seqNum);
 		void _SetSenderAddr(struct sockaddr_in* senderAddr, bool copy);
+		bool _IsSender(struct sockaddr_in* senderAddr);
 		void _UpdateRtt();
 		void _AckTimeOut();
+		void _RegisterStats();
+		void _StartLowLatency();
+		void _Notify();
 
 		static void _TimeOutCallBack(void* caller);
 				
 		TransmissionTimer*	mTransTimer;
 		DiskBuffer			*mDiskBuffer;
+		FecDecoder			*mFecDecoder;
 		Mutex				mPacketLock;
 		
 		ReceiverState		mCurrentState;
@@ -53,17 +130,61 @@ class Receiver {
 		struct timeval		mConnStartTime;
 		struct timeval		mConnEndTime;
 		struct timeval		mRttStartTime;
-		struct timeval		mRttEndTime;
 		unsigned short		mPort;
 		struct sockaddr_in*	mSenderAddr;
+		vector<struct sockaddr_in>	mSenderPaths; // Other addresses the sender's data comes from, if multipath was negotiated.
 		int					mSocket;
 		uint64_t			mFileSize;
 		uint64_t			mTotalReceived;
 		uint64_t			mLastAck;
 		string				mFileName;
-		uint32_t			mEstRtt; // Estimated round trip time.
-		int					mDevRtt; // Deviation of round trip time.
-		uint32_t			mTimeOutInterval;
+		RtoEstimator		mRto; // Samples are the times between ACKs that moved forward.
+		uint32_t			mTimeOutInterval; // mRto's timeout in milliseconds.
 		bool				mLastAckRetransmit;
+		uint32_t			mMaxPacketSize; // Largest datagram we accept.
+		uint32_t			mPacketSize; // Datagram size agreed with the sender, 0 if it never offered one.
+		uint8_t				mPeerVersion; // Protocol version from the SYN, 0 if the sender predates versioning.
+		uint32_t			mFeatures; // ProtocolFeature bits both sides support.
+		uint32_t			mSupportedFeatures; // ProtocolFeature bits we offer, kRecvFeatures unless RefuseEarlyData was called.
+		bool				mSynAck; // The ACK being built answers a SYN, so it carries the handshake fields.
+		bool				mReceiveOffload; // Whether the kernel may hand us several datagrams at once.
+		bool				mDeferAck; // Set while a batch of datagrams is parsed, so it is ACKed once.
+		bool				mAckPending; // An ACK was held back by mDeferAck.
+		uint64_t			mSackPending; // DATA sequence number to SACK once the batch is parsed, 0 for none.
+		bool				mUseIoUring;
+		bool				mSqPoll;
+		IoUring				*mRing; // Socket ring, NULL when using the blocking calls.
+		AckSlot				mAckSlots[kRecvRingAcks];
+		bool				mQueueAcks; // Set while the receive loop parses, so ACKs go out on the ring.
+		DiskWriteMode		mWriteMode;
+		bool				mWriterThread; // Whether the DiskBuffer writes on its own thread.
+		string				mCpuSpec; // Cores to pin the threads to, as EnableLowLatency takes them, or empty.
+		uint32_t			mBusyPoll; // Microseconds the kernel busy polls the socket for, 0 for not at all.
+		bool				mSpin; // Whether the receive loop spins before it blocks.
+		AdaptiveSpin		mRecvSpin;
+
+		// Statistics. They are all updated under mPacketLock.
+		StatsRegistry		mStats;
+		StatsExporter		*mStatsExporter; // NULL unless EnableStats was called.
+		StatsCounter		mStatDataReceived;
+		StatsCounter		mStatBytesReceived;
+		StatsCounter		mStatDuplicates;
+		StatsCounter		mStatOutOfOrder;
+		StatsCounter		mStatParityReceived;
+		StatsCounter		mStatRecovered;
+		StatsCounter		mStatAcksSent;
+		StatsCounter		mStatSacksSent;
+		StatsGauge			mStatWindow;
+		StatsGauge			mStatOutOfOrderDepth;
+		StatsHistogram		mStatOutOfOrderDepths;
+		Trace				*mTrace; // NULL unless EnableTrace was called.
+		StageTimers			*mStages; // NULL unless EnableStageTimers was called.
+
+		StreamBuffer		*mSink; // Not owned. Takes the data in place of a file, or NULL.
+		bool				mOwnsSocket; // Whether mSocket was bound by Start, rather than shared.
+		uint32_t			mAdvertisedWindow; // Window in the last ACK sent.
+		ostream				*mLog; // Where progress is reported, cout unless SetLog was called.
+		void				*mNotifyCaller;
+		void				(*mNotify)(void*); // Called when data arrives in order or the state changes, or NULL.
 };
 #endif
@@ -0,0 +1,114 @@
+/*
+ * File: RtoEstimator.cpp
+ * Desc: Keeps the smoothed round trip time and its variation, and the
+ * retransmission timeout that follows from them, as RFC 6298 describes.
+ */
+#include "RtoEstimator.h"
+#include "Transmission.h"
+
+RtoEstimator::RtoEstimator(uint64_t initialTimeOut, uint64_t minTimeOut, uint64_t maxTimeOut)
+	: mSmoothedRtt(0), mRttVariation(0), mTimeOut(initialTimeOut), mMinTimeOut(minTimeOut),
+	  mMaxTimeOut(MAX(maxTimeOut, minTimeOut)), mBackOffCount(0)
+{
+	mTimeOut = MIN(MAX(mTimeOut, mMinTimeOut), mMaxTimeOut);
+}
+
+RtoEstimator::~RtoEstimator()
+{
+}
+
+/*!
+	\brief Takes a round trip sample and works out a new timeout from it,
+	which also ends any backoff.
+	\param rtt The time from sending a packet to its ACK, in microseconds.
+	\param retransmitted true if the packet was sent more than once, in which
+	case the sample is ignored.
+*/
+void RtoEstimator::AddSample(uint64_t rtt, bool retransmitted)
+{
+	if (retransmitted)
+	{
+		return;
+	}
+
+	// A sample of 0 would read as no sample at all.
+	rtt = MAX(rtt, (uint64_t)1);
+
+	if (mSmoothedRtt == 0)
+	{
+		mSmoothedRtt = rtt;
+		mRttVariation = rtt / 2;
+	}
+	else
+	{
+		// The variation is taken against the smoothed RTT from before this sample.
+		uint64_t fDifference = (mSmoothedRtt > rtt) ? mSmoothedRtt - rtt : rtt - mSmoothedRtt;
+
+		mRttVariation = (3 * mRttVariation + fDifference) / 4;
+		mSmoothedRtt = (7 * mSmoothedRtt + rtt) / 8;
+	}
+
+	mTimeOut = mSmoothedRtt + MAX((uint64_t)kRtoClockGranularity, 4 * mRttVariation);
+	mTimeOut = MIN(MAX(mTimeOut, mMinTimeOut), mMaxTimeOut);
+	mBackOffCount = 0;
+}
+
+/*!
+	\brief Doubles the timeout after it ran out, up to the maximum.
+*/
+void RtoEstimator::BackOff()
+{
+	if (GetTimeOut() < mMaxTimeOut)
+	{
+		mBackOffCount++;
+	}
+}
+
+/*!
+	\brief Returns the current timeout in microseconds, backoff included.
+*/
+uint64_t RtoEstimator::GetTimeOut()
+{
+	uint64_t fTimeOut = mTimeOut;
+
+	for (uint32_t i = 0; i < mBackOffCount && fTimeOut < mMaxTimeOut; i++)
+	{
+		fTimeOut *= 2;
+	}
+
+	return MIN(fTimeOut, mMaxTimeOut);
+}
+
+/*!
+	\brief Returns the current timeout rounded up to whole milliseconds, as
+	TransmissionTimer takes it.
+*/
+uint32_t RtoEstimator::GetTimeOutMilliSeconds()
+{
+	return (uint32_t)((GetTimeOut() + 999) / 1000);
+}
+
+/*!
+	\brief Returns the smoothed round trip time in microseconds, or 0 before
+	the first sample.
+*/
+uint64_t RtoEstimator::GetSmoothedRtt()
+{
+	return mSmoothedRtt;
+}
+
+/*!
+	\brief Returns the round trip time variation in microseconds.
+*/
+uint64_t RtoEstimator::GetRttVariation()
+{
+	return mRttVariation;
+}
+
+/*!
+	\brief Returns how many timeouts have run out since the last sample.
+*/
+uint32_t RtoEstimator::GetBackOffCount()
+{
+	return mBackOffCount;
+}
@@ -0,0 +1,54 @@
+/*
+ * File: RtoEstimator.h
+ * Desc: Keeps the smoothed round trip time and its variation, and the
+ * retransmission timeout that follows from them, as RFC 6298 describes.
+ */
+#ifndef _RTOESTIMATOR_H_
+#define _RTOESTIMATOR_H_
+
+#include <inttypes.h>
+
+#define kRtoInitialTimeOut 1000000 // Microseconds to wait before the first sample, as RFC 6298 suggests.
+#define kRtoMinTimeOut 5000 // Microseconds the timeout never goes below.
+#define kRtoMaxTimeOut 60000000 // Microseconds the timeout and its backoff never go above.
+#define kRtoClockGranularity 1000 // Microseconds, the resolution of TransmissionTimer.
+
+/*! \class RtoEstimator
+    \brief Retransmission timeout estimator in the style of RFC 6298.
+
+   Each round trip sample moves the smoothed RTT an eighth of the way towards
+   it and the variation a quarter of the way towards the difference, and the
+   timeout is the smoothed RTT plus four times the variation. Every timeout
+   doubles it until the next sample. Samples from a packet that was sent more
+   than once are ignored (Karn's rule), since there is no telling which copy
+   the ACK was for; a doubled timeout stays in place until a packet sent once
+   is acknowledged.
+
+   RFC 6298 asks for a 1 second floor, which is meant for ACKs delayed by up
+   to 500 ms. Nothing here delays ACKs, so the floor is configurable and
+   defaults to kRtoMinTimeOut. All times are in microseconds. It is not
+   thread safe.
+*/
+class RtoEstimator {
+	public:
+		RtoEstimator(uint64_t initialTimeOut = kRtoInitialTimeOut, uint64_t minTimeOut = kRtoMinTimeOut,
+			uint64_t maxTimeOut = kRtoMaxTimeOut);
+		virtual ~RtoEstimator();
+
+		void		AddSample(uint64_t rtt, bool retransmitted);
+		void		BackOff();
+		uint64_t	GetTimeOut();
+		uint32_t	GetTimeOutMilliSeconds();
+		uint64_t	GetSmoothedRtt();
+		uint64_t	GetRttVariation();
+		uint32_t	GetBackOffCount();
+
+	private:
+		uint64_t		mSmoothedRtt; // 0 until the first sample.
+		uint64_t		mRttVariation;
+		uint64_t		mTimeOut; // Before backing off.
+		uint64_t		mMinTimeOut;
+		uint64_t		mMaxTimeOut;
+		uint32_t		mBackOffCount; // Timeouts since the last sample.
+};
+#endif
@@ -3,358 +3,1891 @@
  *
  */
 #include "Sender.h"
+#include "Probes.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
 #include <fstream>
 
 using namespace std;
 
-#define error(s) { cerr<<"Error: "<<(s); exit(1); }
+#define error(s) { cerr<<"Error: "<<(s)<<endl; return -1; }
 #define kSendDefaultTimeOut 200
-#define kSendDefaultMss 4800 // 4 packets
-#define kSendMaxMss 16800 // 14 packets
-//#define kSendMaxMss 30000 // 25 packets
+#define kSendInitialWindowPackets 4
+#define kSendMaxWindowPackets 14
+//#define kSendMaxWindowPackets 25
+#define kSendProbeMinFileSize 65536 // Smaller files are over before probing pays off.
+#define kSendBlackHoleTimeOuts 3 // Timeouts in a row before giving up on a probed size.
 #define kSendSynSeqNum 0
 #define kSendSynAckSeqNum 1
 #define kSendDebug 0
 
-void printUsage();
+/* Sets up opening the file and setting the mFileSize correctly. If the file is not found,
+ * Start reports it and returns false.
+ */
+Sender::Sender(char fileName[], sockaddr_in* recv)
+	: Sender(fileName, NULL, 0, recv)
+{
+	mFile.open(mFileName.c_str(), ios::in | ios::binary);
+
+	if (mFile.is_open())
+	{
+		mFile.seekg(0, ios::end);
+		mFileSize = (uint64_t)mFile.tellg();
+		mFile.seekg(0, ios::beg);
+	}
+}
+
+/* Sends size bytes that an application writes to source, under the given name,
+ * instead of a file. The data is read from source as the window allows and
+ * released once it is acknowledged. Call Wake after writing so the send
+ * thread picks the new data up. A size of kStreamUnknownSize sends everything
+ * written until EndStream is called. Also the constructor will setup the Send
+ * and Timer thread.
+ */
+Sender::Sender(const char *name, StreamBuffer *source, uint64_t size, sockaddr_in* recv)
+	: mFileName(name), mRecv(recv), mLastAck(0), mFileSize(size), mSock(-1),
+	  mSendThread(_StartSend, this),
+	  mCurrentState(SEND_NO_CONN), mConnected(false), mFileOffset(0),
+	  mWindowSize(kSendInitialWindowPackets * kPacketSize), mCongWin(kSendInitialWindowPackets * kPacketSize), mRecvWin(0),
+	  mTheTimeout(kSendDefaultTimeOut), mRto(kSendDefaultTimeOut * 1000), mFecEncoder(NULL),
+	  mSeqNumBase(kSendSynAckSeqNum), mNextSeqNum(kSendSynAckSeqNum),
+	  mPayloadSize(kPacketSize - kDataPacketSize), mPacketSize(kPacketSize), mMaxPacketSize(kPacketSize),
+	  mProbe(false), mProbeTarget(0), mProbeAcked(0), mTimeOutCount(0), mFecBlockSize(0), mMFBOut(NULL),
+	  mSegmentOffload(false), mSegmentBuff(NULL), mSegmentLength(0), mSegmentCount(0),
+	  mUseIoUring(false), mSqPoll(false), mRing(NULL), mFileFd(-1), mSlotData(NULL), mNextSlot(0),
+	  mUseReadAhead(false), mReadAhead(NULL), mHighSeqNum(kSendSynAckSeqNum),
+	  mEarlyData(false), mEarlySeqNum(kSendSynAckSeqNum),
+	  mUseLossDetection(true), mLoss(NULL), mLossTimer(NULL), mTailProbe(false), mRecoverySeqNum(0),
+	  mStats("relsend"), mStatsExporter(NULL), mTrace(NULL), mTracedCongWin(0), mStages(NULL),
+	  mSource(source), mUnknownSize(source != NULL && size == kStreamUnknownSize), mLog(&cout), mNotifyCaller(NULL), mNotify(NULL),
+	  mMFBIn(NULL), mReceivedSlots(NULL), mReceived(NULL), mFreeReceived(NULL), mSendDue(true), mSendSleeping(false), mWantData(false),
+	  mWakePending(false), mTimeOutPending(false), mLossTimeOutPending(false), mStopPending(false),
+	  mStreamEnd(kStreamUnknownSize), mAckTicks(0), mBusyPoll(0), mSpin(false), mPaths(NULL)
+{
+	// Keep firing every mTheTimeout until an ACK restarts the timer, so that
+	// repeated losses keep getting retransmitted.
+	mTransTimer = new TransmissionTimer(mTheTimeout, kTransmissionTimerInfiniteInterval, (void*)this, Sender::_TimeOutCallBack);
+}
+
+/* Stops a transfer that is still running. Start must have returned first.
+ */
+Sender::~Sender()
+{
+	// The timer threads call back into this object until they are gone.
+	delete mTransTimer;
+	delete mLossTimer;
+	delete mLoss;
+	mFile.close();
+	delete mFecEncoder;
+	delete [] mMFBOut;
+	delete [] mSegmentBuff;
+	delete mRing;
+	delete [] mSlotData;
+	delete mReadAhead;
+	delete mStatsExporter;
+	delete mTrace;
+	delete mStages;
+	delete mReceived;
+	delete mFreeReceived;
+	delete [] mReceivedSlots;
+	delete mPaths;
+
+	if (mFileFd >= 0)
+	{
+		close(mFileFd);
+	}
+
+	if (mSock >= 0)
+	{
+		close(mSock);
+	}
+}
+
+/* Turns on forward error correction. A parity packet is sent after every
+ * block of at most maxBlockSize DATA packets so the receiver can rebuild one
+ * lost packet per block instead of waiting for a timeout. Must be called
+ * before Start.
+ */
+void Sender::EnableFec(unsigned short maxBlockSize)
+{
+	// The encoder is created once the datagram size for the connection is known.
+	mFecBlockSize = maxBlockSize;
+}
+
+/* Sets the largest datagram this sender will use. The size is offered to the
+ * receiver in the SYN, and the connection runs at the smaller of the two
+ * offers. If probe is set, the connection starts at kPacketSize and the path
+ * is probed with don't-fragment datagrams up to the negotiated size, keeping
+ * the largest size that is echoed back. Must be called before Start.
+ */
+void Sender::SetMaxPacketSize(uint32_t maxPacketSize, bool probe)
+{
+	mMaxPacketSize = MIN(MAX(maxPacketSize, (uint32_t)kPacketSize), (uint32_t)kMaxDatagramSize);
+	mProbe = probe;
+}
+
+/* Sends runs of consecutive DATA packets with one UDP_SEGMENT send each, so
+ * the kernel builds the datagrams instead of the send loop making a system
+ * call per packet. Has no effect if the kernel does not support it. Must be
+ * called before Start.
+ */
+void Sender::EnableSegmentOffload()
+{
+	mSegmentOffload = true;
+}
+
+/* Sends DATA packets through io_uring. Each packet gets its own buffer slot,
+ * the file read and the send for it are linked so the send only goes out once
+ * the read filled the slot, and the whole window is submitted with one system
+ * call. With sqPoll a kernel thread picks up the submissions. Falls back to the
+ * blocking calls if the kernel does not support io_uring. Must be called
+ * before Start.
+ */
+void Sender::EnableIoUring(bool sqPoll)
+{
+	mUseIoUring = true;
+	mSqPoll = sqPoll;
+}
+
+/* Reads the file on a separate thread into a ring of large chunks ahead of the
+ * send window, so a slow read never holds up the send loop, which only copies
+ * from memory. With io_uring the ring still sends the packets, but their data
+ * comes from the chunks. Falls back to reading in the send loop if the reader
+ * cannot be started. Must be called before Start.
+ */
+void Sender::EnableReadAhead()
+{
+	mUseReadAhead = true;
+}
+
+/* Publishes the transfer statistics while the transfer runs: rewritten as JSON
+ * to jsonFile, if not NULL, and served in the Prometheus text format on
+ * 127.0.0.1:port, if port is not 0. The end of transfer summary is printed
+ * either way. Must be called before Start.
+ */
+void Sender::EnableStats(const char *jsonFile, unsigned short port)
+{
+	delete mStatsExporter;
+	mStatsExporter = new StatsExporter(&mStats, jsonFile, port);
+}
+
+/* Records protocol events to fileName as a binary trace, at the detail given
+ * by level. Must be called before Start.
+ */
+void Sender::EnableTrace(const char *fileName, TraceLevel level)
+{
+	delete mTrace;
+	mTrace = new Trace(fileName, level, TRACE_SENDER);
+}
+
+/* Times each stage a packet goes through on the send and listen threads, and
+ * prints the percentiles of each when the transfer ends. Must be called before
+ * Start.
+ */
+void Sender::EnableStageTimers()
+{
+	delete mStages;
+	mStages = new StageTimers();
+}
+
+/* Sends the start of the data with the SYN, and the rest of the first window
+ * behind it, without waiting for the SYN-ACK. A file that fits goes out with
+ * its FIN and is done in one round trip. A receiver that refuses the data, or
+ * predates it, ACKs only the SYN and the data is sent again from there. Must
+ * be called before Start.
+ */
+void Sender::EnableEarlyData()
+{
+	mEarlyData = true;
+}
+
+/* Finds lost packets only by the retransmission timeout, as senders did
+ * before SACKs. Otherwise a packet is sent again as soon as one sent after it
+ * arrives and it is still missing a reordering window later, and the last
+ * packet is probed when its ACK is overdue. Must be called before Start.
+ */
+void Sender::DisableLossDetection()
+{
+	mUseLossDetection = false;
+}
+
+/* Trades CPU time for a shorter wait between an ACK arriving and the send it
+ * allows. cpus, if not NULL, pins the threads: a list of cores such as "2-3",
+ * the name of the interface to use the cores on the NUMA node of, or "auto"
+ * for the interface that routes to the receiver. The listen thread, which is
+ * the one that calls Start, and the send thread get a core each when there
+ * are two or more. busyPoll, if not 0, has the kernel poll the device for that
+ * many microseconds before the listen thread sleeps. spin has the listen and
+ * send threads spin on their next event before they block, backing off to
+ * blocking while the waits keep outlasting the spin; it needs two cores or
+ * more, or it only delays the thread being waited for. Must be called before
+ * Start.
+ */
+void Sender::EnableLowLatency(const char *cpus, uint32_t busyPoll, bool spin)
+{
+	mCpuSpec = (cpus != NULL) ? cpus : "";
+	mBusyPoll = busyPoll;
+	mSpin = spin;
+}
+
+/* Stripes the data over another path as well as the socket Start opens,
+ * for hosts with several interfaces or receivers with several addresses.
+ * local is the address to send from, or NULL for the one the route picks,
+ * and remote the address to send to, or NULL for the receiver's; the port is
+ * always the receiver's. impairment, if not NULL, emulates the path in place
+ * of the one setImpairment set, and is not owned. Each path keeps its own
+ * congestion window and round trip time, and each packet goes on the path
+ * it would arrive soonest by. The receiver is told the paths in the SYN,
+ * and a receiver that does not take them gets everything on one path. DATA
+ * packets are then sent one at a time, without segmentation offload or
+ * io_uring. Up to kPathMaxPaths - 1 paths may be added. Must be called
+ * before Start.
+ */
+void Sender::AddPath(const struct sockaddr_in *local, const struct sockaddr_in *remote, Impairment *impairment)
+{
+	PathConfig fConfig;
+
+	memset(&fConfig, 0, sizeof(fConfig));
+	fConfig.mLocal.sin_family = AF_INET;
+	fConfig.mLocal.sin_addr.s_addr = INADDR_ANY;
+	fConfig.mRemote = fConfig.mLocal;
+	fConfig.mImpairment = impairment;
+
+	if (local != NULL)
+	{
+		fConfig.mLocal.sin_addr = local->sin_addr;
+	}
+
+	if (remote != NULL)
+	{
+		fConfig.mRemote.sin_addr = remote->sin_addr;
+	}
+
+	mPathConfigs.push_back(fConfig);
+}
+
+/* Names the statistics the send and listen paths keep.
+ */
+void Sender::_RegisterStats()
+{
+	mStats.Add("data_packets_sent", "DATA packets sent, including retransmissions.", &mStatDataSent);
+	mStats.Add("data_bytes_sent", "File bytes sent in DATA packets, including retransmissions.", &mStatBytesSent);
+	mStats.Add("retransmitted_packets", "DATA packets sent again.", &mStatRetransmits);
+	mStats.Add("parity_packets_sent", "PARITY packets sent.", &mStatParitySent);
+	mStats.Add("acks_received", "ACKs received.", &mStatAcksReceived);
+	mStats.Add("duplicate_acks_received", "ACKs that did not move the window forward.", &mStatDupAcks);
+	mStats.Add("timeouts", "Retransmission timeouts.", &mStatTimeOuts);
+	mStats.Add("rack_losses", "Packets found lost by a later packet arriving, without a timeout.", &mStatLosses);
+	mStats.Add("tail_loss_probes", "Probes sent because the ACK for the last packets was overdue.", &mStatTailProbes);
+	mStats.Add("congestion_window_bytes", "Congestion window.", &mStatCongWin);
+	mStats.Add("send_window_bytes", "Window in use, the smaller of the congestion and receiver windows.", &mStatWindow);
+	mStats.Add("receiver_window_bytes", "Window last advertised by the receiver.", &mStatRecvWin);
+	mStats.Add("retransmission_timeout_milliseconds", "Current retransmission timeout.", &mStatTimeOut);
+	mStats.Add("rtt_microseconds", "Round trip time samples from ACKs of data sent once.", &mStatRtt);
+}
+
+/* Pins the listen thread and the timers, and turns on busy polling, as
+ * EnableLowLatency asked. The send thread is pinned once it is started. The
+ * timers seldom fire, so they share the last core.
+ * Returns the core for the send thread, or -1 to leave it be.
+ */
+int Sender::_StartLowLatency()
+{
+	vector<int> fCpus;
+
+	if (mBusyPoll > 0 && !setBusyPoll(mSock, mBusyPoll))
+	{
+		*mLog<<"Unable to busy poll the socket."<<endl;
+	}
+
+	if (!mCpuSpec.empty() && !getLowLatencyCpus(mCpuSpec.c_str(), mRecv, &fCpus))
+	{
+		*mLog<<"Unable to pin the threads to '"<<mCpuSpec<<"'."<<endl;
+	}
+
+	// Unpinned threads run on any core the process may use.
+	vector<int> fSpinCpus = fCpus;
+
+	if (fSpinCpus.empty())
+	{
+		getAllowedCpus(&fSpinCpus);
+	}
+
+	if (mSpin && fSpinCpus.size() < 2)
+	{
+		*mLog<<"Spinning needs two cores or more, blocking instead."<<endl;
+		mSpin = false;
+	}
+
+	if (fCpus.empty())
+	{
+		return -1;
+	}
+
+	pinThread(pthread_self(), fCpus[1 % fCpus.size()]);
+	mTransTimer->SetAffinity(fCpus.back());
+
+	if (mLossTimer != NULL)
+	{
+		mLossTimer->SetAffinity(fCpus.back());
+	}
+
+	return fCpus[0];
+}
+
+/* Opens a socket for each path AddPath was given, beside mSock. A path that
+ * cannot be opened is left out, and with none left the transfer has one path.
+ */
+void Sender::_OpenPaths()
+{
+	if (mPathConfigs.empty())
+	{
+		return;
+	}
+
+	mPaths = new PathScheduler(mSock, mRecv, kSendDefaultTimeOut * 1000);
+
+	for (size_t i = 0; i < mPathConfigs.size(); i++)
+	{
+		PathConfig *fConfig = &mPathConfigs[i];
+
+		if (!mPaths->Open(&fConfig->mLocal, &fConfig->mRemote, fConfig->mImpairment))
+		{
+			*mLog<<"Unable to send from "<<inet_ntoa(fConfig->mLocal.sin_addr)<<", leaving that path out."<<endl;
+		}
+	}
+
+	if (mPaths->GetCount() < 2)
+	{
+		delete mPaths;
+		mPaths = NULL;
+	}
+}
+
+
+// ***********************************************************************************
+
+/* Connects and sends the file or stream, and returns once the receiver has
+ * acknowledged all of it, turned it away or Stop was called. ACKs are received
+ * on the calling thread.
+ * Returns true if everything was acknowledged.
+ */
+bool Sender::Start()
+{
+	//initialize class members to values passed in as parameters
+	if (mSource == NULL && !mFile.is_open())
+	{
+		*mLog<<"Unable to open '"<<mFileName<<"'."<<endl;
+		return false;
+	}
+
+	// Set the expected sequence number we should have when are are done. A
+	// stream of unknown length has none until EndStream gives it one.
+	mFinSeqNum = (mFileSize == kStreamUnknownSize) ? kStreamUnknownSize : mFileSize + 2;
+	mMFBOut = new char[mMaxPacketSize];
+
+	// Every slot starts out free for the listen thread to receive into.
+	mReceivedSlots = new ReceivedSlot[kSendReceivedSlots];
+	mReceived = new SpscQueue(kSendReceivedSlots);
+	mFreeReceived = new SpscQueue(kSendReceivedSlots);
+
+	for (uint32_t i = 0; i < kSendReceivedSlots; i++)
+	{
+		mFreeReceived->Push(i);
+	}
+
+	mSock = _ConfigureSocket();
+
+	if (mSock < 0)
+	{
+		return false;
+	}
+
+	_OpenPaths();
+	_RegisterStats();
+
+	mLoss = new LossDetector();
+
+	if (mUseLossDetection)
+	{
+		mLossTimer = new TransmissionTimer(kLossMinProbeTimeOut / 1000, kTransmissionTimerInfiniteInterval, (void*)this, Sender::_LossTimeOutCallBack);
+	}
+
+	int fSendCpu = _StartLowLatency();
+
+	if (mStatsExporter != NULL && !mStatsExporter->Start())
+	{
+		*mLog<<"Unable to publish statistics."<<endl;
+		delete mStatsExporter;
+		mStatsExporter = NULL;
+	}
+
+	if (mTrace != NULL && !mTrace->Start())
+	{
+		*mLog<<"Unable to start the trace."<<endl;
+		delete mTrace;
+		mTrace = NULL;
+	}
+
+	// Each DATA packet picks its own path, so none are sent together.
+	if (mPaths != NULL)
+	{
+		mSegmentOffload = false;
+		mUseIoUring = false;
+	}
+
+	if (mSegmentOffload)
+	{
+		mSegmentOffload = isSegmentOffloadSupported(mSock);
+
+		if (mSegmentOffload)
+		{
+			mSegmentBuff = new char[kMaxDatagramSize];
+		}
+		else
+		{
+			*mLog<<"UDP segmentation offload is not available, sending one packet at a time."<<endl;
+		}
+	}
+
+	// A stream has no file for the reader thread or the ring to read.
+	if (mSource != NULL)
+	{
+		mUseReadAhead = false;
+		mUseIoUring = false;
+	}
+
+	if (mUseReadAhead)
+	{
+		mReadAhead = new ReadAhead(mFileName, mFileSize);
+
+		if (!mReadAhead->Start())
+		{
+			*mLog<<"Unable to start reading ahead, reading in the send loop."<<endl;
+			delete mReadAhead;
+			mReadAhead = NULL;
+		}
+	}
+
+	// Impaired datagrams, including emulated drops, must all go through sendPacket.
+	if (mUseIoUring && !isImpaired())
+	{
+		// Every slot may have its read and send complete at once.
+		mRing = new IoUring(kSendRingSlots * 2, mSqPoll);
+		mFileFd = open(mFileName.c_str(), O_RDONLY);
+
+		if (!mRing->IsValid() || mFileFd < 0)
+		{
+			*mLog<<"io_uring is not available, using blocking calls."<<endl;
+			delete mRing;
+			mRing = NULL;
+		}
+		else
+		{
+			int fFiles[2] = { mSock, mFileFd };
+			mRing->RegisterFiles(fFiles, 2);
+
+			// One registered buffer holds every slot, so file reads can use it directly.
+			mSlotData = new char[kSendRingSlots * mMaxPacketSize];
+			struct iovec fBuffer;
+			fBuffer.iov_base = mSlotData;
+			fBuffer.iov_len = kSendRingSlots * mMaxPacketSize;
+			mRing->RegisterBuffers(&fBuffer, 1);
+
+			for (int i = 0; i < kSendRingSlots; i++)
+			{
+				SendSlot *fSlot = &mSlots[i];
+				fSlot->mBuffer = mSlotData + (i * mMaxPacketSize);
+				fSlot->mBusy = false;
+				fSlot->mIov.iov_base = fSlot->mBuffer;
+				memset(&fSlot->mMsg, 0, sizeof(fSlot->mMsg));
+				fSlot->mMsg.msg_name = mRecv;
+				fSlot->mMsg.msg_namelen = sizeof(*mRecv);
+				fSlot->mMsg.msg_iov = &fSlot->mIov;
+				fSlot->mMsg.msg_iovlen = 1;
+			}
+		}
+	}
+
+	mSendThread.Start();
+
+	if (fSendCpu >= 0)
+	{
+		mSendThread.SetAffinity(fSendCpu);
+	}
+
+	_StartListen();
+
+	// Let the send thread see that the connection is closed, then stop the timer.
+	_WakeSendThread();
+	mSendThread.Join();
+	mTransTimer->Stop();
+
+	if (mLossTimer != NULL)
+	{
+		mLossTimer->Stop();
+	}
+
+	return mLastAck == mFinSeqNum;
+}
+
+/* Gives up on the transfer from another thread. Start returns soon after.
+ */
+void Sender::Stop()
+{
+	_PostEvent(&mStopPending);
+}
+
+/* Tells the send thread that more data was written to the stream buffer, so
+ * it sends what the window allows. Does nothing until data is being sent or
+ * while the window is full, so the send thread only wakes when it has
+ * something to send.
+ */
+void Sender::Wake()
+{
+	_PostEvent(&mWakePending);
+}
+
+/* Ends a stream started with kStreamUnknownSize bytes after everything written
+ * to the source so far, so the FIN follows the last of it. May be called
+ * before Start.
+ */
+void Sender::EndStream()
+{
+	if (mUnknownSize)
+	{
+		uint64_t fEnd = kStreamUnknownSize;
+
+		// Only the first call counts, as only the first ended the stream before.
+		__atomic_compare_exchange_n(&mStreamEnd, &fEnd, mSource->GetEnd(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		_WakeSendThread();
+	}
+}
+
+/* Returns how far the transfer has got.
+ */
+SenderState Sender::GetState()
+{
+	return __atomic_load_n(&mCurrentState, __ATOMIC_ACQUIRE);
+}
+
+/* Sends the progress messages and the end of transfer summary to log instead
+ * of cout. An ostream without a buffer discards them. Must be called before
+ * Start.
+ */
+void Sender::SetLog(ostream *log)
+{
+	mLog = log;
+}
+
+/* Has notify called with caller, on the send or listen thread, whenever the
+ * state changes or data is acknowledged, which frees room in the stream
+ * buffer. notify must not call back into the Sender. Must be called before
+ * Start.
+ */
+void Sender::SetNotify(void *caller, void (*notify)(void*))
+{
+	mNotifyCaller = caller;
+	mNotify = notify;
+}
+
+/* Marks the connection closed and wakes the listen thread by shutting the
+ * socket down, which ends its receive. The send thread stops once it is back
+ * in its loop. Call on the send thread.
+ */
+void Sender::_Close()
+{
+	mConnected = false;
+	_SetState(SEND_CLOSED);
+
+	if (mSock >= 0)
+	{
+		shutdown(mSock, SHUT_RDWR);
+	}
+
+	_Notify();
+}
+
+/* Calls the function given to SetNotify, if any.
+ */
+void Sender::_Notify()
+{
+	if (mNotify != NULL)
+	{
+		mNotify(mNotifyCaller);
+	}
+}
+
+void *Sender::_StartSend(void *args)
+{
+	// Args points to this object.
+	Sender *fSender = (Sender*)args;
+
+	if (fSender != NULL)
+	{
+		*fSender->mLog<<"Sending file '"<<fSender->mFileName<<"' to "<<inet_ntoa(fSender->mRecv->sin_addr)
+			<<" on port "<<dec<<ntohs(fSender->mRecv->sin_port)<<"."<<endl;
+
+		// Get the connection start time.
+		gettimeofday(&(fSender->mConnStartTime), NULL);
+
+		do
+		{
+			bool fParsed = fSender->_HandleEvents();
+			bool fSent = fSender->mSendDue && fSender->mCurrentState != SEND_CLOSED;
+
+			if (fSent)
+			{
+				fSender->mSendDue = false;
+				fSender->_SendCurrent();
+				fSender->mTransTimer->Start(true, fSender->mTheTimeout);
+
+				// A timeout that fired while sending was for the timer just restarted.
+				__atomic_store_n(&fSender->mTimeOutPending, false, __ATOMIC_SEQ_CST);
+			}
+
+			// The loss timer follows every send and ACK, but only once the
+			// packets are out, since setting it wakes the timer's thread.
+			if (fSender->mLossTimer != NULL && (fSent || fParsed))
+			{
+				fSender->_ArmLossTimer();
+				__atomic_store_n(&fSender->mLossTimeOutPending, false, __ATOMIC_SEQ_CST);
+			}
+
+			fSender->_WaitForEvents();
+		}
+		while (fSender->mCurrentState != SEND_CLOSED);
+	}
+
+	return NULL;
+}
+
+/* Parses the datagrams the listen thread has handed over, then acts on the
+ * events other threads have raised since the last call. Whatever calls for a
+ * send sets mSendDue. Call on the send thread.
+ * Returns true if any datagram was parsed.
+ */
+bool Sender::_HandleEvents()
+{
+	uint32_t fIndex = 0;
+	bool fParsed = false;
+
+	while (mReceived->Pop(&fIndex))
+	{
+		ReceivedSlot *fSlot = &mReceivedSlots[fIndex];
+
+		mMFBIn = fSlot->mBuffer;
+		*mRecv = fSlot->mFrom;
+		mAckTicks = fSlot->mReceivedTicks;
+
+		if (mMFBIn[0] == (char)PROBE)
+		{
+			_ParseProbe(fSlot->mSize);
+		}
+		else
+		{
+			ScopedStageTimer fParse(mStages, STAGE_ACK_PARSE);
+			_ParseAck(fSlot->mSize);
+		}
+
+		mFreeReceived->Push(fIndex);
+		fParsed = true;
+	}
+
+	if (__atomic_exchange_n(&mStopPending, false, __ATOMIC_SEQ_CST) && mCurrentState != SEND_CLOSED)
+	{
+		_Close();
+	}
+
+	uint64_t fStreamEnd = __atomic_load_n(&mStreamEnd, __ATOMIC_ACQUIRE);
+
+	if (fStreamEnd != kStreamUnknownSize && mFileSize == kStreamUnknownSize)
+	{
+		mFileSize = fStreamEnd;
+		mFinSeqNum = mFileSize + 2;
+
+		if (mCurrentState == SEND_DATA)
+		{
+			mSendDue = true;
+		}
+	}
+
+	// Data written while the window is full is sent as ACKs open it.
+	if (__atomic_exchange_n(&mWakePending, false, __ATOMIC_SEQ_CST)
+		&& mCurrentState == SEND_DATA && mNextSeqNum - mSeqNumBase + mPayloadSize <= mWindowSize)
+	{
+		mSendDue = true;
+	}
+
+	if (__atomic_exchange_n(&mTimeOutPending, false, __ATOMIC_SEQ_CST))
+	{
+		_Retransmit();
+	}
+
+	if (__atomic_exchange_n(&mLossTimeOutPending, false, __ATOMIC_SEQ_CST) && mLossTimer != NULL)
+	{
+		_LossTimeOut();
+	}
+
+	return fParsed;
+}
+
+/* Returns true if the send thread has something to do: a datagram to parse,
+ * an event to act on, or a closed connection to leave. A Wake only counts
+ * while there is room in the window for the data it announces.
+ */
+bool Sender::_HasEvents()
+{
+	return __atomic_load_n(&mCurrentState, __ATOMIC_ACQUIRE) == SEND_CLOSED
+		|| mReceived->GetSize() > 0
+		|| __atomic_load_n(&mStopPending, __ATOMIC_SEQ_CST)
+		|| __atomic_load_n(&mTimeOutPending, __ATOMIC_SEQ_CST)
+		|| __atomic_load_n(&mLossTimeOutPending, __ATOMIC_SEQ_CST)
+		|| (mFileSize == kStreamUnknownSize && __atomic_load_n(&mStreamEnd, __ATOMIC_SEQ_CST) != kStreamUnknownSize)
+		|| (mWantData && __atomic_load_n(&mWakePending, __ATOMIC_SEQ_CST));
+}
+
+/* Puts the send thread to sleep on mSendLock until another thread raises an
+ * event. mSendSleeping is set before the last look for events and the other
+ * threads set their event before looking at it, so one side always sees the
+ * other and no wake up is lost. Call on the send thread.
+ */
+void Sender::_WaitForEvents()
+{
+	mWantData = mCurrentState == SEND_DATA && mNextSeqNum - mSeqNumBase + mPayloadSize <= mWindowSize;
+	mAckTicks = 0;
+
+	if (mSpin && mSendSpin.Spin(_HasEventsCallBack, this))
+	{
+		return;
+	}
+
+	mSendLock.Lock();
+
+	for (;;)
+	{
+		__atomic_store_n(&mSendSleeping, true, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (_HasEvents())
+		{
+			break;
+		}
+
+		mSendLock.Wait();
+	}
+
+	__atomic_store_n(&mSendSleeping, false, __ATOMIC_SEQ_CST);
+	mSendLock.Unlock();
+}
+
+/* Raises event for the send thread and wakes it if it is asleep. Safe on any
+ * thread.
+ */
+void Sender::_PostEvent(bool *event)
+{
+	__atomic_store_n(event, true, __ATOMIC_SEQ_CST);
+	_WakeSendThread();
+}
+
+/* Wakes the send thread if it is asleep in _WaitForEvents. Taking the lock
+ * waits for it to be in Wait, so the signal cannot come too early. Call after
+ * raising the event it is woken for.
+ */
+void Sender::_WakeSendThread()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&mSendSleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&mSendSleeping, false, __ATOMIC_SEQ_CST))
+	{
+		mSendLock.Lock();
+		mSendLock.Unlock();
+		mSendLock.Signal();
+	}
+}
+
+/* Moves to state. The listen thread and GetState read it without a lock.
+ */
+void Sender::_SetState(SenderState state)
+{
+	__atomic_store_n(&mCurrentState, state, __ATOMIC_RELEASE);
+}
+
+/* Records the time from the arrival of the last ACK parsed to the send about
+ * to go out, once per ACK.
+ */
+void Sender::_RecordAckToSend()
+{
+	if (mStages != NULL && mAckTicks != 0)
+	{
+		mStages->Record(STAGE_ACK_TO_SEND, readStageClock() - mAckTicks);
+		mAckTicks = 0;
+	}
+}
+
+void Sender::_SendCurrent()
+{
+	switch (mCurrentState)
+	{
+		case SEND_NO_CONN:
+			_SendSyn();
+			break;
+		case SEND_PROBE:
+			_SendProbes();
+			break;
+		case SEND_DATA:
+		case SEND_FIN:
+			_SendData();
+			break;
+		case SEND_CLOSED:
+			break;
+	}
+}
+
+void Sender::_SendSyn()
+{
+	uint32_t fSize = _BuildSynPacket();
+
+	if (mEarlyData)
+	{
+		fSize = _AddEarlyData(fSize);
+	}
+
+	_SendPacket(fSize, true);
+
+	// The SYN-ACK gives the first round trip sample.
+	mLoss->OnSent(kSendSynSeqNum, 1);
+
+	// Follow the SYN with the rest of the first window, and the FIN if that is
+	// all of it. A file large enough to probe for would only have to resend
+	// them at the new size.
+	if (mEarlyData && !(mProbe && mFileSize >= kSendProbeMinFileSize))
+	{
+		_SendData();
+	}
+
+	// A retransmitted SYN may send less than the first one, which could
+	// still be acknowledged.
+	if (mEarlyData)
+	{
+		mEarlySeqNum = MAX(mEarlySeqNum, (mNextSeqNum >= mFinSeqNum - 1) ? mFinSeqNum : mNextSeqNum);
+	}
+	// Start timeout thread.
+}
+
+/* Appends as much of the data as fits in a datagram every path carries to
+ * the SYN of length bytes in mMFBOut, and moves mNextSeqNum past it. A
+ * timeout moves mNextSeqNum back, so each retransmitted SYN carries the data
+ * again.
+ * Returns the new length of the SYN.
+ */
+uint32_t Sender::_AddEarlyData(uint32_t length)
+{
+	// The options start with the version byte after the name and datagram size.
+	uint32_t fOptions = SynPacket::kSize + mFileName.length() + 1 + kSegmentSizeByteSize;
+	uint32_t fOffset = length - fOptions;
+	uint64_t fAvailable = (mSource != NULL) ? mSource->GetEnd() : mFileSize;
+	char fData[kPacketSize];
+	streamsize fSize = (streamsize)MIN((uint64_t)(kPacketSize - MIN(length, (uint32_t)kPacketSize)), fAvailable);
+
+	if (fSize <= 0)
+	{
+		return length;
+	}
+
+	if (mSource != NULL)
+	{
+		fSize = mSource->Read(0, fData, (size_t)fSize);
+	}
+	else
+	{
+		// The send loop seeks back to where it sends from before reading.
+		mFile.clear();
+		mFile.seekg(0, ios_base::beg);
+		mFile.read(fData, fSize);
+		fSize = mFile.gcount();
+	}
+
+	uint32_t fEarly = setEarlyData(mMFBOut + fOptions, kPacketSize - fOptions, &fOffset, fData, (uint32_t)fSize);
+
+	mStatBytesSent.Add(fEarly);
+	mNextSeqNum = kSendSynAckSeqNum + fEarly;
+	mHighSeqNum = MAX(mHighSeqNum, mNextSeqNum);
+
+	return fOptions + fOffset;
+}
+
+void Sender::_SendData()
+{
+	streamsize fSize = 0;
+	uint32_t fPacketSize = 0;
+	uint64_t fEndSeqNum = mFinSeqNum - 1; // Sequence number following the last byte of the file.
+	uint64_t fSendEndSeqNum = fEndSeqNum; // Sequence number following the last byte we have to send.
+	uint32_t fPayloadSize = mPayloadSize;
+
+	// Only what the application has written to a stream can be sent so far.
+	if (mSource != NULL)
+	{
+		fSendEndSeqNum = MIN(fEndSeqNum, kSendSynAckSeqNum + mSource->GetEnd());
+	}
+
+	// Send new data from mNextSeqNum up to the edge of the window. ACKs move
+	// mSeqNumBase forward, and a timeout moves mNextSeqNum back to it so the
+	// window is sent again.
+	if (mNextSeqNum < mSeqNumBase)
+	{
+		mNextSeqNum = mSeqNumBase;
+	}
+
+	// Fill the holes the receiver reported before adding to them.
+	if (mLossTimer != NULL)
+	{
+		_SendLost();
+	}
+
+	// Check the file position against where we are supposed to be sending
+	// from, since a retransmission moves us backwards in the file.
+	streampos fSendPos = (streamoff)(mNextSeqNum - kSendSynAckSeqNum);
+
+	if (mRing == NULL && mReadAhead == NULL && mSource == NULL && mNextSeqNum < fEndSeqNum && mFile.tellg() != fSendPos)
+	{
+		if (!mFile.good())
+		{
+			mFile.clear();
+		}
+
+		// Update our stream position to match the next sequence number.
+		mFile.seekg(fSendPos, ios_base::beg);
+	}
+
+	// Everything before the window has been acknowledged, so the reader may reuse it.
+	if (mReadAhead != NULL)
+	{
+		mReadAhead->Release(mSeqNumBase - kSendSynAckSeqNum);
+	}
+
+	if (kSendDebug)
+	{
+		*mLog<<"Window Size = "<<dec<<mWindowSize<<endl;
+	}
+
+	uint32_t fPacketCount = mWindowSize / mPacketSize;
+	uint32_t fInFlight = (uint32_t)((mNextSeqNum - mSeqNumBase + fPayloadSize - 1) / fPayloadSize);
+
+	// With segmentation offload, full sized packets are laid out back to back
+	// and handed to the kernel together. Only the last one in a send may be short.
+	uint32_t fSegmentSize = kDataPacketSize + fPayloadSize;
+	uint32_t fMaxSegments = (mSegmentOffload && mRing == NULL) ? MIN((uint32_t)kMaxSegments, kMaxDatagramSize / fSegmentSize) : 0;
+	uint64_t fStartSeqNum = mNextSeqNum;
+
+	// Send each packet that fits in the window.
+	while (fInFlight < fPacketCount && mNextSeqNum < fSendEndSeqNum)
+	{
+		char *fBuffer = NULL;
+		int fPath = 0;
+
+		// Data sent before the SYN-ACK goes where the SYN went. Data sent again
+		// after a timeout does not wait for room on a path, as it is not
+		// counted on any.
+		if (mPaths != NULL && mConnected)
+		{
+			fPath = mPaths->Pick(mLoss, fPayloadSize, fSendEndSeqNum - mNextSeqNum, mNextSeqNum < mHighSeqNum);
+
+			if (fPath < 0)
+			{
+				break;
+			}
+		}
+
+		if (mRing != NULL)
+		{
+			// The ring reads the file into the packet and sends it once submitted.
+			fSize = (streamsize)MIN((uint64_t)fPayloadSize, fEndSeqNum - mNextSeqNum);
+			ScopedStageTimer fBuild(mStages, STAGE_PACKET_BUILD);
+			fBuffer = _QueueDataPacket(mNextSeqNum, (unsigned short)fSize);
+		}
+		else
+		{
+			// Read one packet worth of data from the file straight into the packet.
+			char *fPacket = (fMaxSegments > 1) ? mSegmentBuff + mSegmentLength : mMFBOut;
+			fBuffer = fPacket + kDataPacketSize;
+			fSize = (streamsize)MIN((uint64_t)fPayloadSize, fSendEndSeqNum - mNextSeqNum);
+
+			{
+				ScopedStageTimer fRead(mStages, STAGE_FILE_READ);
+
+				if (mReadAhead != NULL)
+				{
+					fSize = mReadAhead->Read(mNextSeqNum - kSendSynAckSeqNum, fBuffer, (uint32_t)fSize);
+				}
+				else if (mSource != NULL)
+				{
+					fSize = mSource->Read(mNextSeqNum - kSendSynAckSeqNum, fBuffer, (size_t)fSize);
+				}
+				else
+				{
+					mFile.read(fBuffer, fSize);
+					fSize = mFile.gcount(); // See how many bytes we read.
+				}
+			}
+
+			if (fSize > 0)
+			{
+				{
+					ScopedStageTimer fBuild(mStages, STAGE_PACKET_BUILD);
+					fPacketSize = _BuildDataPacket(fPacket, mNextSeqNum, (unsigned short)fSize);
+				}
+
+				if (fMaxSegments > 1)
+				{
+					mSegmentLength += fPacketSize;
+					mSegmentCount++;
+
+					if (mSegmentCount >= fMaxSegments || fPacketSize < fSegmentSize)
+					{
+						_SendSegments();
+					}
+				}
+				else
+				{
+					_SendPacket(fPacketSize, true, fPath);
+				}
+			}
+		}
+
+		if (fBuffer == NULL || fSize <= 0)
+		{
+			*mLog<<"An error occurred while reading the file. No packets sent."<<endl;
+			break;
+		}
+
+		if (mFecEncoder != NULL)
+		{
+			mFecEncoder->Add(mNextSeqNum, fBuffer, (unsigned short)fSize);
+
+			if (mFecEncoder->IsBlockFull(fPacketCount))
+			{
+				// Keep the parity behind the packets it covers.
+				_SendSegments();
+				_ReapRing(0);
+				_SendParity();
+			}
+		}
+
+		mStatDataSent.Add();
+		mStatBytesSent.Add((uint64_t)fSize);
+		traceEvent(mTrace, TRACE_PACKET, TRACE_PACKET_SENT, (uint32_t)fSize, mNextSeqNum, (mNextSeqNum < mHighSeqNum) ? 1 : 0);
+		PROBE4(send_data, mNextSeqNum, (uint32_t)fSize, mCongWin, mWindowSize);
+
+		if (mNextSeqNum < mHighSeqNum)
+		{
+			mStatRetransmits.Add();
+		}
+
+		mLoss->OnSent(mNextSeqNum, (uint32_t)fSize, (uint8_t)fPath);
+
+		mNextSeqNum += fSize;
+		mHighSeqNum = MAX(mHighSeqNum, mNextSeqNum);
+		fInFlight++;
+	}
+
+	_SendSegments();
+	_ReapRing(0);
 
-int main (int argc, char *argv[])
+	// A tail loss probe is new data if the window sent any, and otherwise the
+	// last packet again, so its ACK or SACK shows what is missing. The FIN
+	// below goes again anyway once all the data was sent.
+	if (mTailProbe)
+	{
+		uint64_t fTailSeqNum = 0;
+		uint32_t fTailSize = 0;
+
+		mTailProbe = false;
+
+		if (mNextSeqNum == fStartSeqNum && mLoss->GetTail(&fTailSeqNum, &fTailSize) && fTailSeqNum < fEndSeqNum)
+		{
+			traceEvent(mTrace, TRACE_CONTROL, TRACE_LOSS, 2, fTailSeqNum, fTailSize);
+			PROBE2(tail_probe, fTailSeqNum, fTailSize);
+			_ResendPacket(fTailSeqNum, fTailSize);
+		}
+
+		mLoss->OnProbeSent();
+		mStatTailProbes.Add();
+	}
+	
+	// Check if we need to send a FIN.
+	if (mNextSeqNum >= fEndSeqNum)
+	{
+		// Protect the tail of the file as well, since a lost packet there
+		// would otherwise always cost a timeout.
+		if (mFecEncoder != NULL && mFecEncoder->HasBlock())
+		{
+			_SendParity();
+		}
+
+		// When we are done send a Fin. One sent behind the SYN waits for the
+		// SYN-ACK like the data before it.
+		if (mCurrentState == SEND_DATA)
+		{
+			_SetState(SEND_FIN);
+		}
+
+		fPacketSize = _BuildFinPacket();
+  		_SendPacket(fPacketSize, true);
+		mLoss->OnSent(fEndSeqNum, 1);
+	}
+}
+
+/* Sends again, ahead of new data, each packet the loss detector found lost
+ * that the window is not about to send anyway.
+ */
+void Sender::_SendLost()
+{
+	uint64_t fSeqNum = 0;
+	uint32_t fSize = 0;
+
+	while (mLoss->TakeLost(&fSeqNum, &fSize))
+	{
+		if (fSeqNum >= mNextSeqNum && fSeqNum < mFinSeqNum - 1)
+		{
+			continue;
+		}
+
+		traceEvent(mTrace, TRACE_CONTROL, TRACE_LOSS, 1, fSeqNum, fSize);
+		PROBE3(rack_loss, fSeqNum, fSize, mLoss->GetRackRtt());
+		_ResendPacket(fSeqNum, fSize);
+	}
+}
+
+/* Sends the packet of size sequence numbers at seqNum again on its own, or the
+ * FIN if seqNum is the end of the data. The packet is cut to the current
+ * payload size, in case a black hole made it smaller since.
+ */
+void Sender::_ResendPacket(uint64_t seqNum, uint32_t size)
+{
+	uint64_t fEndSeqNum = mFinSeqNum - 1;
+
+	if (seqNum >= fEndSeqNum)
+	{
+		_SendPacket(_BuildFinPacket(), true);
+		mLoss->OnSent(fEndSeqNum, 1);
+		return;
+	}
+
+	char *fBuffer = mMFBOut + kDataPacketSize;
+	uint64_t fOffset = seqNum - kSendSynAckSeqNum;
+	streamsize fSize = (streamsize)MIN((uint64_t)MIN(size, mPayloadSize), fEndSeqNum - seqNum);
+
+	{
+		ScopedStageTimer fRead(mStages, STAGE_FILE_READ);
+
+		if (mReadAhead != NULL)
+		{
+			fSize = mReadAhead->Read(fOffset, fBuffer, (uint32_t)fSize);
+		}
+		else if (mSource != NULL)
+		{
+			fSize = mSource->Read(fOffset, fBuffer, (size_t)fSize);
+		}
+		else if (mFileFd >= 0)
+		{
+			fSize = pread(mFileFd, fBuffer, (size_t)fSize, (off_t)fOffset);
+		}
+		else
+		{
+			// The send loop seeks back to where it sends from before reading.
+			mFile.clear();
+			mFile.seekg((streamoff)fOffset, ios_base::beg);
+			mFile.read(fBuffer, fSize);
+			fSize = mFile.gcount();
+		}
+	}
+
+	if (fSize <= 0)
+	{
+		return;
+	}
+
+	{
+		ScopedStageTimer fBuild(mStages, STAGE_PACKET_BUILD);
+		_BuildDataPacket(mMFBOut, seqNum, (unsigned short)fSize);
+	}
+
+	// A lost packet goes again on the path with the most room, full or not.
+	int fPath = (mPaths != NULL && mConnected) ? mPaths->Pick(mLoss, (uint32_t)fSize, (uint64_t)fSize, true) : 0;
+
+	_SendPacket(kDataPacketSize + (uint32_t)fSize, true, fPath);
+	mLoss->OnSent(seqNum, (uint32_t)fSize, (uint8_t)fPath);
+
+	mStatDataSent.Add();
+	mStatBytesSent.Add((uint64_t)fSize);
+	mStatRetransmits.Add();
+	traceEvent(mTrace, TRACE_PACKET, TRACE_PACKET_SENT, (uint32_t)fSize, seqNum, 1);
+	PROBE4(send_data, seqNum, (uint32_t)fSize, mCongWin, mWindowSize);
+}
+
+/* Answers count packets newly found lost by the loss detector. The window is
+ * cut once for all the losses in a flight, as a timeout would cut it, or with
+ * several paths each path's window for its own losses, and the send thread
+ * sends them again ahead of new data.
+ */
+void Sender::_OnLoss(uint32_t count)
+{
+	mStatLosses.Add(count);
+
+	// The redundancy follows the loss rate, so every lost packet counts,
+	// not only the first of a flight.
+	if (mFecEncoder != NULL)
+	{
+		mFecEncoder->ReportLoss(count);
+	}
+
+	if (mSeqNumBase >= mRecoverySeqNum)
+	{
+		mRecoverySeqNum = mHighSeqNum;
+		mCongWin = MAX(mCongWin / 2, mPacketSize);
+		_UpdateWindowSize();
+	}
+
+	_UpdatePaths();
+}
+
+/* Has each path take what was delivered and lost on it, and sets the
+ * congestion window from theirs and the timeout to the longest of
+ * theirs. Does nothing with one path.
+ */
+void Sender::_UpdatePaths()
+{
+	if (mPaths != NULL)
+	{
+		mCongWin = mPaths->Update(mLoss, mPacketSize);
+		_UpdateWindowSize();
+
+		mTheTimeout = _GetTimeOutMilliSeconds();
+		mStatTimeOut.Set(mTheTimeout);
+	}
+}
+
+/* Returns the retransmission timeout in milliseconds: mRto's, or with
+ * several paths the longest of it and those of the paths with data in
+ * flight, since mRto mixes the samples of every path.
+ */
+uint32_t Sender::_GetTimeOutMilliSeconds()
+{
+	uint32_t fTimeOut = mRto.GetTimeOutMilliSeconds();
+
+	if (mPaths != NULL)
+	{
+		fTimeOut = MAX(fTimeOut, mPaths->GetTimeOutMilliSeconds(mLoss));
+	}
+
+	return fTimeOut;
+}
+
+/* Returns the smoothed round trip time in microseconds that the tail loss
+ * probe waits on: mRto's, or with several paths that of the slowest one.
+ */
+uint64_t Sender::_GetSmoothedRtt()
+{
+	uint64_t fSmoothedRtt = mRto.GetSmoothedRtt();
+
+	if (mPaths != NULL)
+	{
+		fSmoothedRtt = MAX(fSmoothedRtt, mPaths->GetSmoothedRtt());
+	}
+
+	return fSmoothedRtt;
+}
+
+/* Sets the loss timer for when the reordering window runs out on the next
+ * packet, or for a tail loss probe, and stops it if neither would come before
+ * the retransmission timeout.
+ */
+void Sender::_ArmLossTimer()
+{
+	bool fReorder = false;
+	uint32_t fTimeOut = 0;
+
+	if (mCurrentState == SEND_DATA || mCurrentState == SEND_FIN)
+	{
+		fTimeOut = mLoss->GetTimeOut(_GetSmoothedRtt(), &fReorder);
+	}
+
+	if (fTimeOut > 0 && fTimeOut < mTheTimeout)
+	{
+		mLossTimer->Start(false, fTimeOut);
+	}
+	else
+	{
+		mLossTimer->Stop();
+	}
+}
+
+/* Sends the DATA packets gathered in mSegmentBuff with a single UDP_SEGMENT
+ * send. If the kernel turns the send down, offload is switched off for the rest
+ * of the transfer and the packets are sent one at a time instead.
+ */
+void Sender::_SendSegments()
+{
+	if (mSegmentCount == 0)
+	{
+		return;
+	}
+
+	uint32_t fSegmentSize = kDataPacketSize + mPayloadSize;
+	_RecordAckToSend();
+	ScopedStageTimer fSend(mStages, STAGE_SEND);
+
+	if (mSegmentCount == 1)
+	{
+		sendPacket(mSock, mRecv, mSegmentBuff, mSegmentLength, kSendDebug);
+	}
+	else if (!sendSegments(mSock, mRecv, mSegmentBuff, mSegmentLength, (uint16_t)fSegmentSize))
+	{
+		*mLog<<"UDP segmentation offload failed, sending one packet at a time."<<endl;
+		mSegmentOffload = false;
+
+		for (uint32_t fOffset = 0; fOffset < mSegmentLength; fOffset += fSegmentSize)
+		{
+			sendPacket(mSock, mRecv, mSegmentBuff + fOffset, MIN(fSegmentSize, mSegmentLength - fOffset), kSendDebug);
+		}
+	}
+
+	mSegmentLength = 0;
+	mSegmentCount = 0;
+}
+
+/* Queues the DATA packet for seqNum on the io_uring backend in a free slot.
+ * The file read into the slot is linked to the send, so a short read cancels
+ * the send. With FEC the encoder needs the payload straight away, so the read
+ * is done synchronously instead. With read ahead the payload is copied from
+ * memory.
+ * Returns the payload in the slot, or NULL if the file could not be read.
+ */
+char *Sender::_QueueDataPacket(uint64_t seqNum, unsigned short dataSize)
+{
+	SendSlot *fSlot = NULL;
+
+	// Take the next free slot, waiting for a send to finish if they are all busy.
+	while (fSlot == NULL)
+	{
+		for (uint32_t i = 0; i < kSendRingSlots && fSlot == NULL; i++)
+		{
+			uint32_t fIndex = (mNextSlot + i) % kSendRingSlots;
+
+			if (!mSlots[fIndex].mBusy)
+			{
+				fSlot = &mSlots[fIndex];
+				mNextSlot = (fIndex + 1) % kSendRingSlots;
+			}
+		}
+
+		if (fSlot == NULL)
+		{
+			_ReapRing(1);
+		}
+	}
+
+	uint64_t fUserData = (uint64_t)(fSlot - mSlots) * 2;
+	char *fBuffer = fSlot->mBuffer + kDataPacketSize;
+	off_t fOffset = (off_t)(seqNum - kSendSynAckSeqNum);
+
+	fSlot->mIov.iov_len = _BuildDataPacket(fSlot->mBuffer, seqNum, dataSize);
+
+	if (mReadAhead != NULL)
+	{
+		if (mReadAhead->Read((uint64_t)fOffset, fBuffer, dataSize) != dataSize)
+		{
+			return NULL;
+		}
+	}
+	else if (mFecEncoder != NULL)
+	{
+		if (pread(mFileFd, fBuffer, dataSize, fOffset) != dataSize)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		mRing->PrepareRead(mFileFd, fBuffer, dataSize, fOffset, fUserData, true);
+	}
+
+	mRing->PrepareSendMsg(mSock, &fSlot->mMsg, fUserData + 1);
+	fSlot->mBusy = true;
+
+	return fBuffer;
+}
+
+/* Submits everything queued on the io_uring backend and frees the slots whose
+ * sends have completed, waiting for at least waitCount completions. Does
+ * nothing when the blocking calls are in use.
+ */
+void Sender::_ReapRing(unsigned waitCount)
 {
-	char fileName[20];
-	char ipAdd[16];
-	uint32_t portNumI;
-	unsigned short portNumS;
-	struct sockaddr_in * recv;
+	uint64_t fUserData = 0;
+	int fResult = 0;
+
+	if (mRing == NULL)
+	{
+		return;
+	}
+
+	{
+		_RecordAckToSend();
+		ScopedStageTimer fSend(mStages, STAGE_SEND);
+		mRing->Submit(waitCount);
+	}
 
-        //confirm that required number of arguments are present
-	if(argc != 4){
-	  printUsage();
-	  exit(1);
+	while (mRing->GetCompletion(&fUserData, &fResult))
+	{
+		// Even values are file reads, odd values the sends linked to them.
+		if ((fUserData & 1) == 0)
+		{
+			if (fResult < 0)
+			{
+				*mLog<<"An error occurred while reading the file. No packets sent."<<endl;
+			}
+		}
+		else
+		{
+			mSlots[(fUserData / 2) % kSendRingSlots].mBusy = false;
+		}
 	}
-	//check validity of filename and store
-	if (!isRegExMatch(argv[1], kFileNameRegEx, kFileNameMaxChars)){
-	  printUsage();
-	  exit(1);
+}
+
+/* Sends a PARITY packet for the block the FEC encoder has accumulated.
+ */
+void Sender::_SendParity()
+{
+	uint32_t fPacketSize = mFecEncoder->BuildParityPacket(mMFBOut, mPacketSize);
+
+	if (fPacketSize > 0)
+	{
+		_SendPacket(fPacketSize, true);
+		mStatParitySent.Add();
 	}
-	strcpy(fileName, argv[1]);
+}
+
+void Sender::_ParseAck(uint32_t size)
+{
+	uint8_t fCode = isWireSizeValid<AckPacket>(size) ? AckPacket::Code::Get(mMFBIn) : 0;
+
+	//extract info and test to make sure valid. SACKs carry an ACK as well,
+	//but only mean anything once data is being sent
+	if(fCode == ACK || (fCode == SACK && (mCurrentState == SEND_DATA || mCurrentState == SEND_FIN)))
+	{
+		// Get ACK # and window size.
+		uint64_t fSeqNum = AckPacket::Ack::Get(mMFBIn);
+		mRecvWin = AckPacket::Window::Get(mMFBIn);
+		mStatAcksReceived.Add();
+		mStatRecvWin.Set(mRecvWin);
+		traceEvent(mTrace, TRACE_PACKET, TRACE_ACK_RECEIVED, mRecvWin, fSeqNum, 0);
+		PROBE4(ack, fSeqNum, mRecvWin, mCongWin, mRto.GetSmoothedRtt() / 1000);
+
+		if (mCurrentState >= SEND_DATA && fSeqNum == mSeqNumBase)
+		{
+			mStatDupAcks.Add();
+		}
+
+		// Check if we are receiving an ACK in response to data being sent.
+		if ((mCurrentState == SEND_DATA && fSeqNum > kSendSynAckSeqNum) || (mCurrentState == SEND_FIN && fSeqNum < mFinSeqNum))
+		{
+			// Check if ACK # is in valid range. The receiver may have filled
+			// holes from parity packets, so anything up to the file end is valid.
+			if (fSeqNum >= mSeqNumBase && fSeqNum < mFinSeqNum)
+			{
+				// Update our file offset with the number of bytes ACKed.
+				mFileOffset += fSeqNum - mSeqNumBase;
+
+				// Update our base sequence number.
+				mSeqNumBase = fSeqNum;
+				mLastAck = fSeqNum;
+
+				// Acknowledged data is never sent again, so make room for more.
+				if (mSource != NULL)
+				{
+					mSource->Release(mSeqNumBase - kSendSynAckSeqNum);
+					_Notify();
+				}
+
+				mTimeOutCount = 0;
+
+				// Update window size. Several paths grow theirs below instead.
+				if (mPaths == NULL)
+				{
+					mCongWin += mPacketSize;
+				}
+
+				_UpdateWindowSize();
+
+				// The window moved, so there is more to send.
+				mSendDue = true;
+			}
+		}
+		else if (mCurrentState == SEND_FIN && fSeqNum == mFinSeqNum)
+		{
+			// File was successfully transerred and acknowledged.
+			mLastAck = fSeqNum;
+			_Complete();
+		}
+		else if (mCurrentState == SEND_NO_CONN && (fSeqNum == kSendSynAckSeqNum || fSeqNum == kSendSynSeqNum
+			|| (fSeqNum > kSendSynAckSeqNum && fSeqNum <= mEarlySeqNum && size > AckPacket::SegmentSize::kEnd)))
+		{
+			//if the sequence number is 1 need to set connected to true. A
+			//SYN-ACK for early data acknowledges as much of it as was taken,
+			//while plain ACKs of the data sent behind the SYN are ignored
+			if (fSeqNum >= kSendSynAckSeqNum)
+			{
+				uint16_t fPacketSize = kPacketSize;
+
+				// A receiver that understood our datagram size offer answers
+				// with the largest size it will take. Older receivers send a
+				// plain ACK, so we stay at kPacketSize for them.
+				if (size >= AckPacket::SegmentSize::kEnd)
+				{
+					fPacketSize = AckPacket::SegmentSize::Get(mMFBIn);
+					fPacketSize = MIN(MAX(fPacketSize, (uint16_t)kPacketSize), mMaxPacketSize);
+				}
+
+				// A versioned receiver lists its features after the size, and we
+				// drop the ones it does not have. Older receivers are trusted to
+				// take whatever we send, as before.
+				uint8_t fVersion = 0;
+				uint32_t fFeatures = _GetFeatures();
+
+				if (size > AckPacket::SegmentSize::kEnd
+					&& getHandshakeOptions(mMFBIn + AckPacket::Version::kOffset, size - AckPacket::Version::kOffset, &fVersion, &fFeatures))
+				{
+					fFeatures &= _GetFeatures();
+					*mLog<<"Negotiated "<<describeFeatures(MIN(fVersion, (uint8_t)kProtocolVersion), fFeatures)<<"."<<endl;
+				}
+				else
+				{
+					*mLog<<"Receiver predates protocol versions, using "<<describeFeatures(0, fFeatures)<<"."<<endl;
+				}
+
+				if (!(fFeatures & FEATURE_FEC))
+				{
+					mFecBlockSize = 0;
+				}
+
+				if (!(fFeatures & FEATURE_PROBE))
+				{
+					mProbe = false;
+				}
+
+				// The receiver would drop whatever came from the other paths.
+				if (mPaths != NULL && !(fFeatures & FEATURE_MULTIPATH))
+				{
+					*mLog<<"Receiver cannot take more than one path, sending on one."<<endl;
+					delete mPaths;
+					mPaths = NULL;
+				}
+
+				// Without the feature the receiver would wait for
+				// kStreamUnknownSize bytes.
+				if (mUnknownSize && !(fFeatures & FEATURE_STREAM))
+				{
+					*mLog<<"Receiver cannot take a stream of unknown length. Shutting down."<<endl;
+					_Close();
+					return;
+				}
+
+				mFileOffset += fSeqNum - mSeqNumBase;
+				mSeqNumBase = fSeqNum;
+				mLastAck = fSeqNum;
+				mConnected = true;
+				//mTransTimer->Start(true);
+
+				if (MIN(mEarlySeqNum, mFinSeqNum - 1) > kSendSynAckSeqNum)
+				{
+					*mLog<<"Receiver took "<<dec<<(MIN(fSeqNum, mFinSeqNum - 1) - kSendSynAckSeqNum)<<" of the "
+						<<(MIN(mEarlySeqNum, mFinSeqNum - 1) - kSendSynAckSeqNum)<<" bytes sent before the SYN-ACK."<<endl;
+
+					// Send again whatever was refused.
+					if (fSeqNum == kSendSynAckSeqNum)
+					{
+						mNextSeqNum = kSendSynAckSeqNum;
+					}
+
+					if (mSource != NULL)
+					{
+						mSource->Release(mSeqNumBase - kSendSynAckSeqNum);
+					}
+				}
+
+				// All of it, FIN included, arrived with the SYN.
+				if (fSeqNum == mFinSeqNum)
+				{
+					_Complete();
+					return;
+				}
+
+				// Only probe when there is room above kPacketSize and enough
+				// data for a larger datagram to make a difference.
+				if (mProbe && fPacketSize > kPacketSize && mFileSize >= kSendProbeMinFileSize)
+				{
+					mProbeTarget = fPacketSize;
+					mProbeAcked = kPacketSize;
+					_SetState(SEND_PROBE);
+				}
+				else
+				{
+					_StartData(mProbe ? kPacketSize : fPacketSize);
+				}
+
+				// The FIN went behind the SYN, so only its ACK is left to wait for.
+				if (mCurrentState == SEND_DATA && mEarlySeqNum == mFinSeqNum && mNextSeqNum >= mFinSeqNum - 1)
+				{
+					_SetState(SEND_FIN);
+				}
+
+				mSendDue = true;
+				_Notify();
+			}
+			//if seq number is zero then we have recieved nack shutdown
+			else
+			{
+				*mLog<<"Receiver already has file. Shutting down."<<endl;
+				_Close();
+			}
+		}
+		else if (kSendDebug)
+		{
+			*mLog<<"An unanticipated ACK was received. Ignoring."<<endl;
+		}
+
+		// Whatever arrived gives a round trip sample, from the SYN-ACK on.
+		if (mCurrentState != SEND_NO_CONN && mCurrentState != SEND_CLOSED)
+		{
+			bool fRetransmitted = false;
+			uint64_t fRtt = mLoss->OnAck(mSeqNumBase, &fRetransmitted);
+
+			if (fRtt > 0)
+			{
+				_UpdateRtt(fRtt, fRetransmitted);
+			}
+
+			if (fCode == SACK && isWireSizeValid<SackPacket>(size))
+			{
+				fRtt = mLoss->OnSack(SackPacket::Received::Get(mMFBIn), &fRetransmitted);
 
-	//check validity of IP address and store
-	strcpy(ipAdd, argv[2]);
-	
-	//check validity of port number and store
-	portNumI = atoi(argv[3]);
-	if (portNumI < kPortNumMin || portNumI > kPortNumMax){
-	  printUsage();
-	  exit(1);
-	}
-	portNumS = (unsigned short)portNumI;
+				if (fRtt > 0)
+				{
+					_UpdateRtt(fRtt, fRetransmitted);
+				}
+			}
+		}
 
-	if ((recv = getHostAddress(ipAdd, portNumS)) == NULL){error("Unable to locate host");}
+		// It also shows which of the packets sent before it are lost.
+		if (mLossTimer != NULL && (mCurrentState == SEND_DATA || mCurrentState == SEND_FIN))
+		{
+			uint32_t fLost = mLoss->DetectLosses();
 
-	Sender sender(fileName, recv);
-	sender.Start();
-}
+			if (fLost > 0)
+			{
+				_OnLoss(fLost);
+				mSendDue = true;
+			}
+		}
 
-/* Function: printUsage
- * Desc: This function displays the usage information on how this program should work.
- */
-void printUsage()
-{
-	cout<<"Invalid command line arguments specified.\n\n";
-	cout<<"User sust supply three arguments for program\n";
-	cout<<"First Argument Must be filename to transfer cannot exceed 20 characters\n";
-	cout<<"Sencond Argument must be a valid IP address of the receiver\n";
-	cout<<"Third argument must be numeric port number that receiver is listening on\n";
-	cout<<"Usage: relsend <filename> <ip> <port>\n";
-	cout<<"\t<port> - A number between "<<kPortNumMin<<" and "<<kPortNumMax<<".\n";
+		if (mCurrentState == SEND_DATA || mCurrentState == SEND_FIN)
+		{
+			_UpdatePaths();
+		}
+	}
 }
 
-/* Sets up opening the file and setting the mFileSize correctly. If the file is not found or
- * something goes wrong opening the file then we close the application. 
- * Also the constructor will setup the Send and Timer thread.
+/* Reports a transfer whose FIN was acknowledged and closes the connection.
  */
-Sender::Sender(char fileName[], sockaddr_in* recv)
-	: mFileName(fileName), mRecv(recv), mLastAck(0), mEstRTT(0),
-	  mSendThread(_StartSend, this), mTimerThread(_StartTimer, this),
-	  mCurrentState(SEND_NO_CONN), mConnected(false), mFileOffset(0),
-	  mWindowSize(kSendDefaultMss), mCongWin(kSendDefaultMss), mRecvWin(0),
-	  mTheTimeout(200), mEstDEV(0), mRetransmit(false)
-{
-	try {
-		mFile.open(mFileName.c_str(), ios::in | ios::binary);
-		mFile.seekg(0, ios::end);
-  		mFileSize = (uint64_t)mFile.tellg();
-		mFile.seekg(0, ios::beg);
- 	}
- 	catch (ios_base::failure &e) {
-	 	cerr<<"Open: "<<e.what();
-	 	exit(-1);
- 	}
-	mTransTimer = new TransmissionTimer(mEstRTT, 0, (void*)this, Sender::_TimeOutCallBack);
-}
-
-Sender::~Sender()
+void Sender::_Complete()
 {
-	mFile.close();
-}
-
-
-// ***********************************************************************************
+	*mLog<<"File sent successfully!"<<endl;
 
-void Sender::Start()
-{
-	//initialize class members to values passed in as parameters
+	// Get the connection end time.
+	gettimeofday(&mConnEndTime, NULL);
+	double transTime = (((mConnEndTime.tv_sec * 1000000.0) + mConnEndTime.tv_usec) - ((mConnStartTime.tv_sec * 1000000.0) + mConnStartTime.tv_usec)) / 1000000.0;
 
-	// Set the expected sequence number we should have when are are done.
-	mFinSeqNum = mFileSize + 2;
-	mSock = _ConfigureSocket();
-	mSendThread.Start();
-	_StartListen();
-}
+	mLog->precision(4);
+	*mLog << "Time to send was " << dec << transTime << " seconds at a rate of " << (transTime / mFileSize) << " seconds per byte." << endl;
+	mStats.PrintSummary(*mLog);
 
-void *Sender::_StartSend(void *args)
-{
-	// Args points to this object.
-	Sender *fSender = (Sender*)args;
+	if (mPaths != NULL)
+	{
+		mPaths->PrintSummary(*mLog, mLoss);
+	}
 
-	if (fSender != NULL)
+	if (mStages != NULL)
 	{
-		cout<<"Sending file '"<<fSender->mFileName<<"' to "<<inet_ntoa(fSender->mRecv->sin_addr)
-			<<" on port "<<dec<<ntohs(fSender->mRecv->sin_port)<<"."<<endl;
+		mStages->PrintSummary(*mLog);
+	}
 
-		// Get the connection start time.
-		gettimeofday(&(fSender->mConnStartTime), NULL);
+	// Leave the final numbers in the JSON file and the trace before exiting.
+	if (mStatsExporter != NULL)
+	{
+		mStatsExporter->Stop();
+	}
 
-		do
-		{
-			fSender->mSendLock.Lock();
-			fSender->_SendCurrent();
-			fSender->mTransTimer->Start(true, fSender->mTheTimeout);
-			fSender->mSendLock.Wait();
-			fSender->mSendLock.Unlock();
-		}
-		while (fSender->mConnected || (fSender->mCurrentState == SEND_NO_CONN));
+	if (mTrace != NULL)
+	{
+		mTrace->Stop();
 	}
-}
 
-void Sender::_SendCurrent()
-{
-        gettimeofday(&mBegTimestamp, NULL);
-	switch (mCurrentState)
+	if (mReadAhead != NULL)
 	{
-		case SEND_NO_CONN:
-			_SendSyn();
-			break;
-		case SEND_DATA:
-		case SEND_FIN:
-			_SendData();
-			break;
+		*mLog << "Waited for the file " << dec << mReadAhead->GetStallCount() << " times, "
+			<< (mReadAhead->GetStallTime() / 1000.0) << " ms in total." << endl;
 	}
-}
 
-void Sender::_SendSyn()
-{
-	uint32_t fSize = _BuildSynPacket();
-	_SendPacket(fSize, true);
-	// Start timeout thread.
+	_Close();
 }
 
-void Sender::_SendData()
+/*Func: _ParseProbe
+ *Desc: Handles a PROBE echoed by the receiver. The echo carries the size of the
+ *datagram that arrived, so that size is known to fit through the path. Once the
+ *largest probe comes back there is nothing left to wait for and data starts.
+ *Ret: n/a
+ */
+void Sender::_ParseProbe(uint32_t size)
 {
-	streamsize fSize = 0;
-	uint32_t fPacketSize = 0;
-	// Send data from mFileOffset + mWindowSize or next nearest whole packet.
-
-	// Check to see if our file offset is at the end of file.
-
-	// Check the file position against where we are supposed to be sending
-	// from. The member mFileOffset can be adjusted from ACKs received to
-	// indicate the starting position of where data should be sent.
-	streampos fFilePos = mFile.tellg();
-
-	// Make sure we don't have an error condition.
-	if ((int)fFilePos != -1 || ((int)fFilePos == -1 && mFile.eof() && (uint64_t)mFileOffset != mFileSize))
+	if (mCurrentState == SEND_PROBE && isWireSizeValid<ProbePacket>(size))
 	{
-		if (fFilePos != mFileOffset)
-		{
-		  if(!mFile.good()){
-		    mFile.clear();
-		  }
-			// Update our stream position to match mFileOffset.
-			mFile.seekg(mFileOffset, ios_base::beg);
-		}
+		uint64_t fProbeSize = ProbePacket::Size::Get(mMFBIn);
 
-		if (kSendDebug)
+		if (fProbeSize > mProbeAcked && fProbeSize <= mProbeTarget)
 		{
-			cout<<"Window Size = "<<dec<<mWindowSize<<endl;
+			mProbeAcked = (uint32_t)fProbeSize;
 		}
 
-		int packetCount = mWindowSize / kPacketSize;
-
-		// Send each packet.
-		for (int i = 0; (i < packetCount) && mFile.good(); i++)
+		if (mProbeAcked == mProbeTarget)
 		{
-			// While the file is no an EOF or failure copy out chunks of kPacketSize
-			// until there is no more data left.
-			char fBuffer[kPacketSize - kDataPacketSize];
-
-			// Send one packet worth of data from the file.
-			mFile.read(fBuffer, kPacketSize - kDataPacketSize);
-			fSize = mFile.gcount(); // See how many bytes we read.
-			fPacketSize = _BuildDataPacket(fBuffer, (unsigned short)fSize);
-			_SendPacket(fPacketSize, true);
+			_StartData(mProbeAcked);
+			mSendDue = true;
 		}
 	}
-	else if (!mFile.eof())
-	{
-		cout<<"An error occurred while getting file stream position. No packets sent."<<endl;
-	}
-	
-	// Check if we need to send a FIN.
-	if (mFile.eof())
+}
+
+/*Func: _SendProbes
+ *Desc: Sends one padded PROBE datagram for each candidate size between kPacketSize
+ *and the negotiated size: the route MTU, common jumbo and ethernet frames, and the
+ *negotiated size itself. The socket is in IP_PMTUDISC_PROBE mode, so these go out
+ *with don't-fragment set and are simply lost if the path cannot carry them.
+ *Ret: n/a
+ */
+void Sender::_SendProbes()
+{
+	uint32_t fCandidates[4];
+	fCandidates[0] = mProbeTarget;
+	fCandidates[1] = getPathMaxDatagramSize(mRecv);
+	fCandidates[2] = 9000 - kUdpIpHeaderSize;
+	fCandidates[3] = 1500 - kUdpIpHeaderSize;
+
+	for (int i = 0; i < 4; i++)
 	{
-		// When we are done send a Fin.
+		uint32_t fSize = fCandidates[i];
 
-		if (mCurrentState != SEND_FIN)
+		if (fSize > mProbeAcked && fSize <= mProbeTarget)
 		{
-			mCurrentState = SEND_FIN;
+			memset(mMFBOut, 0, fSize);
+			ProbePacket::Code::Set(mMFBOut, PROBE);
+			ProbePacket::Size::Set(mMFBOut, fSize);
+			_SendPacket(fSize, true);
 		}
-
-		fPacketSize = _BuildFinPacket();
-  		_SendPacket(fPacketSize, true);
 	}
 }
 
-void Sender::_ParseAck()
+/*Func: _StartData
+ *Desc: Fixes the datagram size for the rest of the connection and moves to sending
+ *data. The window and the FEC encoder are sized from it.
+ *Ret: n/a
+ */
+void Sender::_StartData(uint32_t packetSize)
 {
-	if(mMFBIn[0] == (char)ACK)
-	{
-		uint64_t fSeqNum = 0;
-		uint32_t fOffset = 1;
-
-		//extract info and test to make sure valid
-
-		gettimeofday(&mEndTimestamp, NULL);
-		// Get ACK #.
-		if(tryGetULongFromMessage(mMFBIn + fOffset, (kMaxPacketSize - fOffset), &fSeqNum))
-		{
-			fOffset += kSeqNumByteSize;
-			uint32_t fWinSize = kSendDefaultMss;
-
-			// Get window size.
-			if(tryGetUIntFromMessage(mMFBIn + fOffset, (kMaxPacketSize - fOffset), &fWinSize))
-			{
-				mRecvWin = fWinSize;
-
-				// Check if we are receiving an ACK in response to data being sent.
-				if ((mCurrentState == SEND_DATA && fSeqNum > kSendSynAckSeqNum) || (mCurrentState == SEND_FIN && fSeqNum < mFinSeqNum))
-				{
-					// Check if ACK # is in valid range.
-					if (fSeqNum >= mSeqNumBase && fSeqNum <= (mSeqNumBase + mWindowSize))
-					{
-						// Update our file offset with the number of bytes ACKed.
-						mFileOffset += fSeqNum - mSeqNumBase;
-
-						// Update our base sequence number.
-						mSeqNumBase = fSeqNum;
-						mLastAck = fSeqNum;
-
-						// Update RTT.
-						_UpdateRTT(false);
-
-						// Update window size.
-						mCongWin += kPacketSize;
-						mWindowSize = MIN(mCongWin, mRecvWin);
-
-						// If for some reason window is less than packet size, reset it to packet size.
-						if (mWindowSize < kPacketSize)
-						{
-							mWindowSize = kPacketSize;
-						}
-						else if (mWindowSize > kSendMaxMss)
-						{
-							mWindowSize = kSendMaxMss;
-						}
-
-						// Signal send thread.
-						mSendLock.Signal();
-					}
-				}
-				else if (mCurrentState == SEND_FIN && fSeqNum == mFinSeqNum)
-				{
-					// File was successfully transerred and acknowledged.
-					mConnected = false;
-					cout<<"File sent successfully!"<<endl;
+	mPacketSize = packetSize;
+	mPayloadSize = mPacketSize - kDataPacketSize;
 
-					// Get the connection end time.
-					gettimeofday(&mConnEndTime, NULL);
-					double transTime = (((mConnEndTime.tv_sec * 1000000.0) + mConnEndTime.tv_usec) - ((mConnStartTime.tv_sec * 1000000.0) + mConnStartTime.tv_usec)) / 1000000.0;
+	if (mFecBlockSize > 0)
+	{
+		// Parity packets carry a longer header than DATA packets, so shrink the
+		// payload to keep them within the datagram size.
+		mPayloadSize = mPacketSize - kParityPacketSize;
+		delete mFecEncoder;
+		mFecEncoder = new FecEncoder(mFecBlockSize, mPayloadSize);
+	}
 
-					cout.precision(4);
-					cout << "Time to send was " << dec << transTime << " seconds at a rate of " << (transTime / mFileSize) << " seconds per byte." << endl;
+	mCongWin = (mPaths != NULL) ? mPaths->Reset(mPacketSize) : kSendInitialWindowPackets * mPacketSize;
+	_UpdateWindowSize();
+	_SetState(SEND_DATA);
 
-					// Just do quick and dirty exit for now.
-					exit(EXIT_SUCCESS);
-				}
-				else if (mCurrentState == SEND_NO_CONN && (fSeqNum == kSendSynAckSeqNum || fSeqNum == kSendSynSeqNum))
-				{
-					//if the sequence number is 1 need to set connected to true
-					if (fSeqNum == kSendSynAckSeqNum)
-					{
-						mSeqNumBase = fSeqNum;
-						mLastAck = fSeqNum;
-						mCurrentState = SEND_DATA;
-						mConnected = true;
-						//mTransTimer->Start(true);
-
-						// Signal send thread.
-						mSendLock.Signal();
-					}
-					//if seq number is zero then we have recieved nack shutdown
-					else
-					{
-						cout<<"Receiver already has file. Shutting down."<<endl;
-						exit(1);
-					}
-				}
-				else if (kSendDebug)
-				{
-					cout<<"An unanticipated ACK was received. Ignoring."<<endl;
-				}
-			}
-		}
+	if (mPacketSize != kPacketSize)
+	{
+		*mLog<<"Using "<<dec<<mPacketSize<<" byte datagrams."<<endl;
 	}
 }
 
 // ***********************************************************************************
 
 
+/* Receives the receiver's datagrams into free slots and hands them to the
+ * send thread, which parses them. A slot is kept until a receive fills it.
+ * All slots are only taken while the send thread is busy parsing, so waiting
+ * for one just yields.
+ */
 void Sender::_StartListen()
 {
-	ssize_t fSize;
+	uint32_t fIndex = 0;
+	uint32_t fUnannounced = 0;
+	bool fHaveSlot = false;
 
 	//while (mLastAck < mFileSize + 2)
-	while (mCurrentState == SEND_NO_CONN || mConnected)
+	while (__atomic_load_n(&mCurrentState, __ATOMIC_ACQUIRE) != SEND_CLOSED)
 	{
-		fSize = _ReceivePacket();
+		if (!fHaveSlot)
+		{
+			fHaveSlot = mFreeReceived->Pop(&fIndex);
+
+			if (!fHaveSlot)
+			{
+				_WakeSendThread();
+				fUnannounced = 0;
+				sched_yield();
+				continue;
+			}
+		}
+
+		// Take whatever else has already arrived before waking the send
+		// thread, so it parses a burst of ACKs in one go. With nothing to
+		// hand over, spinning first may save the blocking receive its sleep.
+		ReceivedSlot *fSlot = &mReceivedSlots[fIndex];
+
+		if (mSpin && fUnannounced == 0)
+		{
+			mListenSpin.Spin(isSocketReadable, &mSock);
+		}
+
+		ssize_t fSize = _ReceivePacket(fSlot, (fUnannounced > 0) ? MSG_DONTWAIT : 0);
 
 		if (fSize > 0)
 		{
-			mSendLock.Lock();
-		    _ParseAck();
-			mSendLock.Unlock();
+			fSlot->mSize = (uint32_t)fSize;
+			fSlot->mReceivedTicks = (mStages != NULL) ? readStageClock() : 0;
+			mReceived->Push(fIndex);
+			fHaveSlot = false;
+			fUnannounced++;
 		}
-	}
-}
 
-void *Sender::_StartTimer(void *args)
-{
-	//TODO: Can we use the TransmissionTimer that mills built here as well?
+		if (fUnannounced > 0 && (fSize <= 0 || fUnannounced >= kSendReceivedBurst))
+		{
+			_WakeSendThread();
+			fUnannounced = 0;
+		}
+	}
 }
 
 int32_t Sender ::_ConfigureSocket()
@@ -367,6 +1900,18 @@ int32_t Sender ::_ConfigureSocket()
   if((proEnt = getprotobyname("udp")) == NULL){ error("Error opening listen protocol");}
   if((sock = socket(PF_INET, SOCK_DGRAM, proEnt->p_proto)) < 0){ error("Error creating socket");}
 
+  //make room for a full window of large datagrams
+  if(mMaxPacketSize > kPacketSize){
+    setSocketBufferSize(sock, kSocketBufferSize);
+  }
+
+  //send with don't fragment set and ignore the cached path MTU so probes
+  //larger than the current estimate actually go out
+  if(mProbe){
+    int pmtuMode = IP_PMTUDISC_PROBE;
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtuMode, sizeof(pmtuMode));
+  }
+
   return sock;
 }
 
@@ -378,19 +1923,12 @@ int32_t Sender ::_ConfigureSocket()
  */
 uint32_t Sender::_BuildSynPacket()
 {
-  uint32_t fLength = 0;
-
-  //insert identifier and increase length
-  mMFBOut[0] = (char)SYN;
-  fLength++;
-
-  //insert the sequence number and increase length
-  setULongToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), mLastAck);
-  fLength += 8;
+  uint32_t fLength = SynPacket::kSize;
 
-  //insert filesize and increase length
-  setULongToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), mFileSize);
-  fLength += 8;
+  //insert identifier, sequence number and filesize
+  SynPacket::Code::Set(mMFBOut, SYN);
+  SynPacket::Seq::Set(mMFBOut, mLastAck);
+  SynPacket::FileSize::Set(mMFBOut, mUnknownSize ? kStreamUnknownSize : mFileSize);
   
   //insert filename into the buffer and increase length
   mFileName.copy(mMFBOut + fLength, mFileName.length());
@@ -400,33 +1938,79 @@ uint32_t Sender::_BuildSynPacket()
   mMFBOut[fLength] = 0x00;
   fLength++;
 
+  //offer the largest datagram we are willing to use, older receivers ignore it
+  wireStore<uint16_t>(mMFBOut + fLength, (uint16_t)mMaxPacketSize);
+  fLength += kSegmentSizeByteSize;
+
+  //follow it with our version and the features this transfer wants to use
+  uint32_t fOptions = fLength;
+  fLength += setHandshakeOptions(mMFBOut + fLength, kMaxDatagramSize - fLength, _GetFeatures());
+
+  //and the addresses our other paths send from
+  if(mPaths != NULL && fLength > fOptions){
+    sockaddr_in fLocals[kPathMaxPaths];
+    uint32_t fOffset = fLength - fOptions;
+
+    for(uint32_t i = 1; i < mPaths->GetCount(); i++){
+      fLocals[i - 1] = mPaths->GetPath(i)->mLocal;
+    }
+
+    setPaths(mMFBOut + fOptions, kMaxDatagramSize - fOptions, &fOffset, fLocals, mPaths->GetCount() - 1);
+    fLength = fOptions + fOffset;
+  }
+
   return fLength;
 }
 
+/*Func: _GetFeatures
+ *Desc: Returns the ProtocolFeature bits this transfer was configured to use,
+ *which are the ones we advertise in the SYN.
+ *Ret: the feature bits
+ */
+uint32_t Sender::_GetFeatures()
+{
+  uint32_t fFeatures = 0;
+
+  if(mFecBlockSize > 0){
+    fFeatures |= FEATURE_FEC;
+  }
+
+  if(mProbe){
+    fFeatures |= FEATURE_PROBE;
+  }
+
+  if(mUnknownSize){
+    fFeatures |= FEATURE_STREAM;
+  }
+
+  if(mEarlyData){
+    fFeatures |= FEATURE_EARLY_DATA;
+  }
+
+  if(mUseLossDetection){
+    fFeatures |= FEATURE_SACK;
+  }
+
+  if(mPaths != NULL){
+    fFeatures |= FEATURE_MULTIPATH;
+  }
+
+  return fFeatures;
+}
+
 /*Func: BuildFinPacket
  *Desc: Fills a passed buffer with the info for a syn packet
  *Ret: returns the length in bytes inserted into the buffer
  */
-uint32_t Sender::_BuildDataPacket(char buffer[], unsigned short dataSize)
+uint32_t Sender::_BuildDataPacket(char *packet, uint64_t seqNum, unsigned short dataSize)
 {
-	uint32_t fLength = 0;
-  
-	//insert selector byte and increase length and advance pointer
-	mMFBOut[0] = (char)DATA;
-	fLength++;
-
-	//insert sequence number and increase length and advance pointer
-	setULongToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), mLastAck);
-	fLength += 8;
-
-	setUShortToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), dataSize);
-	fLength += 2;
-  
-	// Copy the file data into a packet.
-	memcpy(mMFBOut + fLength, buffer, dataSize);
-	fLength += dataSize;
+	//insert selector byte, sequence number and payload length
+	DataPacket::Code::Set(packet, DATA);
+	DataPacket::Seq::Set(packet, seqNum);
+	DataPacket::Length::Set(packet, dataSize);
   
-	return fLength;
+	// The file data was read straight into the packet after the header.
+	return DataPacket::kSize + dataSize;
 }
 
 
@@ -436,30 +2020,33 @@ uint32_t Sender::_BuildDataPacket(char buffer[], unsigned short dataSize)
  */
 uint32_t Sender::_BuildFinPacket()
 {
-  uint32_t fLength = 0;
-
-  //insert selector byte and increase length and advance pointer
-  mMFBOut[0] = (char)FIN;
-  fLength++;
+  //insert selector byte and sequence number
+  FinPacket::Code::Set(mMFBOut, FIN);
+  FinPacket::Seq::Set(mMFBOut, mFinSeqNum - 1);
   
-  //insert sequence number andd increase length and advance pointer
-  //setULongToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), mLastAck);
-  setULongToMessage(mMFBOut + fLength, (kMaxPacketSize - fLength), mFinSeqNum - 1);
-  fLength += 8;
-  
-  return fLength;
+  return FinPacket::kSize;
 }
 
-void Sender::_SendPacket(uint32_t dataSize, bool print)
+void Sender::_SendPacket(uint32_t dataSize, bool print, int path)
 {
-	sendPacket(mSock, mRecv, mMFBOut, dataSize, kSendDebug);
+	_RecordAckToSend();
+	ScopedStageTimer fSend(mStages, STAGE_SEND);
+
+	if (path > 0 && mPaths != NULL)
+	{
+		mPaths->Send((uint32_t)path, mMFBOut, dataSize);
+	}
+	else
+	{
+		sendPacket(mSock, mRecv, mMFBOut, dataSize, kSendDebug);
+	}
 }
 
-ssize_t Sender::_ReceivePacket()
+ssize_t Sender::_ReceivePacket(ReceivedSlot *slot, int flags)
 {
 	ssize_t fBytesRecv;
-	uint32_t fAddrSize = sizeof(mRecv);
-	fBytesRecv = recvfrom(mSock, mMFBIn, kMaxPacketSize, 0, (sockaddr*)mRecv, &fAddrSize);
+	socklen_t fAddrSize = sizeof(slot->mFrom);
+	fBytesRecv = recvfrom(mSock, slot->mBuffer, sizeof(slot->mBuffer), flags, (sockaddr*)&slot->mFrom, &fAddrSize);
 	// TODO: Check if fBytesRecv > 0 or figure out what to do if that is the case.
 	
 	return fBytesRecv;
@@ -472,73 +2059,217 @@ ssize_t Sender::_ReceivePacket()
  */
 void Sender::_Retransmit()
 {
-	uint32_t fSize = 0;
+	// Nothing is outstanding once the connection is closed, or while an
+	// application has not written the next data yet.
+	if (mCurrentState == SEND_CLOSED
+		|| (mSource != NULL && mCurrentState == SEND_DATA && mHighSeqNum == mSeqNumBase && !_IsRecvWindowClosed()))
+	{
+		return;
+	}
 
-	//lock and adjust the window size and update RTT
-	if (mSendLock.TryLock() == 0)
+	mSendDue = true;
 
+	// Probes that have not come back by now did not fit through the path,
+	// so go with the largest one that did.
+	if (mCurrentState == SEND_PROBE)
 	{
-		if((mCongWin/2) < kPacketSize){
-			mCongWin == kPacketSize;
-		} 
-		else{
-			mCongWin /= 2;
-		}
+		_StartData(mProbeAcked);
+		return;
+	}
+
+	// A receiver whose disk has fallen behind closes its window. Nothing is
+	// lost, so let one packet through to ask for a fresh window instead of
+	// backing off.
+	if (_IsRecvWindowClosed())
+	{
+		mNextSeqNum = mSeqNumBase;
+		mWindowSize = mPacketSize;
+		return;
+	}
 
-		mWindowSize = MIN(mCongWin, mRecvWin);
+	// If a probed size stops getting through altogether, the path MTU has
+	// shrunk underneath us. Fall back to the size every path carries.
+	if (++mTimeOutCount >= kSendBlackHoleTimeOuts && mProbe && mPacketSize > kPacketSize)
+	{
+		mPacketSize = kPacketSize;
+		mPayloadSize = kPacketSize - ((mFecEncoder != NULL) ? kParityPacketSize : kDataPacketSize);
+		*mLog<<"No ACKs at the probed datagram size, falling back to "<<dec<<kPacketSize<<" bytes."<<endl;
+	}
 
-		_UpdateRTT(true);
+	mStatTimeOuts.Add();
 
-		mSendLock.Signal();
-		mSendLock.Unlock();
+	if((mCongWin/2) < mPacketSize){
+		mCongWin = mPacketSize;
+	} 
+	else{
+		mCongWin /= 2;
+	}
+
+	// With several paths, each one is cut and backs off.
+	if (mPaths != NULL)
+	{
+		mCongWin = mPaths->OnTimeOut(mPacketSize);
+	}
+
+	_UpdateWindowSize();
+
+	// Wait twice as long for the next one, until an ACK of a packet
+	// sent once gives a fresh sample.
+	mRto.BackOff();
+	mTheTimeout = _GetTimeOutMilliSeconds();
+	mStatTimeOut.Set(mTheTimeout);
+
+	traceEvent(mTrace, TRACE_CONTROL, TRACE_TIMEOUT, mTheTimeout, mSeqNumBase, mTimeOutCount);
+	traceEvent(mTrace, TRACE_CONTROL, TRACE_LOSS, 0, mSeqNumBase, mNextSeqNum - mSeqNumBase);
+	PROBE4(retransmit, mSeqNumBase, mNextSeqNum - mSeqNumBase, mTheTimeout, mTimeOutCount);
+
+	// Go back and resend everything that has not been acknowledged. That
+	// covers whatever the loss detector was waiting on, and the cut above
+	// covers the losses in this flight.
+	mNextSeqNum = mSeqNumBase;
+	mLoss->OnTimeOut();
+	mTailProbe = false;
+	mRecoverySeqNum = mHighSeqNum;
+
+	if (mFecEncoder != NULL)
+	{
+		mFecEncoder->ReportLoss(1);
+		mFecEncoder->Reset();
+	}
+}
+
+
+/*Func:_UpdateWindowSize
+ *Desc: Sets the window to the smaller of the congestion and receiver windows,
+ *kept between one packet and kSendMaxWindowPackets a path. The receiver window is 0 until the
+ *first ACK arrives, so it is ignored until then. A receiver window smaller than a
+ *packet closes the window until an ACK or a retransmission timeout opens it.
+ *Ret: n/a
+ */
+void Sender::_UpdateWindowSize()
+{
+	// The paths bound their own windows, and the span the sender keeps past
+	// its ACK goes beyond that with paths of different round trip times.
+	uint32_t fMaxWindow = (mPaths != NULL) ? MAX(mCongWin, mPacketSize) : kSendMaxWindowPackets * mPacketSize;
+
+	mWindowSize = (mRecvWin > 0) ? MIN(mCongWin, mRecvWin) : mCongWin;
+
+	if (_IsRecvWindowClosed())
+	{
+		mWindowSize = 0;
+	}
+	// If for some reason window is less than packet size, reset it to packet size.
+	else if (mWindowSize < mPacketSize)
+	{
+		mWindowSize = mPacketSize;
+	}
+	else if (mWindowSize > fMaxWindow)
+	{
+		mWindowSize = fMaxWindow;
+	}
+
+	mStatCongWin.Set(mCongWin);
+	mStatWindow.Set(mWindowSize);
+
+	// Cuts are rare and worth keeping at any level; growth happens on every ACK.
+	if (mCongWin != mTracedCongWin)
+	{
+		traceEvent(mTrace, (mCongWin < mTracedCongWin) ? TRACE_CONTROL : TRACE_PACKET, TRACE_CWND, mWindowSize, mCongWin, mRecvWin);
+		mTracedCongWin = mCongWin;
 	}
 }
 
+/*Func:_IsRecvWindowClosed
+ *Desc: Checks whether the receiver has asked us to stop sending for now.
+ *Ret: true if the receiver window is smaller than one packet
+ */
+bool Sender::_IsRecvWindowClosed()
+{
+	return mRecvWin > 0 && mRecvWin < mPacketSize;
+}
 
 void Sender::_TimeOutCallBack(void* caller)
 {
 
   if(caller != NULL){
     Sender* sendr = (Sender*)caller;
-    sendr->_Retransmit();
+    sendr->_PostEvent(&sendr->mTimeOutPending);
 
   }
 
 }
 
-void Sender::_UpdateRTT(bool flag)
+/* Handles the loss timer running out, on the send thread. Packets whose
+ * reordering window has run out are sent again, and if nothing was waiting on
+ * a window the probe timeout has run out, so the send thread probes.
+ */
+void Sender::_LossTimeOut()
 {
+	bool fReorder = false;
+	uint32_t fLost = 0;
+
+	if (mCurrentState == SEND_DATA || mCurrentState == SEND_FIN)
+	{
+		fLost = mLoss->DetectLosses();
 
-  //if true called by timeout add 1 std dev to timeout interval
-  if(flag){
-	  mRetransmit = true;
+		if (fLost > 0)
+		{
+			_OnLoss(fLost);
+		}
+		else if (mLoss->GetTimeOut(_GetSmoothedRtt(), &fReorder) > 0 && !fReorder)
+		{
+			mTailProbe = true;
+		}
+	}
 
-	  int tempAdj = mEstDEV;
+	// The send loop sets the timer again once it has sent. A window that has
+	// not quite run out yet is waited for again.
+	if (fLost > 0 || mTailProbe)
+	{
+		mLossTimer->Stop();
+		mSendDue = true;
+	}
+	else
+	{
+		_ArmLossTimer();
+	}
+}
 
-	  if (tempAdj < 0)
-	  {
-		  tempAdj *= -1;
-	  }
+void Sender::_LossTimeOutCallBack(void* caller)
+{
+	if (caller != NULL)
+	{
+		Sender *fSender = (Sender*)caller;
+		fSender->_PostEvent(&fSender->mLossTimeOutPending);
+	}
+}
 
-    mTheTimeout += tempAdj;
-  }
-  //otherwise called by the parse ack update with calc
-  else{
-    if(!mRetransmit){
-      mTheTimeout = calculateTimeOutInterval(&mEstRTT, &mEstDEV, &mBegTimestamp, &mEndTimestamp);
-
-      if( mTheTimeout == 0){
-	mTheTimeout = 200;
-      }
-    }
+/* Lets the send thread spin on _HasEvents with an AdaptiveSpin.
+ */
+bool Sender::_HasEventsCallBack(void* caller)
+{
+	return ((Sender*)caller)->_HasEvents();
+}
 
-    else{
-      mRetransmit = false;
-    }
-  }
+/* Feeds a round trip sample, in microseconds, to the retransmission timeout.
+ * Samples from packets sent more than once are left out of the statistics as
+ * well as the estimate.
+ */
+void Sender::_UpdateRtt(uint64_t rtt, bool retransmitted)
+{
+	mRto.AddSample(rtt, retransmitted);
 
+	if (retransmitted)
+	{
+		return;
+	}
 
+	mTheTimeout = _GetTimeOutMilliSeconds();
+	mStatRtt.Record(rtt);
+	mStatTimeOut.Set(mTheTimeout);
 
+	traceEvent(mTrace, TRACE_PACKET, TRACE_RTT, (uint32_t)rtt, mRto.GetSmoothedRtt() / 1000, mTheTimeout);
+	PROBE3(rtt, rtt, mRto.GetSmoothedRtt() / 1000, mTheTimeout);
 }
 
 
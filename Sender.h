@@ -5,13 +5,23 @@
 #ifndef _SENDER_H_
 #define _SENDER_H_
 
-#define kMaxPacketSize 1200
-
 #include <iostream>
 #include <fstream>
 
 #include "Mutex.h"
 #include "Thread.h"
+#include "FecEncoder.h"
+#include "IoUring.h"
+#include "LossDetector.h"
+#include "LowLatency.h"
+#include "MultiPath.h"
+#include "ReadAhead.h"
+#include "RtoEstimator.h"
+#include "SpscQueue.h"
+#include "StageTimer.h"
+#include "Stats.h"
+#include "StreamBuffer.h"
+#include "Trace.h"
 #include "Transmission.h"
 #include "TransmissionTimer.h"
 
@@ -20,44 +30,132 @@ using namespace std;
 enum SenderState
 {
 	SEND_NO_CONN,
+	SEND_PROBE,
 	SEND_DATA,
-	SEND_FIN
+	SEND_FIN,
+	SEND_CLOSED // Finished, turned away or stopped.
 };
 
+#define kSendRingSlots 32
+#define kSendReceivedSlots 64 // Datagrams the listen thread can hand over before the send thread takes them.
+#define kSendReceivedBurst 16 // Datagrams the listen thread hands over at most before waking the send thread.
+
 class Mutex;
 
+/*! \struct SendSlot
+    \brief A DATA packet queued on the io_uring backend, kept until its send completes.
+*/
+struct SendSlot {
+	char			*mBuffer;
+	struct iovec	mIov;
+	struct msghdr	mMsg;
+	bool			mBusy;
+};
+
+/*! \struct ReceivedSlot
+    \brief A datagram from the receiver, kept from the listen thread's receive
+    until the send thread has parsed it.
+*/
+struct ReceivedSlot {
+	char			mBuffer[kPacketSize];
+	uint32_t		mSize;
+	sockaddr_in		mFrom;
+	uint64_t		mReceivedTicks; // readStageClock when it arrived, 0 without stage timers.
+};
+
 /*! \class Sender
     \brief The main class of the sending application.
 
-   Parses command line and opens a connection to the receiver. Starts
-   worker threads for sending and receiving data, as well as handling timeouts
+   Opens a connection to the receiver and sends a file, or the bytes an
+   application writes to a StreamBuffer, which may end whenever the
+   application calls EndStream. Starts worker threads for sending
+   data and handling timeouts, and receives ACKs on the thread that calls Start.
+
+   Only the send thread touches the connection state. The listen thread hands
+   it each datagram through an SpscQueue of ReceivedSlot indexes, and the
+   timers and the application only raise event flags, so no thread waits on
+   another to parse or send. mSendLock is left just for the send thread to
+   sleep on when it has no events.
 */
 class Sender {
 	public:
 		Sender(char fileName[], struct sockaddr_in* recv);
+		Sender(const char *name, StreamBuffer *source, uint64_t size, struct sockaddr_in* recv);
 		virtual ~Sender();
 		
-		void Start();
+		bool Start();
+		void Stop();
+		void Wake();
+		void EndStream();
+		SenderState GetState();
+		void SetLog(ostream *log);
+		void SetNotify(void *caller, void (*notify)(void*));
+		void EnableFec(unsigned short maxBlockSize);
+		void SetMaxPacketSize(uint32_t maxPacketSize, bool probe);
+		void EnableSegmentOffload();
+		void EnableIoUring(bool sqPoll);
+		void EnableReadAhead();
+		void EnableStats(const char *jsonFile, unsigned short port);
+		void EnableTrace(const char *fileName, TraceLevel level);
+		void EnableStageTimers();
+		void EnableEarlyData();
+		void DisableLossDetection();
+		void EnableLowLatency(const char *cpus, uint32_t busyPoll, bool spin);
+		void AddPath(const struct sockaddr_in *local, const struct sockaddr_in *remote, Impairment *impairment);
 	
 	private:
 		static void*	_StartSend(void *);
-		static void*	_StartTimer(void *);
 		void			_StartListen();
-		void			_SendPacket(uint32_t, bool);
-		ssize_t			_ReceivePacket();
+		void			_SendPacket(uint32_t, bool, int path = 0);
+		ssize_t			_ReceivePacket(ReceivedSlot *slot, int flags);
+		bool			_HandleEvents();
+		bool			_HasEvents();
+		void			_WaitForEvents();
+		void			_PostEvent(bool *event);
+		void			_WakeSendThread();
+		void			_SetState(SenderState state);
+		void			_RecordAckToSend();
 		int32_t 		_ConfigureSocket();
 		uint32_t 		_BuildSynPacket();
-		uint32_t 		_BuildDataPacket(char buffer[], unsigned short dataSize);
+		uint32_t		_GetFeatures();
+		uint32_t 		_BuildDataPacket(char *packet, uint64_t seqNum, unsigned short dataSize);
 		uint32_t 		_BuildFinPacket();
-		void 			_ParseAck();
+		void 			_ParseAck(uint32_t size);
+		void			_ParseProbe(uint32_t size);
+		void			_SendProbes();
+		void			_StartData(uint32_t packetSize);
 		void                    _Retransmit();
-		void                    _UpdateRTT(bool flag);
+		void			_UpdateRtt(uint64_t rtt, bool retransmitted);
+		void			_UpdateWindowSize();
+		bool			_IsRecvWindowClosed();
+		void			_SendParity();
+		void			_SendSegments();
+		char			*_QueueDataPacket(uint64_t seqNum, unsigned short dataSize);
+		void			_ReapRing(unsigned waitCount);
 		void			_SendCurrent();
 		void			_SendSyn();
+		uint32_t		_AddEarlyData(uint32_t length);
 		void			_SendData();
+		void			_SendLost();
+		void			_ResendPacket(uint64_t seqNum, uint32_t size);
+		void			_OnLoss(uint32_t count);
+		void			_ArmLossTimer();
+		void			_LossTimeOut();
+		void			_RegisterStats();
+		int				_StartLowLatency();
+		void			_OpenPaths();
+		void			_UpdatePaths();
+		uint32_t		_GetTimeOutMilliSeconds();
+		uint64_t		_GetSmoothedRtt();
 		//void			_SendFin();
 
+		void			_Complete();
+		void			_Close();
+		void			_Notify();
+
 		static void             _TimeOutCallBack(void* caller);
+		static void		_LossTimeOutCallBack(void* caller);
+		static bool		_HasEventsCallBack(void* caller);
 
 		sockaddr_in		*mRecv;
 		fstream			mFile;
@@ -68,27 +166,100 @@ class Sender {
 		string     		mFileName;
 		int32_t         mSock;
 		bool            mConnected;
-		char            mMFBOut[1200];
-		char            mMFBIn[14];
-		Mutex			mSendLock;
+		char            *mMFBOut;
+		char            *mMFBIn; // The datagram being parsed, in one of mReceivedSlots.
+		Mutex			mSendLock; // Only for the send thread to sleep on.
+		ReceivedSlot	*mReceivedSlots;
+		SpscQueue		*mReceived; // Slots the listen thread has filled, in arrival order.
+		SpscQueue		*mFreeReceived; // Slots the send thread has parsed.
+		bool			mSendDue; // Something the send thread should send for has happened since it last sent.
+		bool			mSendSleeping; // Set while the send thread waits on mSendLock. Whoever clears it signals.
+		bool			mWantData; // Set while the window has room for data the source does not have yet.
+		bool			mWakePending; // Events raised by other threads for the send thread.
+		bool			mTimeOutPending;
+		bool			mLossTimeOutPending;
+		bool			mStopPending;
+		uint64_t		mStreamEnd; // Set by EndStream, kStreamUnknownSize until then.
+		uint64_t		mAckTicks; // Arrival of the last ACK parsed since the last send, for STAGE_ACK_TO_SEND.
 		Thread 			mSendThread;
-  		Thread 			mTimerThread;
 		TransmissionTimer*      mTransTimer;
-		uint32_t                mEstRTT;
-		int		                mEstDEV;
-		bool                    mRetransmit;
-		struct timeval          mBegTimestamp;
-		struct timeval          mEndTimestamp;
+		FecEncoder*		mFecEncoder;
+		RtoEstimator	mRto; // Samples from the send times the loss detector keeps.
 		struct timeval		mConnStartTime;
 		struct timeval		mConnEndTime;
 
 		SenderState		mCurrentState;
 		uint64_t		mSeqNumBase;
+		uint64_t		mNextSeqNum; // Next sequence number to send new data from.
 		uint64_t		mFinSeqNum;
 		uint32_t		mCongWin;
 		uint32_t		mRecvWin;
-		uint32_t        mTheTimeout;
+		uint32_t		mPayloadSize; // Bytes of file data carried by each DATA packet.
+		uint32_t		mPacketSize; // Datagram size in use for this connection.
+		uint32_t		mMaxPacketSize; // Largest datagram we are willing to send.
+		bool			mProbe; // Whether to probe the path for a larger datagram size.
+		uint32_t		mProbeTarget; // Largest probe outstanding.
+		uint32_t		mProbeAcked; // Largest probe the receiver echoed.
+		uint32_t		mTimeOutCount; // Consecutive timeouts without an ACK.
+		unsigned short	mFecBlockSize;
+		bool			mSegmentOffload; // Whether runs of DATA packets are handed to the kernel in one send.
+		char			*mSegmentBuff; // DATA packets waiting to be sent with a single UDP_SEGMENT send.
+		uint32_t		mSegmentLength; // Bytes used in mSegmentBuff.
+		uint32_t		mSegmentCount; // Packets in mSegmentBuff.
+		bool			mUseIoUring;
+		bool			mSqPoll;
+		IoUring			*mRing; // Send ring, NULL when using the blocking calls.
+		int				mFileFd; // The file opened for the ring's reads.
+		char			*mSlotData;
+		SendSlot		mSlots[kSendRingSlots];
+		uint32_t		mNextSlot;
+		bool			mUseReadAhead;
+		ReadAhead		*mReadAhead; // Reader thread, NULL when the send loop reads the file itself.
+		uint32_t        mTheTimeout; // mRto's timeout in milliseconds.
 		streampos		mFileOffset;
+		uint64_t		mHighSeqNum; // Sequence number following the furthest data sent so far.
+		bool			mEarlyData; // Whether the SYN carries the start of the data.
+		uint64_t		mEarlySeqNum; // Sequence number following the data sent before the SYN-ACK, or the final ACK if the FIN went too.
+		bool			mUseLossDetection;
+		LossDetector	*mLoss; // Send times for RTT samples, RACK and tail loss probes.
+		TransmissionTimer	*mLossTimer; // Fires when the reordering window or the probe timeout runs out, NULL if DisableLossDetection was called.
+		bool			mTailProbe; // The loss timer asked the send thread for a tail loss probe.
+		uint64_t		mRecoverySeqNum; // Losses found before the window passes this were already answered by a cut.
+		string			mCpuSpec; // Cores to pin the threads to, as EnableLowLatency takes them, or empty.
+		uint32_t		mBusyPoll; // Microseconds the kernel busy polls the socket for, 0 for not at all.
+		bool			mSpin; // Whether the listen and send threads spin before they block.
+		AdaptiveSpin	mListenSpin;
+		AdaptiveSpin	mSendSpin;
+		vector<PathConfig>	mPathConfigs; // Paths AddPath was given, opened by Start.
+		PathScheduler	*mPaths; // Picks the path of each DATA packet, NULL while there is only one.
+
+		// Statistics. They are all updated on the send thread.
+		StatsRegistry	mStats;
+		StatsExporter	*mStatsExporter; // NULL unless EnableStats was called.
+		StatsCounter	mStatDataSent;
+		StatsCounter	mStatBytesSent;
+		StatsCounter	mStatRetransmits;
+		StatsCounter	mStatParitySent;
+		StatsCounter	mStatAcksReceived;
+		StatsCounter	mStatDupAcks;
+		StatsCounter	mStatTimeOuts;
+		StatsCounter	mStatLosses;
+		StatsCounter	mStatTailProbes;
+		StatsGauge		mStatCongWin;
+		StatsGauge		mStatWindow;
+		StatsGauge		mStatRecvWin;
+		StatsGauge		mStatTimeOut;
+		StatsHistogram	mStatRtt;
+
+		Trace			*mTrace; // NULL unless EnableTrace was called.
+		uint32_t		mTracedCongWin; // Congestion window in the last TRACE_CWND event.
+		StageTimers		*mStages; // NULL unless EnableStageTimers was called.
+
+		StreamBuffer	*mSource; // Not owned. Holds the data in place of the file, or NULL.
+		bool			mUnknownSize; // The stream was started with kStreamUnknownSize bytes, and EndStream sets its length.
+		ostream			*mLog; // Where progress is reported, cout unless SetLog was called.
+		void			*mNotifyCaller;
+		void			(*mNotify)(void*); // Called when the state changes or data is acknowledged, or NULL.
 };
 #endif
 
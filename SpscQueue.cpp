@@ -0,0 +1,97 @@
+/*
+ * File: SpscQueue.cpp
+ * Desc: A bounded lock free queue between exactly one producer thread and
+ * one consumer thread.
+ */
+#include "SpscQueue.h"
+
+/*!
+	\param capacity The most values the queue must hold at once. The ring is
+	rounded up to a power of two.
+*/
+SpscQueue::SpscQueue(uint32_t capacity)
+	: mTail(0), mCachedHead(0), mHead(0), mCachedTail(0)
+{
+	uint32_t fSize = 1;
+
+	while (fSize < capacity)
+	{
+		fSize <<= 1;
+	}
+
+	mValues = new uint32_t[fSize];
+	mMask = fSize - 1;
+}
+
+SpscQueue::~SpscQueue()
+{
+	delete [] mValues;
+}
+
+/*!
+	\brief Adds a value to the back of the queue. Producer only.
+	\return false if the queue is full.
+*/
+bool SpscQueue::Push(uint32_t value)
+{
+	if (mTail - mCachedHead > mMask)
+	{
+		mCachedHead = __atomic_load_n(&mHead, __ATOMIC_ACQUIRE);
+
+		if (mTail - mCachedHead > mMask)
+		{
+			return false;
+		}
+	}
+
+	mValues[mTail & mMask] = value;
+
+	// Publish the value before the new tail.
+	__atomic_store_n(&mTail, mTail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*!
+	\brief Takes the value at the front of the queue. Consumer only.
+	\return false if the queue is empty.
+*/
+bool SpscQueue::Pop(uint32_t *value)
+{
+	if (mHead == mCachedTail)
+	{
+		mCachedTail = __atomic_load_n(&mTail, __ATOMIC_ACQUIRE);
+
+		if (mHead == mCachedTail)
+		{
+			return false;
+		}
+	}
+
+	*value = mValues[mHead & mMask];
+
+	// Hand the slot back only after the value has been read.
+	__atomic_store_n(&mHead, mHead + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*!
+	\brief Returns the number of values in the queue. Either thread may call it,
+	and the answer may be stale by the time it is used.
+*/
+uint32_t SpscQueue::GetSize()
+{
+	uint32_t fHead = __atomic_load_n(&mHead, __ATOMIC_ACQUIRE);
+	uint32_t fTail = __atomic_load_n(&mTail, __ATOMIC_ACQUIRE);
+
+	return fTail - fHead;
+}
+
+/*!
+	\brief Returns the number of values the queue can hold.
+*/
+uint32_t SpscQueue::GetCapacity()
+{
+	return mMask + 1;
+}
@@ -0,0 +1,43 @@
+/*
+ * File: SpscQueue.h
+ * Desc: A bounded lock free queue between exactly one producer thread and
+ * one consumer thread.
+ */
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <inttypes.h>
+
+#define kSpscQueueCacheLine 64
+
+/*! \class SpscQueue
+    \brief Passes 32 bit values, such as buffer indexes, from one thread to another.
+
+   The values live in a power of two ring. Only the producer moves the tail and
+   only the consumer moves the head, so Push and Pop need no lock, just an
+   acquire load of the other side's index. The two indexes sit on separate cache
+   lines, and each side keeps a copy of the other side's index that it refreshes
+   only when the ring looks full or empty, so the threads rarely touch the same
+   line. Push must only be called by the producer and Pop by the consumer.
+*/
+class SpscQueue {
+	public:
+		SpscQueue(uint32_t capacity);
+		virtual ~SpscQueue();
+
+		bool			Push(uint32_t value);
+		bool			Pop(uint32_t *value);
+		uint32_t		GetSize();
+		uint32_t		GetCapacity();
+
+	private:
+		uint32_t		*mValues;
+		uint32_t		mMask;
+
+		uint32_t		mTail __attribute__((aligned(kSpscQueueCacheLine))); // Written by the producer.
+		uint32_t		mCachedHead; // The producer's last look at mHead.
+
+		uint32_t		mHead __attribute__((aligned(kSpscQueueCacheLine))); // Written by the consumer.
+		uint32_t		mCachedTail; // The consumer's last look at mTail.
+};
+#endif
@@ -0,0 +1,209 @@
+/*
+ * File: StageTimer.cpp
+ * Desc: Scoped timers that split each packet's time into pipeline stages, with
+ * per thread log linear histograms merged into a percentile breakdown.
+ */
+#include <iomanip>
+#include <string.h>
+#include <time.h>
+
+#include "StageTimer.h"
+
+static const char *kStageNames[kStageCount] =
+{
+	"file_read",
+	"packet_build",
+	"send",
+	"ack_parse",
+	"ack_to_send",
+	"recv_parse",
+	"reorder",
+	"disk_write"
+};
+
+// The histograms of the calling thread, created on its first sample.
+static __thread StageThread *tStageThread = NULL;
+
+/*!
+	\brief Returns the CLOCK_MONOTONIC_RAW time in nanoseconds.
+*/
+static uint64_t getRawNanoSeconds()
+{
+	struct timespec fNow;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &fNow);
+
+	return ((uint64_t)fNow.tv_sec * 1000000000) + fNow.tv_nsec;
+}
+
+/*!
+	\brief Returns the bucket a value is counted in.
+*/
+static unsigned getStageBucket(uint64_t value)
+{
+	if (value < kStageSubBuckets)
+	{
+		return (unsigned)value;
+	}
+
+	// Keep the top kStageSubBucketBits bits below the leading one.
+	unsigned fShift = (63 - __builtin_clzll(value)) - kStageSubBucketBits;
+	return ((fShift + 1) * kStageSubBuckets) + (unsigned)((value >> fShift) - kStageSubBuckets);
+}
+
+/*!
+	\brief Returns the middle of the range of values counted in a bucket.
+*/
+static uint64_t getStageBucketValue(unsigned bucket)
+{
+	if (bucket < kStageSubBuckets)
+	{
+		return bucket;
+	}
+
+	unsigned fShift = (bucket / kStageSubBuckets) - 1;
+	uint64_t fLow = (uint64_t)(kStageSubBuckets + (bucket % kStageSubBuckets)) << fShift;
+
+	return fLow + (((uint64_t)1 << fShift) / 2);
+}
+
+/*!
+	\brief Returns the value below which a given share of the samples fall.
+	\param buckets The merged histogram.
+	\param count The number of samples in it.
+	\param fraction The share, from 0 to 1.
+*/
+static uint64_t getStagePercentile(uint64_t *buckets, uint64_t count, double fraction)
+{
+	uint64_t fTarget = (uint64_t)((count * fraction) + 0.5);
+	uint64_t fSeen = 0;
+
+	if (fTarget == 0)
+	{
+		fTarget = 1;
+	}
+
+	for (unsigned i = 0; i < kStageBuckets; i++)
+	{
+		fSeen += buckets[i];
+
+		if (fSeen >= fTarget)
+		{
+			return getStageBucketValue(i);
+		}
+	}
+
+	return 0;
+}
+
+StageTimers::StageTimers()
+	: mStartTicks(readStageClock()), mStartNanoSeconds(getRawNanoSeconds())
+{
+}
+
+/*!
+	\brief Frees the histograms of every thread. No thread may record afterwards.
+*/
+StageTimers::~StageTimers()
+{
+	for (size_t i = 0; i < mThreads.size(); i++)
+	{
+		delete mThreads[i];
+	}
+}
+
+/*!
+	\brief Adds a sample to the calling thread's histogram for a stage.
+	\param stage The stage timed.
+	\param ticks How long it took, from readStageClock.
+*/
+void StageTimers::Record(Stage stage, uint64_t ticks)
+{
+	StageThread *fThread = tStageThread;
+
+	if (fThread == NULL || fThread->mOwner != this)
+	{
+		fThread = _AddThread();
+	}
+
+	// Relaxed stores, like StatsHistogram, so a report taken while the
+	// thread still runs reads whole values.
+	unsigned fBucket = getStageBucket(ticks);
+	__atomic_store_n(&fThread->mBuckets[stage][fBucket], fThread->mBuckets[stage][fBucket] + 1, __ATOMIC_RELAXED);
+
+	if (ticks > fThread->mMax[stage])
+	{
+		__atomic_store_n(&fThread->mMax[stage], ticks, __ATOMIC_RELAXED);
+	}
+}
+
+/*!
+	\brief Creates the calling thread's histograms and adds them to the ones
+	merged by PrintSummary.
+*/
+StageThread *StageTimers::_AddThread()
+{
+	StageThread *fThread = new StageThread;
+
+	memset(fThread, 0, sizeof(StageThread));
+	fThread->mOwner = this;
+
+	mThreadLock.Lock();
+	mThreads.push_back(fThread);
+	mThreadLock.Unlock();
+
+	tStageThread = fThread;
+	return fThread;
+}
+
+/*!
+	\brief Prints the count, median, 99th and 99.9th percentile and maximum of
+	every stage with samples, merged across threads, in microseconds.
+*/
+void StageTimers::PrintSummary(ostream &out)
+{
+	uint64_t fTicks = readStageClock() - mStartTicks;
+	uint64_t fNanoSeconds = getRawNanoSeconds() - mStartNanoSeconds;
+	double fTicksPerMicroSecond = (fNanoSeconds > 0) ? (fTicks * 1000.0) / fNanoSeconds : 1000.0;
+	uint64_t fBuckets[kStageBuckets];
+
+	out<<"Stage latencies (microseconds):"<<endl;
+	out<<"\t"<<left<<setw(14)<<"stage"<<right<<setw(10)<<"count"<<setw(10)<<"p50"<<setw(10)<<"p99"
+		<<setw(10)<<"p999"<<setw(10)<<"max"<<endl;
+
+	mThreadLock.Lock();
+
+	for (int s = 0; s < kStageCount; s++)
+	{
+		uint64_t fCount = 0;
+		uint64_t fMax = 0;
+
+		memset(fBuckets, 0, sizeof(fBuckets));
+
+		for (size_t t = 0; t < mThreads.size(); t++)
+		{
+			for (unsigned i = 0; i < kStageBuckets; i++)
+			{
+				uint64_t fValue = __atomic_load_n(&mThreads[t]->mBuckets[s][i], __ATOMIC_RELAXED);
+				fBuckets[i] += fValue;
+				fCount += fValue;
+			}
+
+			uint64_t fThreadMax = __atomic_load_n(&mThreads[t]->mMax[s], __ATOMIC_RELAXED);
+			fMax = (fThreadMax > fMax) ? fThreadMax : fMax;
+		}
+
+		if (fCount == 0)
+		{
+			continue;
+		}
+
+		out<<"\t"<<left<<setw(14)<<kStageNames[s]<<right<<setw(10)<<fCount<<fixed<<setprecision(2)
+			<<setw(10)<<(getStagePercentile(fBuckets, fCount, 0.5) / fTicksPerMicroSecond)
+			<<setw(10)<<(getStagePercentile(fBuckets, fCount, 0.99) / fTicksPerMicroSecond)
+			<<setw(10)<<(getStagePercentile(fBuckets, fCount, 0.999) / fTicksPerMicroSecond)
+			<<setw(10)<<(fMax / fTicksPerMicroSecond)<<endl;
+	}
+
+	mThreadLock.Unlock();
+	out.unsetf(ios_base::floatfield);
+}
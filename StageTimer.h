@@ -0,0 +1,118 @@
+/*
+ * File: StageTimer.h
+ * Desc: Scoped timers that split each packet's time into pipeline stages, with
+ * per thread log linear histograms merged into a percentile breakdown.
+ */
+#ifndef _STAGE_TIMER_H_
+#define _STAGE_TIMER_H_
+
+#include <inttypes.h>
+#include <iostream>
+#include <vector>
+
+#include "Mutex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define kStageSubBucketBits 4 // Each power of two is split into 2^4 buckets, for about 6% resolution.
+#define kStageSubBuckets (1 << kStageSubBucketBits)
+#define kStageBuckets (64 * kStageSubBuckets)
+
+using namespace std;
+
+/*
+ * The stages timed. A stage may contain another: recv_parse covers all the
+ * handling of a datagram, including its reorder and, without a writer thread,
+ * its disk write, and a reorder that drains the cache includes the writes.
+ */
+enum Stage
+{
+	STAGE_FILE_READ, // Sender: reading a packet's payload, from the file or the read ahead ring.
+	STAGE_PACKET_BUILD, // Sender: writing a DATA header, or queueing the packet on io_uring.
+	STAGE_SEND, // Sender: the send system call, or an io_uring submission.
+	STAGE_ACK_PARSE, // Sender: handling an ACK.
+	STAGE_ACK_TO_SEND, // Sender: from an ACK's arrival to the first send after the send thread handled it.
+	STAGE_RECV_PARSE, // Receiver: handling one datagram.
+	STAGE_REORDER, // Receiver: adding a packet to the out of order cache, or draining it once a hole is filled.
+	STAGE_DISK_WRITE, // Receiver: one file write, on whichever thread makes it.
+	kStageCount
+};
+
+/*! \struct StageThread
+    \brief The histograms of one thread. Only that thread writes them.
+*/
+struct StageThread {
+	const void	*mOwner; // The StageTimers these belong to.
+	uint64_t	mBuckets[kStageCount][kStageBuckets];
+	uint64_t	mMax[kStageCount];
+};
+
+/*! \class StageTimers
+    \brief Collects stage durations from every thread of a transfer.
+
+   Durations are measured in TSC ticks where the CPU has a TSC, and in
+   CLOCK_MONOTONIC_RAW nanoseconds elsewhere. The tick rate is measured against
+   CLOCK_MONOTONIC_RAW over the whole transfer when the report is printed.
+
+   Each thread records into its own histograms, found through a thread local
+   pointer, so recording takes no lock and shares no cache lines. The buckets
+   are HdrHistogram style: exact below kStageSubBuckets, then kStageSubBuckets
+   linear steps per power of two.
+*/
+class StageTimers {
+	public:
+		StageTimers();
+		virtual ~StageTimers();
+
+		void		Record(Stage stage, uint64_t ticks);
+		void		PrintSummary(ostream &out);
+
+	private:
+		StageThread*	_AddThread();
+
+		vector<StageThread*>	mThreads;
+		Mutex					mThreadLock; // Guards mThreads.
+		uint64_t				mStartTicks;
+		uint64_t				mStartNanoSeconds;
+};
+
+/*
+ * Reads the clock the stage timers count in.
+ */
+inline uint64_t readStageClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec fNow;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &fNow);
+
+	return ((uint64_t)fNow.tv_sec * 1000000000) + fNow.tv_nsec;
+#endif
+}
+
+/*! \class ScopedStageTimer
+    \brief Times its own scope as one sample of a stage. Does nothing, apart
+    from a compare, when timers is NULL.
+*/
+class ScopedStageTimer {
+	public:
+		ScopedStageTimer(StageTimers *timers, Stage stage)
+			: mTimers(timers), mStage(stage), mStart((timers != NULL) ? readStageClock() : 0) {}
+
+		~ScopedStageTimer()
+		{
+			if (mTimers != NULL)
+			{
+				mTimers->Record(mStage, readStageClock() - mStart);
+			}
+		}
+
+	private:
+		StageTimers	*mTimers;
+		Stage		mStage;
+		uint64_t	mStart;
+};
+#endif
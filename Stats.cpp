@@ -0,0 +1,476 @@
+/*
+ * File: Stats.cpp
+ * Desc: Counters, gauges and histograms updated from the packet paths, and
+ * their export as JSON, Prometheus text and an end of transfer summary.
+ */
+#include <errno.h>
+#include <fstream>
+#include <poll.h>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Stats.h"
+#include "Transmission.h"
+
+/*!
+	\brief Returns the upper bound of a histogram bucket.
+*/
+static uint64_t getBucketBound(unsigned bucket)
+{
+	return (uint64_t)1 << bucket;
+}
+
+StatsHistogram::StatsHistogram()
+	: mCount(0), mSum(0)
+{
+	memset(mBuckets, 0, sizeof(mBuckets));
+}
+
+/*!
+	\brief Adds a sample to the bucket of the smallest power of two that holds it.
+	\param value The sample.
+*/
+void StatsHistogram::Record(uint64_t value)
+{
+	unsigned fBucket = (value <= 1) ? 0 : 64 - __builtin_clzll(value - 1);
+
+	if (fBucket < kStatsHistogramBuckets)
+	{
+		__atomic_store_n(&mBuckets[fBucket], mBuckets[fBucket] + 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&mCount, mCount + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&mSum, mSum + value, __ATOMIC_RELAXED);
+}
+
+/*!
+	\brief Returns the upper bound of the bucket holding the given percentile, or
+	0 if there are no samples.
+	\param percent The percentile, from 1 to 100.
+*/
+uint64_t StatsHistogram::GetPercentile(unsigned percent)
+{
+	uint64_t fCount = GetCount();
+	uint64_t fTarget = ((fCount * percent) + 99) / 100;
+	uint64_t fSeen = 0;
+
+	if (fCount == 0)
+	{
+		return 0;
+	}
+
+	for (unsigned i = 0; i < kStatsHistogramBuckets; i++)
+	{
+		fSeen += GetBucket(i);
+
+		if (fSeen >= fTarget)
+		{
+			return getBucketBound(i);
+		}
+	}
+
+	// The sample is past the last bucket.
+	return getBucketBound(kStatsHistogramBuckets);
+}
+
+/*!
+	\param prefix Put in front of every metric name in the Prometheus export,
+	e.g. "relsend".
+*/
+StatsRegistry::StatsRegistry(const char *prefix)
+	: mPrefix(prefix)
+{
+}
+
+/*!
+	\brief Registers a counter under name, described by help.
+*/
+void StatsRegistry::Add(const char *name, const char *help, StatsCounter *counter)
+{
+	StatsEntry fEntry = { STATS_COUNTER, name, help, counter };
+	mEntries.push_back(fEntry);
+}
+
+/*!
+	\brief Registers a gauge under name, described by help.
+*/
+void StatsRegistry::Add(const char *name, const char *help, StatsGauge *gauge)
+{
+	StatsEntry fEntry = { STATS_GAUGE, name, help, gauge };
+	mEntries.push_back(fEntry);
+}
+
+/*!
+	\brief Registers a histogram under name, described by help.
+*/
+void StatsRegistry::Add(const char *name, const char *help, StatsHistogram *histogram)
+{
+	StatsEntry fEntry = { STATS_HISTOGRAM, name, help, histogram };
+	mEntries.push_back(fEntry);
+}
+
+/*!
+	\brief Returns every metric as one JSON object keyed by name. Histograms are
+	objects with their count, sum, median, 99th percentile and the non empty
+	buckets as [upper bound, count] pairs.
+*/
+string StatsRegistry::ToJson()
+{
+	ostringstream fOut;
+	fOut<<"{";
+
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		StatsEntry &fEntry = mEntries[i];
+		fOut<<((i > 0) ? ",\n" : "\n")<<"\t\""<<fEntry.mName<<"\": ";
+
+		if (fEntry.mType == STATS_COUNTER)
+		{
+			fOut<<((StatsCounter*)fEntry.mMetric)->Get();
+		}
+		else if (fEntry.mType == STATS_GAUGE)
+		{
+			fOut<<((StatsGauge*)fEntry.mMetric)->Get();
+		}
+		else
+		{
+			StatsHistogram *fHistogram = (StatsHistogram*)fEntry.mMetric;
+			bool fFirst = true;
+
+			fOut<<"{\"count\": "<<fHistogram->GetCount()<<", \"sum\": "<<fHistogram->GetSum()
+				<<", \"p50\": "<<fHistogram->GetPercentile(50)<<", \"p99\": "<<fHistogram->GetPercentile(99)<<", \"buckets\": [";
+
+			for (unsigned b = 0; b < kStatsHistogramBuckets; b++)
+			{
+				if (fHistogram->GetBucket(b) > 0)
+				{
+					fOut<<(fFirst ? "" : ", ")<<"["<<getBucketBound(b)<<", "<<fHistogram->GetBucket(b)<<"]";
+					fFirst = false;
+				}
+			}
+
+			fOut<<"]}";
+		}
+	}
+
+	fOut<<"\n}\n";
+
+	return fOut.str();
+}
+
+/*!
+	\brief Returns every metric in the Prometheus text exposition format.
+	Counters get the conventional _total suffix.
+*/
+string StatsRegistry::ToPrometheus()
+{
+	ostringstream fOut;
+
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		StatsEntry &fEntry = mEntries[i];
+		string fName = mPrefix + "_" + fEntry.mName;
+
+		if (fEntry.mType == STATS_COUNTER)
+		{
+			fName += "_total";
+			fOut<<"# HELP "<<fName<<" "<<fEntry.mHelp<<"\n";
+			fOut<<"# TYPE "<<fName<<" counter\n";
+			fOut<<fName<<" "<<((StatsCounter*)fEntry.mMetric)->Get()<<"\n";
+		}
+		else if (fEntry.mType == STATS_GAUGE)
+		{
+			fOut<<"# HELP "<<fName<<" "<<fEntry.mHelp<<"\n";
+			fOut<<"# TYPE "<<fName<<" gauge\n";
+			fOut<<fName<<" "<<((StatsGauge*)fEntry.mMetric)->Get()<<"\n";
+		}
+		else
+		{
+			StatsHistogram *fHistogram = (StatsHistogram*)fEntry.mMetric;
+			uint64_t fCumulative = 0;
+
+			fOut<<"# HELP "<<fName<<" "<<fEntry.mHelp<<"\n";
+			fOut<<"# TYPE "<<fName<<" histogram\n";
+
+			for (unsigned b = 0; b < kStatsHistogramBuckets; b++)
+			{
+				fCumulative += fHistogram->GetBucket(b);
+				fOut<<fName<<"_bucket{le=\""<<getBucketBound(b)<<"\"} "<<fCumulative<<"\n";
+			}
+
+			// Samples may land between the reads above, so keep +Inf from falling behind.
+			uint64_t fCount = fHistogram->GetCount();
+			fCount = (fCount > fCumulative) ? fCount : fCumulative;
+			fOut<<fName<<"_bucket{le=\"+Inf\"} "<<fCount<<"\n";
+			fOut<<fName<<"_sum "<<fHistogram->GetSum()<<"\n";
+			fOut<<fName<<"_count "<<fCount<<"\n";
+		}
+	}
+
+	return fOut.str();
+}
+
+/*!
+	\brief Prints one line per metric for the end of a transfer.
+	\param out Where to print.
+*/
+void StatsRegistry::PrintSummary(ostream &out)
+{
+	out<<"Statistics:"<<endl;
+
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		StatsEntry &fEntry = mEntries[i];
+		out<<"\t"<<fEntry.mName<<": "<<dec;
+
+		if (fEntry.mType == STATS_COUNTER)
+		{
+			out<<((StatsCounter*)fEntry.mMetric)->Get()<<endl;
+		}
+		else if (fEntry.mType == STATS_GAUGE)
+		{
+			out<<((StatsGauge*)fEntry.mMetric)->Get()<<endl;
+		}
+		else
+		{
+			StatsHistogram *fHistogram = (StatsHistogram*)fEntry.mMetric;
+			uint64_t fCount = fHistogram->GetCount();
+
+			out<<fCount<<" samples";
+
+			if (fCount > 0)
+			{
+				out<<", mean "<<(fHistogram->GetSum() / fCount)<<", p50 <= "<<fHistogram->GetPercentile(50)
+					<<", p99 <= "<<fHistogram->GetPercentile(99);
+			}
+
+			out<<endl;
+		}
+	}
+}
+
+/*!
+	\param registry The metrics to publish.
+	\param jsonFile The file to keep rewriting, or NULL for none.
+	\param port The local TCP port to serve Prometheus scrapes on, or 0 for none.
+*/
+StatsExporter::StatsExporter(StatsRegistry *registry, const char *jsonFile, unsigned short port)
+	: mRegistry(registry), mJsonFile((jsonFile != NULL) ? jsonFile : ""), mPort(port), mListenSocket(-1),
+	  mExportThread(_StartExport, this), mRunning(false)
+{
+	mStopPipe[0] = -1;
+	mStopPipe[1] = -1;
+}
+
+StatsExporter::~StatsExporter()
+{
+	Stop();
+
+	if (mListenSocket >= 0)
+	{
+		close(mListenSocket);
+	}
+
+	if (mStopPipe[0] >= 0)
+	{
+		close(mStopPipe[0]);
+		close(mStopPipe[1]);
+	}
+}
+
+/*!
+	\brief Opens the Prometheus socket, if a port was given, and starts the
+	export thread.
+	\return true if the export thread is running.
+*/
+bool StatsExporter::Start()
+{
+	if (mRunning)
+	{
+		return true;
+	}
+
+	if (mPort > 0 && !_OpenListenSocket())
+	{
+		cerr<<"StatsExporter [Start]: Unable to listen on port "<<dec<<mPort<<": "<<strerror(errno)<<endl;
+		return false;
+	}
+
+	if (pipe(mStopPipe) != 0)
+	{
+		return false;
+	}
+
+	mRunning = (mExportThread.Start() == 0);
+
+	return mRunning;
+}
+
+/*!
+	\brief Stops the export thread after a last rewrite of the JSON file. Does
+	nothing if the thread is not running.
+*/
+void StatsExporter::Stop()
+{
+	if (mRunning)
+	{
+		char fByte = 0;
+
+		if (write(mStopPipe[1], &fByte, 1) == 1)
+		{
+			mExportThread.Join();
+		}
+
+		mRunning = false;
+	}
+}
+
+/*!
+	\brief Opens a TCP socket listening on 127.0.0.1 at mPort.
+	\return true if it is listening.
+*/
+bool StatsExporter::_OpenListenSocket()
+{
+	struct sockaddr_in fAddr;
+	int fReuse = 1;
+
+	mListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (mListenSocket < 0)
+	{
+		return false;
+	}
+
+	setsockopt(mListenSocket, SOL_SOCKET, SO_REUSEADDR, &fReuse, sizeof(fReuse));
+
+	memset(&fAddr, 0, sizeof(fAddr));
+	fAddr.sin_family = AF_INET;
+	fAddr.sin_port = htons(mPort);
+	fAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(mListenSocket, (struct sockaddr*)&fAddr, sizeof(fAddr)) != 0 || listen(mListenSocket, 4) != 0)
+	{
+		close(mListenSocket);
+		mListenSocket = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/*!
+	\brief Writes the JSON export to a temporary file and renames it over mJsonFile.
+*/
+void StatsExporter::_WriteJson()
+{
+	if (mJsonFile.empty())
+	{
+		return;
+	}
+
+	string fTempFile = mJsonFile + ".tmp";
+	ofstream fFile(fTempFile.c_str(), ios::out | ios::trunc);
+
+	fFile<<mRegistry->ToJson();
+	fFile.close();
+
+	if (!fFile.good() || rename(fTempFile.c_str(), mJsonFile.c_str()) != 0)
+	{
+		cerr<<"StatsExporter [Write]: Unable to write "<<mJsonFile<<endl;
+	}
+}
+
+/*!
+	\brief Accepts a waiting connection and answers it with the Prometheus export
+	as a minimal HTTP response, whatever was asked for.
+*/
+void StatsExporter::_ServeScrape()
+{
+	int fSocket = accept(mListenSocket, NULL, NULL);
+
+	if (fSocket < 0)
+	{
+		return;
+	}
+
+	// Read the request so closing does not reset the connection, but never wait long for it.
+	struct timeval fTimeOut = { 0, 100000 };
+	char fRequest[1024];
+	setsockopt(fSocket, SOL_SOCKET, SO_RCVTIMEO, &fTimeOut, sizeof(fTimeOut));
+	recv(fSocket, fRequest, sizeof(fRequest), 0);
+
+	string fBody = mRegistry->ToPrometheus();
+	ostringstream fResponse;
+	fResponse<<"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+		<<fBody.size()<<"\r\nConnection: close\r\n\r\n"<<fBody;
+
+	string fData = fResponse.str();
+	size_t fSent = 0;
+
+	while (fSent < fData.size())
+	{
+		ssize_t fResult = send(fSocket, fData.data() + fSent, fData.size() - fSent, MSG_NOSIGNAL);
+
+		if (fResult <= 0)
+		{
+			break;
+		}
+
+		fSent += (size_t)fResult;
+	}
+
+	close(fSocket);
+}
+
+/*!
+	\brief Entry point of the export thread. Sleeps in poll until the next JSON
+	rewrite is due, a scrape arrives or Stop is called.
+	\param args The StatsExporter that started the thread.
+*/
+void *StatsExporter::_StartExport(void *args)
+{
+	StatsExporter *fExporter = (StatsExporter*)args;
+	uint64_t fNextWrite = getMonotonicMicroSeconds() / 1000;
+	struct pollfd fPoll[2];
+
+	fPoll[0].fd = fExporter->mStopPipe[0];
+	fPoll[0].events = POLLIN;
+	fPoll[1].fd = fExporter->mListenSocket; // Ignored by poll when negative.
+	fPoll[1].events = POLLIN;
+
+	while (true)
+	{
+		uint64_t fNow = getMonotonicMicroSeconds() / 1000;
+
+		if (fNow >= fNextWrite)
+		{
+			fExporter->_WriteJson();
+			fNextWrite = fNow + kStatsWriteInterval;
+		}
+
+		if (poll(fPoll, 2, (int)(fNextWrite - fNow)) < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		if (fPoll[0].revents & POLLIN)
+		{
+			break;
+		}
+
+		if (fPoll[1].revents & POLLIN)
+		{
+			fExporter->_ServeScrape();
+		}
+	}
+
+	fExporter->_WriteJson();
+
+	return NULL;
+}
@@ -0,0 +1,147 @@
+/*
+ * File: Stats.h
+ * Desc: Counters, gauges and histograms updated from the packet paths, and
+ * their export as JSON, Prometheus text and an end of transfer summary.
+ */
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <inttypes.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Thread.h"
+
+#define kStatsHistogramBuckets 24 // Bucket i counts values up to 2^i; larger values only reach the total.
+#define kStatsWriteInterval 1000 // Milliseconds between rewrites of the JSON file.
+
+using namespace std;
+
+/*! \class StatsCounter
+    \brief A total that only goes up, such as packets sent.
+
+   Only one thread may update a counter at a time, either because a single
+   thread owns it or because the updates happen under a lock the caller already
+   holds. That lets Add be a relaxed load and store, with no locked instruction,
+   while any thread may read a recent value without a lock.
+*/
+class StatsCounter {
+	public:
+		StatsCounter() : mValue(0) {}
+
+		void		Add(uint64_t count = 1) { __atomic_store_n(&mValue, mValue + count, __ATOMIC_RELAXED); }
+		uint64_t	Get() { return __atomic_load_n(&mValue, __ATOMIC_RELAXED); }
+
+	private:
+		uint64_t	mValue;
+};
+
+/*! \class StatsGauge
+    \brief A value that moves both ways, such as the congestion window.
+*/
+class StatsGauge {
+	public:
+		StatsGauge() : mValue(0) {}
+
+		void		Set(int64_t value) { __atomic_store_n(&mValue, value, __ATOMIC_RELAXED); }
+		int64_t		Get() { return __atomic_load_n(&mValue, __ATOMIC_RELAXED); }
+
+	private:
+		int64_t		mValue;
+};
+
+/*! \class StatsHistogram
+    \brief A distribution of samples, such as round trip times, in power of two buckets.
+
+   Like StatsCounter, a histogram has one writer at a time, and recording a
+   sample is three relaxed stores. The buckets are not cumulative; the exporters
+   add them up.
+*/
+class StatsHistogram {
+	public:
+		StatsHistogram();
+
+		void		Record(uint64_t value);
+		uint64_t	GetCount() { return __atomic_load_n(&mCount, __ATOMIC_RELAXED); }
+		uint64_t	GetSum() { return __atomic_load_n(&mSum, __ATOMIC_RELAXED); }
+		uint64_t	GetBucket(unsigned bucket) { return __atomic_load_n(&mBuckets[bucket], __ATOMIC_RELAXED); }
+		uint64_t	GetPercentile(unsigned percent);
+
+	private:
+		uint64_t	mBuckets[kStatsHistogramBuckets];
+		uint64_t	mCount;
+		uint64_t	mSum;
+};
+
+enum StatsType
+{
+	STATS_COUNTER,
+	STATS_GAUGE,
+	STATS_HISTOGRAM
+};
+
+/*! \struct StatsEntry
+    \brief A metric registered with a StatsRegistry.
+*/
+struct StatsEntry {
+	StatsType		mType;
+	string			mName;
+	string			mHelp;
+	void			*mMetric;
+};
+
+/*! \class StatsRegistry
+    \brief Names the metrics of one connection so they can be exported together.
+
+   The metrics themselves are owned by the caller, usually as members, and must
+   outlive the registry. Register everything before the transfer starts; only
+   the exports read the list afterwards.
+*/
+class StatsRegistry {
+	public:
+		StatsRegistry(const char *prefix);
+
+		void		Add(const char *name, const char *help, StatsCounter *counter);
+		void		Add(const char *name, const char *help, StatsGauge *gauge);
+		void		Add(const char *name, const char *help, StatsHistogram *histogram);
+		string		ToJson();
+		string		ToPrometheus();
+		void		PrintSummary(ostream &out);
+
+	private:
+		string				mPrefix;
+		vector<StatsEntry>	mEntries;
+};
+
+/*! \class StatsExporter
+    \brief Publishes a StatsRegistry from its own thread while a transfer runs.
+
+   Every kStatsWriteInterval the JSON export is written to a temporary file and
+   renamed over the JSON file, so readers never see half of it. A TCP socket on
+   127.0.0.1 answers each connection with the Prometheus text export, so the
+   address can be scraped directly.
+*/
+class StatsExporter {
+	public:
+		StatsExporter(StatsRegistry *registry, const char *jsonFile, unsigned short port);
+		virtual ~StatsExporter();
+
+		bool			Start();
+		void			Stop();
+
+	private:
+		static void*	_StartExport(void *);
+		bool			_OpenListenSocket();
+		void			_WriteJson();
+		void			_ServeScrape();
+
+		StatsRegistry	*mRegistry;
+		string			mJsonFile;
+		unsigned short	mPort; // 0 for no Prometheus endpoint.
+		int				mListenSocket;
+		int				mStopPipe[2]; // Written by Stop to wake the export thread.
+		Thread			mExportThread;
+		bool			mRunning;
+};
+#endif
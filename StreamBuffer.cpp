@@ -0,0 +1,141 @@
+/*
+ * File: StreamBuffer.cpp
+ * Desc: A bounded ring of stream bytes between an application and a
+ * connection, addressed by their offset in the stream.
+ */
+#include <string.h>
+
+#include "StreamBuffer.h"
+
+/*!
+	\param capacity The most bytes held at once.
+*/
+StreamBuffer::StreamBuffer(size_t capacity)
+	: mData(new char[capacity]), mCapacity(capacity), mStart(0), mEnd(0)
+{
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	delete [] mData;
+}
+
+/*!
+	\brief Appends as many bytes as fit after the newest one.
+	\return The number of bytes taken, 0 if the buffer is full.
+*/
+size_t StreamBuffer::Write(const char *data, size_t size)
+{
+	mLock.Lock();
+
+	uint64_t fEnd = mEnd;
+	size_t fFree = mCapacity - (size_t)(mEnd - mStart);
+
+	mLock.Unlock();
+
+	// Only this thread moves mEnd, and Release only frees more room.
+	size_t fLength = (size < fFree) ? size : fFree;
+	size_t fCopied = 0;
+
+	while (fCopied < fLength)
+	{
+		size_t fIndex = (size_t)((fEnd + fCopied) % mCapacity);
+		size_t fPart = ((mCapacity - fIndex) < (fLength - fCopied)) ? mCapacity - fIndex : fLength - fCopied;
+
+		memcpy(mData + fIndex, data + fCopied, fPart);
+		fCopied += fPart;
+	}
+
+	mLock.Lock();
+	mEnd += fLength;
+	mLock.Unlock();
+
+	return fLength;
+}
+
+/*!
+	\brief Copies bytes from the given stream offset, leaving them held.
+	\param offset Stream offset of the first byte, no lower than GetStart.
+	\return The number of bytes copied, which is short when the end is reached
+	and 0 if offset is not held.
+*/
+size_t StreamBuffer::Read(uint64_t offset, char *data, size_t size)
+{
+	mLock.Lock();
+
+	size_t fLength = 0;
+
+	if (offset >= mStart && offset < mEnd)
+	{
+		fLength = ((mEnd - offset) < size) ? (size_t)(mEnd - offset) : size;
+	}
+
+	// The bytes cannot be released or overwritten while the lock is held.
+	size_t fCopied = 0;
+
+	while (fCopied < fLength)
+	{
+		size_t fIndex = (size_t)((offset + fCopied) % mCapacity);
+		size_t fPart = ((mCapacity - fIndex) < (fLength - fCopied)) ? mCapacity - fIndex : fLength - fCopied;
+
+		memcpy(data + fCopied, mData + fIndex, fPart);
+		fCopied += fPart;
+	}
+
+	mLock.Unlock();
+
+	return fLength;
+}
+
+/*!
+	\brief Drops every byte before the given stream offset, making room for
+	more. Offsets at or before GetStart are ignored.
+*/
+void StreamBuffer::Release(uint64_t offset)
+{
+	mLock.Lock();
+
+	if (offset > mStart)
+	{
+		mStart = (offset < mEnd) ? offset : mEnd;
+	}
+
+	mLock.Unlock();
+}
+
+/*!
+	\brief Returns the stream offset of the oldest byte held.
+*/
+uint64_t StreamBuffer::GetStart()
+{
+	mLock.Lock();
+	uint64_t fStart = mStart;
+	mLock.Unlock();
+
+	return fStart;
+}
+
+/*!
+	\brief Returns the stream offset following the newest byte held, which is
+	the number of bytes written so far.
+*/
+uint64_t StreamBuffer::GetEnd()
+{
+	mLock.Lock();
+	uint64_t fEnd = mEnd;
+	mLock.Unlock();
+
+	return fEnd;
+}
+
+/*!
+	\brief Returns how many more bytes Write would take.
+*/
+size_t StreamBuffer::GetFree()
+{
+	mLock.Lock();
+	size_t fFree = mCapacity - (size_t)(mEnd - mStart);
+	mLock.Unlock();
+
+	return fFree;
+}
@@ -0,0 +1,44 @@
+/*
+ * File: StreamBuffer.h
+ * Desc: A bounded ring of stream bytes between an application and a
+ * connection, addressed by their offset in the stream.
+ */
+#ifndef _STREAMBUFFER_H_
+#define _STREAMBUFFER_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "Mutex.h"
+
+/*! \class StreamBuffer
+    \brief Holds the part of a byte stream between two offsets.
+
+   Bytes are appended at the end with Write and dropped from the start with
+   Release, and any byte in between can be copied out with Read, by its offset
+   in the whole stream. The sender keeps data here until it is acknowledged,
+   reading it again for each retransmission; the receiver appends in order data
+   and the application reads and releases it. At most the capacity given to the
+   constructor is held, so Write takes only as much as fits. One thread may
+   write while another reads and releases.
+*/
+class StreamBuffer {
+	public:
+		StreamBuffer(size_t capacity);
+		virtual ~StreamBuffer();
+
+		size_t			Write(const char *data, size_t size);
+		size_t			Read(uint64_t offset, char *data, size_t size);
+		void			Release(uint64_t offset);
+		uint64_t		GetStart();
+		uint64_t		GetEnd();
+		size_t			GetFree();
+
+	private:
+		char			*mData;
+		size_t			mCapacity;
+		uint64_t		mStart; // Stream offset of the oldest byte held.
+		uint64_t		mEnd; // Stream offset following the newest byte held.
+		Mutex			mLock; // Guards mStart and mEnd.
+};
+#endif
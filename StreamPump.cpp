@@ -0,0 +1,229 @@
+/*
+ * File: StreamPump.cpp
+ * Desc: Moves a byte stream between a file descriptor, such as a pipe or
+ * standard input or output, and a StreamBuffer on its own thread.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "StreamPump.h"
+#include "Transmission.h"
+
+/*!
+	\param fd The descriptor to read or write. It is not closed.
+	\param buffer The buffer on the connection's side.
+	\param direction Whether bytes go into the buffer or out of it.
+*/
+StreamPump::StreamPump(int fd, StreamBuffer *buffer, StreamPumpDirection direction)
+	: mFd(fd), mBuffer(buffer), mDirection(direction), mChunk(new char[kStreamPumpChunkSize]),
+	  mCount(0), mFailed(false), mFinish(false), mStop(false), mRunning(false),
+	  mThread(_StartPump, this), mCallbackCaller(NULL), mCallback(NULL)
+{
+}
+
+/*!
+	\brief Stops the pump thread without waiting for the buffer to empty.
+*/
+StreamPump::~StreamPump()
+{
+	if (mRunning)
+	{
+		mLock.Lock();
+		mStop = true;
+		mLock.Signal();
+		mLock.Unlock();
+		mThread.Join();
+	}
+
+	delete [] mChunk;
+}
+
+/*!
+	\brief Sets the function called on the pump thread after each move, at end
+	of file and on errors. Must be called before Start.
+*/
+void StreamPump::SetCallback(void *caller, void (*callback)(void *, StreamPumpEvent))
+{
+	mCallbackCaller = caller;
+	mCallback = callback;
+}
+
+/*!
+	\brief Starts the pump thread.
+	\return true if it is running.
+*/
+bool StreamPump::Start()
+{
+	if (!mRunning)
+	{
+		mRunning = (mThread.Start() == 0);
+	}
+
+	return mRunning;
+}
+
+/*!
+	\brief Tells the pump that the other end of the buffer moved.
+*/
+void StreamPump::Wake()
+{
+	mLock.Lock();
+	mLock.Signal();
+	mLock.Unlock();
+}
+
+/*!
+	\brief Waits for the pump thread to write out everything left in the
+	buffer, then stops it. Only for STREAM_PUMP_OUT, once nothing more will be
+	added to the buffer.
+	\return true if every byte was written.
+*/
+bool StreamPump::Finish()
+{
+	if (mRunning)
+	{
+		mLock.Lock();
+		mFinish = true;
+		mLock.Signal();
+		mLock.Unlock();
+		mThread.Join();
+		mRunning = false;
+	}
+
+	return !mFailed;
+}
+
+/*!
+	\brief Returns the number of bytes moved so far.
+*/
+uint64_t StreamPump::GetCount()
+{
+	return __atomic_load_n(&mCount, __ATOMIC_ACQUIRE);
+}
+
+void *StreamPump::_StartPump(void *args)
+{
+	StreamPump *fPump = (StreamPump*)args;
+
+	if (fPump->mDirection == STREAM_PUMP_IN)
+	{
+		fPump->_PumpIn();
+	}
+	else
+	{
+		fPump->_PumpOut();
+	}
+
+	return NULL;
+}
+
+/*!
+	\brief Reads the descriptor into the buffer until end of file, an error or
+	Stop. A read waits for at most kStreamPumpPollInterval, so the destructor
+	is not held up by a quiet pipe.
+*/
+void StreamPump::_PumpIn()
+{
+	while (_WaitForBuffer())
+	{
+		struct pollfd fPoll;
+		fPoll.fd = mFd;
+		fPoll.events = POLLIN;
+		fPoll.revents = 0;
+
+		if (poll(&fPoll, 1, kStreamPumpPollInterval) == 0)
+		{
+			continue;
+		}
+
+		// Only this thread adds to the buffer, so whatever is read fits.
+		size_t fLength = MIN(mBuffer->GetFree(), (size_t)kStreamPumpChunkSize);
+		ssize_t fRead = read(mFd, mChunk, fLength);
+
+		if (fRead < 0 && (errno == EINTR || errno == EAGAIN))
+		{
+			continue;
+		}
+
+		if (fRead <= 0)
+		{
+			mFailed = (fRead < 0);
+			_Callback(mFailed ? STREAM_PUMP_ERROR : STREAM_PUMP_END);
+			break;
+		}
+
+		mBuffer->Write(mChunk, (size_t)fRead);
+		__atomic_store_n(&mCount, mCount + fRead, __ATOMIC_RELEASE);
+		_Callback(STREAM_PUMP_MOVED);
+	}
+}
+
+/*!
+	\brief Writes the buffer out to the descriptor until Finish or Stop. After
+	a failed write the rest is released unwritten, so the connection can still
+	finish.
+*/
+void StreamPump::_PumpOut()
+{
+	while (_WaitForBuffer())
+	{
+		uint64_t fStart = mBuffer->GetStart();
+		size_t fLength = mBuffer->Read(fStart, mChunk, kStreamPumpChunkSize);
+		size_t fWritten = 0;
+
+		while (!mFailed && fWritten < fLength)
+		{
+			ssize_t fResult = write(mFd, mChunk + fWritten, fLength - fWritten);
+
+			if (fResult > 0)
+			{
+				fWritten += fResult;
+			}
+			else if (fResult < 0 && errno != EINTR)
+			{
+				mFailed = true;
+				_Callback(STREAM_PUMP_ERROR);
+			}
+		}
+
+		mBuffer->Release(fStart + fLength);
+		__atomic_store_n(&mCount, mCount + fLength, __ATOMIC_RELEASE);
+		_Callback(STREAM_PUMP_MOVED);
+	}
+}
+
+/*!
+	\brief Sleeps until the buffer has room to read into, or bytes to write out.
+	\return false once the pump should stop.
+*/
+bool StreamPump::_WaitForBuffer()
+{
+	bool fReady = false;
+
+	mLock.Lock();
+
+	while (!mStop)
+	{
+		fReady = (mDirection == STREAM_PUMP_IN) ? (mBuffer->GetFree() > 0) : (mBuffer->GetEnd() > mBuffer->GetStart());
+
+		if (fReady || mFinish)
+		{
+			break;
+		}
+
+		mLock.Wait();
+	}
+
+	mLock.Unlock();
+
+	return fReady && !mStop;
+}
+
+void StreamPump::_Callback(StreamPumpEvent event)
+{
+	if (mCallback != NULL)
+	{
+		mCallback(mCallbackCaller, event);
+	}
+}
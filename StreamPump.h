@@ -0,0 +1,78 @@
+/*
+ * File: StreamPump.h
+ * Desc: Moves a byte stream between a file descriptor, such as a pipe or
+ * standard input or output, and a StreamBuffer on its own thread.
+ */
+#ifndef _STREAMPUMP_H_
+#define _STREAMPUMP_H_
+
+#include <inttypes.h>
+
+#include "Mutex.h"
+#include "StreamBuffer.h"
+#include "Thread.h"
+
+#define kStreamPumpBufferSize 4194304 // Default size of the StreamBuffer a program pumps through.
+#define kStreamPumpChunkSize 65536 // Most bytes moved by one read or write.
+#define kStreamPumpPollInterval 100 // Milliseconds between checks for the destructor while waiting for input.
+
+enum StreamPumpDirection
+{
+	STREAM_PUMP_IN, // From the descriptor into the buffer.
+	STREAM_PUMP_OUT // From the buffer out to the descriptor.
+};
+
+enum StreamPumpEvent
+{
+	STREAM_PUMP_MOVED, // Bytes were added to or released from the buffer.
+	STREAM_PUMP_END, // The descriptor reached end of file, so no more bytes follow.
+	STREAM_PUMP_ERROR // The descriptor could not be read or written.
+};
+
+/*! \class StreamPump
+    \brief Copies between a descriptor and a StreamBuffer, so that data of any
+    length passes through a bounded amount of memory.
+
+   Going in, the pump reads the descriptor into the buffer while it has room,
+   and reports STREAM_PUMP_END at end of file. Going out, it writes each byte
+   added to the buffer to the descriptor and releases it. Reads and writes
+   block, so a slow consumer leaves the buffer full and a slow producer leaves
+   it empty, and the connection waits for them.
+
+   The callback runs on the pump thread after each move, without any lock
+   held. Whoever moves the other end of the buffer calls Wake, so the pump
+   notices new room or new bytes.
+*/
+class StreamPump {
+	public:
+		StreamPump(int fd, StreamBuffer *buffer, StreamPumpDirection direction);
+		virtual ~StreamPump();
+
+		void			SetCallback(void *caller, void (*callback)(void *, StreamPumpEvent));
+		bool			Start();
+		void			Wake();
+		bool			Finish();
+		uint64_t		GetCount();
+
+	private:
+		static void*	_StartPump(void *);
+		void			_PumpIn();
+		void			_PumpOut();
+		bool			_WaitForBuffer();
+		void			_Callback(StreamPumpEvent event);
+
+		int					mFd;
+		StreamBuffer		*mBuffer;
+		StreamPumpDirection	mDirection;
+		char				*mChunk;
+		uint64_t			mCount; // Bytes moved so far. Written by the pump thread.
+		bool				mFailed; // The descriptor could not be read or written.
+		bool				mFinish; // Going out: exit once the buffer is empty.
+		bool				mStop;
+		bool				mRunning;
+		Thread				mThread;
+		Mutex				mLock; // Guards mFinish and mStop, and wakes the pump thread.
+		void				*mCallbackCaller;
+		void				(*mCallback)(void *, StreamPumpEvent);
+};
+#endif
@@ -0,0 +1,717 @@
+/*
+ * File: TcpLight.cpp
+ * Desc: The protocol as a library. Connections carry a byte stream from one
+ * program to another through a socket-like interface.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "TcpLight.h"
+
+static ostream gNoLog(NULL); // Discards everything, for connections without a log.
+
+/*!
+	\brief Makes an eventfd readable. It stays readable until it is read.
+*/
+static void signalEventFd(int fd)
+{
+	uint64_t fOne = 1;
+	ssize_t fResult = write(fd, &fOne, sizeof(fOne));
+	(void)fResult;
+}
+
+/*!
+	\brief Makes an eventfd unreadable again.
+*/
+static void drainEventFd(int fd)
+{
+	uint64_t fCount = 0;
+	ssize_t fResult = read(fd, &fCount, sizeof(fCount));
+	(void)fResult;
+}
+
+TcpLightOptions::TcpLightOptions()
+	: mBufferSize(kTcpLightBufferSize), mFecBlockSize(0), mMaxPacketSize(kPacketSize), mProbe(false),
+	  mSegmentOffload(false), mCpus(NULL), mBusyPoll(0), mSpin(false), mLog(NULL)
+{
+}
+
+/*!
+	\param options How the connection runs.
+	\param name The name of the stream, sent in the SYN.
+	\param size The length of the stream.
+*/
+TcpLightConnection::TcpLightConnection(const TcpLightOptions &options, const char *name, uint64_t size)
+	: mSender(NULL), mReceiver(NULL), mListener(NULL), mBuffer(options.mBufferSize), mName(name), mSize(size),
+	  mOffset(0), mSenderThread(_StartSender, this), mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+	  mSenderDone(false), mSenderResult(false), mClosed(false), mCallback(NULL), mCallbackCaller(NULL)
+{
+	memset(&mPeer, 0, sizeof(mPeer));
+}
+
+/*!
+	\brief The sender thread must have returned, and the receiver must no
+	longer be fed by the listener.
+*/
+TcpLightConnection::~TcpLightConnection()
+{
+	// Their timer threads call back into this object until they are gone.
+	delete mSender;
+	delete mReceiver;
+
+	if (mEventFd >= 0)
+	{
+		close(mEventFd);
+	}
+}
+
+/*!
+	\brief Starts sending a stream to a listener. Returns at once; the
+	connection is TCPLIGHT_CONNECTING until the receiver accepts it, and bytes
+	passed to Send before then are sent once it does. There is no connect
+	timeout, so Close gives up on a receiver that never answers.
+	\param to The address and port of the listener.
+	\param name The name of the stream, matching kFileNameRegEx.
+	\param size The number of bytes that will be sent.
+	\return The connection, or NULL with errno set if the name is not valid or
+	the connection could not be started.
+*/
+TcpLightConnection *TcpLightConnection::Connect(struct sockaddr_in *to, const char *name, uint64_t size, const TcpLightOptions &options)
+{
+	if (to == NULL || name == NULL || !isRegExMatch(name, kFileNameRegEx, kFileNameMaxChars))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	TcpLightConnection *fConnection = new TcpLightConnection(options, name, size);
+
+	if (fConnection->mEventFd < 0)
+	{
+		delete fConnection;
+		errno = EMFILE;
+		return NULL;
+	}
+
+	// The sender reads the address of every ACK into this copy.
+	fConnection->mPeer = *to;
+	fConnection->mSender = new Sender(name, &fConnection->mBuffer, size, &fConnection->mPeer);
+	fConnection->mSender->SetLog((options.mLog != NULL) ? options.mLog : &gNoLog);
+	fConnection->mSender->SetNotify(fConnection, _OnNotify);
+	fConnection->mSender->SetMaxPacketSize(options.mMaxPacketSize, options.mProbe);
+
+	if (options.mFecBlockSize > 0)
+	{
+		fConnection->mSender->EnableFec(options.mFecBlockSize);
+	}
+
+	if (options.mSegmentOffload)
+	{
+		fConnection->mSender->EnableSegmentOffload();
+	}
+
+	if (options.mCpus != NULL || options.mBusyPoll > 0 || options.mSpin)
+	{
+		fConnection->mSender->EnableLowLatency(options.mCpus, options.mBusyPoll, options.mSpin);
+	}
+
+	if (fConnection->mSenderThread.Start() != 0)
+	{
+		delete fConnection;
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return fConnection;
+}
+
+/*!
+	\brief Entry point of the sender thread, which runs the whole transfer.
+*/
+void *TcpLightConnection::_StartSender(void *args)
+{
+	TcpLightConnection *fConnection = (TcpLightConnection*)args;
+	bool fResult = fConnection->mSender->Start();
+
+	fConnection->mLock.Lock();
+	fConnection->mSenderDone = true;
+	fConnection->mSenderResult = fResult;
+	fConnection->mLock.Unlock();
+
+	_OnNotify(fConnection);
+	return NULL;
+}
+
+/*!
+	\brief Called by the sender or receiver whenever there is something new:
+	room or data in the buffer, or a change of state.
+*/
+void TcpLightConnection::_OnNotify(void *caller)
+{
+	TcpLightConnection *fConnection = (TcpLightConnection*)caller;
+
+	signalEventFd(fConnection->mEventFd);
+
+	fConnection->mLock.Lock();
+	void (*fCallback)(TcpLightConnection *, void *) = fConnection->mCallback;
+	void *fCaller = fConnection->mCallbackCaller;
+	fConnection->mLock.Unlock();
+
+	if (fCallback != NULL)
+	{
+		fCallback(fConnection, fCaller);
+	}
+}
+
+/*!
+	\brief Clears the descriptor before the buffer is looked at, so anything
+	that happens after the look makes it readable again.
+*/
+void TcpLightConnection::_DrainFd()
+{
+	drainEventFd(mEventFd);
+}
+
+/*!
+	\brief Queues bytes to be sent, as many as fit in the buffer. Only the
+	sending end may call it.
+	\return The number of bytes taken, or -1 with errno set to EAGAIN if the
+	buffer is full, EMSGSIZE if the declared length was already sent, EPIPE if
+	the connection is over or EOPNOTSUPP at the receiving end.
+*/
+ssize_t TcpLightConnection::Send(const char *data, size_t size)
+{
+	if (mSender == NULL)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	_DrainFd();
+	TcpLightState fState = GetState();
+
+	if (fState == TCPLIGHT_CLOSED || fState == TCPLIGHT_FAILED)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (size > mSize - mOffset)
+	{
+		size = (size_t)(mSize - mOffset);
+
+		if (size == 0)
+		{
+			errno = EMSGSIZE;
+			return -1;
+		}
+	}
+
+	size_t fTaken = mBuffer.Write(data, size);
+
+	if (fTaken == 0 && size > 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	mOffset += fTaken;
+	mSender->Wake();
+
+	return (ssize_t)fTaken;
+}
+
+/*!
+	\brief Takes received bytes out of the buffer, in order. Only the receiving
+	end may call it.
+	\return The number of bytes copied, 0 once the whole stream was read and
+	the sender's FIN arrived, or -1 with errno set to EAGAIN if nothing has
+	arrived yet or EOPNOTSUPP at the sending end.
+*/
+ssize_t TcpLightConnection::Recv(char *data, size_t size)
+{
+	if (mReceiver == NULL)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	_DrainFd();
+
+	// The FIN gives a stream of unknown length its end.
+	if (mSize == kStreamUnknownSize && mReceiver->GetState() == RECV_FIN)
+	{
+		mSize = mReceiver->GetFileSize();
+	}
+
+	// Closing before the FIN would leave the sender retransmitting it.
+	if (mOffset == mSize)
+	{
+		if (mReceiver->GetState() == RECV_FIN)
+		{
+			return 0;
+		}
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	size_t fCopied = mBuffer.Read(mOffset, data, size);
+
+	if (fCopied == 0 && size > 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	mOffset += fCopied;
+	mBuffer.Release(mOffset);
+
+	// The sender may be waiting for the room just made.
+	mReceiver->UpdateWindow();
+
+	return (ssize_t)fCopied;
+}
+
+/*!
+	\brief Ends a stream connected with kStreamUnknownSize bytes after the
+	bytes sent so far. Later Sends fail with EMSGSIZE. Only the sending end may
+	call it.
+*/
+void TcpLightConnection::Shutdown()
+{
+	if (mSender != NULL && mSize == kStreamUnknownSize)
+	{
+		mSize = mOffset;
+		mSender->EndStream();
+	}
+}
+
+/*!
+	\brief Returns how far the connection has got.
+*/
+TcpLightState TcpLightConnection::GetState()
+{
+	if (mReceiver != NULL)
+	{
+		return (mReceiver->GetState() == RECV_FIN) ? TCPLIGHT_CLOSED : TCPLIGHT_OPEN;
+	}
+
+	mLock.Lock();
+	bool fDone = mSenderDone;
+	bool fResult = mSenderResult;
+	mLock.Unlock();
+
+	if (fDone)
+	{
+		return fResult ? TCPLIGHT_CLOSED : TCPLIGHT_FAILED;
+	}
+
+	return (mSender->GetState() == SEND_NO_CONN) ? TCPLIGHT_CONNECTING : TCPLIGHT_OPEN;
+}
+
+/*!
+	\brief Returns a descriptor that is readable when Send, Recv or GetState may
+	give a different answer than last time. Do not read or close it.
+*/
+int TcpLightConnection::GetFd()
+{
+	return mEventFd;
+}
+
+/*!
+	\brief Has callback called with the connection and caller whenever the
+	descriptor from GetFd becomes readable. It runs on a thread of the library
+	and must not call into the connection or its listener; it should only wake
+	the thread that does.
+*/
+void TcpLightConnection::SetCallback(void (*callback)(TcpLightConnection *, void *), void *caller)
+{
+	mLock.Lock();
+	mCallback = callback;
+	mCallbackCaller = caller;
+	mLock.Unlock();
+}
+
+/*!
+	\brief Blocks until the descriptor from GetFd is readable, then clears it,
+	so the next Wait blocks until something else happens.
+*/
+void TcpLightConnection::Wait()
+{
+	struct pollfd fPoll;
+
+	fPoll.fd = mEventFd;
+	fPoll.events = POLLIN;
+
+	while (poll(&fPoll, 1, -1) < 0 && errno == EINTR)
+	{
+	}
+
+	_DrainFd();
+}
+
+/*!
+	\brief Returns the name of the stream given to Connect.
+*/
+string TcpLightConnection::GetName()
+{
+	return mName;
+}
+
+/*!
+	\brief Returns the length of the stream given to Connect, which is
+	kStreamUnknownSize for a stream that has not ended yet.
+*/
+uint64_t TcpLightConnection::GetSize()
+{
+	return mSize;
+}
+
+/*!
+	\brief Frees the connection. A sender still running is stopped; a receiver
+	that is still answering retransmitted FINs is left to the listener, which
+	frees it when it is done.
+*/
+void TcpLightConnection::Close()
+{
+	mLock.Lock();
+	mCallback = NULL;
+	mLock.Unlock();
+
+	if (mSender != NULL)
+	{
+		mSender->Stop();
+		mSenderThread.Join();
+		delete this;
+	}
+	else
+	{
+		mListener->_Close(this);
+	}
+}
+
+/*!
+	\param sock The bound socket, which the listener now owns.
+	\param options How the accepted connections run.
+*/
+TcpLightListener::TcpLightListener(int sock, const TcpLightOptions &options)
+	: mSocket(sock), mOptions(options), mThread(_StartReceive, this),
+	  mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), mCpu(-1), mRunning(false)
+{
+}
+
+/*!
+	\brief Stops the receive thread and frees the connections that were never
+	accepted or are closed.
+*/
+TcpLightListener::~TcpLightListener()
+{
+	mLock.Lock();
+	bool fRunning = mRunning;
+	mRunning = false;
+	mLock.Unlock();
+
+	if (fRunning)
+	{
+		// Wake the receive thread from its wait for a datagram.
+		shutdown(mSocket, SHUT_RD);
+		mThread.Join();
+	}
+
+	for (map<uint64_t, TcpLightConnection *>::iterator fEntry = mConnections.begin(); fEntry != mConnections.end(); fEntry++)
+	{
+		if (fEntry->second->mClosed)
+		{
+			delete fEntry->second;
+		}
+	}
+
+	for (size_t i = 0; i < mAccepted.size(); i++)
+	{
+		delete mAccepted[i];
+	}
+
+	close(mSocket);
+
+	if (mEventFd >= 0)
+	{
+		close(mEventFd);
+	}
+}
+
+/*!
+	\brief Binds a UDP port and starts accepting connections on it.
+	\return The listener, or NULL with errno set if the port could not be bound
+	or the receive thread started.
+*/
+TcpLightListener *TcpLightListener::Listen(unsigned short port, const TcpLightOptions &options)
+{
+	int fSock = socket(PF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in fAddr;
+
+	if (fSock < 0)
+	{
+		return NULL;
+	}
+
+	memset(&fAddr, 0, sizeof(fAddr));
+	fAddr.sin_family = AF_INET;
+	fAddr.sin_port = htons(port);
+	fAddr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(fSock, (struct sockaddr*)&fAddr, sizeof(fAddr)) != 0)
+	{
+		int fError = errno;
+		close(fSock);
+		errno = fError;
+		return NULL;
+	}
+
+	// Make room for a full window of large datagrams.
+	if (options.mMaxPacketSize > kPacketSize)
+	{
+		setSocketBufferSize(fSock, kSocketBufferSize);
+	}
+
+	enableReceiveOffload(fSock);
+
+	if (options.mBusyPoll > 0)
+	{
+		setBusyPoll(fSock, options.mBusyPoll);
+	}
+
+	// Wake up now and then to free finished connections.
+	struct timeval fTimeOut;
+	fTimeOut.tv_sec = 0;
+	fTimeOut.tv_usec = kTcpLightReapInterval * 1000;
+	setsockopt(fSock, SOL_SOCKET, SO_RCVTIMEO, &fTimeOut, sizeof(fTimeOut));
+
+	TcpLightListener *fListener = new TcpLightListener(fSock, options);
+	fListener->mRunning = (fListener->mEventFd >= 0);
+
+	// Every accepted connection is received on the one thread, so it gets the
+	// first core and spins only if another is left for the applications.
+	vector<int> fCpus;
+
+	if (options.mCpus == NULL || !getLowLatencyCpus(options.mCpus, NULL, &fCpus))
+	{
+		getAllowedCpus(&fCpus);
+	}
+	else
+	{
+		fListener->mCpu = fCpus[0];
+	}
+
+	fListener->mOptions.mCpus = NULL;
+	fListener->mOptions.mSpin = options.mSpin && fCpus.size() >= 2;
+
+	if (!fListener->mRunning || fListener->mThread.Start() != 0)
+	{
+		fListener->mRunning = false;
+		delete fListener;
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (fListener->mCpu >= 0)
+	{
+		fListener->mThread.SetAffinity(fListener->mCpu);
+	}
+
+	return fListener;
+}
+
+/*!
+	\brief Returns the next connection waiting to be accepted, without
+	blocking.
+	\return The connection, or NULL with errno set to EAGAIN if none is
+	waiting.
+*/
+TcpLightConnection *TcpLightListener::Accept()
+{
+	TcpLightConnection *fConnection = NULL;
+
+	mLock.Lock();
+
+	if (!mAccepted.empty())
+	{
+		fConnection = mAccepted.front();
+		mAccepted.pop_front();
+	}
+
+	if (mAccepted.empty())
+	{
+		drainEventFd(mEventFd);
+	}
+
+	mLock.Unlock();
+
+	if (fConnection == NULL)
+	{
+		errno = EAGAIN;
+	}
+
+	return fConnection;
+}
+
+/*!
+	\brief Returns a descriptor that is readable while connections are waiting
+	for Accept. Do not read or close it.
+*/
+int TcpLightListener::GetFd()
+{
+	return mEventFd;
+}
+
+/*!
+	\brief Entry point of the receive thread. Hands every datagram to the
+	receiver it belongs to, and frees finished connections every
+	kTcpLightReapInterval.
+	\param args The TcpLightListener that started the thread.
+*/
+void *TcpLightListener::_StartReceive(void *args)
+{
+	TcpLightListener *fListener = (TcpLightListener*)args;
+	char *fBuff = new char[kMaxDatagramSize];
+	struct sockaddr_in fFrom;
+	uint32_t fSegmentSize = 0;
+	uint64_t fLastReap = getMonotonicMicroSeconds() / 1000;
+	AdaptiveSpin fSpin;
+
+	fListener->mLock.Lock();
+
+	while (fListener->mRunning)
+	{
+		fListener->mLock.Unlock();
+
+		if (fListener->mOptions.mSpin)
+		{
+			fSpin.Spin(isSocketReadable, &fListener->mSocket);
+		}
+
+		ssize_t fBytes = receiveSegments(fListener->mSocket, &fFrom, fBuff, kMaxDatagramSize, &fSegmentSize);
+		fListener->mLock.Lock();
+
+		if (fBytes > 0 && fListener->mRunning)
+		{
+			fListener->_Receive(&fFrom, fBuff, (uint32_t)fBytes, fSegmentSize);
+		}
+
+		if (getMonotonicMicroSeconds() / 1000 - fLastReap >= kTcpLightReapInterval)
+		{
+			fListener->_Reap();
+			fLastReap = getMonotonicMicroSeconds() / 1000;
+		}
+	}
+
+	fListener->mLock.Unlock();
+	delete [] fBuff;
+
+	return NULL;
+}
+
+/*!
+	\brief Returns the key of a sender address in mConnections.
+*/
+uint64_t TcpLightListener::_GetKey(struct sockaddr_in *addr)
+{
+	return ((uint64_t)ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+}
+
+/*!
+	\brief Hands a received buffer to the receiver of the sender it came from.
+	A SYN from a new sender starts a connection, which waits for Accept if the
+	SYN was valid. Call with mLock held.
+*/
+void TcpLightListener::_Receive(struct sockaddr_in *from, char *buff, uint32_t size, uint32_t segmentSize)
+{
+	uint64_t fKey = _GetKey(from);
+	map<uint64_t, TcpLightConnection *>::iterator fEntry = mConnections.find(fKey);
+
+	if (fEntry != mConnections.end())
+	{
+		fEntry->second->mReceiver->Receive(from, buff, size, segmentSize);
+		return;
+	}
+
+	// Anything else from an unknown sender is left over from an old connection.
+	if (!isWireSizeValid<PacketHeader>(size) || PacketHeader::Code::Get(buff) != SYN)
+	{
+		return;
+	}
+
+	TcpLightConnection *fConnection = new TcpLightConnection(mOptions, "", 0);
+
+	fConnection->mListener = this;
+	fConnection->mPeer = *from;
+	fConnection->mReceiver = new Receiver(mSocket, &fConnection->mBuffer);
+	fConnection->mReceiver->SetLog((mOptions.mLog != NULL) ? mOptions.mLog : &gNoLog);
+	fConnection->mReceiver->SetMaxPacketSize(mOptions.mMaxPacketSize);
+	fConnection->mReceiver->SetNotify(fConnection, TcpLightConnection::_OnNotify);
+
+	// A SYN replayed after its connection was reaped would start a new one, so
+	// data in it is not taken. Senders from Connect never send any.
+	fConnection->mReceiver->RefuseEarlyData();
+	fConnection->mReceiver->Receive(from, buff, size, segmentSize);
+
+	if (fConnection->mEventFd < 0 || fConnection->mReceiver->GetState() != RECV_DATA)
+	{
+		delete fConnection;
+		return;
+	}
+
+	fConnection->mName = fConnection->mReceiver->GetFileName();
+	fConnection->mSize = fConnection->mReceiver->GetFileSize();
+
+	mConnections[fKey] = fConnection;
+	mAccepted.push_back(fConnection);
+	signalEventFd(mEventFd);
+}
+
+/*!
+	\brief Frees the closed connections whose receivers are done. Call with
+	mLock held.
+*/
+void TcpLightListener::_Reap()
+{
+	map<uint64_t, TcpLightConnection *>::iterator fEntry = mConnections.begin();
+
+	while (fEntry != mConnections.end())
+	{
+		if (fEntry->second->mClosed && !fEntry->second->mReceiver->IsActive())
+		{
+			delete fEntry->second;
+			mConnections.erase(fEntry++);
+		}
+		else
+		{
+			fEntry++;
+		}
+	}
+}
+
+/*!
+	\brief Takes back a connection the application closed. It is freed now,
+	unless its receiver has all the data and is still answering retransmitted
+	FINs, in which case _Reap frees it later.
+*/
+void TcpLightListener::_Close(TcpLightConnection *connection)
+{
+	mLock.Lock();
+
+	connection->mClosed = true;
+
+	if (connection->mReceiver->GetState() != RECV_FIN || !connection->mReceiver->IsActive())
+	{
+		mConnections.erase(_GetKey(&connection->mPeer));
+		delete connection;
+	}
+
+	mLock.Unlock();
+}
@@ -0,0 +1,158 @@
+/*
+ * File: TcpLight.h
+ * Desc: The protocol as a library. Connections carry a byte stream from one
+ * program to another through a socket-like interface.
+ */
+#ifndef _TCPLIGHT_H_
+#define _TCPLIGHT_H_
+
+#include <deque>
+#include <inttypes.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "Mutex.h"
+#include "Receiver.h"
+#include "Sender.h"
+#include "StreamBuffer.h"
+#include "Thread.h"
+
+#define kTcpLightBufferSize 4194304 // Default bytes held by each end of a connection.
+#define kTcpLightReapInterval 100 // Milliseconds between the listener's checks for finished connections.
+
+using namespace std;
+
+class TcpLightListener;
+
+enum TcpLightState
+{
+	TCPLIGHT_CONNECTING, // Waiting for the receiver to accept the connection.
+	TCPLIGHT_OPEN,
+	TCPLIGHT_CLOSED, // Every byte was acknowledged, or has arrived.
+	TCPLIGHT_FAILED // Turned away or stopped before every byte was acknowledged.
+};
+
+/*! \struct TcpLightOptions
+    \brief How a connection or listener runs. The constructor sets the defaults.
+*/
+struct TcpLightOptions {
+	TcpLightOptions();
+
+	size_t			mBufferSize; // Bytes buffered at each end.
+	unsigned short	mFecBlockSize; // Sender: DATA packets per parity packet, 0 for no FEC.
+	uint32_t		mMaxPacketSize; // Largest datagram to send or accept.
+	bool			mProbe; // Sender: probe the path for the largest datagram size that gets through.
+	bool			mSegmentOffload; // Sender: hand runs of packets to the kernel in one send.
+	const char		*mCpus; // Cores to pin the threads to, as Sender::EnableLowLatency takes them, or NULL. Only read by Connect and Listen.
+	uint32_t		mBusyPoll; // Microseconds the kernel busy polls each socket for, 0 for not at all.
+	bool			mSpin; // Spin on the next datagram or event before blocking, given two cores or more.
+	ostream			*mLog; // Where progress and summaries are written, NULL for nowhere.
+};
+
+/*! \class TcpLightConnection
+    \brief One end of a connection, carrying a stream of a declared length.
+
+   The sending end comes from Connect and the receiving end from
+   TcpLightListener::Accept. The SYN carries the length of the stream, so the
+   sender declares it up front and the receiver learns it on accept. A sender
+   that does not know it declares kStreamUnknownSize instead and calls Shutdown
+   after the last Send.
+
+   Send and Recv never block: they return -1 with errno set to EAGAIN when the
+   buffer is full or empty. GetFd returns a descriptor that becomes readable
+   whenever there is something new to look at, for poll, select or epoll; Wait
+   blocks on it, and SetCallback is called at the same moments. The descriptor
+   is cleared by Send, Recv and Wait, so after EAGAIN the caller waits for it
+   and tries again. Recv returns 0 once the stream is read and the sender has
+   finished.
+
+   Send, Recv and Close are for one thread at a time. Close frees the
+   connection. A sender should wait for TCPLIGHT_CLOSED first; closing earlier
+   stops the transfer.
+*/
+class TcpLightConnection {
+	public:
+		static TcpLightConnection	*Connect(struct sockaddr_in *to, const char *name, uint64_t size, const TcpLightOptions &options);
+
+		ssize_t			Send(const char *data, size_t size);
+		ssize_t			Recv(char *data, size_t size);
+		void			Shutdown();
+		TcpLightState	GetState();
+		int				GetFd();
+		void			SetCallback(void (*callback)(TcpLightConnection *, void *), void *caller);
+		void			Wait();
+		string			GetName();
+		uint64_t		GetSize();
+		void			Close();
+
+	private:
+		friend class TcpLightListener;
+
+		TcpLightConnection(const TcpLightOptions &options, const char *name, uint64_t size);
+		virtual ~TcpLightConnection();
+
+		static void*	_StartSender(void *);
+		static void		_OnNotify(void *);
+		void			_DrainFd();
+
+		Sender				*mSender; // NULL at the receiving end.
+		Receiver			*mReceiver; // NULL at the sending end.
+		TcpLightListener	*mListener; // The listener that accepted it, or NULL.
+		StreamBuffer		mBuffer;
+		string				mName;
+		uint64_t			mSize;
+		uint64_t			mOffset; // Bytes passed to Send or returned by Recv so far.
+		struct sockaddr_in	mPeer;
+		Thread				mSenderThread; // Runs Sender::Start.
+		int					mEventFd;
+		Mutex				mLock; // Guards everything below.
+		bool				mSenderDone; // Sender::Start has returned.
+		bool				mSenderResult; // What it returned.
+		bool				mClosed; // Close was called, and the listener frees it once it is done.
+		void				(*mCallback)(TcpLightConnection *, void *);
+		void				*mCallbackCaller;
+};
+
+/*! \class TcpLightListener
+    \brief Accepts connections on a UDP port.
+
+   One socket and one thread serve every sender: datagrams are handed to the
+   receiver of the address they came from, and a SYN from a new address starts
+   a new receiver. Accept returns connections whose SYN was accepted. A closed
+   connection stays with the listener until its receiver has stopped answering
+   retransmitted FINs. Every accepted connection must be closed before the
+   listener is deleted.
+*/
+class TcpLightListener {
+	public:
+		static TcpLightListener	*Listen(unsigned short port, const TcpLightOptions &options);
+		virtual ~TcpLightListener();
+
+		TcpLightConnection	*Accept();
+		int					GetFd();
+
+	private:
+		friend class TcpLightConnection;
+
+		TcpLightListener(int sock, const TcpLightOptions &options);
+
+		static void*	_StartReceive(void *);
+		static uint64_t	_GetKey(struct sockaddr_in *addr);
+		void			_Receive(struct sockaddr_in *from, char *buff, uint32_t size, uint32_t segmentSize);
+		void			_Reap();
+		void			_Close(TcpLightConnection *connection);
+
+		int										mSocket;
+		TcpLightOptions							mOptions;
+		Thread									mThread;
+		int										mEventFd; // Readable while connections wait for Accept.
+		int										mCpu; // Core the receive thread is pinned to, -1 for none.
+		Mutex									mLock; // Guards everything below.
+		bool									mRunning;
+		map<uint64_t, TcpLightConnection *>		mConnections; // By sender address and port.
+		deque<TcpLightConnection *>				mAccepted; // Waiting for Accept.
+};
+#endif
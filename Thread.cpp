@@ -9,6 +9,7 @@
  */
 
 #include "Thread.h"
+#include "LowLatency.h"
 
 Thread::Thread (void *(*func) (void *), void *caller)
 	: mCaller(caller), mFunction(func)
@@ -33,3 +34,10 @@ void Thread::Exit()
 {
 	pthread_exit(NULL);
 }
+
+/* Keeps the thread on one core. It must have been started.
+ */
+bool Thread::SetAffinity(int cpu)
+{
+	return pinThread(mThread, cpu);
+}
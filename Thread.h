@@ -24,6 +24,7 @@ class Thread {
 		int 		Start();
 		int 		Join();
 		void		Exit();
+		bool		SetAffinity(int cpu);
 
 	private:
 		pthread_t	mThread;
@@ -0,0 +1,236 @@
+/*
+ * File: Trace.cpp
+ * Desc: A binary log of timestamped protocol events, gathered in a lock free
+ * ring and written to a file on its own thread.
+ */
+#include <iostream>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "Trace.h"
+#include "Transmission.h"
+
+/*!
+	\param fileName The file to write the trace to.
+	\param level The most detailed events to record.
+	\param role Which end of the connection is tracing.
+*/
+Trace::Trace(const char *fileName, TraceLevel level, TraceRole role)
+	: mFileName(fileName), mLevel(level), mRole(role), mFile(NULL), mRing(NULL), mHead(0), mTail(0),
+	  mDropped(0), mLastDropped(0), mStop(false), mRunning(false), mWriterThread(_StartWriter, this)
+{
+}
+
+Trace::~Trace()
+{
+	Stop();
+
+	if (mFile != NULL)
+	{
+		fclose(mFile);
+	}
+
+	delete [] mRing;
+}
+
+/*!
+	\brief Creates the file, writes its header and starts the writer thread.
+	Nothing is recorded until this succeeds.
+	\return true if the writer thread is running.
+*/
+bool Trace::Start()
+{
+	TraceFileHeader fHeader;
+	struct timespec fWallTime;
+
+	if (mRunning)
+	{
+		return true;
+	}
+
+	mFile = fopen(mFileName.c_str(), "wb");
+
+	if (mFile == NULL)
+	{
+		cerr<<"Trace [Start]: Unable to create "<<mFileName<<": "<<strerror(errno)<<endl;
+		return false;
+	}
+
+	memset(&fHeader, 0, sizeof(fHeader));
+	memcpy(fHeader.mMagic, kTraceMagic, sizeof(kTraceMagic));
+	fHeader.mVersion = kTraceVersion;
+	fHeader.mEventSize = sizeof(TraceEvent);
+	clock_gettime(CLOCK_REALTIME, &fWallTime);
+	fHeader.mStartTime = getMonotonicMicroSeconds() * 1000;
+	fHeader.mStartWallTime = (uint64_t)fWallTime.tv_sec * 1000000000ULL + fWallTime.tv_nsec;
+	fHeader.mRole = mRole;
+	fwrite(&fHeader, sizeof(fHeader), 1, mFile);
+
+	mRing = new TraceSlot[kTraceRingSize];
+
+	for (uint64_t i = 0; i < kTraceRingSize; i++)
+	{
+		mRing[i].mSequence = i;
+	}
+
+	mRunning = (mWriterThread.Start() == 0);
+
+	if (!mRunning)
+	{
+		mLevel = TRACE_OFF;
+	}
+
+	return mRunning;
+}
+
+/*!
+	\brief Writes out everything recorded so far and stops the writer thread.
+	Events recorded afterwards are dropped.
+*/
+void Trace::Stop()
+{
+	if (mRunning)
+	{
+		mStopLock.Lock();
+		mStop = true;
+		mStopLock.Signal();
+		mStopLock.Unlock();
+
+		mWriterThread.Join();
+		mRunning = false;
+		fflush(mFile);
+	}
+}
+
+/*!
+	\brief Adds an event to the ring, or counts it as dropped if the ring is full.
+	Safe to call from any thread.
+	\param type What happened.
+	\param arg0, arg1, arg2 Details, see TraceEventType.
+*/
+void Trace::Record(TraceEventType type, uint32_t arg0, uint64_t arg1, uint64_t arg2)
+{
+	if (mRing == NULL)
+	{
+		return;
+	}
+
+	uint64_t fTime = getMonotonicMicroSeconds() * 1000;
+	uint64_t fPosition = __atomic_load_n(&mHead, __ATOMIC_RELAXED);
+	TraceSlot *fSlot = NULL;
+
+	while (true)
+	{
+		fSlot = &mRing[fPosition & (kTraceRingSize - 1)];
+		int64_t fTurn = (int64_t)(__atomic_load_n(&fSlot->mSequence, __ATOMIC_ACQUIRE) - fPosition);
+
+		if (fTurn == 0)
+		{
+			// Our turn; claim the position unless another producer got there first.
+			if (__atomic_compare_exchange_n(&mHead, &fPosition, fPosition + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (fTurn < 0)
+		{
+			// The writer thread has not emptied this slot from the last lap.
+			__atomic_fetch_add(&mDropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			fPosition = __atomic_load_n(&mHead, __ATOMIC_RELAXED);
+		}
+	}
+
+	fSlot->mEvent.mTime = fTime;
+	fSlot->mEvent.mType = (uint16_t)type;
+	fSlot->mEvent.mReserved = 0;
+	fSlot->mEvent.mArg0 = arg0;
+	fSlot->mEvent.mArg1 = arg1;
+	fSlot->mEvent.mArg2 = arg2;
+
+	// Publish the event to the writer thread.
+	__atomic_store_n(&fSlot->mSequence, fPosition + 1, __ATOMIC_RELEASE);
+}
+
+/*!
+	\brief Returns the number of events dropped because the ring was full.
+*/
+uint64_t Trace::GetDropCount()
+{
+	return __atomic_load_n(&mDropped, __ATOMIC_RELAXED);
+}
+
+/*!
+	\brief Writes the published events to the file in order, stopping at the
+	first slot a producer has claimed but not filled yet. Hands each slot back
+	to the producers for the next lap. Writer thread only.
+*/
+void Trace::_Drain()
+{
+	while (true)
+	{
+		TraceSlot *fSlot = &mRing[mTail & (kTraceRingSize - 1)];
+
+		if (__atomic_load_n(&fSlot->mSequence, __ATOMIC_ACQUIRE) != mTail + 1)
+		{
+			break;
+		}
+
+		fwrite(&fSlot->mEvent, sizeof(TraceEvent), 1, mFile);
+		__atomic_store_n(&fSlot->mSequence, mTail + kTraceRingSize, __ATOMIC_RELEASE);
+		mTail++;
+	}
+
+	// Note new drops in the trace itself, so gaps can be told from quiet periods.
+	uint64_t fDropped = GetDropCount();
+
+	if (fDropped != mLastDropped)
+	{
+		TraceEvent fEvent;
+		memset(&fEvent, 0, sizeof(fEvent));
+		fEvent.mTime = getMonotonicMicroSeconds() * 1000;
+		fEvent.mType = TRACE_DROPPED;
+		fEvent.mArg1 = fDropped;
+		fwrite(&fEvent, sizeof(TraceEvent), 1, mFile);
+		mLastDropped = fDropped;
+	}
+}
+
+/*!
+	\brief Entry point of the writer thread. Drains the ring every
+	kTraceFlushInterval until stopped, then once more.
+	\param args The Trace that started the thread.
+*/
+void *Trace::_StartWriter(void *args)
+{
+	Trace *fTrace = (Trace*)args;
+	struct timespec fWake;
+
+	fTrace->mStopLock.Lock();
+
+	while (!fTrace->mStop)
+	{
+		clock_gettime(CLOCK_REALTIME, &fWake);
+		fWake.tv_nsec += kTraceFlushInterval * 1000000;
+
+		if (fWake.tv_nsec >= 1000000000)
+		{
+			fWake.tv_sec++;
+			fWake.tv_nsec -= 1000000000;
+		}
+
+		fTrace->mStopLock.TimedWait(fWake);
+		fTrace->mStopLock.Unlock();
+		fTrace->_Drain();
+		fTrace->mStopLock.Lock();
+	}
+
+	fTrace->mStopLock.Unlock();
+	fTrace->_Drain();
+
+	return NULL;
+}
@@ -0,0 +1,151 @@
+/*
+ * File: Trace.h
+ * Desc: A binary log of timestamped protocol events, gathered in a lock free
+ * ring and written to a file on its own thread.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+
+#include "Mutex.h"
+#include "Thread.h"
+
+#define kTraceRingSize 65536 // Events held in memory, a power of two.
+#define kTraceFlushInterval 10 // Milliseconds between drains of the ring.
+#define kTraceSlowWriteNs 10000000 // Disk writes taking longer than this are traced at TRACE_CONTROL.
+#define kTraceMagic "TLTRACE"
+#define kTraceVersion 1
+
+using namespace std;
+
+/*
+ * How much to trace. TRACE_CONTROL is cheap enough to leave on: it records
+ * losses, timeouts, window cuts, holes in the received data and slow disk
+ * writes. TRACE_PACKET adds an event for every packet, ACK, RTT sample and
+ * disk write.
+ */
+enum TraceLevel
+{
+	TRACE_OFF = 0,
+	TRACE_CONTROL = 1,
+	TRACE_PACKET = 2
+};
+
+/*
+ * Event types, with what the three arguments of a TraceEvent hold for each.
+ */
+enum TraceEventType
+{
+	TRACE_PACKET_SENT = 1, // Payload length, sequence number, 1 if sent before.
+	TRACE_PACKET_RECEIVED = 2, // Payload length, sequence number, next sequence number expected.
+	TRACE_ACK_SENT = 3, // Window, ACK number, 1 if resent by a timeout.
+	TRACE_ACK_RECEIVED = 4, // Window, ACK number, 0.
+	TRACE_LOSS = 5, // 0 for a timeout, 1 for a later packet arriving, 2 for a tail loss probe; first sequence number resent, bytes resent.
+	TRACE_TIMEOUT = 6, // New timeout in milliseconds, first unacknowledged sequence number, timeouts in a row.
+	TRACE_CWND = 7, // Send window, congestion window, receiver window.
+	TRACE_RTT = 8, // Sample in microseconds, estimated RTT in milliseconds, timeout in milliseconds.
+	TRACE_DISK_WRITE = 9, // Length, file offset, nanoseconds taken (0 if unknown).
+	TRACE_OUT_OF_ORDER = 10, // Packets in the out of order cache, sequence number, next sequence number expected.
+	TRACE_DROPPED = 11 // 0, events lost to a full ring so far, 0.
+};
+
+/*
+ * Which end of the connection wrote a trace.
+ */
+enum TraceRole
+{
+	TRACE_SENDER = 1,
+	TRACE_RECEIVER = 2
+};
+
+/*! \struct TraceFileHeader
+    \brief Starts every trace file. The events follow it back to back, in the
+    byte order of the machine that wrote them.
+*/
+struct TraceFileHeader {
+	char		mMagic[8];
+	uint32_t	mVersion;
+	uint32_t	mEventSize;
+	uint64_t	mStartTime; // CLOCK_MONOTONIC nanoseconds when the trace started.
+	uint64_t	mStartWallTime; // CLOCK_REALTIME nanoseconds at the same moment.
+	uint32_t	mRole;
+	uint32_t	mReserved;
+};
+
+/*! \struct TraceEvent
+    \brief One event, 32 bytes.
+*/
+struct TraceEvent {
+	uint64_t	mTime; // CLOCK_MONOTONIC nanoseconds.
+	uint16_t	mType;
+	uint16_t	mReserved;
+	uint32_t	mArg0;
+	uint64_t	mArg1;
+	uint64_t	mArg2;
+};
+
+/*! \struct TraceSlot
+    \brief A ring slot. mSequence says whose turn it is: the producer that
+    claimed position p may write the slot when it holds p, and the writer thread
+    may read it when it holds p + 1.
+*/
+struct TraceSlot {
+	uint64_t	mSequence;
+	TraceEvent	mEvent;
+};
+
+/*! \class Trace
+    \brief Records events from any thread without locking, for a file written
+    in the background.
+
+   Record claims a ring position with a compare and swap, fills the slot and
+   publishes it, so producers never wait on each other or on the disk. If the
+   writer thread has fallen a full ring behind, the event is counted as dropped
+   instead. Every kTraceFlushInterval the writer thread copies the published
+   events to the file in order.
+*/
+class Trace {
+	public:
+		Trace(const char *fileName, TraceLevel level, TraceRole role);
+		virtual ~Trace();
+
+		bool			Start();
+		void			Stop();
+		bool			IsEnabled(TraceLevel level) { return level <= mLevel; }
+		void			Record(TraceEventType type, uint32_t arg0, uint64_t arg1, uint64_t arg2);
+		uint64_t		GetDropCount();
+
+	private:
+		static void*	_StartWriter(void *);
+		void			_Drain();
+
+		string			mFileName;
+		TraceLevel		mLevel;
+		TraceRole		mRole;
+		FILE			*mFile;
+		TraceSlot		*mRing;
+		uint64_t		mHead __attribute__((aligned(64))); // Next position to claim. Shared by the producers.
+		uint64_t		mTail __attribute__((aligned(64))); // Next position to write out. Writer thread only.
+		uint64_t		mDropped;
+		uint64_t		mLastDropped; // mDropped when the writer thread last logged it.
+		bool			mStop;
+		bool			mRunning;
+		Thread			mWriterThread;
+		Mutex			mStopLock; // Wakes the writer thread early when stopping.
+};
+
+/*
+ * Records an event if trace is not NULL and traces at level, so call sites
+ * cost a compare when tracing is off.
+ */
+inline void traceEvent(Trace *trace, TraceLevel level, TraceEventType type, uint32_t arg0, uint64_t arg1, uint64_t arg2)
+{
+	if (trace != NULL && trace->IsEnabled(level))
+	{
+		trace->Record(type, arg0, arg1, arg2);
+	}
+}
+#endif
@@ -9,80 +9,19 @@
  * in the reliable transfer protocol for project 3.
  */
 
+#include <time.h>
+
 #include "Transmission.h"
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/udp.h>
 
 // Private function prototypes.
-uint32_t calculateEstimatedRtt(uint32_t estRtt, uint32_t sampleRtt);
-int calculateDeviationRtt(int devRtt, uint32_t estRtt, uint32_t sampleRtt);
-uint32_t getTimeDiffMilliSeconds(struct timeval* startTime, struct timeval* endTime);
-
 ssize_t error_send(int s, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen);
 
-/* Function: tryGetUShortFromMessage
- * Desc: This function attempts to convert the first two bytes from
- * the specified buffer into an unsigned 16-bit integer. The buffer is 
- * assumed to be arranged in network byte order. The result is copied
- * into the location of memory where the result pointer parameter is
- * addressed to. If true is returned, then the result was successfully
- * copied. Otherwise, faise is returned if not.
- */
-bool tryGetUShortFromMessage(char* buff, int size, unsigned short* result)
-{
-	bool success = false;
-
-	if (buff != NULL && result != NULL && size >= 2)
-	{
-		*result = (unsigned char)buff[0] << 8 | (unsigned char)buff[1];
-		success = true;
-	}
-
-	return success;
-}
-
-/* Function: tryGetUIntFromMessage
- * Desc: This function attempts to convert the first four bytes from
- * the specified buffer into an unsigned 32-bit integer. The buffer is 
- * assumed to be arranged in network byte order. The result is copied
- * into the location of memory where the result pointer parameter is
- * addressed to. If true is returned, then the result was successfully
- * copied. Otherwise, faise is returned if not.
- */
-bool tryGetUIntFromMessage(char* buff, int size, uint32_t* result)
-{
-	bool success = false;
-
-	if (buff != NULL && result != NULL && size >= 4)
-	{
-		*result = (unsigned char)buff[0] << 24 | (unsigned char)buff[1] << 16 | (unsigned char)buff[2] << 8 | (unsigned char)buff[3];
-		success = true;
-	}
-
-	return success;
-}
-
-/* Function: tryGetULongFromMessage
- * Desc: This function attempts to convert the first eight bytes from
- * the specified buffer into an unsigned 64-bit integer. The buffer is 
- * assumed to be arranged in network byte order. The result is copied
- * into the location of memory where the result pointer parameter is
- * addressed to. If true is returned, then the result was successfully
- * copied. Otherwise, faise is returned if not.
- */
-bool tryGetULongFromMessage(char* buff, int size, uint64_t* result)
-{
-	bool success = false;
-
-	if (buff != NULL && result != NULL && size >= 8)
-	{
-		uint32_t t1 = (unsigned char)buff[0] << 24 | (unsigned char)buff[1] << 16 | (unsigned char)buff[2] << 8 | (unsigned char)buff[3];
-		uint32_t t2 = (unsigned char)buff[4] << 24 | (unsigned char)buff[5] << 16 | (unsigned char)buff[6] << 8 | (unsigned char)buff[7];
-		*result = ((uint64_t)t1 << 32) | (uint64_t)t2;
-		success = true;
-	}
-
-	return success;
-}
+// Set by setImpairment to impair every datagram sendPacket sends.
+static Impairment* gImpairment = NULL;
 
 /* Function: tryGetStringFromMessage
  * Desc: This function will copy a null terminated string out of the specified 
@@ -129,69 +68,234 @@ bool tryGetStringFromMessage(char* buff, int size, char* result, int resultSize)
 	return success;
 }
 
-/* Function: setUIntToMessage
- * Desc: Copies the specified uint32_t input value to the buff parameter in
- * network byte order. A return value of true means the input was copied. A 
- * return value of false means it was not copied.
+/* Function: setHandshakeOptions
+ * Desc: Writes the protocol version and the option blocks that advertise the
+ * specified features at the start of buff. Returns the number of bytes written,
+ * or 0 if they do not fit in size bytes.
  */
-bool setUShortToMessage(char* buff, int buffSize, uint16_t input)
+uint32_t setHandshakeOptions(char* buff, uint32_t size, uint32_t features)
 {
-bool success = false;
+	uint32_t offset = 1;
+	char value[sizeof(uint32_t)];
 
-	if (buff != NULL && buffSize >= 4)
+	if (size < offset)
 	{
-		buff[0] = (input >> 8) & 0xFF;
-		buff[1] = input & 0xFF;
-		success = true;
+		return 0;
 	}
-	
-	return success;
+
+	wireStore<uint8_t>(buff, kProtocolVersion);
+	wireStore<uint32_t>(value, features);
+
+	if (!wirePutOption(buff, size, &offset, OPTION_FEATURES, value, sizeof(value)))
+	{
+		return 0;
+	}
+
+	return offset;
 }
 
-/* Function: setUIntToMessage
- * Desc: Copies the specified uint32_t input value to the buff parameter in
- * network byte order. A return value of true means the input was copied. A 
- * return value of false means it was not copied.
+/* Function: getHandshakeOptions
+ * Desc: Reads the protocol version and option blocks a peer put at the start of
+ * buff. Options of an unknown type, or of a known type with an unexpected length,
+ * are skipped. Returns false if there is no version, meaning the peer predates
+ * versioning; version and features are left alone in that case.
  */
-bool setUIntToMessage(char* buff, int buffSize, uint32_t input)
+bool getHandshakeOptions(char* buff, uint32_t size, uint8_t* version, uint32_t* features)
 {
-	bool success = false;
+	uint32_t offset = 1;
+	WireOption option;
 
-	if (buff != NULL && buffSize >= 4)
+	if (buff == NULL || size < offset)
 	{
-		buff[0] = (input >> 24) & 0xFF;
-		buff[1] = (input >> 16) & 0xFF;
-		buff[2] = (input >> 8) & 0xFF;
-		buff[3] = input & 0xFF;
-		success = true;
+		return false;
 	}
 
-	return success;
+	*version = wireLoad<uint8_t>(buff);
+	*features = 0;
+
+	while (wireGetOption(buff, size, &offset, &option))
+	{
+		if (option.mType == OPTION_FEATURES && option.mLength == sizeof(uint32_t))
+		{
+			*features = wireLoad<uint32_t>(option.mValue);
+		}
+	}
+
+	return true;
 }
 
-/* Function: setULongToMessage
- * Desc: Copies the specified uint64_t input value to the buff parameter in
- * network byte order. A return value of true means the input was copied. A 
- * return value of false means it was not copied.
+/* Function: setEarlyData
+ * Desc: Appends as much of data as fits in size bytes to the options that
+ * setHandshakeOptions wrote at the start of buff, in OPTION_EARLY_DATA blocks
+ * starting at offset, and moves offset past them. Returns the number of data
+ * bytes written. Peers that do not know the option skip the blocks.
  */
-bool setULongToMessage(char* buff, int buffSize, uint64_t input)
+uint32_t setEarlyData(char* buff, uint32_t size, uint32_t* offset, const char* data, uint32_t length)
 {
-	bool success = false;
+	uint32_t written = 0;
 
-	if (buff != NULL && buffSize >= 8)
+	while (written < length && *offset + 3 <= size)
 	{
-		buff[0] = (input >> 56) & 0xFF;
-		buff[1] = (input >> 48) & 0xFF;
-		buff[2] = (input >> 40) & 0xFF;
-		buff[3] = (input >> 32) & 0xFF;
-		buff[4] = (input >> 24) & 0xFF;
-		buff[5] = (input >> 16) & 0xFF;
-		buff[6] = (input >> 8) & 0xFF;
-		buff[7] = input & 0xFF;
-		success = true;
+		uint32_t part = MIN(MIN(length - written, (uint32_t)UINT8_MAX), size - *offset - 2);
+
+		if (!wirePutOption(buff, size, offset, OPTION_EARLY_DATA, data + written, (uint8_t)part))
+		{
+			break;
+		}
+
+		written += part;
 	}
 
-	return success;
+	return written;
+}
+
+/* Function: getEarlyData
+ * Desc: Copies the data a SYN carries in the OPTION_EARLY_DATA blocks of the
+ * options at the start of buff to data, in order, stopping at the first block
+ * that does not fit in dataSize bytes. Returns the number of bytes copied.
+ */
+uint32_t getEarlyData(char* buff, uint32_t size, char* data, uint32_t dataSize)
+{
+	uint32_t offset = 1;
+	uint32_t length = 0;
+	WireOption option;
+
+	if (buff == NULL || size < offset)
+	{
+		return 0;
+	}
+
+	while (wireGetOption(buff, size, &offset, &option))
+	{
+		if (option.mType == OPTION_EARLY_DATA)
+		{
+			if (length + option.mLength > dataSize)
+			{
+				break;
+			}
+
+			memcpy(data + length, option.mValue, option.mLength);
+			length += option.mLength;
+		}
+	}
+
+	return length;
+}
+
+/* Function: setPaths
+ * Desc: Appends the addresses in paths to the options that setHandshakeOptions
+ * wrote at the start of buff, in one OPTION_PATHS block starting at offset, and
+ * moves offset past it. As many as fit in size bytes are written. Returns the
+ * number of addresses written. Peers that do not know the option skip the block.
+ */
+uint32_t setPaths(char* buff, uint32_t size, uint32_t* offset, const struct sockaddr_in* paths, uint32_t count)
+{
+	const uint32_t entrySize = sizeof(uint32_t) + sizeof(uint16_t);
+	char value[UINT8_MAX];
+	uint32_t written = 0;
+
+	if (*offset + 2 > size)
+	{
+		return 0;
+	}
+
+	count = MIN(MIN(count, (uint32_t)UINT8_MAX / entrySize), (size - *offset - 2) / entrySize);
+
+	for (written = 0; written < count; written++)
+	{
+		wireStore<uint32_t>(value + written * entrySize, ntohl(paths[written].sin_addr.s_addr));
+		wireStore<uint16_t>(value + written * entrySize + sizeof(uint32_t), ntohs(paths[written].sin_port));
+	}
+
+	if (written == 0 || !wirePutOption(buff, size, offset, OPTION_PATHS, value, (uint8_t)(written * entrySize)))
+	{
+		return 0;
+	}
+
+	return written;
+}
+
+/* Function: getPaths
+ * Desc: Copies the addresses a SYN lists in the OPTION_PATHS blocks of the
+ * options at the start of buff to paths, stopping once maxCount are copied.
+ * Returns the number of addresses copied.
+ */
+uint32_t getPaths(char* buff, uint32_t size, struct sockaddr_in* paths, uint32_t maxCount)
+{
+	const uint32_t entrySize = sizeof(uint32_t) + sizeof(uint16_t);
+	uint32_t offset = 1;
+	uint32_t count = 0;
+	WireOption option;
+
+	if (buff == NULL || size < offset)
+	{
+		return 0;
+	}
+
+	while (wireGetOption(buff, size, &offset, &option))
+	{
+		if (option.mType != OPTION_PATHS)
+		{
+			continue;
+		}
+
+		for (uint32_t i = 0; i + entrySize <= option.mLength && count < maxCount; i += entrySize)
+		{
+			memset(&paths[count], 0, sizeof(paths[count]));
+			paths[count].sin_family = AF_INET;
+			paths[count].sin_addr.s_addr = htonl(wireLoad<uint32_t>(option.mValue + i));
+			paths[count].sin_port = htons(wireLoad<uint16_t>(option.mValue + i + sizeof(uint32_t)));
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Function: describeFeatures
+ * Desc: Returns a readable summary of a negotiated version and feature set, for
+ * logging. The version is left out if it is 0, meaning the peer has none.
+ */
+string describeFeatures(uint8_t version, uint32_t features)
+{
+	string summary = (version > 0) ? "version " + to_string(version) + ", features:" : "features:";
+
+	if (features & FEATURE_FEC)
+	{
+		summary += " fec";
+	}
+
+	if (features & FEATURE_PROBE)
+	{
+		summary += " probe";
+	}
+
+	if (features & FEATURE_STREAM)
+	{
+		summary += " stream";
+	}
+
+	if (features & FEATURE_EARLY_DATA)
+	{
+		summary += " early";
+	}
+
+	if (features & FEATURE_SACK)
+	{
+		summary += " sack";
+	}
+
+	if (features & FEATURE_MULTIPATH)
+	{
+		summary += " multipath";
+	}
+
+	if ((features & FEATURE_ALL) == 0)
+	{
+		summary += " none";
+	}
+
+	return summary;
 }
 
 /* Function: isEqualHost
@@ -286,10 +390,209 @@ void sendPacket(int sock, struct sockaddr_in* receiver, char* data, size_t size,
 			cout<<endl<<endl;
 		}
 
-		// Send the packet.
-		sendto(sock, data, size, 0, (struct sockaddr*)receiver, sizeof(*receiver));
-		//error_send(sock, data, size, 0, (struct sockaddr*)receiver, sizeof(*receiver));
+		// Send the packet. Building with -DkEmulateDrops=1 routes every packet
+		// through error_send so loss recovery can be exercised on a clean link,
+		// and setImpairment routes them through an emulated path.
+		if (gImpairment != NULL)
+		{
+			gImpairment->Send(sock, receiver, data, size);
+		}
+		else if (kEmulateDrops)
+		{
+			error_send(sock, data, size, 0, (struct sockaddr*)receiver, sizeof(*receiver));
+		}
+		else
+		{
+			sendto(sock, data, size, 0, (struct sockaddr*)receiver, sizeof(*receiver));
+		}
+	}
+}
+
+/* Function: setImpairment
+ * Desc: This function routes every datagram sendPacket sends through the specified
+ * Impairment, or straight to the socket if it is NULL. It should be called before
+ * any packets are sent.
+ */
+void setImpairment(Impairment* impairment)
+{
+	gImpairment = impairment;
+}
+
+/* Function: isImpaired
+ * Desc: This function determines if datagrams are dropped or delayed on purpose,
+ * by an Impairment or a kEmulateDrops build. Paths that send without sendPacket,
+ * such as io_uring and UDP segmentation offload, must not be used if so.
+ */
+bool isImpaired()
+{
+	return gImpairment != NULL || kEmulateDrops;
+}
+
+/* Function: parseImpairment
+ * Desc: This function creates and starts an Impairment from a list such as
+ * "loss=0.01,delay=20" (see Impairment::ParseConfig), and prints what it does.
+ * NULL is returned if the list is not valid.
+ */
+Impairment* parseImpairment(const char* spec)
+{
+	ImpairConfig config;
+
+	if (!Impairment::ParseConfig(spec, &config))
+	{
+		return NULL;
 	}
+
+	Impairment* impairment = new Impairment(config);
+
+	if (!impairment->Start())
+	{
+		cerr<<"Unable to start the impairment scheduler, delays are ignored."<<endl;
+	}
+
+	cerr<<"Impairing sent datagrams: "<<impairment->Describe()<<"."<<endl;
+	return impairment;
+}
+
+/* Function: isSegmentOffloadSupported
+ * Desc: This function determines if the kernel can split one large send on the
+ * specified UDP socket into several datagrams (UDP_SEGMENT). It always returns
+ * false while datagrams are impaired, since each one has to go through sendPacket.
+ */
+bool isSegmentOffloadSupported(int sock)
+{
+	bool supported = false;
+
+	if (sock >= 0 && !isImpaired())
+	{
+		int segmentSize = 0;
+		socklen_t optSize = sizeof(segmentSize);
+
+		supported = (getsockopt(sock, SOL_UDP, UDP_SEGMENT, &segmentSize, &optSize) == 0);
+	}
+
+	return supported;
+}
+
+/* Function: sendSegments
+ * Desc: This function sends the specified buffer as a run of datagrams of
+ * segmentSize bytes each, of which only the last may be shorter, with a single
+ * call. The kernel does the split (UDP_SEGMENT), so at most kMaxSegments
+ * datagrams and kMaxDatagramSize bytes may be sent at once. If false is
+ * returned, the kernel or the outgoing device cannot segment and nothing was
+ * sent; the caller should send the datagrams one at a time instead.
+ */
+bool sendSegments(int sock, struct sockaddr_in* receiver, char* data, size_t size, uint16_t segmentSize)
+{
+	bool sent = true;
+
+	if (sock >= 0 && receiver != NULL && data != NULL && size > 0 && segmentSize > 0)
+	{
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr* cmsg;
+		char control[CMSG_SPACE(sizeof(uint16_t))];
+
+		iov.iov_base = data;
+		iov.iov_len = size;
+
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		msg.msg_name = receiver;
+		msg.msg_namelen = sizeof(*receiver);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+
+		// A full socket buffer loses the datagrams just like sendto would, so only
+		// the errors that mean segmentation itself is not available are reported.
+		if (sendmsg(sock, &msg, 0) < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+		{
+			sent = false;
+		}
+	}
+
+	return sent;
+}
+
+/* Function: enableReceiveOffload
+ * Desc: This function asks the kernel to hand runs of datagrams that arrive
+ * together on the specified UDP socket to us in one piece (UDP_GRO), instead of
+ * one receive per datagram. If false is returned, the kernel does not support it
+ * and datagrams keep arriving one at a time.
+ */
+bool enableReceiveOffload(int sock)
+{
+	int enable = 1;
+
+	return (sock >= 0 && setsockopt(sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0);
+}
+
+/* Function: receiveSegments
+ * Desc: This function receives from the specified socket like recvfrom. When
+ * receive offload has coalesced several datagrams, the segmentSize parameter is
+ * set to the size of each of them (only the last may be shorter); otherwise it
+ * is set to the number of bytes received. The buffer should hold at least
+ * kMaxDatagramSize bytes, since coalesced datagrams can be that large.
+ */
+ssize_t receiveSegments(int sock, struct sockaddr_in* sender, char* buff, size_t size, uint32_t* segmentSize)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t bytesRead = -1;
+
+	if (sock >= 0 && sender != NULL && buff != NULL && segmentSize != NULL)
+	{
+		iov.iov_base = buff;
+		iov.iov_len = size;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = sender;
+		msg.msg_namelen = sizeof(*sender);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		bytesRead = recvmsg(sock, &msg, 0);
+		*segmentSize = getReceivedSegmentSize(&msg, bytesRead);
+	}
+
+	return bytesRead;
+}
+
+/* Function: getReceivedSegmentSize
+ * Desc: This function returns the size of each datagram in a buffer filled by
+ * recvmsg, taken from the UDP_GRO control message if receive offload coalesced
+ * several datagrams. Otherwise the whole buffer is one datagram and bytesRead is
+ * returned. The control buffer must have room for an int sized message.
+ */
+uint32_t getReceivedSegmentSize(struct msghdr* msg, ssize_t bytesRead)
+{
+	uint32_t segmentSize = (bytesRead > 0) ? (uint32_t)bytesRead : 0;
+
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); bytesRead > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+		{
+			int groSize = 0;
+			memcpy(&groSize, CMSG_DATA(cmsg), sizeof(groSize));
+
+			if (groSize > 0 && groSize < bytesRead)
+			{
+				segmentSize = (uint32_t)groSize;
+			}
+		}
+	}
+
+	return segmentSize;
 }
 
 /* Function: getHostAddress
@@ -342,118 +645,74 @@ bool doesFileExist(char* fileName)
 	return exists;
 }
 
-/* Function: calculateTimeOutInterval
- * Desc: This function calculates the time out interval in milliseconds based off of
- * the current estimated round trip time and deviation. The time out interval 
- * calculation is based on the TCP method. The values in the memory location where
- * the estRTT and devRTT pointers point to will be updated in this function. If any
- * invalid parameters are passed in, the value 0 is returned without changes to
- * estRtt or devRtt pointer memory locations.
+/* Function: setSocketBufferSize
+ * Desc: This function raises the send and receive buffers of the specified socket
+ * so that a full window of large datagrams is not dropped by the kernel. The
+ * forced variants are tried first since they may exceed the system maximum when
+ * running as root.
  */
-uint32_t calculateTimeOutInterval(uint32_t* estRtt, int* devRtt, struct timeval* sampleStartTime, struct timeval* sampleEndTime)
+void setSocketBufferSize(int sock, int size)
 {
-	uint32_t timeOut = 0;
-
-	if (estRtt != NULL && devRtt != NULL && sampleStartTime != NULL && sampleEndTime != NULL)
+	if (sock >= 0 && size > 0)
 	{
-		if (*estRtt > 0)
+		if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
 		{
-			//cout<<"Est RTT: "<<dec<<*estRtt<<endl;
-			uint32_t sampleRtt = getTimeDiffMilliSeconds(sampleStartTime, sampleEndTime);
-			uint32_t newEstRtt = calculateEstimatedRtt(*estRtt, sampleRtt);
-			int newDevRtt = calculateDeviationRtt(*devRtt, *estRtt, sampleRtt);
-			int estAdj = newDevRtt * 4;
-
-			if (estAdj < 0 && (newEstRtt + estAdj) > newEstRtt)
-			{
-				timeOut = newEstRtt / 2;
-			}
-			else
-			{
-				timeOut = newEstRtt + estAdj;
-			}
-
-			*estRtt = newEstRtt;
-			*devRtt = newDevRtt;
-			/*cout<<"Sample RTT: "<<dec<<sampleRtt<<endl;
-			cout<<"New Estimated RTT: "<<dec<<newEstRtt<<endl;
-			cout<<"New Deviation RTT: "<<dec<<newDevRtt<<endl;*/
+			setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
 		}
-		else
+
+		if (setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0)
 		{
-			*estRtt = getTimeDiffMilliSeconds(sampleStartTime, sampleEndTime);
-			*devRtt = 0;
-			timeOut = *estRtt * 2;
+			setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 		}
 	}
-
-	//cout<<"Timeout: "<<dec<<timeOut<<endl;
-
-	return timeOut;
 }
 
-/* Function: calculateEstimatedRtt
- * Desc: This function calculates the estimated round trip time. It requires the
- * current estimated RTT value and current sample RTT. The new estimated round
- * trip time is returned.
+/* Function: getPathMaxDatagramSize
+ * Desc: This function asks the kernel for the MTU of the route to the specified
+ * host and returns the largest UDP payload that fits in it without fragmenting.
+ * For loopback and other same host routes this is close to kMaxDatagramSize. If
+ * the MTU cannot be determined, 0 is returned.
  */
-uint32_t calculateEstimatedRtt(uint32_t estRtt, uint32_t sampleRtt)
+uint32_t getPathMaxDatagramSize(struct sockaddr_in* host)
 {
-	uint32_t estAdj = sampleRtt >> kRttEstDelta; // May lose accuracy.
-
-	return (estRtt - (estRtt >> kRttEstDelta)) + estAdj;
-}
+	uint32_t size = 0;
 
-/* Function: calculateDeviationRtt
- * Desc: This function calculates the new deviation between an estimated round trip
- * time and the current sample.
- */
-int calculateDeviationRtt(int devRtt, uint32_t estRtt, uint32_t sampleRtt)
-{
-	int devAdj = 0;
-
-	if (sampleRtt > estRtt)
-	{
-		devAdj = (sampleRtt - estRtt) >> kRttDevDelta;
-	}
-	else
+	if (host != NULL)
 	{
-		devAdj = (estRtt - sampleRtt) >> kRttDevDelta;
-	}
+		// IP_MTU is only available on a connected socket, so use a throw away one.
+		int sock = socket(PF_INET, SOCK_DGRAM, 0);
 
-	//uint32_t devAdj = ((uint32_t)fabs(((double)sampleRtt - estRtt))) >> kRttDevDelta;
-	//cout<<"sampleRtt - estRtt: "<<dec<<(sampleRtt - estRtt)<<endl;
-	//cout<<"sampleRtt - estRtt double: "<<dec<<(double)(sampleRtt - estRtt)<<endl;
-	/*cout<<"devAdj: "<<dec<<devAdj<<endl;
-	cout<<"devRtt: "<<dec<<devRtt<<endl;*/
+		if (sock >= 0)
+		{
+			int mtu = 0;
+			socklen_t mtuSize = sizeof(mtu);
 
-	return (devRtt - (devRtt >> kRttDevDelta)) - devAdj;
+			if (connect(sock, (struct sockaddr*)host, sizeof(*host)) == 0
+				&& getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &mtuSize) == 0
+				&& mtu > kUdpIpHeaderSize)
+			{
+				size = MIN((uint32_t)(mtu - kUdpIpHeaderSize), (uint32_t)kMaxDatagramSize);
+			}
 
-	//double devAdj = fabs((double)(sampleRtt - estRtt)) * 0.25;
+			close(sock);
+		}
+	}
 
-	//return (devRtt - (devRtt >> kRttDevDelta)) - devAdj;
+	return size;
 }
 
-/* Function: getTimeDiffMilliSeconds
- * Desc: This function returns the difference between two timeval structures in
- * milliseconds.
+/* Function: getMonotonicMicroSeconds
+ * Desc: This function returns the CLOCK_MONOTONIC time in microseconds, the
+ * clock every timing in the protocol is taken on.
  */
-uint32_t getTimeDiffMilliSeconds(struct timeval* startTime, struct timeval* endTime)
+uint64_t getMonotonicMicroSeconds()
 {
-	uint32_t rttMilliSecs = 0;
-
-	if (startTime != NULL && endTime != NULL)
-	{
-		rttMilliSecs = (uint32_t)((((endTime->tv_sec * kMicroSecond) + endTime->tv_usec) - ((startTime->tv_sec * kMicroSecond) + startTime->tv_usec)) / 1000);
-		//cout<<dec<<(uint32_t)(((endTime->tv_sec * kMicroSecond) + endTime->tv_usec) - ((startTime->tv_sec * kMicroSecond) + startTime->tv_usec))<<endl;
-	}
+	struct timespec fNow;
+	clock_gettime(CLOCK_MONOTONIC, &fNow);
 
-	return rttMilliSecs;
+	return (uint64_t)fNow.tv_sec * 1000000ULL + (uint64_t)fNow.tv_nsec / 1000;
 }
 
-
-
-
 /* call sendto or drop the packet.  Packets are only dropped if
  * DROP_COUNT > 0, in which case (approximately or exactly) one out
  * of every DROP_COUNT packets is dropped.
@@ -480,7 +739,9 @@ uint32_t getTimeDiffMilliSeconds(struct timeval* startTime, struct timeval* endT
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#ifndef DROP_COUNT
 #define	DROP_COUNT 5		/* change this to drop packets */
+#endif
 #define	PREDICTABLE_DROP 0	/* this specifies predictable or random drop */
 /*
 #define	IRREPRODUCIBLE_SEQUENCE // when defined, every run has different drops
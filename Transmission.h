@@ -10,21 +10,36 @@
 #ifndef _TRANSMISSION_H_
 #define _TRANSMISSION_H_
 
-#define kPacketSize 1200
+#define kPacketSize 1200 // Default datagram size, and the size every path is assumed to carry.
+#define kMaxDatagramSize 65507 // Largest UDP payload over IPv4.
+#define kUdpIpHeaderSize 28
+#define kSocketBufferSize 4194304
+#define kSegmentSizeByteSize 2
+#define kMaxSegments 64 // Most datagrams the kernel will split a single UDP_SEGMENT send into.
 #define kAckPacketSize 13
+#define kSackPacketSize 21
 #define kDataPacketSize 11
+#define kParityPacketSize 15
 #define kPortNumMin 1
 #define kPortNumMax 65535
 #define kFileNameMaxChars 20
 #define kMicroSecond 1000000
-#define kRttEstDelta 3
-#define kRttDevDelta 2
 #define kSeqNumByteSize 8
+#define kProtocolVersion 1 // Sent after the datagram size in the SYN and SYN-ACK. Older peers send nothing there.
+#define kHandshakeOptionsSize 32 // Room for the version and options at the end of a SYN-ACK.
+#define kAckPacketMaxSize (kAckPacketSize + kSegmentSizeByteSize + kHandshakeOptionsSize)
+#define kStreamUnknownSize 0xFFFFFFFFFFFFFFFFULL // Size sent in the SYN of a stream whose end is marked by the FIN.
+
+// Set to 1 (e.g. -DkEmulateDrops=1) to send every packet through error_send.
+#ifndef kEmulateDrops
+#define kEmulateDrops 0
+#endif
 
 // Valid file name characters are a-z and 0-9, and the file name may also contain a single ".".
 #define kFileNameRegEx "^[0-9a-z]*\\.?[0-9a-z]*$"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 #include <iostream>
 #include <arpa/inet.h>
@@ -33,6 +48,7 @@
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
@@ -41,6 +57,9 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include "Impairment.h"
+#include "WireFormat.h"
+
 using namespace std;
 
 /*! \class Data
@@ -49,7 +68,7 @@ using namespace std;
 class Data {
 	public:
 		Data(){}
-		Data(uint32_t seq, unsigned short size, char *data) 
+		Data(uint64_t seq, unsigned short size, char *data) 
 			: mSeqNum(seq), mPacketSize(size), mData(data) {} //!< Adds the information to the object.
 		~Data() {  }
 		
@@ -62,48 +81,67 @@ enum MessageType {
 	SYN = 0x55,
 	ACK = 0x5A,
 	DATA = 0xDD,
-	FIN = 0x5F
-};
-
-struct SynPacket {
-	uint8_t		code;
-	uint64_t	seq;
-	uint64_t	len;
-	char		*name;
+	FIN = 0x5F,
+	PARITY = 0xEC,
+	PROBE = 0x50,
+	SACK = 0x5C
 };
 
-struct AckPacket {
-	uint8_t		code;
-	uint64_t	ack;
-	uint32_t	window;
+/*
+ * Options carried at the end of the SYN and SYN-ACK. Unknown types are skipped,
+ * so new ones can be added without breaking older peers.
+ */
+enum HandshakeOption {
+	OPTION_FEATURES = 1, // uint32_t bit mask of ProtocolFeature.
+	OPTION_EARLY_DATA = 2, // Part of the data carried by a SYN. The parts follow each other from sequence number 1.
+	OPTION_PATHS = 3 // Other addresses the sender's packets come from, each a uint32_t address and uint16_t port.
 };
 
-struct DataPacket {
-	uint8_t		code;
-	uint64_t	seq;
-	uint16_t	len;
-	char		*data;
+/*
+ * Optional parts of the protocol. Each side advertises the ones it supports and
+ * a transfer uses only those both sides advertised.
+ */
+enum ProtocolFeature {
+	FEATURE_FEC = 0x1, // PARITY packets.
+	FEATURE_PROBE = 0x2, // PROBE packets for finding the path's datagram size.
+	FEATURE_STREAM = 0x4, // A SYN of kStreamUnknownSize bytes, with the FIN marking the end.
+	FEATURE_EARLY_DATA = 0x8, // Data carried by the SYN, and sent behind it before the SYN-ACK.
+	FEATURE_SACK = 0x10, // SACK packets for DATA that did not move the ACK forward.
+	FEATURE_MULTIPATH = 0x20, // DATA, PARITY and FIN from the addresses in OPTION_PATHS as well as the SYN's.
+	FEATURE_ALL = FEATURE_FEC | FEATURE_PROBE | FEATURE_STREAM | FEATURE_EARLY_DATA | FEATURE_SACK | FEATURE_MULTIPATH
 };
 
-struct FinPacket {
-	uint8_t		code;
-	uint64_t	seq;
-};
+static_assert(AckPacket::kSize == kAckPacketSize, "ACK layout does not match kAckPacketSize");
+static_assert(SackPacket::kSize == kSackPacketSize, "SACK layout does not match kSackPacketSize");
+static_assert(DataPacket::kSize == kDataPacketSize, "DATA layout does not match kDataPacketSize");
+static_assert(ParityPacket::kSize == kParityPacketSize, "PARITY layout does not match kParityPacketSize");
+static_assert(AckPacket::SegmentSize::kEnd == kAckPacketSize + kSegmentSizeByteSize, "SYN-ACK size does not match kSegmentSizeByteSize");
 
-bool tryGetUShortFromMessage(char* buff, int size, unsigned short* result);
-bool tryGetUIntFromMessage(char* buff, int size, uint32_t* result);
-bool tryGetULongFromMessage(char* buff, int size, uint64_t* result);
 bool tryGetStringFromMessage(char* buff, int size, char* result, int resultSize);
-bool setUShortToMessage(char* buff, int buffSize, uint16_t input);
-bool setUIntToMessage(char* buff, int buffSize, uint32_t input);
-bool setULongToMessage(char* buff, int buffSize, uint64_t input);
+uint32_t setHandshakeOptions(char* buff, uint32_t size, uint32_t features);
+bool getHandshakeOptions(char* buff, uint32_t size, uint8_t* version, uint32_t* features);
+uint32_t setEarlyData(char* buff, uint32_t size, uint32_t* offset, const char* data, uint32_t length);
+uint32_t getEarlyData(char* buff, uint32_t size, char* data, uint32_t dataSize);
+uint32_t setPaths(char* buff, uint32_t size, uint32_t* offset, const struct sockaddr_in* paths, uint32_t count);
+uint32_t getPaths(char* buff, uint32_t size, struct sockaddr_in* paths, uint32_t maxCount);
+string describeFeatures(uint8_t version, uint32_t features);
 bool isEqualHost(struct sockaddr_in* host1, struct sockaddr_in* host2);
 bool isRegExMatch(const char* str, const char* pattern, int maxChars);
 void sendPacket(int sock, struct sockaddr_in* receiver, char* data, int size);
 void sendPacket(int sock, struct sockaddr_in* receiver, char* data, size_t size, bool printPackets);
+void setImpairment(Impairment* impairment);
+bool isImpaired();
+Impairment* parseImpairment(const char* spec);
+bool isSegmentOffloadSupported(int sock);
+bool sendSegments(int sock, struct sockaddr_in* receiver, char* data, size_t size, uint16_t segmentSize);
+bool enableReceiveOffload(int sock);
+ssize_t receiveSegments(int sock, struct sockaddr_in* sender, char* buff, size_t size, uint32_t* segmentSize);
+uint32_t getReceivedSegmentSize(struct msghdr* msg, ssize_t bytesRead);
 void spawnThread(pthread_t *thread, void *(*threadFunc)(void*), void *args);
 struct sockaddr_in* getHostAddress(char* hostName, unsigned short port);
 bool doesFileExist(char* fileName);
-uint32_t calculateTimeOutInterval(uint32_t* estRtt, int* devRtt, struct timeval* sampleStartTime, struct timeval* sampleEndTime);
+void setSocketBufferSize(int sock, int size);
+uint32_t getPathMaxDatagramSize(struct sockaddr_in* host);
+uint64_t getMonotonicMicroSeconds();
 
 #endif
@@ -11,6 +11,7 @@
 
 #include "TransmissionTimer.h"
 #include "Transmission.h"
+#include "Probes.h"
 #include <iostream>
 
 TransmissionTimer::TransmissionTimer(unsigned int milliSeconds, void* caller, void (*callBackFunc)(void*))
@@ -35,8 +36,20 @@ TransmissionTimer::TransmissionTimer(unsigned int milliSeconds, int intervalCt,
 	mTimerThread.Start();
 }
 
+/* Function (dtor): TransmissionTimer
+ * Desc: This destructor stops the timer thread and waits for it to exit, so a
+ * callback is never made on a deleted caller. It must not be called from the
+ * timer's own callback.
+ */
 TransmissionTimer::~TransmissionTimer()
 {
+	mMutex.Lock();
+	this->mIsRunning = false;
+	this->mIsPaused = false;
+	mMutex.Signal();
+	mMutex.Unlock();
+
+	mTimerThread.Join();
 }
 
 int TransmissionTimer::GetIntervalCount()
@@ -84,8 +97,9 @@ void TransmissionTimer::Start(bool abortIfStarted)
 {
 	mMutex.Lock();
 
-	// Check if the timer is running and if we should start a new timer.
-	if (abortIfStarted && this->mIsRunning)
+	// Check if the timer is running and if we should start a new timer. A paused
+	// timer has no wait in progress, so there is nothing to abort.
+	if (abortIfStarted && this->mIsRunning && !this->mIsPaused)
 	{
 		mDoAbort = true;
 	}
@@ -117,7 +131,9 @@ void TransmissionTimer::Stop()
 	{
 		mMutex.Signal();
 
-		if (this->mIntervalCt != 0)
+		// A timer that repeats forever is only paused, so that Start can
+		// resume it. Clearing its count would end the thread at the next fire.
+		if (this->mIntervalCt > 0)
 		{
 			this->mIntervalCt = 0;
 		}
@@ -129,6 +145,14 @@ void TransmissionTimer::Stop()
 	mMutex.Unlock();
 }
 
+/* Function: SetAffinity
+ * Desc: This function keeps the timer thread, which makes the callbacks, on one core.
+ */
+bool TransmissionTimer::SetAffinity(int cpu)
+{
+	return mTimerThread.SetAffinity(cpu);
+}
+
 void* TransmissionTimer::_DoTimer(void* arg)
 {
 	TransmissionTimer* timer = (TransmissionTimer*)arg;
@@ -155,6 +179,14 @@ void* TransmissionTimer::_DoTimer(void* arg)
 				absTime.tv_sec += timer->mSecs; // Add seconds offset.
 				absTime.tv_nsec += timer->mNanoSecs; // Add nanoseconds offset.
 
+				// Carry whole seconds out of the nanoseconds field, otherwise the
+				// wait fails with EINVAL and this loop spins until the clock wraps.
+				if (absTime.tv_nsec >= 1000000000L)
+				{
+					absTime.tv_sec += absTime.tv_nsec / 1000000000L;
+					absTime.tv_nsec %= 1000000000L;
+				}
+
 				//cout << "Waiting for time out... " << dec << timer->mSecs << endl;
 
 
@@ -177,6 +209,8 @@ void* TransmissionTimer::_DoTimer(void* arg)
 					{
 						if (isTimeOut)
 						{
+							PROBE2(timer_fire, timer->mDelayMilliSecs, timer->mIntervalCt);
+
 							if (timer->mTimerCallBack != NULL)
 							{
 								// Call the callback function to notify of timer time out.
@@ -209,4 +243,5 @@ void* TransmissionTimer::_DoTimer(void* arg)
 	}
 
 	timer->mTimerThread.Exit();
+	return NULL;
 }
@@ -36,6 +36,7 @@ class TransmissionTimer
 		void Start(bool abortIfStarted);
 		void Start(bool abortIfStarted, unsigned int newDelayMilliSeconds);
 		void Stop();
+		bool SetAffinity(int cpu);
 
 	private:
 		static void* 	_DoTimer(void *arg);
@@ -0,0 +1,214 @@
+/*
+ * File: WireFormat.h
+ * Desc: Compile time layouts of the packet headers, and the big endian loads
+ * and stores used to read and write their fields.
+ */
+#ifndef _WIREFORMAT_H_
+#define _WIREFORMAT_H_
+
+#include <endian.h>
+#include <inttypes.h>
+#include <string.h>
+
+/*
+ * Loads and stores of network byte order values at any alignment. The memcpy
+ * becomes a single unaligned move and the conversion a bswap, so a field costs
+ * two instructions instead of a shift and mask per byte.
+ */
+template <typename T> inline T wireLoad(const char *buff);
+template <typename T> inline void wireStore(char *buff, T value);
+
+template <> inline uint8_t wireLoad<uint8_t>(const char *buff)
+{
+	return (uint8_t)buff[0];
+}
+
+template <> inline uint16_t wireLoad<uint16_t>(const char *buff)
+{
+	uint16_t fValue;
+	memcpy(&fValue, buff, sizeof(fValue));
+	return be16toh(fValue);
+}
+
+template <> inline uint32_t wireLoad<uint32_t>(const char *buff)
+{
+	uint32_t fValue;
+	memcpy(&fValue, buff, sizeof(fValue));
+	return be32toh(fValue);
+}
+
+template <> inline uint64_t wireLoad<uint64_t>(const char *buff)
+{
+	uint64_t fValue;
+	memcpy(&fValue, buff, sizeof(fValue));
+	return be64toh(fValue);
+}
+
+template <> inline void wireStore<uint8_t>(char *buff, uint8_t value)
+{
+	buff[0] = (char)value;
+}
+
+template <> inline void wireStore<uint16_t>(char *buff, uint16_t value)
+{
+	value = htobe16(value);
+	memcpy(buff, &value, sizeof(value));
+}
+
+template <> inline void wireStore<uint32_t>(char *buff, uint32_t value)
+{
+	value = htobe32(value);
+	memcpy(buff, &value, sizeof(value));
+}
+
+template <> inline void wireStore<uint64_t>(char *buff, uint64_t value)
+{
+	value = htobe64(value);
+	memcpy(buff, &value, sizeof(value));
+}
+
+/*! \struct WireField
+    \brief A field of type T at a fixed byte offset in a packet.
+
+   Get and Set do no bounds checking. A packet is checked once against its
+   layout's kSize with isWireSizeValid before any of its fields are read.
+*/
+template <typename T, unsigned Offset>
+struct WireField {
+	typedef T Type;
+	static constexpr unsigned kOffset = Offset;
+	static constexpr unsigned kEnd = Offset + sizeof(T);
+
+	static T Get(const char *packet) { return wireLoad<T>(packet + Offset); }
+	static void Set(char *packet, T value) { wireStore<T>(packet + Offset, value); }
+};
+
+/*! \struct PacketHeader
+    \brief The message type and sequence number every packet starts with.
+*/
+struct PacketHeader {
+	typedef WireField<uint8_t, 0> Code;
+	typedef WireField<uint64_t, Code::kEnd> Seq;
+	static constexpr unsigned kSize = Seq::kEnd;
+};
+
+/*! \struct SynPacket
+    \brief SYN: header, file size, then the NUL terminated file name.
+*/
+struct SynPacket : PacketHeader {
+	typedef WireField<uint64_t, PacketHeader::kSize> FileSize;
+	static constexpr unsigned kSize = FileSize::kEnd;
+};
+
+/*! \struct AckPacket
+    \brief ACK: the next sequence number expected and the receive window. The
+    SYN-ACK may add the datagram size the receiver agreed to, then its protocol
+    version and options.
+*/
+struct AckPacket : PacketHeader {
+	typedef PacketHeader::Seq Ack;
+	typedef WireField<uint32_t, PacketHeader::kSize> Window;
+	static constexpr unsigned kSize = Window::kEnd;
+	typedef WireField<uint16_t, kSize> SegmentSize;
+	typedef WireField<uint8_t, SegmentSize::kEnd> Version;
+	static constexpr unsigned kOptionsOffset = Version::kEnd;
+};
+
+/*! \struct SackPacket
+    \brief SACK: an ACK sent for a DATA packet that did not move the ACK
+    forward, followed by the sequence number of that packet.
+*/
+struct SackPacket : AckPacket {
+	typedef WireField<uint64_t, AckPacket::kSize> Received;
+	static constexpr unsigned kSize = Received::kEnd;
+};
+
+/*! \struct DataPacket
+    \brief DATA: header and payload length, followed by the payload.
+*/
+struct DataPacket : PacketHeader {
+	typedef WireField<uint16_t, PacketHeader::kSize> Length;
+	static constexpr unsigned kSize = Length::kEnd;
+};
+
+/*! \struct ParityPacket
+    \brief PARITY: the block it covers, followed by stride bytes of parity.
+*/
+struct ParityPacket : PacketHeader {
+	typedef WireField<uint16_t, PacketHeader::kSize> Count;
+	typedef WireField<uint16_t, Count::kEnd> Stride;
+	typedef WireField<uint16_t, Stride::kEnd> LengthXor;
+	static constexpr unsigned kSize = LengthXor::kEnd;
+};
+
+/*! \struct ProbePacket
+    \brief PROBE: the datagram size in place of the sequence number, then padding.
+*/
+struct ProbePacket : PacketHeader {
+	typedef PacketHeader::Seq Size;
+};
+
+/*! \struct FinPacket
+    \brief FIN: the sequence number following the last byte of the file.
+*/
+struct FinPacket : PacketHeader {
+};
+
+/*
+ * Returns true if a packet of size bytes holds every fixed field of Layout.
+ */
+template <typename Layout>
+inline bool isWireSizeValid(uint32_t size)
+{
+	return size >= Layout::kSize;
+}
+
+/*! \struct WireOption
+    \brief A type-length-value option from the end of a SYN or SYN-ACK. Each
+    option is a type byte, a length byte and length bytes of value.
+*/
+struct WireOption {
+	uint8_t			mType;
+	uint8_t			mLength;
+	const char		*mValue;
+};
+
+/*
+ * Appends an option at buff + *offset if it fits in size bytes and moves *offset
+ * past it. Returns false, leaving *offset alone, if it does not fit.
+ */
+inline bool wirePutOption(char *buff, uint32_t size, uint32_t *offset, uint8_t type, const char *value, uint8_t length)
+{
+	if (*offset + 2 + length > size)
+	{
+		return false;
+	}
+
+	buff[*offset] = (char)type;
+	buff[*offset + 1] = (char)length;
+	memcpy(buff + *offset + 2, value, length);
+	*offset += 2 + length;
+
+	return true;
+}
+
+/*
+ * Reads the option at buff + *offset and moves *offset past it. Returns false at
+ * the end of the packet or if the option runs past it.
+ */
+inline bool wireGetOption(const char *buff, uint32_t size, uint32_t *offset, WireOption *option)
+{
+	if (*offset + 2 > size || *offset + 2 + (uint8_t)buff[*offset + 1] > size)
+	{
+		return false;
+	}
+
+	option->mType = (uint8_t)buff[*offset];
+	option->mLength = (uint8_t)buff[*offset + 1];
+	option->mValue = buff + *offset + 2;
+	*offset += 2 + option->mLength;
+
+	return true;
+}
+
+#endif
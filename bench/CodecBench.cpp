@@ -0,0 +1,212 @@
+/*
+ * File: CodecBench.cpp
+ * Desc: Measures how long it takes to encode and decode packet headers, with
+ * the byte at a time helpers WireFormat.h replaced and with WireFormat.h itself.
+ * Build with "make codecbench" and run ./codecbench [iterations].
+ */
+#include <iostream>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../Transmission.h"
+
+#define kBenchDefaultIterations 20000000
+#define kBenchPackets 64 // Headers cycled through, so the loop is not one hot cache line.
+
+using namespace std;
+
+/*
+ * The helpers the packet code used before WireFormat.h, kept here as the baseline.
+ * They lived in Transmission.cpp, so every field was a call; noinline keeps that.
+ */
+__attribute__((noinline)) bool legacyGetUShort(char* buff, int size, unsigned short* result)
+{
+	if (buff != NULL && result != NULL && size >= 2)
+	{
+		*result = (unsigned char)buff[0] << 8 | (unsigned char)buff[1];
+		return true;
+	}
+
+	return false;
+}
+
+__attribute__((noinline)) bool legacyGetUInt(char* buff, int size, uint32_t* result)
+{
+	if (buff != NULL && result != NULL && size >= 4)
+	{
+		*result = (unsigned char)buff[0] << 24 | (unsigned char)buff[1] << 16 | (unsigned char)buff[2] << 8 | (unsigned char)buff[3];
+		return true;
+	}
+
+	return false;
+}
+
+__attribute__((noinline)) bool legacyGetULong(char* buff, int size, uint64_t* result)
+{
+	if (buff != NULL && result != NULL && size >= 8)
+	{
+		uint32_t t1 = (unsigned char)buff[0] << 24 | (unsigned char)buff[1] << 16 | (unsigned char)buff[2] << 8 | (unsigned char)buff[3];
+		uint32_t t2 = (unsigned char)buff[4] << 24 | (unsigned char)buff[5] << 16 | (unsigned char)buff[6] << 8 | (unsigned char)buff[7];
+		*result = ((uint64_t)t1 << 32) | (uint64_t)t2;
+		return true;
+	}
+
+	return false;
+}
+
+__attribute__((noinline)) bool legacySetUShort(char* buff, int buffSize, uint16_t input)
+{
+	if (buff != NULL && buffSize >= 2)
+	{
+		buff[0] = (input >> 8) & 0xFF;
+		buff[1] = input & 0xFF;
+		return true;
+	}
+
+	return false;
+}
+
+__attribute__((noinline)) bool legacySetUInt(char* buff, int buffSize, uint32_t input)
+{
+	if (buff != NULL && buffSize >= 4)
+	{
+		buff[0] = (input >> 24) & 0xFF;
+		buff[1] = (input >> 16) & 0xFF;
+		buff[2] = (input >> 8) & 0xFF;
+		buff[3] = input & 0xFF;
+		return true;
+	}
+
+	return false;
+}
+
+__attribute__((noinline)) bool legacySetULong(char* buff, int buffSize, uint64_t input)
+{
+	if (buff != NULL && buffSize >= 8)
+	{
+		for (int i = 0; i < 8; i++)
+		{
+			buff[i] = (input >> (56 - (8 * i))) & 0xFF;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Keeps the compiler from dropping work whose result is never used.
+ */
+static inline void keep(uint64_t value)
+{
+	asm volatile("" : : "r"(value) : "memory");
+}
+
+static double elapsedNs(struct timespec *start, struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) * 1e9) + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t iterations = (argc > 1) ? strtoull(argv[1], NULL, 10) : kBenchDefaultIterations;
+	static char packets[kBenchPackets][kAckPacketSize + kDataPacketSize];
+	struct timespec start, end;
+	uint64_t sum = 0;
+
+	// Encode a DATA header and an ACK, the two packets every payload costs.
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		char *packet = packets[i % kBenchPackets];
+		packet[0] = (char)DATA;
+		legacySetULong(packet + 1, kDataPacketSize - 1, i);
+		legacySetUShort(packet + 9, kDataPacketSize - 9, (uint16_t)i);
+		packet += kDataPacketSize;
+		packet[0] = (char)ACK;
+		legacySetULong(packet + 1, kAckPacketSize - 1, i);
+		legacySetUInt(packet + 9, kAckPacketSize - 9, (uint32_t)i);
+		keep((uint64_t)packet[3]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double legacyEncode = elapsedNs(&start, &end) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		char *packet = packets[i % kBenchPackets];
+		DataPacket::Code::Set(packet, DATA);
+		DataPacket::Seq::Set(packet, i);
+		DataPacket::Length::Set(packet, (uint16_t)i);
+		packet += kDataPacketSize;
+		AckPacket::Code::Set(packet, ACK);
+		AckPacket::Ack::Set(packet, i);
+		AckPacket::Window::Set(packet, (uint32_t)i);
+		keep((uint64_t)packet[3]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double wireEncode = elapsedNs(&start, &end) / iterations;
+
+	// Decode them again, checking the length the way each version does.
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		char *packet = packets[i % kBenchPackets];
+		uint64_t seq = 0;
+		unsigned short length = 0;
+		uint32_t window = 0;
+		legacyGetULong(packet + 1, kDataPacketSize - 1, &seq);
+		legacyGetUShort(packet + 9, kDataPacketSize - 9, &length);
+		packet += kDataPacketSize;
+		legacyGetULong(packet + 1, kAckPacketSize - 1, &seq);
+		legacyGetUInt(packet + 9, kAckPacketSize - 9, &window);
+		sum += seq + length + window;
+		keep(sum);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double legacyDecode = elapsedNs(&start, &end) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		char *packet = packets[i % kBenchPackets];
+		uint64_t seq = 0;
+		unsigned short length = 0;
+		uint32_t window = 0;
+
+		if (isWireSizeValid<DataPacket>(kDataPacketSize))
+		{
+			seq = DataPacket::Seq::Get(packet);
+			length = DataPacket::Length::Get(packet);
+		}
+
+		packet += kDataPacketSize;
+
+		if (isWireSizeValid<AckPacket>(kAckPacketSize))
+		{
+			seq = AckPacket::Ack::Get(packet);
+			window = AckPacket::Window::Get(packet);
+		}
+
+		sum += seq + length + window;
+		keep(sum);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double wireDecode = elapsedNs(&start, &end) / iterations;
+
+	cout.precision(3);
+	cout<<"DATA + ACK header, ns per packet pair over "<<dec<<iterations<<" iterations:"<<endl;
+	cout<<"\tencode: byte at a time "<<legacyEncode<<", WireFormat "<<wireEncode<<endl;
+	cout<<"\tdecode: byte at a time "<<legacyDecode<<", WireFormat "<<wireDecode<<endl;
+
+	return 0;
+}
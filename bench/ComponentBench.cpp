@@ -0,0 +1,383 @@
+/*
+ * File: ComponentBench.cpp
+ * Desc: Microbenchmarks of the receive path components, the packet codec, the
+ * RTO calculation and the transmission timer, on Google Benchmark. Build with
+ * "make microbench" and run ./microbench [--pin=<cpu>] [benchmark flags], or
+ * "make microbench-run" for pinned, repeated runs saved as JSON.
+ */
+#include <benchmark/benchmark.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../DiskBuffer.h"
+#include "../OutOfSeqCache.h"
+#include "../RtoEstimator.h"
+#include "../Transmission.h"
+#include "../TransmissionTimer.h"
+
+#define kBenchPayloadSize (kPacketSize - kDataPacketSize - kUdpIpHeaderSize) // A default DATA payload.
+#define kBenchPackets 64 // Headers cycled through, so the loop is not one hot cache line.
+#define kBenchDiskPackets 16384 // Packets per DiskBuffer file before it is started again, about 19 MB.
+#define kBenchDiskPath "/dev/shm/microbench.bin" // tmpfs, so the disk itself is not measured.
+
+using namespace std;
+
+static char gPayload[kBenchPayloadSize];
+
+/*
+ * Returns the CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t getNanoSeconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+/*
+ * A hole at the front of the window, then depth packets behind it, then the
+ * hole is filled and the cache drained in order, as the receiver does.
+ */
+static void BM_OutOfSeqCache(benchmark::State &state)
+{
+	uint64_t depth = state.range(0);
+	OutOfSeqCache cache;
+
+	for (auto _ : state)
+	{
+		for (uint64_t i = 1; i <= depth; i++)
+		{
+			cache.Add(Data(1 + (i * kBenchPayloadSize), kBenchPayloadSize, gPayload));
+		}
+
+		for (uint64_t i = 1; i <= depth; i++)
+		{
+			Data *data = cache.GetData(1 + (i * kBenchPayloadSize));
+			delete [] data->mData;
+			delete data;
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * depth);
+	state.SetBytesProcessed(state.iterations() * depth * kBenchPayloadSize);
+}
+BENCHMARK(BM_OutOfSeqCache)->RangeMultiplier(8)->Range(1, 4096);
+
+/*
+ * Adds packets to a DiskBuffer on tmpfs. With a depth of 1 they arrive in
+ * order; otherwise each run of depth packets arrives backwards, so all but the
+ * last go through the out of order cache and the last drains it.
+ */
+static void BM_DiskBufferAdd(benchmark::State &state)
+{
+	uint64_t depth = state.range(0);
+	DiskWriteMode mode = (DiskWriteMode)state.range(1);
+	string fileName = kBenchDiskPath;
+	vector<uint64_t> order;
+
+	for (uint64_t first = 0; first + depth <= kBenchDiskPackets; first += depth)
+	{
+		for (uint64_t i = depth; i > 0; i--)
+		{
+			order.push_back(1 + ((first + i - 1) * kBenchPayloadSize));
+		}
+	}
+
+	DiskBuffer *buffer = NULL;
+	size_t next = order.size();
+
+	for (auto _ : state)
+	{
+		if (next == order.size())
+		{
+			// Start a new file, without counting the flush of the last one.
+			state.PauseTiming();
+			delete buffer;
+			buffer = new DiskBuffer(fileName, (uint64_t)order.size() * kBenchPayloadSize, 1);
+
+			if (!buffer->SetWriteMode(mode))
+			{
+				state.SkipWithError("The write mode could not be set");
+				break;
+			}
+
+			next = 0;
+			state.ResumeTiming();
+		}
+
+		Data data(order[next++], kBenchPayloadSize, gPayload);
+		benchmark::DoNotOptimize(buffer->Add(data));
+	}
+
+	delete buffer;
+	unlink(kBenchDiskPath);
+
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * kBenchPayloadSize);
+}
+BENCHMARK(BM_DiskBufferAdd)->ArgNames({"depth", "mode"})
+	->ArgsProduct({{1, 8, 64, 512}, {DISK_WRITE_STREAM, DISK_WRITE_COALESCE}});
+
+static void BM_EncodeDataHeader(benchmark::State &state)
+{
+	static char packets[kBenchPackets][kDataPacketSize];
+	uint64_t i = 0;
+
+	for (auto _ : state)
+	{
+		char *packet = packets[i % kBenchPackets];
+		DataPacket::Code::Set(packet, DATA);
+		DataPacket::Seq::Set(packet, i);
+		DataPacket::Length::Set(packet, (uint16_t)i);
+		benchmark::ClobberMemory();
+		i++;
+	}
+}
+BENCHMARK(BM_EncodeDataHeader);
+
+static void BM_DecodeDataHeader(benchmark::State &state)
+{
+	static char packets[kBenchPackets][kDataPacketSize];
+	uint64_t i = 0;
+
+	for (uint64_t p = 0; p < kBenchPackets; p++)
+	{
+		DataPacket::Seq::Set(packets[p], p * kBenchPayloadSize);
+		DataPacket::Length::Set(packets[p], kBenchPayloadSize);
+	}
+
+	for (auto _ : state)
+	{
+		char *packet = packets[i++ % kBenchPackets];
+		benchmark::DoNotOptimize(packet);
+
+		if (isWireSizeValid<DataPacket>(kDataPacketSize))
+		{
+			benchmark::DoNotOptimize(DataPacket::Seq::Get(packet));
+			benchmark::DoNotOptimize(DataPacket::Length::Get(packet));
+		}
+	}
+}
+BENCHMARK(BM_DecodeDataHeader);
+
+static void BM_EncodeDecodeAck(benchmark::State &state)
+{
+	static char packets[kBenchPackets][kAckPacketSize];
+	uint64_t i = 0;
+
+	for (auto _ : state)
+	{
+		char *packet = packets[i % kBenchPackets];
+		AckPacket::Code::Set(packet, ACK);
+		AckPacket::Ack::Set(packet, i);
+		AckPacket::Window::Set(packet, (uint32_t)i);
+		benchmark::DoNotOptimize(packet);
+		benchmark::DoNotOptimize(AckPacket::Ack::Get(packet) + AckPacket::Window::Get(packet));
+		i++;
+	}
+}
+BENCHMARK(BM_EncodeDecodeAck);
+
+/*
+ * The version and option TLVs of a SYN, written by the sender and read back
+ * by the receiver.
+ */
+static void BM_HandshakeOptions(benchmark::State &state)
+{
+	char options[kHandshakeOptionsSize];
+
+	for (auto _ : state)
+	{
+		uint32_t size = setHandshakeOptions(options, sizeof(options), FEATURE_ALL);
+		uint8_t version = 0;
+		uint32_t features = 0;
+
+		benchmark::DoNotOptimize(getHandshakeOptions(options, size, &version, &features));
+		benchmark::DoNotOptimize(features);
+	}
+}
+BENCHMARK(BM_HandshakeOptions);
+
+/*
+ * Feeds RTT samples that wander around 20 ms, as ACKs on a steady path would.
+ */
+static void BM_RtoEstimator(benchmark::State &state)
+{
+	uint64_t samples[kBenchPackets];
+	RtoEstimator rto;
+	uint64_t i = 0;
+
+	srand(1);
+
+	for (int p = 0; p < kBenchPackets; p++)
+	{
+		samples[p] = (15 + (rand() % 10)) * 1000;
+	}
+
+	for (auto _ : state)
+	{
+		rto.AddSample(samples[i++ % kBenchPackets], false);
+		benchmark::DoNotOptimize(rto.GetTimeOutMilliSeconds());
+	}
+}
+BENCHMARK(BM_RtoEstimator);
+
+/*
+ * Arming and disarming a timer that does not fire, as the sender does with its
+ * retransmission timer on every ACK.
+ */
+static void BM_TimerStartStop(benchmark::State &state)
+{
+	// Never freed: destroying a timer whose thread waits on its condition
+	// variable blocks at exit.
+	static TransmissionTimer *timer = new TransmissionTimer(1000, kTransmissionTimerInfiniteInterval, NULL, NULL);
+
+	for (auto _ : state)
+	{
+		timer->Start(true);
+		timer->Stop();
+	}
+
+	// Stop clears the interval count.
+	timer->SetIntervalCount(kTransmissionTimerInfiniteInterval);
+}
+BENCHMARK(BM_TimerStartStop);
+
+/*! \struct TimerFirings
+    \brief Counts the callbacks of BM_TimerFiring's timer.
+*/
+struct TimerFirings {
+	Mutex		mLock;
+	uint64_t	mCount;
+	uint64_t	mLast; // CLOCK_MONOTONIC nanoseconds of the last callback.
+};
+
+static void onTimerFired(void *caller)
+{
+	TimerFirings *firings = (TimerFirings*)caller;
+
+	firings->mLock.Lock();
+	firings->mLast = getNanoSeconds();
+	firings->mCount++;
+	firings->mLock.Signal();
+	firings->mLock.Unlock();
+}
+
+/*
+ * How late a repeating timer fires. Each iteration waits for one callback and
+ * reports, as its time, how long after the previous callback plus the delay it
+ * came; the timer thread rearms after each callback, so this is the drift a
+ * retransmission timeout sees.
+ */
+static void BM_TimerFiring(benchmark::State &state)
+{
+	static TimerFirings *firings = new TimerFirings();
+	static TransmissionTimer *timer = new TransmissionTimer(1000, kTransmissionTimerInfiniteInterval, firings, onTimerFired);
+	uint64_t delay = state.range(0) * 1000000;
+	uint64_t worst = 0;
+	uint64_t total = 0;
+
+	// The callback takes firings->mLock inside the timer's lock, so the timer
+	// is not started with firings->mLock held.
+	firings->mLock.Lock();
+	uint64_t count = firings->mCount;
+	firings->mLock.Unlock();
+
+	uint64_t previous = getNanoSeconds();
+	timer->SetIntervalCount(kTransmissionTimerInfiniteInterval);
+	timer->Start(true, (unsigned)state.range(0));
+	firings->mLock.Lock();
+
+	for (auto _ : state)
+	{
+		while (firings->mCount == count)
+		{
+			firings->mLock.Wait();
+		}
+
+		count = firings->mCount;
+		uint64_t late = (firings->mLast > previous + delay) ? firings->mLast - (previous + delay) : 0;
+		previous = firings->mLast;
+
+		worst = (late > worst) ? late : worst;
+		total += late;
+		state.SetIterationTime(late / 1e9);
+	}
+
+	firings->mLock.Unlock();
+	timer->Stop();
+
+	state.counters["late_us"] = benchmark::Counter(total / 1000.0, benchmark::Counter::kAvgIterations);
+	state.counters["worst_us"] = worst / 1000.0;
+}
+BENCHMARK(BM_TimerFiring)->Arg(1)->Iterations(500)->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_TimerFiring)->Arg(10)->Iterations(100)->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+/*
+ * Takes --pin=<cpu> out of the arguments and pins the process to that CPU, so
+ * runs are not moved between cores or spread over their caches. The timer
+ * threads are pinned with it, so their wakeups compete with the benchmark the
+ * way the sender's do on one core.
+ */
+static bool pinFromArguments(int *argc, char *argv[])
+{
+	for (int i = 1; i < *argc; i++)
+	{
+		if (strncmp(argv[i], "--pin=", 6) != 0)
+		{
+			continue;
+		}
+
+		int cpu = atoi(argv[i] + 6);
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		{
+			perror("Could not pin to the CPU");
+			return false;
+		}
+
+		benchmark::AddCustomContext("pinned_cpu", argv[i] + 6);
+
+		for (int j = i; j < *argc - 1; j++)
+		{
+			argv[j] = argv[j + 1];
+		}
+
+		(*argc)--;
+		break;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	memset(gPayload, 'x', sizeof(gPayload));
+
+	if (!pinFromArguments(&argc, argv))
+	{
+		return 1;
+	}
+
+	benchmark::Initialize(&argc, argv);
+
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+	{
+		return 1;
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	return 0;
+}
@@ -0,0 +1,365 @@
+#!/usr/bin/env python3
+"""
+File: transfer_bench.py
+Desc: End to end benchmark of relsend and relrecv. Runs transfers over a
+matrix of file sizes, drop rates, delays and datagram sizes, repeats each
+cell, and reports completion time, throughput and CPU time with 95%
+confidence intervals. With a delay, completion is also given in round trips,
+which is how the small-file fast path (relsend -0) is judged. Results are written as JSON, and --compare diffs them
+against an earlier run.
+
+Drop rates reuse error_send: each one is a build with -DkEmulateDrops=1 and
+-DDROP_COUNT=<n>, so about 1 in n packets is dropped. Delays need root and
+the netem qdisc; the transfers then run in a network namespace whose
+loopback delays every packet, so the round trip time is twice the delay.
+
+Run with "make bench", or directly:
+    python3 bench/transfer_bench.py --sizes 1M,64M --drops 0,20 --repeat 10
+    sudo python3 bench/transfer_bench.py --sizes 500,4K --delays 50 --send-opts "-0"
+"""
+
+import argparse
+import datetime
+import filecmp
+import json
+import math
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+NETNS = "tlbench"
+BASE_CFLAGS = "-O2 -g"
+# Measured per transfer; completion_rtts is None without a delay.
+METRICS = ("completion_s", "completion_rtts", "throughput_mbps", "sender_cpu_s", "receiver_cpu_s")
+
+# Two sided 95% Student t quantiles by degrees of freedom; 1.96 beyond.
+T95 = [0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+       2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+       2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+       2.042]
+
+
+def parse_size(text):
+    """Parses a byte count with an optional K, M or G suffix."""
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    text = text.strip().upper()
+
+    if text and text[-1] in units:
+        return int(float(text[:-1]) * units[text[-1]])
+
+    return int(text)
+
+
+def parse_list(text, convert):
+    return [convert(item) for item in text.split(",") if item.strip()]
+
+
+def summarize(samples):
+    """Returns the mean and 95% confidence half width of samples."""
+    count = len(samples)
+
+    if count == 0:
+        return None
+
+    mean = sum(samples) / count
+
+    if count == 1:
+        return {"mean": mean, "ci95": None, "n": 1}
+
+    variance = sum((x - mean) ** 2 for x in samples) / (count - 1)
+    quantile = T95[count - 1] if count - 1 < len(T95) else 1.96
+
+    return {"mean": mean, "ci95": quantile * math.sqrt(variance / count), "n": count}
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(["git", "-C", REPO, "describe", "--always", "--dirty"],
+                                       stderr=subprocess.DEVNULL, text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def build(work, drop_count):
+    """Builds relsend and relrecv from a copy of the tree, with drops emulated
+    if drop_count is not 0. Returns the directory holding the binaries."""
+    target = os.path.join(work, "build", "drop_%d" % drop_count)
+    os.makedirs(target)
+
+    for name in os.listdir(REPO):
+        if name.endswith((".cpp", ".h")) or name == "makefile":
+            shutil.copy(os.path.join(REPO, name), target)
+
+    cflags = BASE_CFLAGS
+
+    if drop_count > 0:
+        cflags += " -DkEmulateDrops=1 -DDROP_COUNT=%d -DIRREPRODUCIBLE_SEQUENCE" % drop_count
+
+    result = subprocess.run(["make", "-s", "CFLAGS=" + cflags], cwd=target,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+
+    if result.returncode != 0:
+        sys.exit("Building with DROP_COUNT=%d failed:\n%s" % (drop_count, result.stdout))
+
+    return target
+
+
+def netem_available():
+    """Returns whether a namespace with a delayed loopback can be set up."""
+    if os.geteuid() != 0 or shutil.which("ip") is None or shutil.which("tc") is None:
+        return False
+
+    subprocess.run(["ip", "netns", "del", NETNS], stderr=subprocess.DEVNULL)
+
+    if subprocess.run(["ip", "netns", "add", NETNS], stderr=subprocess.DEVNULL).returncode != 0:
+        return False
+
+    works = subprocess.run(["ip", "netns", "exec", NETNS, "tc", "qdisc", "add", "dev", "lo", "root",
+                            "netem", "delay", "1ms"], stderr=subprocess.DEVNULL).returncode == 0
+    subprocess.run(["ip", "netns", "del", NETNS], stderr=subprocess.DEVNULL)
+
+    return works
+
+
+def set_delay(delay):
+    """Recreates the benchmark namespace with its loopback delayed by delay ms."""
+    subprocess.run(["ip", "netns", "del", NETNS], stderr=subprocess.DEVNULL)
+    subprocess.check_call(["ip", "netns", "add", NETNS])
+    subprocess.check_call(["ip", "netns", "exec", NETNS, "ip", "link", "set", "lo", "up"])
+    subprocess.check_call(["ip", "netns", "exec", NETNS, "tc", "qdisc", "add", "dev", "lo", "root",
+                           "netem", "delay", "%gms" % delay])
+
+
+def wait_rusage(process, deadline):
+    """Waits for process until deadline, killing it if it runs over. Returns
+    its exit status and CPU seconds, or None for the status if it was killed."""
+    while True:
+        pid, status, usage = os.wait4(process.pid, os.WNOHANG)
+
+        if pid != 0:
+            process.returncode = os.waitstatus_to_exitcode(status)
+            return process.returncode, usage.ru_utime + usage.ru_stime
+
+        if time.monotonic() > deadline:
+            process.kill()
+            pid, status, usage = os.wait4(process.pid, 0)
+            process.returncode = -9
+            return None, usage.ru_utime + usage.ru_stime
+
+        time.sleep(0.002)
+
+
+def run_transfer(binaries, cell, data_file, port, args):
+    """Runs one transfer and returns its measurements, or None if it failed."""
+    prefix = ["ip", "netns", "exec", NETNS] if cell["delay_ms"] > 0 else []
+    run_dir = os.path.dirname(data_file)
+    name = os.path.basename(data_file)
+    received = os.path.join(run_dir, "r" + name)
+    sender_opts = ["-m", str(cell["mss"])] if cell["mss"] > 0 else []
+
+    if os.path.exists(received):
+        os.remove(received)
+
+    receiver = subprocess.Popen(prefix + [os.path.join(binaries, "relrecv")] + args.recv_opts.split() + [str(port)],
+                                cwd=run_dir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.2)
+
+    start = time.monotonic()
+    sender = subprocess.Popen(prefix + [os.path.join(binaries, "relsend")] + sender_opts + args.send_opts.split()
+                              + [name, "127.0.0.1", str(port)],
+                              cwd=run_dir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    send_status, send_cpu = wait_rusage(sender, start + args.timeout)
+    elapsed = time.monotonic() - start
+    recv_status, recv_cpu = wait_rusage(receiver, time.monotonic() + 5)
+
+    if send_status != 0 or recv_status != 0 or not filecmp.cmp(data_file, received, shallow=False):
+        return None
+
+    return {
+        "completion_s": elapsed,
+        "completion_rtts": elapsed * 1000 / (2 * cell["delay_ms"]) if cell["delay_ms"] > 0 else None,
+        "throughput_mbps": (cell["size"] * 8) / elapsed / 1e6,
+        "sender_cpu_s": send_cpu,
+        "receiver_cpu_s": recv_cpu,
+    }
+
+
+def run_matrix(args):
+    work = tempfile.mkdtemp(prefix="tlbench.")
+    port = args.port
+    results = []
+    has_netem = any(delay > 0 for delay in args.delays) and netem_available()
+
+    try:
+        binaries = {}
+
+        for drop_count in args.drops:
+            print("Building with DROP_COUNT=%d..." % drop_count, file=sys.stderr)
+            binaries[drop_count] = build(work, drop_count)
+
+        data_dir = os.path.join(work, "data")
+        os.makedirs(data_dir)
+
+        for delay in args.delays:
+            if delay > 0 and not has_netem:
+                print("Skipping %g ms delay: needs root and the netem qdisc." % delay, file=sys.stderr)
+                continue
+
+            if delay > 0:
+                set_delay(delay)
+
+            for size in args.sizes:
+                data_file = os.path.join(data_dir, "b%d.bin" % size)
+
+                if not os.path.exists(data_file):
+                    with open(data_file, "wb") as out:
+                        out.write(os.urandom(size))
+
+                for drop_count in args.drops:
+                    for mss in args.mss:
+                        cell = {"size": size, "drop_count": drop_count, "delay_ms": delay, "mss": mss}
+                        samples = []
+                        failures = 0
+
+                        for run in range(args.warmup + args.repeat):
+                            port = port + 1 if port < args.port + 1000 else args.port + 1
+                            sample = run_transfer(binaries[drop_count], cell, data_file, port, args)
+
+                            if sample is None:
+                                failures += 1
+                            elif run >= args.warmup:
+                                samples.append(sample)
+
+                        cell["failures"] = failures
+                        cell["samples"] = samples
+
+                        for metric in METRICS:
+                            cell[metric] = summarize([sample[metric] for sample in samples
+                                                      if sample.get(metric) is not None])
+
+                        results.append(cell)
+                        print_cell(cell)
+    finally:
+        if has_netem:
+            subprocess.run(["ip", "netns", "del", NETNS], stderr=subprocess.DEVNULL)
+
+        if args.keep:
+            print("Kept the builds and data in " + work, file=sys.stderr)
+        else:
+            shutil.rmtree(work, ignore_errors=True)
+
+    return results
+
+
+def format_stat(stat, scale=1.0, digits=3):
+    if stat is None:
+        return "-"
+
+    text = "%.*f" % (digits, stat["mean"] * scale)
+
+    if stat["ci95"] is not None:
+        text += " +/- %.*f" % (digits, stat["ci95"] * scale)
+
+    return text
+
+
+def cell_name(cell):
+    return "size=%d drop=1/%s delay=%gms mss=%s" % (cell["size"], cell["drop_count"] or "inf",
+                                                    cell["delay_ms"], cell["mss"] or "default")
+
+
+def print_cell(cell):
+    print("%-50s %22s s %18s rtt %24s Mbit/s  cpu send %18s s recv %18s s  failed %d/%d"
+          % (cell_name(cell), format_stat(cell["completion_s"]), format_stat(cell["completion_rtts"], digits=2),
+             format_stat(cell["throughput_mbps"], digits=1),
+             format_stat(cell["sender_cpu_s"]), format_stat(cell["receiver_cpu_s"]),
+             cell["failures"], cell["failures"] + len(cell["samples"])))
+    sys.stdout.flush()
+
+
+def compare(old_file, results):
+    """Prints the change in each cell's means against an earlier run. A change
+    is marked significant when the confidence intervals do not overlap."""
+    with open(old_file) as source:
+        old = json.load(source)
+
+    old_cells = {cell_name(cell): cell for cell in old["results"]}
+    print("\nAgainst %s (%s):" % (old_file, old.get("revision", "unknown")))
+
+    for cell in results:
+        before = old_cells.get(cell_name(cell))
+
+        if before is None:
+            continue
+
+        changes = []
+
+        for metric in METRICS:
+            a, b = before.get(metric), cell.get(metric)
+
+            if not a or not b or a["mean"] == 0:
+                continue
+
+            overlap = a["ci95"] is None or b["ci95"] is None or \
+                abs(b["mean"] - a["mean"]) <= a["ci95"] + b["ci95"]
+            changes.append("%s %+.1f%%%s" % (metric, (b["mean"] - a["mean"]) * 100 / a["mean"],
+                                             "" if overlap else " *"))
+
+        print("%-50s %s" % (cell_name(cell), ", ".join(changes)))
+
+    print("* = confidence intervals do not overlap")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Loopback transfer benchmark for relsend and relrecv.")
+    parser.add_argument("--sizes", default="1M,16M", help="file sizes, with K, M or G suffixes (default 1M,16M)")
+    parser.add_argument("--drops", default="0,20",
+                        help="DROP_COUNT values; 0 for no drops, n to drop about 1 in n packets (default 0,20)")
+    parser.add_argument("--delays", default="0", help="one way delays in ms, needing root and netem (default 0)")
+    parser.add_argument("--mss", default="0", help="relsend -m datagram sizes; 0 for the default (default 0)")
+    parser.add_argument("--repeat", type=int, default=5, help="measured runs per cell (default 5)")
+    parser.add_argument("--warmup", type=int, default=1, help="unmeasured runs per cell (default 1)")
+    parser.add_argument("--timeout", type=float, default=120, help="seconds before a transfer counts as failed")
+    parser.add_argument("--port", type=int, default=9400, help="first port to use (default 9400)")
+    parser.add_argument("--send-opts", default="", help="extra relsend options, such as \"-r -g\"")
+    parser.add_argument("--recv-opts", default="", help="extra relrecv options, such as \"-t\"")
+    parser.add_argument("--output", help="write the results as JSON to this file")
+    parser.add_argument("--compare", help="diff the results against this earlier JSON file")
+    parser.add_argument("--keep", action="store_true", help="keep the builds and data files")
+    args = parser.parse_args()
+
+    args.sizes = parse_list(args.sizes, parse_size)
+    args.drops = parse_list(args.drops, int)
+    args.delays = parse_list(args.delays, float)
+    args.mss = parse_list(args.mss, int)
+
+    results = run_matrix(args)
+    report = {
+        "revision": git_revision(),
+        "date": datetime.datetime.now(datetime.timezone.utc).isoformat(),
+        "host": platform.node(),
+        "kernel": platform.release(),
+        "cpus": os.cpu_count(),
+        "send_opts": args.send_opts,
+        "recv_opts": args.recv_opts,
+        "results": results,
+    }
+
+    if args.output:
+        with open(args.output, "w") as out:
+            json.dump(report, out, indent=1)
+            out.write("\n")
+
+    if args.compare:
+        compare(args.compare, results)
+
+    return 1 if any(cell["failures"] > 0 for cell in results) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,289 @@
+/*
+ * File: relrecv.cpp
+ * Desc: Entry point of the relrecv program, which receives one file with the
+ * Receiver class of libtcplight, to disk or to a pipe.
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "Receiver.h"
+#include "StreamPump.h"
+
+void printUsage();
+void onReceived(void *caller);
+void onWritten(void *caller, StreamPumpEvent event);
+
+/* Function: main
+ * Desc: This function is the main entry point for the relrecv program.
+ */
+int main (int argc, char *argv[])
+{
+	int maxPacketSize = kMaxDatagramSize;
+	bool useIoUring = false;
+	bool sqPoll = false;
+	bool writerThread = false;
+	DiskWriteMode writeMode = DISK_WRITE_STREAM;
+	char *statsFile = NULL;
+	int statsPort = 0;
+	char *traceFile = NULL;
+	int traceLevel = TRACE_CONTROL;
+	bool stageTimers = false;
+	Impairment *impairment = NULL;
+	char *outputFile = NULL;
+	bool refuseEarlyData = false;
+	char *cpus = NULL;
+	int busyPoll = 0;
+	bool spin = false;
+	int opt;
+
+	// Parse the options that come before the port.
+	while ((opt = getopt(argc, argv, "m:tuUw:j:x:T:L:SI:o:EC:B:s")) != -1)
+	{
+		if (opt == 'm' && atoi(optarg) >= kPacketSize && atoi(optarg) <= kMaxDatagramSize)
+		{
+			maxPacketSize = atoi(optarg);
+		}
+		else if (opt == 't')
+		{
+			writerThread = true;
+		}
+		else if (opt == 'u' || opt == 'U')
+		{
+			useIoUring = true;
+			sqPoll = sqPoll || (opt == 'U');
+		}
+		else if (opt == 'w' && (strcmp(optarg, "stream") == 0 || strcmp(optarg, "coalesce") == 0 || strcmp(optarg, "direct") == 0))
+		{
+			writeMode = (optarg[0] == 's') ? DISK_WRITE_STREAM : ((optarg[0] == 'c') ? DISK_WRITE_COALESCE : DISK_WRITE_DIRECT);
+		}
+		else if (opt == 'j')
+		{
+			statsFile = optarg;
+		}
+		else if (opt == 'x' && atoi(optarg) >= kPortNumMin && atoi(optarg) <= kPortNumMax)
+		{
+			statsPort = atoi(optarg);
+		}
+		else if (opt == 'T')
+		{
+			traceFile = optarg;
+		}
+		else if (opt == 'L' && atoi(optarg) >= TRACE_CONTROL && atoi(optarg) <= TRACE_PACKET)
+		{
+			traceLevel = atoi(optarg);
+		}
+		else if (opt == 'S')
+		{
+			stageTimers = true;
+		}
+		else if (opt == 'I' && (impairment = parseImpairment(optarg)) != NULL)
+		{
+			setImpairment(impairment);
+		}
+		else if (opt == 'o')
+		{
+			outputFile = optarg;
+		}
+		else if (opt == 'E')
+		{
+			refuseEarlyData = true;
+		}
+		else if (opt == 'C')
+		{
+			cpus = optarg;
+		}
+		else if (opt == 'B' && atoi(optarg) > 0)
+		{
+			busyPoll = atoi(optarg);
+		}
+		else if (opt == 's')
+		{
+			spin = true;
+		}
+		else
+		{
+			printUsage();
+			exit(1);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	// Check to see if we have correct # of arguments.
+	if (argc == 2)
+	{
+		int port = atoi(argv[1]);
+
+		if (port >= kPortNumMin && port <= kPortNumMax)
+		{
+			Receiver receiver((unsigned short)port);
+			receiver.SetMaxPacketSize((uint32_t)maxPacketSize);
+			receiver.SetWriteMode(writeMode);
+
+			StreamPump *pump = NULL;
+
+			// Data for a pipe or standard output passes through a bounded
+			// buffer in order, and a full pipe closes the window.
+			if (outputFile != NULL)
+			{
+				int fd = (strcmp(outputFile, "-") == 0) ? STDOUT_FILENO : open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+				if (fd < 0)
+				{
+					cerr<<"Unable to open '"<<outputFile<<"'."<<endl;
+					exit(1);
+				}
+
+				// Keep standard output for the data.
+				if (fd == STDOUT_FILENO)
+				{
+					receiver.SetLog(&cerr);
+				}
+
+				StreamBuffer *sink = new StreamBuffer(kStreamPumpBufferSize);
+				pump = new StreamPump(fd, sink, STREAM_PUMP_OUT);
+				pump->SetCallback(&receiver, onWritten);
+				receiver.SetSink(sink);
+				receiver.SetNotify(pump, onReceived);
+				pump->Start();
+			}
+
+			if (writerThread)
+			{
+				receiver.EnableWriterThread();
+			}
+
+			if (refuseEarlyData)
+			{
+				receiver.RefuseEarlyData();
+			}
+
+			if (useIoUring)
+			{
+				receiver.EnableIoUring(sqPoll);
+			}
+
+			if (statsFile != NULL || statsPort > 0)
+			{
+				receiver.EnableStats(statsFile, (unsigned short)statsPort);
+			}
+
+			if (traceFile != NULL)
+			{
+				receiver.EnableTrace(traceFile, (TraceLevel)traceLevel);
+			}
+
+			if (stageTimers)
+			{
+				receiver.EnableStageTimers();
+			}
+
+			if (cpus != NULL || busyPoll > 0 || spin)
+			{
+				receiver.EnableLowLatency(cpus, (uint32_t)busyPoll, spin);
+			}
+
+			bool received = receiver.Start();
+
+			// Write out what is still buffered before exiting.
+			if (pump != NULL && !pump->Finish())
+			{
+				cerr<<"Unable to write to '"<<outputFile<<"'."<<endl;
+				received = false;
+			}
+
+			// The CPU time goes with the stage latencies, so the cost of -C, -B
+			// and -s can be weighed against the latency they save.
+			if (stageTimers)
+			{
+				struct rusage usage;
+				getrusage(RUSAGE_SELF, &usage);
+				((pump != NULL && strcmp(outputFile, "-") == 0) ? cerr : cout)<<"CPU time: "
+					<<(usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000)<<" ms user, "
+					<<(usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000)<<" ms system."<<endl;
+			}
+
+			if (!received)
+			{
+				exit(1);
+			}
+		}
+		else
+		{
+			printUsage();
+		}
+	}
+	else
+	{
+		printUsage();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Function: onReceived
+ * Desc: This function is called by the receiver when in order data arrived, and
+ * wakes the pump that writes it out.
+ */
+void onReceived(void *caller)
+{
+	((StreamPump*)caller)->Wake();
+}
+
+/* Function: onWritten
+ * Desc: This function is called by the pump after it wrote data out, since the
+ * room made may reopen the sender's window.
+ */
+void onWritten(void *caller, StreamPumpEvent event)
+{
+	if (event == STREAM_PUMP_MOVED)
+	{
+		((Receiver*)caller)->UpdateWindow();
+	}
+}
+
+/* Function: printUsage
+ * Desc: This function displays the usage information on how this program should work.
+ */
+void printUsage()
+{
+	cout<<"Invalid command line arguments specified.\n\n";
+	cout<<"You must supply one numeric argument, which denotes the port number.\n";
+	cout<<"Usage: relrecv [-m <bytes>] [-t] [-u | -U] [-w stream|coalesce|direct] [-j <file>] [-x <port>]\n";
+	cout<<"               [-T <file> [-L 1|2]] [-S] [-I <impairments>] [-o <file>] [-E] [-C <cores>] [-B <us>] [-s] <port>\n";
+	cout<<"\t<port> - A number between "<<kPortNumMin<<" and "<<kPortNumMax<<".\n";
+	cout<<"\t-m <bytes> - Largest datagram to accept ("<<kPacketSize<<" to "<<kMaxDatagramSize<<", default "<<kMaxDatagramSize<<")."<<endl;
+	cout<<"\t-t - Write the file on its own thread, so a slow disk shrinks the window instead of\n";
+	cout<<"\t     stalling the receive loop. Takes the place of io_uring for file writes.\n";
+	cout<<"\t-u - Receive and write the file through io_uring instead of blocking calls.\n";
+	cout<<"\t-U - Like -u, with kernel threads polling the submission queues (SQPOLL).\n";
+	cout<<"\t     Only worth it with spare CPU cores.\n";
+	cout<<"\t-w <mode> - How the file is written. stream (default) writes each packet as it arrives,\n";
+	cout<<"\t            coalesce writes "<<(kDiskBufferCoalesceSize / 1048576)<<" MB at a time into a preallocated file, and\n";
+	cout<<"\t            direct does the same with O_DIRECT to bypass the page cache."<<endl;
+	cout<<"\t-j <file> - Rewrite <file> with the transfer statistics as JSON every "<<kStatsWriteInterval<<" ms.\n";
+	cout<<"\t-x <port> - Serve the transfer statistics to Prometheus on 127.0.0.1:<port>.\n";
+	cout<<"\t-T <file> - Write a binary event trace to <file>, for traceconvert.\n";
+	cout<<"\t-L <level> - Trace detail: 1 (default) for holes in the data and slow disk writes, cheap\n";
+	cout<<"\t             enough to leave on; 2 adds every packet, ACK and disk write.\n";
+	cout<<"\t-S - Time the parse, reorder and disk write of every packet, and print their\n";
+	cout<<"\t     percentiles and the CPU time used at the end.\n";
+	cout<<"\t-I <impairments> - Emulate a bad path for the ACKs sent, with a list such as\n";
+	cout<<"\t     loss=0.01,burst=0.01:0.3:0.5,delay=20,jitter=5,reorder=0.02,dup=0.01,rate=50,queue=64,seed=7\n";
+	cout<<"\t     (probabilities, milliseconds, Mbit/s and datagrams). io_uring is then not used for ACKs."<<endl;
+	cout<<"\t-o <file> - Write the data in order to <file>, which may be a pipe, or to standard output\n";
+	cout<<"\t     for -, instead of r<filename>. At most "<<(kStreamPumpBufferSize / 1048576)<<" MB is held, and the sender waits\n";
+	cout<<"\t     while the reader of the pipe falls behind. -t, -w and io_uring file writes do not apply,\n";
+	cout<<"\t     and with - the messages go to standard error."<<endl;
+	cout<<"\t-E - Refuse data sent with the SYN (relsend -0), so the sender sends it again after the handshake."<<endl;
+	cout<<"\t-C <cores> - Pin the receive loop and the ACK timer to a list of cores such as 2-3, or to the\n";
+	cout<<"\t     cores on the NUMA node of the named interface, such as eth0.\n";
+	cout<<"\t-B <us> - Have the kernel busy poll the device for up to <us> microseconds before the receive\n";
+	cout<<"\t     loop sleeps (SO_BUSY_POLL; "<<kLowLatencyBusyPoll<<" is a good start). Needs root, and a NAPI device, not loopback.\n";
+	cout<<"\t-s - Spin on the socket for up to "<<kLowLatencyMaxSpin<<" us before each blocking receive, spinning less while\n";
+	cout<<"\t     packets keep taking longer. Costs a core; needs two or more, and does not apply to -u."<<endl;
+}
@@ -0,0 +1,351 @@
+/*
+ * File: relsend.cpp
+ * Desc: Entry point of the relsend program, which sends one file, or standard
+ * input, with the Sender class of libtcplight.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "Sender.h"
+#include "StreamPump.h"
+
+using namespace std;
+
+#define error(s) { cerr<<"Error: "<<(s); exit(1); }
+
+void printUsage();
+void onAcked(void *caller);
+void onRead(void *caller, StreamPumpEvent event);
+
+int main (int argc, char *argv[])
+{
+	char fileName[kFileNameMaxChars + 1];
+	const char *streamName = "stdin";
+	char ipAdd[16];
+	uint32_t portNumI;
+	unsigned short portNumS;
+	struct sockaddr_in * recv;
+	int fecBlockSize = 0;
+	int maxPacketSize = 0;
+	bool probe = false;
+	bool segmentOffload = false;
+	bool useIoUring = false;
+	bool sqPoll = false;
+	bool readAhead = false;
+	char *statsFile = NULL;
+	int statsPort = 0;
+	char *traceFile = NULL;
+	int traceLevel = TRACE_CONTROL;
+	bool stageTimers = false;
+	Impairment *impairment = NULL;
+	bool fromStdin = false;
+	bool earlyData = false;
+	bool timeOutsOnly = false;
+	char *cpus = NULL;
+	int busyPoll = 0;
+	bool spin = false;
+	PathConfig paths[kPathMaxPaths];
+	int pathCount = 0;
+	string pathImpairments;
+	int opt;
+
+	//parse the options that come before the positional arguments
+	while ((opt = getopt(argc, argv, "f:m:PgruUj:x:T:L:SI:n:0RC:B:sM:")) != -1){
+	  switch (opt){
+	    case 'f':
+	      fecBlockSize = atoi(optarg);
+	      if (fecBlockSize < kFecMinBlockSize || fecBlockSize > kFecMaxBlockSize){
+	        printUsage();
+	        exit(1);
+	      }
+	      break;
+	    case 'm':
+	      maxPacketSize = atoi(optarg);
+	      if (maxPacketSize < kPacketSize || maxPacketSize > kMaxDatagramSize){
+	        printUsage();
+	        exit(1);
+	      }
+	      break;
+	    case 'P':
+	      probe = true;
+	      break;
+	    case 'g':
+	      segmentOffload = true;
+	      break;
+	    case 'r':
+	      readAhead = true;
+	      break;
+	    case 'U':
+	      sqPoll = true;
+	      useIoUring = true;
+	      break;
+	    case 'u':
+	      useIoUring = true;
+	      break;
+	    case 'j':
+	      statsFile = optarg;
+	      break;
+	    case 'x':
+	      statsPort = atoi(optarg);
+	      if (statsPort < kPortNumMin || statsPort > kPortNumMax){
+	        printUsage();
+	        exit(1);
+	      }
+	      break;
+	    case 'T':
+	      traceFile = optarg;
+	      break;
+	    case 'L':
+	      traceLevel = atoi(optarg);
+	      if (traceLevel < TRACE_CONTROL || traceLevel > TRACE_PACKET){
+	        printUsage();
+	        exit(1);
+	      }
+	      break;
+	    case 'S':
+	      stageTimers = true;
+	      break;
+	    case 'I':
+	      impairment = parseImpairment(optarg);
+	      if (impairment == NULL){
+	        printUsage();
+	        exit(1);
+	      }
+	      setImpairment(impairment);
+	      break;
+	    case 'n':
+	      streamName = optarg;
+	      break;
+	    case '0':
+	      earlyData = true;
+	      break;
+	    case 'R':
+	      timeOutsOnly = true;
+	      break;
+	    case 'C':
+	      cpus = optarg;
+	      break;
+	    case 'B':
+	      busyPoll = atoi(optarg);
+	      if (busyPoll <= 0){
+	        printUsage();
+	        exit(1);
+	      }
+	      break;
+	    case 's':
+	      spin = true;
+	      break;
+	    case 'M':
+	      //each path may emulate its own impairments
+	      if (pathCount >= kPathMaxPaths - 1
+	          || !parsePathSpec(optarg, &paths[pathCount].mLocal, &paths[pathCount].mRemote, &pathImpairments)){
+	        printUsage();
+	        exit(1);
+	      }
+	      paths[pathCount].mImpairment = NULL;
+	      if (!pathImpairments.empty()
+	          && (paths[pathCount].mImpairment = parseImpairment(pathImpairments.c_str())) == NULL){
+	        printUsage();
+	        exit(1);
+	      }
+	      pathCount++;
+	      break;
+	    default:
+	      printUsage();
+	      exit(1);
+	  }
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+        //confirm that required number of arguments are present
+	if(argc != 4){
+	  printUsage();
+	  exit(1);
+	}
+	//a filename of - sends standard input under the stream name
+	fromStdin = (strcmp(argv[1], "-") == 0);
+
+	//check validity of filename and store
+	if (!isRegExMatch(fromStdin ? streamName : argv[1], kFileNameRegEx, kFileNameMaxChars)){
+	  printUsage();
+	  exit(1);
+	}
+	strcpy(fileName, fromStdin ? streamName : argv[1]);
+
+	//check validity of IP address and store
+	strcpy(ipAdd, argv[2]);
+	
+	//check validity of port number and store
+	portNumI = atoi(argv[3]);
+	if (portNumI < kPortNumMin || portNumI > kPortNumMax){
+	  printUsage();
+	  exit(1);
+	}
+	portNumS = (unsigned short)portNumI;
+
+	if ((recv = getHostAddress(ipAdd, portNumS)) == NULL){error("Unable to locate host");}
+
+	//standard input is read through a bounded buffer until end of file, and
+	//the FIN marks where it ended
+	StreamBuffer *source = NULL;
+	StreamPump *pump = NULL;
+	Sender *sender;
+
+	if (fromStdin){
+	  source = new StreamBuffer(kStreamPumpBufferSize);
+	  sender = new Sender(fileName, source, kStreamUnknownSize, recv);
+	  pump = new StreamPump(STDIN_FILENO, source, STREAM_PUMP_IN);
+	  pump->SetCallback(sender, onRead);
+	  sender->SetNotify(pump, onAcked);
+	}
+	else{
+	  sender = new Sender(fileName, recv);
+	}
+	if (fecBlockSize > 0){
+	  sender->EnableFec((unsigned short)fecBlockSize);
+	}
+	if (maxPacketSize > 0 || probe){
+	  //probing without a limit searches all the way up to the largest datagram
+	  sender->SetMaxPacketSize((maxPacketSize > 0) ? maxPacketSize : kMaxDatagramSize, probe);
+	}
+	if (segmentOffload){
+	  sender->EnableSegmentOffload();
+	}
+	if (useIoUring){
+	  sender->EnableIoUring(sqPoll);
+	}
+	if (readAhead){
+	  sender->EnableReadAhead();
+	}
+	if (statsFile != NULL || statsPort > 0){
+	  sender->EnableStats(statsFile, (unsigned short)statsPort);
+	}
+	if (traceFile != NULL){
+	  sender->EnableTrace(traceFile, (TraceLevel)traceLevel);
+	}
+	if (stageTimers){
+	  sender->EnableStageTimers();
+	}
+	if (earlyData){
+	  sender->EnableEarlyData();
+	}
+	if (timeOutsOnly){
+	  sender->DisableLossDetection();
+	}
+	if (cpus != NULL || busyPoll > 0 || spin){
+	  sender->EnableLowLatency(cpus, (uint32_t)busyPoll, spin);
+	}
+	for (int i = 0; i < pathCount; i++){
+	  sender->AddPath(&paths[i].mLocal, &paths[i].mRemote, paths[i].mImpairment);
+	}
+	if (pump != NULL && !pump->Start()){error("Unable to read standard input");}
+
+	bool sent = sender->Start();
+
+	//the pump calls into the sender, so it goes first
+	delete pump;
+	delete sender;
+	delete source;
+
+	//the CPU time goes with the stage latencies, so the cost of -C, -B and -s
+	//can be weighed against the latency they save
+	if (stageTimers){
+	  struct rusage usage;
+	  getrusage(RUSAGE_SELF, &usage);
+	  cout<<"CPU time: "<<(usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000)<<" ms user, "
+	      <<(usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000)<<" ms system."<<endl;
+	}
+
+	return sent ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Function: onAcked
+ * Desc: Called by the sender when data was acknowledged, which makes room in
+ * the buffer for the pump to read more.
+ */
+void onAcked(void *caller)
+{
+	((StreamPump*)caller)->Wake();
+}
+
+/* Function: onRead
+ * Desc: Called by the pump after reading standard input. The sender picks up
+ * new data, ends the stream at end of file, and gives up if the read failed.
+ */
+void onRead(void *caller, StreamPumpEvent event)
+{
+	Sender *sender = (Sender*)caller;
+
+	if (event == STREAM_PUMP_MOVED){
+	  sender->Wake();
+	}
+	else if (event == STREAM_PUMP_END){
+	  sender->EndStream();
+	}
+	else{
+	  cerr<<"Unable to read standard input."<<endl;
+	  sender->Stop();
+	}
+}
+
+/* Function: printUsage
+ * Desc: This function displays the usage information on how this program should work.
+ */
+void printUsage()
+{
+	cout<<"Invalid command line arguments specified.\n\n";
+	cout<<"User sust supply three arguments for program\n";
+	cout<<"First Argument Must be filename to transfer cannot exceed 20 characters, or - for standard input\n";
+	cout<<"Sencond Argument must be a valid IP address of the receiver\n";
+	cout<<"Third argument must be numeric port number that receiver is listening on\n";
+	cout<<"Usage: relsend [-f <block>] [-m <bytes>] [-P] [-g] [-r] [-u | -U] [-j <file>] [-x <port>] [-T <file> [-L 1|2]]\n";
+	cout<<"               [-S] [-I <impairments>] [-n <name>] [-0] [-R]\n";
+	cout<<"               [-C <cores>] [-B <us>] [-s] [-M <path>]... <filename> <ip> <port>\n";
+	cout<<"\t<port> - A number between "<<kPortNumMin<<" and "<<kPortNumMax<<".\n";
+	cout<<"\t-f <block> - Send a parity packet after at most <block> data packets ("<<kFecMinBlockSize<<" to "<<kFecMaxBlockSize<<").\n";
+	cout<<"\t             The block shrinks automatically as loss increases.\n";
+	cout<<"\t-m <bytes> - Largest datagram to send ("<<kPacketSize<<" to "<<kMaxDatagramSize<<"). The receiver may lower it.\n";
+	cout<<"\t-P - Probe the path for the largest datagram that gets through, up to -m.\n";
+	cout<<"\t-g - Let the kernel split runs of data packets (UDP GSO) when it supports it.\n";
+	cout<<"\t-r - Read the file ahead of the send window on its own thread, "<<(kReadAheadChunks * kReadAheadChunkSize / 1048576)<<" MB at most.\n";
+	cout<<"\t     Takes the place of io_uring for file reads.\n";
+	cout<<"\t-u - Read the file and send data packets through io_uring instead of blocking calls.\n";
+	cout<<"\t     Data packets are then sent one at a time, so -g has no effect.\n";
+	cout<<"\t-U - Like -u, with a kernel thread polling the submission queue (SQPOLL).\n";
+	cout<<"\t     Only worth it with spare CPU cores.\n";
+	cout<<"\t-j <file> - Rewrite <file> with the transfer statistics as JSON every "<<kStatsWriteInterval<<" ms.\n";
+	cout<<"\t-x <port> - Serve the transfer statistics to Prometheus on 127.0.0.1:<port>.\n";
+	cout<<"\t-T <file> - Write a binary event trace to <file>, for traceconvert.\n";
+	cout<<"\t-L <level> - Trace detail: 1 (default) for losses, timeouts and window cuts, cheap\n";
+	cout<<"\t             enough to leave on; 2 adds every packet, ACK and RTT sample.\n";
+	cout<<"\t-S - Time the file read, packet build, send and ACK parse of every packet, and print\n";
+	cout<<"\t     their percentiles at the end, along with the wait from each ACK to the next send\n";
+	cout<<"\t     and the CPU time used.\n";
+	cout<<"\t-I <impairments> - Emulate a bad path for the packets sent, with a list such as\n";
+	cout<<"\t     loss=0.01,burst=0.01:0.3:0.5,delay=20,jitter=5,reorder=0.02,dup=0.01,rate=50,queue=64,seed=7\n";
+	cout<<"\t     (probabilities, milliseconds, Mbit/s and datagrams). io_uring sends and -g are then not used.\n";
+	cout<<"\t-n <name> - Name to send standard input under (default stdin). Its length is not known up\n";
+	cout<<"\t     front, so the receiver learns it from the FIN. At most "<<(kStreamPumpBufferSize / 1048576)<<" MB is held, and -r\n";
+	cout<<"\t     and -u do not apply.\n";
+	cout<<"\t-0 - Send the start of the file in the SYN, and the rest of the first window behind it,\n";
+	cout<<"\t     without waiting for the receiver. A small file is then done in one round trip.\n";
+	cout<<"\t-R - Resend lost packets only after a retransmission timeout, instead of as soon as the\n";
+	cout<<"\t     receiver reports a later packet or the ACK for the last packets is overdue.\n";
+	cout<<"\t-C <cores> - Pin the threads to a list of cores such as 2-3, to the cores on the NUMA node\n";
+	cout<<"\t     of the named interface, such as eth0, or with auto to those of the interface that routes\n";
+	cout<<"\t     to the receiver. The ACK and send threads get a core each when there are two or more.\n";
+	cout<<"\t-B <us> - Have the kernel busy poll the device for up to <us> microseconds before waiting\n";
+	cout<<"\t     for an ACK (SO_BUSY_POLL; "<<kLowLatencyBusyPoll<<" is a good start). Needs root, and a NAPI device, not loopback.\n";
+	cout<<"\t-s - Spin for up to "<<kLowLatencyMaxSpin<<" us on the next ACK, and on the next event to send for, before\n";
+	cout<<"\t     blocking, spinning less while they keep taking longer. Costs a core; needs two or more.\n";
+	cout<<"\t     -S shows what -C, -B and -s save in ack_to_send and cost in CPU time.\n";
+	cout<<"\t-M <path> - Also send data from another local address, as <local>[/<remote>][@<impairments>],\n";
+	cout<<"\t     such as 10.0.1.5, 10.0.1.5/192.168.7.1 or 127.0.0.2@delay=20,rate=10. <remote> is another\n";
+	cout<<"\t     address of the receiver, and <impairments> emulate the path in place of -I. Repeat for up\n";
+	cout<<"\t     to "<<(kPathMaxPaths - 1)<<" paths. Each packet goes on the path it arrives soonest by, with a congestion\n";
+	cout<<"\t     window per path. Data packets are then sent one at a time, so -g and -u have no effect.\n";
+}
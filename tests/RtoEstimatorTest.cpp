@@ -0,0 +1,243 @@
+/*
+ * File: RtoEstimatorTest.cpp
+ * Desc: Checks RtoEstimator against RFC 6298: a recorded RTT trace replayed
+ * sample by sample, the first sample, the timeout limits, backoff and Karn's
+ * rule. Build and run with "make test", or ./rtotest <trace file>.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "../RtoEstimator.h"
+
+#define kTestDefaultTrace "tests/rtt_trace.txt"
+
+using namespace std;
+
+static int gChecks = 0;
+static int gFailures = 0;
+
+#define CHECK_EQUAL(actual, expected) checkEqual((uint64_t)(actual), (uint64_t)(expected), #actual, __LINE__)
+
+/*
+ * Counts a check, and reports it if the values differ.
+ */
+static void checkEqual(uint64_t actual, uint64_t expected, const char *what, int line)
+{
+	gChecks++;
+
+	if (actual != expected)
+	{
+		gFailures++;
+		cout<<"line "<<line<<": "<<what<<" is "<<actual<<", expected "<<expected<<endl;
+	}
+}
+
+/*
+ * Replays a trace of samples and backoffs, checking the smoothed RTT, the
+ * variation and the timeout after each one. Returns false if the file could
+ * not be read or holds a line it does not know.
+ */
+static bool testTrace(const char *path)
+{
+	ifstream file(path);
+	RtoEstimator rto;
+	string line;
+	int lineNumber = 0;
+	int events = 0;
+
+	if (!file)
+	{
+		cout<<"Unable to open "<<path<<"."<<endl;
+		return false;
+	}
+
+	while (getline(file, line))
+	{
+		istringstream fields(line);
+		string event;
+		uint64_t rtt = 0;
+		uint64_t retransmitted = 0;
+		uint64_t srtt = 0;
+		uint64_t rttVariation = 0;
+		uint64_t timeOut = 0;
+
+		lineNumber++;
+
+		if (!(fields>>event) || event[0] == '#')
+		{
+			continue;
+		}
+
+		if (event == "sample" && fields>>rtt>>retransmitted>>srtt>>rttVariation>>timeOut)
+		{
+			rto.AddSample(rtt, retransmitted != 0);
+		}
+		else if (event == "backoff" && fields>>srtt>>rttVariation>>timeOut)
+		{
+			rto.BackOff();
+		}
+		else
+		{
+			cout<<path<<":"<<lineNumber<<": unknown line."<<endl;
+			return false;
+		}
+
+		int failures = gFailures;
+
+		CHECK_EQUAL(rto.GetSmoothedRtt(), srtt);
+		CHECK_EQUAL(rto.GetRttVariation(), rttVariation);
+		CHECK_EQUAL(rto.GetTimeOut(), timeOut);
+
+		if (gFailures != failures)
+		{
+			cout<<"  at "<<path<<":"<<lineNumber<<endl;
+		}
+
+		events++;
+	}
+
+	cout<<"Replayed "<<events<<" events from "<<path<<"."<<endl;
+
+	return events > 0;
+}
+
+/*
+ * The first sample sets the smoothed RTT to itself and the variation to half
+ * of it; until then the timeout is the initial one.
+ */
+static void testFirstSample()
+{
+	RtoEstimator rto;
+
+	CHECK_EQUAL(rto.GetSmoothedRtt(), 0);
+	CHECK_EQUAL(rto.GetTimeOut(), kRtoInitialTimeOut);
+
+	rto.AddSample(40000, false);
+
+	CHECK_EQUAL(rto.GetSmoothedRtt(), 40000);
+	CHECK_EQUAL(rto.GetRttVariation(), 20000);
+	CHECK_EQUAL(rto.GetTimeOut(), 40000 + 4 * 20000);
+	CHECK_EQUAL(rto.GetTimeOutMilliSeconds(), 120);
+
+	// A sample of 0 still counts as a sample.
+	RtoEstimator zero;
+	zero.AddSample(0, false);
+
+	CHECK_EQUAL(zero.GetSmoothedRtt(), 1);
+}
+
+/*
+ * The timeout never leaves [kRtoMinTimeOut, kRtoMaxTimeOut], the clock
+ * granularity is the least the variation adds, and whole milliseconds round up.
+ */
+static void testLimits()
+{
+	RtoEstimator fast;
+
+	for (int i = 0; i < 50; i++)
+	{
+		fast.AddSample(100, false);
+	}
+
+	CHECK_EQUAL(fast.GetSmoothedRtt(), 100);
+	CHECK_EQUAL(fast.GetTimeOut(), kRtoMinTimeOut);
+
+	RtoEstimator slow;
+	slow.AddSample(100000000, false);
+
+	CHECK_EQUAL(slow.GetTimeOut(), kRtoMaxTimeOut);
+
+	RtoEstimator steady(kRtoInitialTimeOut, 1000);
+
+	for (int i = 0; i < 50; i++)
+	{
+		steady.AddSample(20000, false);
+	}
+
+	CHECK_EQUAL(steady.GetRttVariation(), 0);
+	CHECK_EQUAL(steady.GetTimeOut(), 20000 + kRtoClockGranularity);
+
+	RtoEstimator odd(kRtoInitialTimeOut, 1000);
+	odd.AddSample(1001, false);
+
+	CHECK_EQUAL(odd.GetTimeOut(), 1001 + 4 * 500);
+	CHECK_EQUAL(odd.GetTimeOutMilliSeconds(), 4);
+
+	// The initial timeout is held to the limits too.
+	CHECK_EQUAL(RtoEstimator(1).GetTimeOut(), kRtoMinTimeOut);
+	CHECK_EQUAL(RtoEstimator(kRtoMaxTimeOut * 2).GetTimeOut(), kRtoMaxTimeOut);
+}
+
+/*
+ * Each backoff doubles the timeout until it reaches kRtoMaxTimeOut, where it
+ * stays, and the next sample ends the backoff.
+ */
+static void testBackOff()
+{
+	RtoEstimator rto;
+
+	rto.AddSample(40000, false);
+	rto.BackOff();
+
+	CHECK_EQUAL(rto.GetTimeOut(), 240000);
+	CHECK_EQUAL(rto.GetBackOffCount(), 1);
+
+	rto.BackOff();
+
+	CHECK_EQUAL(rto.GetTimeOut(), 480000);
+
+	for (int i = 0; i < 100; i++)
+	{
+		rto.BackOff();
+	}
+
+	CHECK_EQUAL(rto.GetTimeOut(), kRtoMaxTimeOut);
+
+	// 120 ms doubles past 60 s on the ninth backoff, and the count stops there.
+	CHECK_EQUAL(rto.GetBackOffCount(), 9);
+
+	rto.AddSample(40000, false);
+
+	CHECK_EQUAL(rto.GetBackOffCount(), 0);
+	CHECK_EQUAL(rto.GetTimeOut(), 40000 + 4 * 15000);
+}
+
+/*
+ * A sample from a packet sent more than once changes nothing, not even a
+ * backoff in progress (Karn's rule).
+ */
+static void testKarn()
+{
+	RtoEstimator rto;
+
+	rto.AddSample(30000, true);
+
+	CHECK_EQUAL(rto.GetSmoothedRtt(), 0);
+	CHECK_EQUAL(rto.GetTimeOut(), kRtoInitialTimeOut);
+
+	rto.AddSample(40000, false);
+	rto.BackOff();
+	rto.AddSample(5000, true);
+
+	CHECK_EQUAL(rto.GetSmoothedRtt(), 40000);
+	CHECK_EQUAL(rto.GetRttVariation(), 20000);
+	CHECK_EQUAL(rto.GetBackOffCount(), 1);
+	CHECK_EQUAL(rto.GetTimeOut(), 240000);
+}
+
+int main(int argc, char** argv)
+{
+	const char *trace = (argc > 1) ? argv[1] : kTestDefaultTrace;
+	bool read = testTrace(trace);
+
+	testFirstSample();
+	testLimits();
+	testBackOff();
+	testKarn();
+
+	cout<<gChecks<<" checks, "<<gFailures<<" failed."<<endl;
+
+	return (read && gFailures == 0) ? 0 : 1;
+}
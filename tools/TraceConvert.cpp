@@ -0,0 +1,221 @@
+/*
+ * File: TraceConvert.cpp
+ * Desc: Converts a binary trace written by relsend -T or relrecv -T to qlog
+ * JSON, for qvis and other qlog tools, or to CSV for spreadsheets and scripts.
+ * Build with "make traceconvert" and run ./traceconvert [-c] <trace file>.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Trace.h"
+
+using namespace std;
+
+/*
+ * The name of each event type in the qlog output, or in the CSV output for
+ * the types qlog has no event for.
+ */
+const char *getEventName(uint16_t type)
+{
+	switch (type)
+	{
+		case TRACE_PACKET_SENT: return "transport:packet_sent";
+		case TRACE_PACKET_RECEIVED: return "transport:packet_received";
+		case TRACE_ACK_SENT: return "transport:packet_sent";
+		case TRACE_ACK_RECEIVED: return "transport:packet_received";
+		case TRACE_LOSS: return "recovery:packet_lost";
+		case TRACE_TIMEOUT: return "recovery:loss_timer_updated";
+		case TRACE_CWND: return "recovery:metrics_updated";
+		case TRACE_RTT: return "recovery:metrics_updated";
+		case TRACE_DISK_WRITE: return "tcplight:disk_write";
+		case TRACE_OUT_OF_ORDER: return "tcplight:out_of_order";
+		case TRACE_DROPPED: return "tcplight:events_dropped";
+	}
+
+	return "tcplight:unknown";
+}
+
+const char *getCsvName(uint16_t type)
+{
+	switch (type)
+	{
+		case TRACE_PACKET_SENT: return "packet_sent";
+		case TRACE_PACKET_RECEIVED: return "packet_received";
+		case TRACE_ACK_SENT: return "ack_sent";
+		case TRACE_ACK_RECEIVED: return "ack_received";
+		case TRACE_LOSS: return "loss";
+		case TRACE_TIMEOUT: return "timeout";
+		case TRACE_CWND: return "cwnd";
+		case TRACE_RTT: return "rtt";
+		case TRACE_DISK_WRITE: return "disk_write";
+		case TRACE_OUT_OF_ORDER: return "out_of_order";
+		case TRACE_DROPPED: return "dropped";
+	}
+
+	return "unknown";
+}
+
+/*
+ * Writes the data member of a qlog event, following the arguments listed
+ * with TraceEventType.
+ */
+void printQlogData(TraceEvent *event)
+{
+	switch (event->mType)
+	{
+		case TRACE_PACKET_SENT:
+		case TRACE_PACKET_RECEIVED:
+			printf("{\"header\": {\"packet_type\": \"data\", \"packet_number\": %" PRIu64 "}, \"raw\": {\"payload_length\": %" PRIu32 "}",
+				event->mArg1, event->mArg0);
+
+			if (event->mType == TRACE_PACKET_SENT)
+			{
+				printf(", \"is_retransmit\": %s}", event->mArg2 ? "true" : "false");
+			}
+			else
+			{
+				printf(", \"expected_packet_number\": %" PRIu64 "}", event->mArg2);
+			}
+			break;
+		case TRACE_ACK_SENT:
+		case TRACE_ACK_RECEIVED:
+			printf("{\"header\": {\"packet_type\": \"ack\"}, \"frames\": [{\"frame_type\": \"ack\", \"acked\": %" PRIu64 ", \"window\": %" PRIu32 "}]",
+				event->mArg1, event->mArg0);
+
+			if (event->mType == TRACE_ACK_SENT)
+			{
+				printf(", \"is_retransmit\": %s", event->mArg2 ? "true" : "false");
+			}
+
+			printf("}");
+			break;
+		case TRACE_LOSS:
+			printf("{\"header\": {\"packet_number\": %" PRIu64 "}, \"trigger\": \"%s\", \"bytes\": %" PRIu64 "}",
+				event->mArg1, (event->mArg0 == 1) ? "time_threshold" : (event->mArg0 == 2) ? "pto_expired" : "timeout", event->mArg2);
+			break;
+		case TRACE_TIMEOUT:
+			printf("{\"timer_type\": \"rto\", \"event_type\": \"expired\", \"delta\": %" PRIu32 ", \"packet_number\": %" PRIu64 ", \"timeouts_in_a_row\": %" PRIu64 "}",
+				event->mArg0, event->mArg1, event->mArg2);
+			break;
+		case TRACE_CWND:
+			printf("{\"send_window\": %" PRIu32 ", \"congestion_window\": %" PRIu64 ", \"receiver_window\": %" PRIu64 "}",
+				event->mArg0, event->mArg1, event->mArg2);
+			break;
+		case TRACE_RTT:
+			printf("{\"latest_rtt\": %.3f, \"smoothed_rtt\": %" PRIu64 ", \"rto\": %" PRIu64 "}",
+				event->mArg0 / 1000.0, event->mArg1, event->mArg2);
+			break;
+		case TRACE_DISK_WRITE:
+			printf("{\"length\": %" PRIu32 ", \"offset\": %" PRIu64 ", \"duration\": %.3f}",
+				event->mArg0, event->mArg1, event->mArg2 / 1000000.0);
+			break;
+		case TRACE_OUT_OF_ORDER:
+			printf("{\"depth\": %" PRIu32 ", \"packet_number\": %" PRIu64 ", \"expected_packet_number\": %" PRIu64 "}",
+				event->mArg0, event->mArg1, event->mArg2);
+			break;
+		case TRACE_DROPPED:
+			printf("{\"total\": %" PRIu64 "}", event->mArg1);
+			break;
+		default:
+			printf("{\"type\": %u, \"arg0\": %" PRIu32 ", \"arg1\": %" PRIu64 ", \"arg2\": %" PRIu64 "}",
+				event->mType, event->mArg0, event->mArg1, event->mArg2);
+			break;
+	}
+}
+
+void printUsage()
+{
+	cerr<<"Usage: traceconvert [-c] <trace file>\n";
+	cerr<<"\tWrites the trace to standard output as qlog JSON, with times in milliseconds\n";
+	cerr<<"\tfrom the start of the trace.\n";
+	cerr<<"\t-c - Write CSV instead: time_ms,event,arg0,arg1,arg2, with the arguments\n";
+	cerr<<"\t     described in Trace.h."<<endl;
+}
+
+int main(int argc, char *argv[])
+{
+	bool csv = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c")) != -1)
+	{
+		if (opt == 'c')
+		{
+			csv = true;
+		}
+		else
+		{
+			printUsage();
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1)
+	{
+		printUsage();
+		return 1;
+	}
+
+	FILE *fFile = fopen(argv[optind], "rb");
+	TraceFileHeader fHeader;
+
+	if (fFile == NULL)
+	{
+		cerr<<"Unable to open "<<argv[optind]<<"."<<endl;
+		return 1;
+	}
+
+	if (fread(&fHeader, sizeof(fHeader), 1, fFile) != 1 || memcmp(fHeader.mMagic, kTraceMagic, sizeof(kTraceMagic)) != 0
+		|| fHeader.mVersion != kTraceVersion || fHeader.mEventSize != sizeof(TraceEvent))
+	{
+		cerr<<argv[optind]<<" is not a version "<<kTraceVersion<<" trace."<<endl;
+		fclose(fFile);
+		return 1;
+	}
+
+	if (csv)
+	{
+		printf("time_ms,event,arg0,arg1,arg2\n");
+	}
+	else
+	{
+		printf("{\"qlog_version\": \"0.3\", \"qlog_format\": \"JSON\", \"title\": \"tcp-light %s\",\n",
+			(fHeader.mRole == TRACE_SENDER) ? "relsend" : "relrecv");
+		printf(" \"traces\": [{\"vantage_point\": {\"type\": \"%s\"},\n", (fHeader.mRole == TRACE_SENDER) ? "client" : "server");
+		printf("  \"common_fields\": {\"time_format\": \"relative\", \"reference_time\": %.3f},\n", fHeader.mStartWallTime / 1000000.0);
+		printf("  \"events\": [");
+	}
+
+	TraceEvent fEvent;
+	uint64_t fCount = 0;
+
+	while (fread(&fEvent, sizeof(fEvent), 1, fFile) == 1)
+	{
+		// Events recorded just before the trace started may carry an earlier time.
+		double fTime = (fEvent.mTime > fHeader.mStartTime) ? (fEvent.mTime - fHeader.mStartTime) / 1000000.0 : 0;
+
+		if (csv)
+		{
+			printf("%.3f,%s,%" PRIu32 ",%" PRIu64 ",%" PRIu64 "\n", fTime, getCsvName(fEvent.mType), fEvent.mArg0, fEvent.mArg1, fEvent.mArg2);
+		}
+		else
+		{
+			printf("%s\n    {\"time\": %.3f, \"name\": \"%s\", \"data\": ", (fCount > 0) ? "," : "", fTime, getEventName(fEvent.mType));
+			printQlogData(&fEvent);
+			printf("}");
+		}
+
+		fCount++;
+	}
+
+	if (!csv)
+	{
+		printf("\n  ]}]}\n");
+	}
+
+	fclose(fFile);
+	return 0;
+}